@@ -0,0 +1,32 @@
+require "benchmark/ips"
+require "objspace"
+require "roaring"
+
+base = Roaring::Bitmap32.new
+0.step(10_000_000, 3) { |i| base << i }
+
+cow_base = base.dup
+cow_base.copy_on_write = true
+
+def dup_and_edit(bitmap)
+  copy = bitmap.dup
+  copy << 1
+  copy.remove(3)
+  copy
+end
+
+puts "memsize after dup + 2 edits:"
+puts "  deep copy:     #{ObjectSpace.memsize_of(dup_and_edit(base))} bytes"
+puts "  copy-on-write: #{ObjectSpace.memsize_of(dup_and_edit(cow_base))} bytes"
+
+Benchmark.ips do |x|
+  x.report "dup + edit" do
+    dup_and_edit(base)
+  end
+
+  x.report "dup + edit (copy_on_write)" do
+    dup_and_edit(cow_base)
+  end
+
+  x.compare!
+end
@@ -0,0 +1,31 @@
+require "benchmark/ips"
+require "roaring"
+
+a, b, c, d, e, f = Array.new(6) do |n|
+  bitmap = Roaring::Bitmap32.new
+  (n * 1000).step(5_000_000, n + 2) { |i| bitmap << i }
+  bitmap
+end
+small = Roaring::Bitmap32.new(Array.new(1000) { |i| i * 4999 })
+
+{ "similar sizes" => f, "one small operand" => small }.each do |name, last|
+  query = (Roaring::Query[a] | b | c) & (Roaring::Query[d] - e) & last
+  puts name
+  puts query.explain
+
+  Benchmark.ips do |x|
+    x.report "operators" do
+      ((a | b | c) & (d - e) & last).cardinality
+    end
+
+    x.report "Query#to_bitmap" do
+      query.to_bitmap.cardinality
+    end
+
+    x.report "Query#count" do
+      query.count
+    end
+
+    x.compare!
+  end
+end
@@ -1,6 +1,9 @@
 #include "roaring_ruby.h"
 
 #include <stdio.h>
+#include <string.h>
+
+#include <ruby/thread.h>
 
 static VALUE cRoaringBitmap32;
 
@@ -15,16 +18,95 @@ NUM2UINT32(VALUE num) {
     }
 }
 
+typedef struct {
+    roaring_bitmap_t *bitmap;
+
+    // Number of operations currently reading the bitmap without the GVL.
+    // Like rb_str_locktmp, modifications raise while this is non-zero.
+    unsigned int locks;
+
+    // Changes on every modification, see rb_roaring_next_generation
+    uint64_t generation;
+
+    // Copy-on-write is turned off while the bitmap is locked, since sharing
+    // a container writes to the bitmap it comes from. This keeps the setting.
+    bool copy_on_write;
+} rb_roaring32_t;
+
 static void rb_roaring32_free(void *data)
 {
-    roaring_bitmap_free(data);
+    rb_roaring32_t *wrapper = data;
+    roaring_bitmap_free(wrapper->bitmap);
+    ruby_xfree(wrapper);
+}
+
+// Matches SHARED_CONTAINER_TYPE, which isn't part of CRoaring's public API
+#define ROARING_SHARED_CONTAINER_TYPE 4
+
+// A shallow, read-only copy of containers [start, start + count) of `bitmap`.
+// Copy-on-write is turned off so that operations reading the view never
+// write to `bitmap`, which makes it safe to read from several threads at once.
+static roaring_bitmap_t slice_view(const roaring_bitmap_t *bitmap, int32_t start, int32_t count)
+{
+    const roaring_array_t *ra = &bitmap->high_low_container;
+    roaring_bitmap_t view = {
+        .high_low_container = {
+            .size = count,
+            .allocation_size = count,
+            .containers = ra->containers + start,
+            .keys = ra->keys + start,
+            .typecodes = ra->typecodes + start,
+            .flags = ROARING_FLAG_FROZEN,
+        }
+    };
+    return view;
+}
+
+static roaring_bitmap_t readonly_view(const roaring_bitmap_t *bitmap)
+{
+    return slice_view(bitmap, 0, bitmap->high_low_container.size);
+}
+
+static bool has_shared_containers(const roaring_bitmap_t *bitmap)
+{
+    const roaring_array_t *ra = &bitmap->high_low_container;
+    return ra->size > 0 && memchr(ra->typecodes, ROARING_SHARED_CONTAINER_TYPE, ra->size);
+}
+
+// A copy of `bitmap` owning all its containers. roaring_bitmap_copy can't
+// copy the containers a bitmap shares through copy-on-write without sharing
+// them again, so bitmaps holding some are copied as their union with
+// themselves instead.
+static roaring_bitmap_t *copy_unshared(const roaring_bitmap_t *bitmap)
+{
+    roaring_bitmap_t view = readonly_view(bitmap);
+    if (!has_shared_containers(bitmap)) {
+        return roaring_bitmap_copy(&view);
+    }
+    return roaring_bitmap_or(&view, &view);
 }
 
 static size_t rb_roaring32_memsize(const void *data)
 {
+    const roaring_bitmap_t *bitmap = ((const rb_roaring32_t *)data)->bitmap;
+    const roaring_array_t *ra = &bitmap->high_low_container;
+
     // This is probably an estimate, "frozen" refers to the "frozen"
     // serialization format, which mimics the in-memory representation.
-    return sizeof(roaring_bitmap_t) + roaring_bitmap_frozen_size_in_bytes(data);
+    if (ra->size == 0 || !memchr(ra->typecodes, ROARING_SHARED_CONTAINER_TYPE, ra->size)) {
+        return sizeof(rb_roaring32_t) + sizeof(roaring_bitmap_t) + roaring_bitmap_frozen_size_in_bytes(bitmap);
+    }
+
+    // The frozen format can't describe containers shared with another bitmap
+    // by copy-on-write, so measure the containers we own one at a time.
+    size_t size = sizeof(rb_roaring32_t) + sizeof(roaring_bitmap_t);
+    for (int32_t i = 0; i < ra->size; i++) {
+        if (ra->typecodes[i] == ROARING_SHARED_CONTAINER_TYPE) continue;
+
+        roaring_bitmap_t view = slice_view(bitmap, i, 1);
+        size += roaring_bitmap_frozen_size_in_bytes(&view);
+    }
+    return size;
 }
 
 static const rb_data_type_t roaring_type = {
@@ -33,24 +115,95 @@ static const rb_data_type_t roaring_type = {
         .dfree = rb_roaring32_free,
         .dsize = rb_roaring32_memsize
     },
+#ifdef HAVE_RB_EXT_RACTOR_SAFE
+    .flags = RUBY_TYPED_FREE_IMMEDIATELY | RUBY_TYPED_FROZEN_SHAREABLE,
+#else
     .flags = RUBY_TYPED_FREE_IMMEDIATELY,
+#endif
 };
 
+// Wraps `bitmap` in a new Bitmap32, which takes ownership of it
+static VALUE rb_roaring32_new(VALUE klass, roaring_bitmap_t *bitmap)
+{
+    if (!bitmap) {
+        rb_raise(rb_eNoMemError, "failed to allocate bitmap");
+    }
+
+    rb_roaring32_t *wrapper;
+    VALUE obj = TypedData_Make_Struct(klass, rb_roaring32_t, &roaring_type, wrapper);
+    wrapper->bitmap = bitmap;
+    wrapper->generation = rb_roaring_next_generation();
+    return obj;
+}
+
 static VALUE rb_roaring32_alloc(VALUE self)
 {
-    roaring_bitmap_t *data = roaring_bitmap_create();
-    return TypedData_Wrap_Struct(self, &roaring_type, data);
+    return rb_roaring32_new(self, roaring_bitmap_create());
+}
+
+static rb_roaring32_t *get_wrapper(VALUE obj) {
+    rb_roaring32_t *wrapper;
+    TypedData_Get_Struct(obj, rb_roaring32_t, &roaring_type, wrapper);
+    return wrapper;
 }
 
 static roaring_bitmap_t *get_bitmap(VALUE obj) {
-    roaring_bitmap_t *bitmap;
-    TypedData_Get_Struct(obj, roaring_bitmap_t, &roaring_type, bitmap);
-    return bitmap;
+    return get_wrapper(obj)->bitmap;
+}
+
+// Same as get_bitmap, but raises FrozenError if `obj` is frozen
+static roaring_bitmap_t *get_bitmap_for_write(VALUE obj) {
+    rb_check_frozen(obj);
+    rb_roaring32_t *wrapper = get_wrapper(obj);
+    if (wrapper->locks) {
+        rb_raise(rb_eRuntimeError, "can't modify bitmap; temporarily locked");
+    }
+    wrapper->generation = rb_roaring_next_generation();
+    return wrapper->bitmap;
+}
+
+// Replaces the containers `wrapper` shares through copy-on-write with copies
+// of its own. Only copy-on-write bitmaps can read shared containers, and
+// locked bitmaps, views and frozen bitmaps all have it turned off.
+static void unshare(rb_roaring32_t *wrapper) {
+    if (!has_shared_containers(wrapper->bitmap)) {
+        return;
+    }
+    roaring_bitmap_t *copy = copy_unshared(wrapper->bitmap);
+    if (!copy) {
+        rb_raise(rb_eNoMemError, "failed to allocate bitmap");
+    }
+    roaring_bitmap_set_copy_on_write(copy, roaring_bitmap_get_copy_on_write(wrapper->bitmap));
+    roaring_bitmap_free(wrapper->bitmap);
+    wrapper->bitmap = copy;
+}
+
+// Prevents `obj` from being modified while it's read without the GVL.
+// Frozen bitmaps can't be modified anyway, and may be shared with other
+// Ractors, so they aren't counted.
+static roaring_bitmap_t *lock_bitmap(VALUE obj) {
+    rb_roaring32_t *wrapper = get_wrapper(obj);
+    if (!OBJ_FROZEN(obj)) {
+        if (wrapper->locks == 0) {
+            unshare(wrapper);
+            wrapper->copy_on_write = roaring_bitmap_get_copy_on_write(wrapper->bitmap);
+            roaring_bitmap_set_copy_on_write(wrapper->bitmap, false);
+        }
+        wrapper->locks++;
+    }
+    return wrapper->bitmap;
+}
+
+static void unlock_bitmap(VALUE obj) {
+    rb_roaring32_t *wrapper = get_wrapper(obj);
+    if (!OBJ_FROZEN(obj) && --wrapper->locks == 0) {
+        roaring_bitmap_set_copy_on_write(wrapper->bitmap, wrapper->copy_on_write);
+    }
 }
 
 // Replaces the contents of `self` with another bitmap
 static VALUE rb_roaring32_replace(VALUE self, VALUE other) {
-    roaring_bitmap_t *self_data = get_bitmap(self);
+    roaring_bitmap_t *self_data = get_bitmap_for_write(self);
     roaring_bitmap_t *other_data = get_bitmap(other);
 
     roaring_bitmap_overwrite(self_data, other_data);
@@ -58,6 +211,57 @@ static VALUE rb_roaring32_replace(VALUE self, VALUE other) {
     return self;
 }
 
+// Freezes the bitmap. Frozen bitmaps never hand out copy-on-write
+// containers, which would require writing to them, so copies of a frozen
+// bitmap are always deep.
+// @return [self]
+static VALUE rb_roaring32_freeze(VALUE self)
+{
+    if (!OBJ_FROZEN(self)) {
+        rb_roaring32_t *wrapper = get_wrapper(self);
+        unshare(wrapper);
+        roaring_bitmap_set_copy_on_write(wrapper->bitmap, false);
+    }
+    return rb_call_super(0, NULL);
+}
+
+// @return [Boolean] whether copies made from this bitmap share containers with it
+static VALUE rb_roaring32_copy_on_write_p(VALUE self)
+{
+    rb_roaring32_t *wrapper = get_wrapper(self);
+    if (wrapper->locks) {
+        return RBOOL(wrapper->copy_on_write);
+    }
+    return RBOOL(roaring_bitmap_get_copy_on_write(wrapper->bitmap));
+}
+
+// Enables or disables copy-on-write for this bitmap.
+//
+// With copy-on-write enabled, {dup}, {clone} and {replace} share containers
+// with `self` instead of copying them, and a container is only copied once
+// either bitmap modifies it. The setting carries over to the copies.
+// @param value [Boolean]
+static VALUE rb_roaring32_set_copy_on_write(VALUE self, VALUE value)
+{
+    get_bitmap_for_write(self);
+    rb_roaring32_t *wrapper = get_wrapper(self);
+    if (!RTEST(value)) {
+        // Only copy-on-write bitmaps can read the containers they share
+        unshare(wrapper);
+    }
+    roaring_bitmap_set_copy_on_write(wrapper->bitmap, RTEST(value));
+    return value;
+}
+
+// A number which changes whenever the bitmap may have been modified, and
+// which no other bitmap ever has, so that it identifies the bitmap's contents
+// as long as it doesn't change. Useful as a cache key, see {ResultCache}.
+// @return [Integer]
+static VALUE rb_roaring32_generation(VALUE self)
+{
+    return ULL2NUM(get_wrapper(self)->generation);
+}
+
 // @return [Integer] the number of elements in the bitmap
 static VALUE rb_roaring32_cardinality(VALUE self)
 {
@@ -70,7 +274,7 @@ static VALUE rb_roaring32_cardinality(VALUE self)
 // @param val [Integer] the value to add
 static VALUE rb_roaring32_add(VALUE self, VALUE val)
 {
-    roaring_bitmap_t *data = get_bitmap(self);
+    roaring_bitmap_t *data = get_bitmap_for_write(self);
 
     uint32_t num = NUM2UINT32(val);
     roaring_bitmap_add(data, num);
@@ -82,7 +286,7 @@ static VALUE rb_roaring32_add(VALUE self, VALUE val)
 // @return `self` if value was add, `nil` if value was already in the bitmap
 static VALUE rb_roaring32_add_p(VALUE self, VALUE val)
 {
-    roaring_bitmap_t *data = get_bitmap(self);
+    roaring_bitmap_t *data = get_bitmap_for_write(self);
 
     uint32_t num = NUM2UINT32(val);
     return roaring_bitmap_add_checked(data, num) ? self : Qnil;
@@ -90,7 +294,7 @@ static VALUE rb_roaring32_add_p(VALUE self, VALUE val)
 
 static VALUE rb_roaring32_add_range_closed(VALUE self, VALUE minv, VALUE maxv)
 {
-    roaring_bitmap_t *data = get_bitmap(self);
+    roaring_bitmap_t *data = get_bitmap_for_write(self);
 
     uint32_t min = NUM2UINT32(minv);
     uint32_t max = NUM2UINT32(maxv);
@@ -103,7 +307,7 @@ static VALUE rb_roaring32_add_range_closed(VALUE self, VALUE minv, VALUE maxv)
 // Removes an element from the bitmap
 static VALUE rb_roaring32_remove(VALUE self, VALUE val)
 {
-    roaring_bitmap_t *data = get_bitmap(self);
+    roaring_bitmap_t *data = get_bitmap_for_write(self);
 
     uint32_t num = NUM2UINT32(val);
     roaring_bitmap_remove(data, num);
@@ -116,7 +320,7 @@ static VALUE rb_roaring32_remove(VALUE self, VALUE val)
 // @return [self,nil] `self` if value was removed, `nil` if the value wasn't in the bitmap
 static VALUE rb_roaring32_remove_p(VALUE self, VALUE val)
 {
-    roaring_bitmap_t *data = get_bitmap(self);
+    roaring_bitmap_t *data = get_bitmap_for_write(self);
 
     uint32_t num = NUM2UINT32(val);
     return roaring_bitmap_remove_checked(data, num) ? self : Qnil;
@@ -141,7 +345,7 @@ static VALUE rb_roaring32_empty_p(VALUE self)
 // Removes all elements from the bitmap
 static VALUE rb_roaring32_clear(VALUE self)
 {
-    roaring_bitmap_t *data = get_bitmap(self);
+    roaring_bitmap_t *data = get_bitmap_for_write(self);
     roaring_bitmap_clear(data);
     return self;
 }
@@ -209,12 +413,394 @@ static VALUE rb_roaring32_max(VALUE self)
 // @return [Boolean] whether the result has at least one run container
 static VALUE rb_roaring32_run_optimize(VALUE self)
 {
-    roaring_bitmap_t *data = get_bitmap(self);
+    roaring_bitmap_t *data = get_bitmap_for_write(self);
     return RBOOL(roaring_bitmap_run_optimize(data));
 }
 
+// Adds `offset` to every value of `bitmap`, dropping those which end up
+// outside of 32 bits. Containers move as a whole when `offset` is a multiple
+// of 2**16, and are split in two otherwise.
+static roaring_bitmap_t *shift(const roaring_bitmap_t *bitmap, VALUE offset)
+{
+    int sign;
+    uint64_t magnitude;
+    if (!rb_roaring_num2offset(offset, &sign, &magnitude) || magnitude > UINT32_MAX) {
+        return roaring_bitmap_create();
+    }
+    int64_t delta = sign < 0 ? -(int64_t)magnitude : (int64_t)magnitude;
+
+    // Shared containers can only be copied into a copy-on-write bitmap,
+    // which `bitmap` temporarily isn't while it's locked
+    if (!roaring_bitmap_get_copy_on_write(bitmap) && has_shared_containers(bitmap)) {
+        roaring_bitmap_t *copy = copy_unshared(bitmap);
+        roaring_bitmap_t *result = copy ? roaring_bitmap_add_offset(copy, delta) : NULL;
+        roaring_bitmap_free(copy);
+        return result;
+    }
+    return roaring_bitmap_add_offset(bitmap, delta);
+}
+
+// Adds `offset` to every element of the bitmap. Elements which would end up
+// outside of {RANGE} are dropped.
+// @param offset [Integer] the amount to add, which may be negative
+// @return [Bitmap32] a new bitmap containing the shifted elements
+static VALUE rb_roaring32_shift(VALUE self, VALUE offset)
+{
+    return rb_roaring32_new(cRoaringBitmap32, shift(get_bitmap(self), offset));
+}
+
+// Inplace version of {shift}
+// @return [self] the modified Bitmap
+static VALUE rb_roaring32_shift_inplace(VALUE self, VALUE offset)
+{
+    roaring_bitmap_t *data = get_bitmap_for_write(self);
+    roaring_bitmap_t *result = shift(data, offset);
+    if (!result) {
+        rb_raise(rb_eNoMemError, "failed to allocate bitmap");
+    }
+    get_wrapper(self)->bitmap = result;
+    roaring_bitmap_free(data);
+    return self;
+}
+
+static inline uint64_t splitmix64(uint64_t *state)
+{
+    uint64_t z = (*state += UINT64_C(0x9E3779B97F4A7C15));
+    z = (z ^ (z >> 30)) * UINT64_C(0xBF58476D1CE4E5B9);
+    z = (z ^ (z >> 27)) * UINT64_C(0x94D049BB133111EB);
+    return z ^ (z >> 31);
+}
+
+// The finalizer of MurmurHash3, a bijection which scrambles runs of
+// consecutive values, whose hashes would be correlated otherwise
+static inline uint32_t fmix32(uint32_t h)
+{
+    h ^= h >> 16;
+    h *= 0x85EBCA6B;
+    h ^= h >> 13;
+    h *= 0xC2B2AE35;
+    h ^= h >> 16;
+    return h;
+}
+
+#define MINHASH_CHUNK 256
+
+struct minhash_args {
+    const roaring_bitmap_t *bitmap;
+    const uint64_t *multipliers;
+    const uint64_t *increments;
+    uint32_t *mins;
+    long k;
+};
+
+static void *minhash_nogvl(void *ptr)
+{
+    struct minhash_args *args = ptr;
+
+    roaring_uint32_iterator_t it;
+    roaring_iterator_init(args->bitmap, &it);
+    uint32_t values[MINHASH_CHUNK];
+    uint32_t count;
+    while ((count = roaring_uint32_iterator_read(&it, values, MINHASH_CHUNK)) > 0) {
+        for (uint32_t j = 0; j < count; j++) {
+            values[j] = fmix32(values[j]);
+        }
+        for (long i = 0; i < args->k; i++) {
+            uint64_t a = args->multipliers[i];
+            uint64_t b = args->increments[i];
+            uint32_t min = args->mins[i];
+            for (uint32_t j = 0; j < count; j++) {
+                uint32_t hash = (uint32_t)((a * values[j] + b) >> 32);
+                min = hash < min ? hash : min;
+            }
+            args->mins[i] = min;
+        }
+    }
+    return NULL;
+}
+
+// Computes a MinHash signature: the smallest hash of the elements under
+// each of `k` hash functions. The fraction of positions where the
+// signatures of two bitmaps are equal estimates their {#jaccard_index}.
+//
+// Elements are read from the containers a chunk at a time, scrambled with
+// fmix32, and hashed with multiply-shift functions, `(a * x + b) >> 32`, one
+// function over the whole chunk at a time, a loop compilers vectorize. The
+// GVL is released while hashing.
+// @param k [Integer] the number of hash functions, at most 2**32 - 1
+// @param seed [Integer] picks the hash functions, which only depend on it,
+//   so only signatures with the same `k` and `seed` can be compared
+// @return [Array<Integer>] `k` hashes, all 2**32 - 1 if the bitmap is empty
+static VALUE rb_roaring32_minhash(int argc, VALUE *argv, VALUE self)
+{
+    VALUE kv, opts;
+    rb_scan_args(argc, argv, "1:", &kv, &opts);
+    long k = NUM2LONG(kv);
+    if (k <= 0) {
+        rb_raise(rb_eArgError, "k must be positive");
+    }
+    if ((unsigned long)k > UINT32_MAX || (unsigned long)k > SIZE_MAX / (2 * sizeof(uint64_t) + sizeof(uint32_t))) {
+        rb_raise(rb_eArgError, "k is too large");
+    }
+
+    uint64_t state = 0;
+    if (!NIL_P(opts)) {
+        ID keys[1] = { rb_intern("seed") };
+        VALUE values[1];
+        rb_get_kwargs(opts, keys, 0, 1, values);
+        if (values[0] != Qundef) {
+            state = NUM2ULL(values[0]);
+        }
+    }
+
+    VALUE buf;
+    uint64_t *multipliers = ALLOCV(buf, k * (2 * sizeof(uint64_t) + sizeof(uint32_t)));
+    uint64_t *increments = multipliers + k;
+    uint32_t *mins = (uint32_t *)(increments + k);
+    for (long i = 0; i < k; i++) {
+        multipliers[i] = splitmix64(&state) | 1;
+        increments[i] = splitmix64(&state);
+        mins[i] = UINT32_MAX;
+    }
+
+    roaring_bitmap_t view = readonly_view(lock_bitmap(self));
+    struct minhash_args args = {
+        .bitmap = &view,
+        .multipliers = multipliers,
+        .increments = increments,
+        .mins = mins,
+        .k = k,
+    };
+    rb_thread_call_without_gvl(minhash_nogvl, &args, NULL, NULL);
+    unlock_bitmap(self);
+
+    VALUE signature = rb_ary_new_capa(k);
+    for (long i = 0; i < k; i++) {
+        rb_ary_push(signature, UINT2NUM(mins[i]));
+    }
+    ALLOCV_END(buf);
+    return signature;
+}
+
+// Draws `k` distinct ranks below `n` with Floyd's algorithm, which takes one
+// random number per rank. They're collected in a Bitmap32, which sorts them
+// and is freed by the GC if `random` raises.
+static VALUE random_ranks(VALUE random, uint64_t n, uint64_t k)
+{
+    VALUE ranks = rb_roaring32_new(cRoaringBitmap32, roaring_bitmap_create());
+    roaring_bitmap_t *bitmap = get_bitmap(ranks);
+    if (k == n) {
+        roaring_bitmap_add_range(bitmap, 0, n);
+        return ranks;
+    }
+    for (uint64_t j = n - k; j < n; j++) {
+        uint32_t rank = (uint32_t)rb_random_ulong_limited(random, (unsigned long)j);
+        if (!roaring_bitmap_add_checked(bitmap, rank)) {
+            roaring_bitmap_add(bitmap, (uint32_t)j);
+        }
+    }
+    return ranks;
+}
+
+size_t rb_roaring32_select_many(const roaring_bitmap_t *bitmap, uint64_t base, const uint64_t *ranks, size_t count, uint32_t *values)
+{
+    const roaring_array_t *ra = &bitmap->high_low_container;
+    uint64_t start = base;
+    size_t found = 0;
+    for (int32_t i = 0; i < ra->size && found < count; i++) {
+        roaring_bitmap_t container = slice_view(bitmap, i, 1);
+        uint64_t end = start + roaring_bitmap_get_cardinality(&container);
+        for (; found < count && ranks[found] < end; found++) {
+            roaring_bitmap_select(&container, (uint32_t)(ranks[found] - start), &values[found]);
+        }
+        start = end;
+    }
+    return found;
+}
+
+// Picks elements uniformly at random, without building an array of all of
+// them: random ranks are drawn first, then resolved in a single pass over
+// the containers.
+// @overload sample(random: Random)
+//   @return [Integer, nil] a random element, or `nil` if the bitmap is empty
+// @overload sample(k, random: Random)
+//   @param k [Integer] the number of elements to pick
+//   @param random [Random] the random number generator to use
+//   @return [Array<Integer>] `k` distinct elements in increasing order, or all of them if there are fewer
+static VALUE rb_roaring32_sample(int argc, VALUE *argv, VALUE self)
+{
+    VALUE kv, opts;
+    rb_scan_args(argc, argv, "01:", &kv, &opts);
+    uint64_t k = rb_roaring_num2sample(kv);
+    VALUE random = rb_roaring_random_opt(opts);
+
+    uint64_t n = roaring_bitmap_get_cardinality(get_bitmap(self));
+    if (k > n) {
+        k = n;
+    }
+
+    // `random` may have modified `self`, whose elements are only read after
+    // all the ranks are drawn
+    VALUE ranks = random_ranks(random, n, k);
+    VALUE ranks_buf, values_buf;
+    uint64_t *rank_values = ALLOCV_N(uint64_t, ranks_buf, k);
+    uint32_t *values = ALLOCV_N(uint32_t, values_buf, k);
+    roaring_bitmap_to_uint32_array(get_bitmap(ranks), values);
+    for (uint64_t i = 0; i < k; i++) {
+        rank_values[i] = values[i];
+    }
+    size_t found = rb_roaring32_select_many(get_bitmap(self), 0, rank_values, k, values);
+
+    VALUE result;
+    if (NIL_P(kv)) {
+        result = found ? UINT2NUM(values[0]) : Qnil;
+    } else {
+        result = rb_ary_new_capa(found);
+        for (size_t i = 0; i < found; i++) {
+            rb_ary_push(result, UINT2NUM(values[i]));
+        }
+    }
+    ALLOCV_END(ranks_buf);
+    ALLOCV_END(values_buf);
+    RB_GC_GUARD(ranks);
+    return result;
+}
+
+// Bits of the binary expansion of the sampling probability which are used
+#define BERNOULLI_PRECISION 32
+
+// Each container is expanded into up to 1024 words, which are ANDed with
+// masks whose bits are set with probability `fraction`. Masks are built from
+// random words, going through the binary digits of `fraction` from the
+// lowest: OR-ing in a random word for a 1, or AND-ing one for a 0, halves
+// the probability of each bit being set and adds the digit to it.
+void rb_roaring32_bernoulli(const roaring_bitmap_t *bitmap, double fraction, VALUE random, roaring_bitmap_t *result)
+{
+    uint64_t digits = (uint64_t)ldexp(fraction, BERNOULLI_PRECISION);
+    if (digits == 0) {
+        return;
+    }
+    if (digits >> BERNOULLI_PRECISION) {
+        roaring_bitmap_t *copy = copy_unshared(bitmap);
+        roaring_bitmap_or_inplace(result, copy);
+        roaring_bitmap_free(copy);
+        return;
+    }
+    int lowest = roaring_trailing_zeroes(digits);
+    size_t depth = BERNOULLI_PRECISION - lowest;
+
+    VALUE buf;
+    uint64_t *words = ALLOCV_N(uint64_t, buf, 2 * 1024 + 65536 / 2);
+    uint64_t *masks = words + 1024;
+    uint32_t *values = (uint32_t *)(masks + 1024);
+
+    const roaring_array_t *ra = &bitmap->high_low_container;
+    uint16_t zero = 0;
+    for (int32_t i = 0; i < ra->size; i++) {
+        uint32_t high_bits = (uint32_t)ra->keys[i] << 16;
+        roaring_bitmap_t container = slice_view(bitmap, i, 1);
+        container.high_low_container.keys = &zero;
+        bitset_t bitset = { .array = words, .arraysize = 0, .capacity = 1024 };
+        roaring_bitmap_to_bitset(&container, &bitset);
+        size_t nwords = bitset.arraysize;
+
+        VALUE bytes = rb_random_bytes(random, (long)(depth * nwords * sizeof(uint64_t)));
+        const char *random_words = RSTRING_PTR(bytes);
+        memset(masks, 0, nwords * sizeof(uint64_t));
+        for (size_t d = 0; d < depth; d++) {
+            const char *r = random_words + d * nwords * sizeof(uint64_t);
+            if ((digits >> (lowest + d)) & 1) {
+                for (size_t w = 0; w < nwords; w++) {
+                    uint64_t word;
+                    memcpy(&word, r + w * sizeof(word), sizeof(word));
+                    masks[w] |= word;
+                }
+            } else {
+                for (size_t w = 0; w < nwords; w++) {
+                    uint64_t word;
+                    memcpy(&word, r + w * sizeof(word), sizeof(word));
+                    masks[w] &= word;
+                }
+            }
+        }
+        RB_GC_GUARD(bytes);
+
+        size_t count = 0;
+        for (size_t w = 0; w < nwords; w++) {
+            uint64_t word = words[w] & masks[w];
+            while (word) {
+                values[count++] = high_bits | (uint32_t)(w * 64 + roaring_trailing_zeroes(word));
+                word &= word - 1;
+            }
+        }
+        roaring_bitmap_add_many(result, count, values);
+    }
+    ALLOCV_END(buf);
+}
+
+struct sample_bitmap {
+    VALUE self;
+    const roaring_bitmap_t *bitmap;
+    double fraction;
+    VALUE random;
+    roaring_bitmap_t *result;
+};
+
+static VALUE sample_bitmap_run(VALUE ptr)
+{
+    struct sample_bitmap *s = (struct sample_bitmap *)ptr;
+    rb_roaring32_bernoulli(s->bitmap, s->fraction, s->random, s->result);
+    return Qnil;
+}
+
+static VALUE sample_bitmap_cleanup(VALUE ptr)
+{
+    struct sample_bitmap *s = (struct sample_bitmap *)ptr;
+    unlock_bitmap(s->self);
+    return Qnil;
+}
+
+// Keeps each element with probability `fraction`, independently of the
+// others, a word of 64 elements at a time rather than one by one.
+// `fraction` is rounded down to a multiple of 2**-32.
+// @param fraction [Float] the probability of keeping each element, between 0 and 1
+// @param random [Random] the random number generator to use
+// @return [Bitmap32] a new bitmap containing the sampled elements
+static VALUE rb_roaring32_sample_bitmap(int argc, VALUE *argv, VALUE self)
+{
+    VALUE fractionv, opts;
+    rb_scan_args(argc, argv, "1:", &fractionv, &opts);
+    double fraction = rb_roaring_num2fraction(fractionv);
+    VALUE random = rb_roaring_random_opt(opts);
+
+    // The result is wrapped first, so that it's freed if `random` raises
+    VALUE result = rb_roaring32_new(cRoaringBitmap32, roaring_bitmap_create());
+    struct sample_bitmap s = {
+        .self = self,
+        .bitmap = lock_bitmap(self),
+        .fraction = fraction,
+        .random = random,
+        .result = get_bitmap(result),
+    };
+    rb_ensure(sample_bitmap_run, (VALUE)&s, sample_bitmap_cleanup, (VALUE)&s);
+    return result;
+}
+
 // Serializes a bitmap into a string
 // @return [string]
+struct serialize_args {
+    roaring_bitmap_t bitmap;
+    char *buffer;
+    size_t written;
+};
+
+static void *serialize_nogvl(void *ptr)
+{
+    struct serialize_args *args = ptr;
+    args->written = roaring_bitmap_portable_serialize(&args->bitmap, args->buffer);
+    return NULL;
+}
+
 static VALUE rb_roaring32_serialize(VALUE self)
 {
     roaring_bitmap_t *data = get_bitmap(self);
@@ -222,19 +808,73 @@ static VALUE rb_roaring32_serialize(VALUE self)
     size_t size = roaring_bitmap_portable_size_in_bytes(data);
     VALUE str = rb_str_buf_new(size);
 
-    size_t written = roaring_bitmap_portable_serialize(data, RSTRING_PTR(str));
+    size_t written;
+    if (size >= rb_roaring_offload_threshold() && FL_TEST_RAW(str, RSTRING_NOEMBED)) {
+        struct serialize_args args = {
+            .bitmap = readonly_view(lock_bitmap(self)),
+            .buffer = RSTRING_PTR(str),
+        };
+        int state = rb_roaring_offload(serialize_nogvl, &args);
+        unlock_bitmap(self);
+        if (state) {
+            rb_jump_tag(state);
+        }
+        written = args.written;
+    } else {
+        written = roaring_bitmap_portable_serialize(data, RSTRING_PTR(str));
+    }
     rb_str_set_len(str, written);
 
+    RB_GC_GUARD(self);
     return str;
 }
 
+struct deserialize_one_args {
+    const char *buffer;
+    size_t length;
+    roaring_bitmap_t *result;
+};
+
+static void *deserialize_one_nogvl(void *ptr)
+{
+    struct deserialize_one_args *args = ptr;
+    args->result = roaring_bitmap_portable_deserialize_safe(args->buffer, args->length);
+    return NULL;
+}
+
 // Loads a previously serialized bitmap
 // @return [Bitmap32]
 static VALUE rb_roaring32_deserialize(VALUE self, VALUE str)
 {
-    roaring_bitmap_t *bitmap = roaring_bitmap_portable_deserialize_safe(RSTRING_PTR(str), RSTRING_LEN(str));
+    StringValue(str);
 
-    return TypedData_Wrap_Struct(cRoaringBitmap32, &roaring_type, bitmap);
+    roaring_bitmap_t *bitmap;
+    bool offload = (size_t)RSTRING_LEN(str) >= rb_roaring_offload_threshold();
+    if (offload) {
+        // Other fibers may modify `str` meanwhile, but not this frozen copy
+        str = rb_str_new_frozen(str);
+    }
+    if (offload && FL_TEST_RAW(str, RSTRING_NOEMBED)) {
+        struct deserialize_one_args args = {
+            .buffer = RSTRING_PTR(str),
+            .length = RSTRING_LEN(str),
+        };
+        int state = rb_roaring_offload(deserialize_one_nogvl, &args);
+        if (state) {
+            roaring_bitmap_free(args.result);
+            rb_jump_tag(state);
+        }
+        bitmap = args.result;
+    } else {
+        bitmap = roaring_bitmap_portable_deserialize_safe(RSTRING_PTR(str), RSTRING_LEN(str));
+    }
+    RB_GC_GUARD(str);
+
+    if (!bitmap) {
+        rb_raise(rb_eArgError, "invalid serialized bitmap");
+    }
+
+    return rb_roaring32_new(cRoaringBitmap32, bitmap);
 }
 
 // Provides statistics about the internal layout of the bitmap
@@ -272,18 +912,209 @@ static VALUE rb_roaring32_statistics(VALUE self)
 }
 
 typedef roaring_bitmap_t *binary_func(const roaring_bitmap_t *, const roaring_bitmap_t *);
+
+// Binary operations on bitmaps with fewer containers than this per thread
+// aren't worth splitting up
+#define PARALLEL_BINARY_OP_MIN_CONTAINERS 64
+
+struct binary_op_slice {
+    roaring_bitmap_t left, right;
+    roaring_bitmap_t *result;
+};
+
+struct binary_op_args {
+    binary_func *func;
+    roaring_bitmap_t left, right;
+
+    // When set, the operation is split into `count` slices
+    struct binary_op_slice *slices;
+    size_t count;
+
+    roaring_bitmap_t *result;
+};
+
+static void binary_op_slice_task(void *ptr, size_t i)
+{
+    struct binary_op_args *args = ptr;
+    struct binary_op_slice *slice = &args->slices[i];
+    slice->result = args->func(&slice->left, &slice->right);
+}
+
+// Each slice's result only has keys within its range, so the results are
+// joined by moving their containers into one bitmap, in order.
+static roaring_bitmap_t *join_slices(struct binary_op_slice *slices, size_t count)
+{
+    int32_t size = 0;
+    for (size_t s = 0; s < count; s++) {
+        size += slices[s].result->high_low_container.size;
+    }
+
+    roaring_bitmap_t *result = roaring_bitmap_create_with_capacity(size);
+    roaring_array_t *ra = &result->high_low_container;
+    for (size_t s = 0; s < count; s++) {
+        roaring_array_t *part = &slices[s].result->high_low_container;
+        if (part->size > 0) {
+            memcpy(ra->keys + ra->size, part->keys, part->size * sizeof(uint16_t));
+            memcpy(ra->containers + ra->size, part->containers, part->size * sizeof(part->containers[0]));
+            memcpy(ra->typecodes + ra->size, part->typecodes, part->size * sizeof(uint8_t));
+            ra->size += part->size;
+        }
+
+        // The containers now belong to `result`
+        part->size = 0;
+        roaring_bitmap_free(slices[s].result);
+    }
+    return result;
+}
+
+static void *binary_op_nogvl(void *ptr)
+{
+    struct binary_op_args *args = ptr;
+    if (args->slices) {
+        rb_roaring_parallel_for(args->count, binary_op_slice_task, args);
+        args->result = join_slices(args->slices, args->count);
+    } else {
+        args->result = args->func(&args->left, &args->right);
+    }
+    return NULL;
+}
+
+// Splits the 16-bit container keys of both bitmaps into `count` ranges
+// holding a similar number of containers, so that each range can be
+// computed on its own thread.
+static struct binary_op_slice *split_binary_op(const roaring_bitmap_t *left, const roaring_bitmap_t *right, int count)
+{
+    const roaring_array_t *ra1 = &left->high_low_container;
+    const roaring_array_t *ra2 = &right->high_low_container;
+    int32_t total = ra1->size + ra2->size;
+
+    struct binary_op_slice *slices = ALLOC_N(struct binary_op_slice, count);
+
+    // Walk the keys of both bitmaps in order, cutting a slice whenever it
+    // holds its share of the containers. Keys present in both bitmaps are
+    // never split between slices.
+    int32_t pos1 = 0, pos2 = 0, start1 = 0, start2 = 0;
+    for (int s = 0; s < count; s++) {
+        int32_t target = (int32_t)((int64_t)total * (s + 1) / count);
+        if (s == count - 1) {
+            pos1 = ra1->size;
+            pos2 = ra2->size;
+        }
+        while (pos1 + pos2 < target) {
+            if (pos2 == ra2->size || (pos1 < ra1->size && ra1->keys[pos1] < ra2->keys[pos2])) {
+                pos1++;
+            } else if (pos1 == ra1->size || ra2->keys[pos2] < ra1->keys[pos1]) {
+                pos2++;
+            } else {
+                pos1++;
+                pos2++;
+            }
+        }
+
+        slices[s].left = slice_view(left, start1, pos1 - start1);
+        slices[s].right = slice_view(right, start2, pos2 - start2);
+        start1 = pos1;
+        start2 = pos2;
+    }
+
+    return slices;
+}
+
+struct binary_op {
+    VALUE self;
+    VALUE other;
+    int slices;
+    bool offload;
+    bool copy_on_write;
+    bool self_locked, other_locked;
+    struct binary_op_args args;
+};
+
+static VALUE binary_op_run(VALUE ptr)
+{
+    struct binary_op *op = (struct binary_op *)ptr;
+    struct binary_op_args *args = &op->args;
+
+    // Locking may replace the bitmaps, see unshare
+    args->left = readonly_view(lock_bitmap(op->self));
+    op->self_locked = true;
+    args->right = readonly_view(lock_bitmap(op->other));
+    op->other_locked = true;
+    if (op->slices > 1) {
+        args->slices = split_binary_op(&args->left, &args->right, op->slices);
+        args->count = op->slices;
+    }
+
+    if (op->offload) {
+        int state = rb_roaring_offload(binary_op_nogvl, args);
+        if (state) {
+            rb_jump_tag(state);
+        }
+    } else {
+        rb_thread_call_without_gvl(binary_op_nogvl, args, NULL, NULL);
+    }
+
+    if (args->result) {
+        roaring_bitmap_set_copy_on_write(args->result, op->copy_on_write);
+    }
+    VALUE result = rb_roaring32_new(cRoaringBitmap32, args->result);
+    args->result = NULL;
+    return result;
+}
+
+static VALUE binary_op_cleanup(VALUE ptr)
+{
+    struct binary_op *op = (struct binary_op *)ptr;
+
+    if (op->other_locked) {
+        unlock_bitmap(op->other);
+    }
+    if (op->self_locked) {
+        unlock_bitmap(op->self);
+    }
+    xfree(op->args.slices);
+    roaring_bitmap_free(op->args.result);
+    return Qnil;
+}
+
+// Large operations are split across Roaring.parallelism threads, and moved
+// off the current fiber once past Roaring.offload_threshold. Either way, the
+// operands are locked while they're read without the GVL.
 static VALUE rb_roaring32_binary_op(VALUE self, VALUE other, binary_func func) {
     roaring_bitmap_t *self_data = get_bitmap(self);
     roaring_bitmap_t *other_data = get_bitmap(other);
 
-    roaring_bitmap_t *result = func(self_data, other_data);
+    int32_t containers = self_data->high_low_container.size + other_data->high_low_container.size;
+    int slices = containers / PARALLEL_BINARY_OP_MIN_CONTAINERS;
+    if (slices > rb_roaring_parallelism()) {
+        slices = rb_roaring_parallelism();
+    }
+
+    size_t threshold = rb_roaring_offload_threshold();
+    bool offload = threshold != SIZE_MAX &&
+        roaring_bitmap_portable_size_in_bytes(self_data) + roaring_bitmap_portable_size_in_bytes(other_data) >= threshold;
+
+    if (slices <= 1 && !offload) {
+        return rb_roaring32_new(cRoaringBitmap32, func(self_data, other_data));
+    }
 
-    return TypedData_Wrap_Struct(cRoaringBitmap32, &roaring_type, result);
+    struct binary_op op = {
+        .self = self,
+        .other = other,
+        .slices = slices,
+        .offload = offload,
+        .copy_on_write = RTEST(rb_roaring32_copy_on_write_p(self)) || RTEST(rb_roaring32_copy_on_write_p(other)),
+        .args = { .func = func },
+    };
+    VALUE result = rb_ensure(binary_op_run, (VALUE)&op, binary_op_cleanup, (VALUE)&op);
+    RB_GC_GUARD(self);
+    RB_GC_GUARD(other);
+    return result;
 }
 
 typedef void binary_func_inplace(roaring_bitmap_t *, const roaring_bitmap_t *);
 static VALUE rb_roaring32_binary_op_inplace(VALUE self, VALUE other, binary_func_inplace func) {
-    roaring_bitmap_t *self_data = get_bitmap(self);
+    roaring_bitmap_t *self_data = get_bitmap_for_write(self);
     roaring_bitmap_t *other_data = get_bitmap(other);
 
     func(self_data, other_data);
@@ -329,30 +1160,46 @@ static VALUE rb_roaring32_andnot_inplace(VALUE self, VALUE other)
 }
 
 // Computes the intersection between two bitmaps
-// @return [Bitmap32] a new bitmap containing all elements in both `self` and `other`
+// `other` may also be a Bitmap64, which gives a Bitmap64.
+// @return [Bitmap32, Bitmap64] a new bitmap containing all elements in both `self` and `other`
 static VALUE rb_roaring32_and(VALUE self, VALUE other)
 {
+    if (rb_roaring64_bitmap_p(other)) {
+        return rb_roaring64_mixed_op(self, other, RB_ROARING_AND);
+    }
     return rb_roaring32_binary_op(self, other, roaring_bitmap_and);
 }
 
 // Computes the union between two bitmaps
-// @return [Bitmap32] a new bitmap containing all elements in either `self` or `other`
+// `other` may also be a Bitmap64, which gives a Bitmap64.
+// @return [Bitmap32, Bitmap64] a new bitmap containing all elements in either `self` or `other`
 static VALUE rb_roaring32_or(VALUE self, VALUE other)
 {
+    if (rb_roaring64_bitmap_p(other)) {
+        return rb_roaring64_mixed_op(self, other, RB_ROARING_OR);
+    }
     return rb_roaring32_binary_op(self, other, roaring_bitmap_or);
 }
 
 // Computes the exclusive or between two bitmaps
-// @return [Bitmap32] a new bitmap containing all elements in one of `self` or `other`, but not both
+// `other` may also be a Bitmap64, which gives a Bitmap64.
+// @return [Bitmap32, Bitmap64] a new bitmap containing all elements in one of `self` or `other`, but not both
 static VALUE rb_roaring32_xor(VALUE self, VALUE other)
 {
+    if (rb_roaring64_bitmap_p(other)) {
+        return rb_roaring64_mixed_op(self, other, RB_ROARING_XOR);
+    }
     return rb_roaring32_binary_op(self, other, roaring_bitmap_xor);
 }
 
 // Computes the difference between two bitmaps
-// @return [Bitmap32] a new bitmap containing all elements in `self`, but not in `other`
+// `other` may also be a Bitmap64, which gives a Bitmap64.
+// @return [Bitmap32, Bitmap64] a new bitmap containing all elements in `self`, but not in `other`
 static VALUE rb_roaring32_andnot(VALUE self, VALUE other)
 {
+    if (rb_roaring64_bitmap_p(other)) {
+        return rb_roaring64_mixed_op(self, other, RB_ROARING_ANDNOT);
+    }
     return rb_roaring32_binary_op(self, other, roaring_bitmap_andnot);
 }
 
@@ -360,6 +1207,9 @@ static VALUE rb_roaring32_andnot(VALUE self, VALUE other)
 // @return [Boolean] `true` if both bitmaps contain all the same elements, otherwise `false`
 static VALUE rb_roaring32_eq(VALUE self, VALUE other)
 {
+    if (rb_roaring64_bitmap_p(other)) {
+        return rb_roaring64_mixed_op(self, other, RB_ROARING_EQ);
+    }
     return rb_roaring32_binary_op_bool(self, other, roaring_bitmap_equals);
 }
 
@@ -367,6 +1217,9 @@ static VALUE rb_roaring32_eq(VALUE self, VALUE other)
 // @return [Boolean] `true` if `self` is a strict subset of `other`, otherwise `false`
 static VALUE rb_roaring32_lt(VALUE self, VALUE other)
 {
+    if (rb_roaring64_bitmap_p(other)) {
+        return rb_roaring64_mixed_op(self, other, RB_ROARING_LT);
+    }
     return rb_roaring32_binary_op_bool(self, other, roaring_bitmap_is_strict_subset);
 }
 
@@ -374,6 +1227,9 @@ static VALUE rb_roaring32_lt(VALUE self, VALUE other)
 // @return [Boolean] `true` if `self` is a subset of `other`, otherwise `false`
 static VALUE rb_roaring32_lte(VALUE self, VALUE other)
 {
+    if (rb_roaring64_bitmap_p(other)) {
+        return rb_roaring64_mixed_op(self, other, RB_ROARING_LTE);
+    }
     return rb_roaring32_binary_op_bool(self, other, roaring_bitmap_is_subset);
 }
 
@@ -381,17 +1237,1090 @@ static VALUE rb_roaring32_lte(VALUE self, VALUE other)
 // @return [Boolean] `true` if `self` intersects `other`, otherwise `false`
 static VALUE rb_roaring32_intersect_p(VALUE self, VALUE other)
 {
+    if (rb_roaring64_bitmap_p(other)) {
+        return rb_roaring64_mixed_op(self, other, RB_ROARING_INTERSECT);
+    }
     return rb_roaring32_binary_op_bool(self, other, roaring_bitmap_intersect);
 }
 
+// Computes the size of the intersection between two bitmaps, without building it
+// @return [Integer] the number of elements in both `self` and `other`
+static VALUE rb_roaring32_and_cardinality(VALUE self, VALUE other)
+{
+    if (rb_roaring64_bitmap_p(other)) {
+        return rb_roaring64_mixed_op(self, other, RB_ROARING_AND_CARDINALITY);
+    }
+    roaring_bitmap_t *self_data = get_bitmap(self);
+    roaring_bitmap_t *other_data = get_bitmap(other);
+
+    return ULL2NUM(roaring_bitmap_and_cardinality(self_data, other_data));
+}
+
+// Returns a hidden copy of `ary` (so that it can't change under us) after
+// checking that it only contains bitmaps
+static VALUE bitmap_list(VALUE ary)
+{
+    ary = rb_ary_dup(rb_convert_type(ary, T_ARRAY, "Array", "to_ary"));
+    for (long i = 0; i < RARRAY_LEN(ary); i++) {
+        get_bitmap(RARRAY_AREF(ary, i));
+    }
+    return ary;
+}
+
+// Locks every bitmap in `ary` and fills `views` with read-only views of them.
+// `*locked` counts the bitmaps locked so far, in case locking one raises.
+static void lock_bitmap_list(VALUE ary, roaring_bitmap_t *views, long *locked)
+{
+    for (long i = 0; i < RARRAY_LEN(ary); i++) {
+        views[i] = readonly_view(lock_bitmap(RARRAY_AREF(ary, i)));
+        *locked = i + 1;
+    }
+}
+
+// Unlocks the first `locked` bitmaps of `ary`
+static void unlock_bitmap_list(VALUE ary, long locked)
+{
+    for (long i = 0; i < locked; i++) {
+        unlock_bitmap(RARRAY_AREF(ary, i));
+    }
+}
+
+struct reduce_args {
+    roaring_bitmap_t **bitmaps;
+    size_t count;
+
+    // Whether `bitmaps` are our own temporaries, rather than views of the inputs
+    bool owned;
+
+    binary_func *func;
+    binary_func_inplace *func_inplace;
+};
+
+static void reduce_pair_task(void *ptr, size_t i)
+{
+    struct reduce_args *args = ptr;
+    roaring_bitmap_t **pair = &args->bitmaps[i * 2];
+
+    if (i * 2 + 1 == args->count) {
+        // The odd one out moves up to the next level unchanged
+        if (!args->owned) {
+            pair[0] = copy_unshared(pair[0]);
+        }
+    } else if (args->owned) {
+        args->func_inplace(pair[0], pair[1]);
+        roaring_bitmap_free(pair[1]);
+    } else {
+        pair[0] = args->func(pair[0], pair[1]);
+    }
+}
+
+// Combines neighbouring pairs of bitmaps until only one is left. The shape
+// of the tree only depends on the number of bitmaps, so the result is
+// identical however many threads compute it.
+static void *reduce_nogvl(void *ptr)
+{
+    struct reduce_args *args = ptr;
+
+    while (args->count > 1 || !args->owned) {
+        size_t pairs = (args->count + 1) / 2;
+        rb_roaring_parallel_for(pairs, reduce_pair_task, args);
+
+        for (size_t i = 0; i < pairs; i++) {
+            args->bitmaps[i] = args->bitmaps[i * 2];
+        }
+        args->count = pairs;
+        args->owned = true;
+    }
+
+    return NULL;
+}
+
+struct reduce {
+    VALUE ary;
+    roaring_bitmap_t *views;
+    long locked;
+    struct reduce_args args;
+};
+
+static VALUE reduce_run(VALUE ptr)
+{
+    struct reduce *r = (struct reduce *)ptr;
+    long count = RARRAY_LEN(r->ary);
+
+    r->views = ALLOC_N(roaring_bitmap_t, count);
+    r->args.bitmaps = ALLOC_N(roaring_bitmap_t *, count);
+    lock_bitmap_list(r->ary, r->views, &r->locked);
+    for (long i = 0; i < count; i++) {
+        r->args.bitmaps[i] = &r->views[i];
+    }
+    r->args.count = count;
+
+    // An interrupt may raise once the result is computed
+    rb_thread_call_without_gvl(reduce_nogvl, &r->args, NULL, NULL);
+
+    VALUE result = rb_roaring32_new(cRoaringBitmap32, r->args.bitmaps[0]);
+    r->args.count = 0;
+    return result;
+}
+
+static VALUE reduce_cleanup(VALUE ptr)
+{
+    struct reduce *r = (struct reduce *)ptr;
+
+    if (r->args.owned) {
+        for (size_t i = 0; i < r->args.count; i++) {
+            roaring_bitmap_free(r->args.bitmaps[i]);
+        }
+    }
+    unlock_bitmap_list(r->ary, r->locked);
+    xfree(r->args.bitmaps);
+    xfree(r->views);
+    return Qnil;
+}
+
+static VALUE rb_roaring32_reduce(VALUE ary, binary_func func, binary_func_inplace func_inplace)
+{
+    ary = bitmap_list(ary);
+    if (RARRAY_LEN(ary) == 0) {
+        return rb_roaring32_new(cRoaringBitmap32, roaring_bitmap_create());
+    }
+
+    struct reduce r = {
+        .ary = ary,
+        .args = {
+            .func = func,
+            .func_inplace = func_inplace,
+        },
+    };
+    VALUE result = rb_ensure(reduce_run, (VALUE)&r, reduce_cleanup, (VALUE)&r);
+    RB_GC_GUARD(ary);
+    return result;
+}
+
+// Computes the union of many bitmaps, using up to {Roaring.parallelism} threads
+// @param bitmaps [Array<Bitmap32>]
+// @return [Bitmap32] a new bitmap containing all elements in any of `bitmaps`
+static VALUE rb_roaring32_s_or_many(VALUE klass, VALUE bitmaps)
+{
+    return rb_roaring32_reduce(bitmaps, roaring_bitmap_or, roaring_bitmap_or_inplace);
+}
+
+// Computes the intersection of many bitmaps, using up to {Roaring.parallelism} threads
+// @param bitmaps [Array<Bitmap32>]
+// @return [Bitmap32] a new bitmap containing the elements found in every one of `bitmaps`
+static VALUE rb_roaring32_s_and_many(VALUE klass, VALUE bitmaps)
+{
+    return rb_roaring32_reduce(bitmaps, roaring_bitmap_and, roaring_bitmap_and_inplace);
+}
+
+struct funnel_args {
+    const roaring_bitmap_t *steps;
+    size_t count;
+    uint64_t *counts;
+    roaring_bitmap_t *result;
+};
+
+static void *funnel_nogvl(void *ptr)
+{
+    struct funnel_args *args = ptr;
+
+    args->counts[0] = roaring_bitmap_get_cardinality(&args->steps[0]);
+    if (args->count == 1 || args->counts[0] == 0) {
+        args->result = copy_unshared(&args->steps[0]);
+        return NULL;
+    }
+
+    args->result = roaring_bitmap_and(&args->steps[0], &args->steps[1]);
+    args->counts[1] = roaring_bitmap_get_cardinality(args->result);
+    for (size_t i = 2; i < args->count && args->counts[i - 1] > 0; i++) {
+        roaring_bitmap_and_inplace(args->result, &args->steps[i]);
+        args->counts[i] = roaring_bitmap_get_cardinality(args->result);
+    }
+    return NULL;
+}
+
+struct funnel {
+    VALUE steps;
+    bool want_bitmap;
+    roaring_bitmap_t *views;
+    long locked;
+    struct funnel_args args;
+};
+
+static VALUE funnel_run(VALUE ptr)
+{
+    struct funnel *f = (struct funnel *)ptr;
+    struct funnel_args *args = &f->args;
+
+    f->views = ALLOC_N(roaring_bitmap_t, args->count);
+    args->counts = ZALLOC_N(uint64_t, args->count);
+    lock_bitmap_list(f->steps, f->views, &f->locked);
+
+    args->steps = f->views;
+    rb_thread_call_without_gvl(funnel_nogvl, args, NULL, NULL);
+
+    VALUE result = rb_roaring32_new(cRoaringBitmap32, args->result);
+    args->result = NULL;
+    VALUE counts = rb_ary_new_capa(args->count);
+    for (size_t i = 0; i < args->count; i++) {
+        rb_ary_push(counts, ULL2NUM(args->counts[i]));
+    }
+    return f->want_bitmap ? rb_assoc_new(counts, result) : counts;
+}
+
+static VALUE funnel_cleanup(VALUE ptr)
+{
+    struct funnel *f = (struct funnel *)ptr;
+
+    unlock_bitmap_list(f->steps, f->locked);
+    roaring_bitmap_free(f->args.result);
+    xfree(f->args.counts);
+    xfree(f->views);
+    return Qnil;
+}
+
+// Computes the cardinalities of a chain of intersections, such as the
+// number of users left after each step of a conversion funnel. A single
+// intersection is narrowed step by step, and once it's empty the remaining
+// steps aren't looked at.
+// @example
+//   Roaring::Bitmap32.funnel([visited, signed_up, paid]) # => [1000, 120, 15]
+// @param steps [Array<Bitmap32>]
+// @param bitmap [Boolean] whether to also return the final intersection
+// @return [Array<Integer>, Array(Array<Integer>, Bitmap32)] the cardinality
+//   of `steps[0] & ... & steps[i]` for each step `i`, followed by the
+//   intersection of all steps if `bitmap` is true
+static VALUE rb_roaring32_s_funnel(int argc, VALUE *argv, VALUE klass)
+{
+    VALUE steps, opts;
+    rb_scan_args(argc, argv, "1:", &steps, &opts);
+
+    bool want_bitmap = false;
+    if (!NIL_P(opts)) {
+        ID keys[1] = { rb_intern("bitmap") };
+        VALUE values[1];
+        rb_get_kwargs(opts, keys, 0, 1, values);
+        want_bitmap = values[0] != Qundef && RTEST(values[0]);
+    }
+
+    steps = bitmap_list(steps);
+    if (RARRAY_LEN(steps) == 0) {
+        VALUE counts = rb_ary_new();
+        return want_bitmap ? rb_assoc_new(counts, rb_roaring32_new(cRoaringBitmap32, roaring_bitmap_create())) : counts;
+    }
+
+    struct funnel f = {
+        .steps = steps,
+        .want_bitmap = want_bitmap,
+        .args = { .count = RARRAY_LEN(steps) },
+    };
+    VALUE result = rb_ensure(funnel_run, (VALUE)&f, funnel_cleanup, (VALUE)&f);
+    RB_GC_GUARD(steps);
+    return result;
+}
+
+struct and_cardinality_args {
+    const roaring_bitmap_t *bitmap;
+    const roaring_bitmap_t *others;
+    size_t count;
+    uint64_t *results;
+};
+
+static void and_cardinality_task(void *ptr, size_t i)
+{
+    struct and_cardinality_args *args = ptr;
+    args->results[i] = roaring_bitmap_and_cardinality(args->bitmap, &args->others[i]);
+}
+
+static void *and_cardinality_many_nogvl(void *ptr)
+{
+    struct and_cardinality_args *args = ptr;
+    rb_roaring_parallel_for(args->count, and_cardinality_task, args);
+    return NULL;
+}
+
+struct and_cardinality_many {
+    VALUE self;
+    VALUE others;
+    roaring_bitmap_t view;
+    roaring_bitmap_t *views;
+    bool self_locked;
+    long locked;
+    struct and_cardinality_args args;
+};
+
+static VALUE and_cardinality_many_run(VALUE ptr)
+{
+    struct and_cardinality_many *m = (struct and_cardinality_many *)ptr;
+    long count = RARRAY_LEN(m->others);
+
+    m->views = ALLOC_N(roaring_bitmap_t, count);
+    m->args.results = ALLOC_N(uint64_t, count);
+    m->view = readonly_view(lock_bitmap(m->self));
+    m->self_locked = true;
+    lock_bitmap_list(m->others, m->views, &m->locked);
+
+    m->args.bitmap = &m->view;
+    m->args.others = m->views;
+    m->args.count = count;
+    rb_thread_call_without_gvl(and_cardinality_many_nogvl, &m->args, NULL, NULL);
+
+    VALUE ary = rb_ary_new_capa(count);
+    for (long i = 0; i < count; i++) {
+        rb_ary_push(ary, ULL2NUM(m->args.results[i]));
+    }
+    return ary;
+}
+
+static VALUE and_cardinality_many_cleanup(VALUE ptr)
+{
+    struct and_cardinality_many *m = (struct and_cardinality_many *)ptr;
+
+    unlock_bitmap_list(m->others, m->locked);
+    if (m->self_locked) {
+        unlock_bitmap(m->self);
+    }
+    xfree(m->args.results);
+    xfree(m->views);
+    return Qnil;
+}
+
+// Computes {and_cardinality} between `self` and each of `others`, using up
+// to {Roaring.parallelism} threads
+// @param others [Array<Bitmap32>]
+// @return [Array<Integer>]
+static VALUE rb_roaring32_and_cardinality_many(VALUE self, VALUE others)
+{
+    others = bitmap_list(others);
+    if (RARRAY_LEN(others) == 0) {
+        return rb_ary_new();
+    }
+
+    struct and_cardinality_many m = {
+        .self = self,
+        .others = others,
+    };
+    VALUE ary = rb_ensure(and_cardinality_many_run, (VALUE)&m, and_cardinality_many_cleanup, (VALUE)&m);
+    RB_GC_GUARD(self);
+    RB_GC_GUARD(others);
+    return ary;
+}
+
+// Candidates of top_k_overlap are scored in batches of this many per
+// thread, between which the bound for pruning is raised
+#define TOP_K_BATCH 16
+
+struct top_k_entry {
+    double score;
+    long index;
+};
+
+struct top_k_args {
+    const roaring_bitmap_t *query;
+    const roaring_bitmap_t *candidates;
+    long count;
+    long k;
+    bool jaccard;
+    uint64_t query_cardinality;
+    long batch_size;
+
+    // The upper bound of the score of every candidate, by index, and the
+    // same ordered by decreasing bound
+    struct top_k_entry *bounds;
+    struct top_k_entry *order;
+
+    // The scores of the current batch, or -1 for pruned candidates
+    const struct top_k_entry *batch;
+    double *scores;
+    double threshold;
+
+    // A min-heap of the best `size` candidates so far, worst first
+    struct top_k_entry *heap;
+    long size;
+};
+
+// Whether `a` ranks below `b`: a lower score, or the same score with a later index
+static bool top_k_worse(const struct top_k_entry *a, const struct top_k_entry *b)
+{
+    return a->score < b->score || (a->score == b->score && a->index > b->index);
+}
+
+static int top_k_compare(const void *a, const void *b)
+{
+    const struct top_k_entry *x = a, *y = b;
+    return top_k_worse(x, y) ? 1 : top_k_worse(y, x) ? -1 : 0;
+}
+
+static void top_k_push(struct top_k_args *args, struct top_k_entry entry)
+{
+    struct top_k_entry *heap = args->heap;
+    long i;
+    if (args->size < args->k) {
+        // Sift the new entry up from the end
+        i = args->size++;
+        while (i > 0 && top_k_worse(&entry, &heap[(i - 1) / 2])) {
+            heap[i] = heap[(i - 1) / 2];
+            i = (i - 1) / 2;
+        }
+    } else if (top_k_worse(&heap[0], &entry)) {
+        // Replace the worst entry, and sift the new one down
+        i = 0;
+        for (;;) {
+            long child = 2 * i + 1;
+            if (child >= args->size) break;
+            if (child + 1 < args->size && top_k_worse(&heap[child + 1], &heap[child])) child++;
+            if (!top_k_worse(&heap[child], &entry)) break;
+            heap[i] = heap[child];
+            i = child;
+        }
+    } else {
+        return;
+    }
+    heap[i] = entry;
+}
+
+static void top_k_bound_task(void *ptr, size_t i)
+{
+    struct top_k_args *args = ptr;
+    double query = (double)args->query_cardinality;
+    double candidate = (double)roaring_bitmap_get_cardinality(&args->candidates[i]);
+    double smaller = query < candidate ? query : candidate;
+    double larger = query < candidate ? candidate : query;
+    double bound = args->jaccard ? (larger ? smaller / larger : 1.0) : smaller;
+    args->bounds[i] = (struct top_k_entry){ bound, (long)i };
+}
+
+static void top_k_score_task(void *ptr, size_t i)
+{
+    struct top_k_args *args = ptr;
+    const struct top_k_entry *entry = &args->batch[i];
+    if (entry->score < args->threshold) {
+        args->scores[i] = -1;
+        return;
+    }
+
+    const roaring_bitmap_t *candidate = &args->candidates[entry->index];
+    if (args->jaccard) {
+        uint64_t intersection = roaring_bitmap_and_cardinality(args->query, candidate);
+        uint64_t union_size = args->query_cardinality + roaring_bitmap_get_cardinality(candidate) - intersection;
+        args->scores[i] = union_size ? (double)intersection / (double)union_size : 1.0;
+    } else {
+        args->scores[i] = (double)roaring_bitmap_and_cardinality(args->query, candidate);
+    }
+}
+
+// Scores the candidates of `batch` whose bound isn't below the worst score
+// kept so far, and keeps the best
+static void top_k_score_batch(struct top_k_args *args, const struct top_k_entry *batch, long count)
+{
+    args->threshold = args->size < args->k ? -1 : args->heap[0].score;
+    args->batch = batch;
+    rb_roaring_parallel_for(count, top_k_score_task, args);
+    for (long i = 0; i < count; i++) {
+        if (args->scores[i] >= 0) {
+            top_k_push(args, (struct top_k_entry){ args->scores[i], batch[i].index });
+        }
+    }
+}
+
+// The candidates with the highest bounds are scored first, to set a high
+// bar for the others. Those are then visited in their original order,
+// which reads their containers in about the order they were allocated in,
+// much faster than jumping around memory in order of their bounds.
+static void *top_k_nogvl(void *ptr)
+{
+    struct top_k_args *args = ptr;
+    long batch_size = args->batch_size;
+    args->query_cardinality = roaring_bitmap_get_cardinality(args->query);
+    rb_roaring_parallel_for(args->count, top_k_bound_task, args);
+    memcpy(args->order, args->bounds, args->count * sizeof(*args->order));
+    qsort(args->order, args->count, sizeof(*args->order), top_k_compare);
+
+    long seeded = args->k > batch_size ? args->k : batch_size;
+    if (seeded > args->count) {
+        seeded = args->count;
+    }
+    for (long start = 0; start < seeded; start += batch_size) {
+        top_k_score_batch(args, &args->order[start], seeded - start < batch_size ? seeded - start : batch_size);
+    }
+    for (long i = 0; i < seeded; i++) {
+        args->bounds[args->order[i].index].score = -1;
+    }
+
+    for (long start = 0; start < args->count; start += batch_size) {
+        // The heap is full, so the remaining bounds can't beat it past this
+        if (seeded == args->count || args->order[seeded].score < args->heap[0].score) {
+            break;
+        }
+        top_k_score_batch(args, &args->bounds[start], args->count - start < batch_size ? args->count - start : batch_size);
+    }
+
+    qsort(args->heap, args->size, sizeof(*args->heap), top_k_compare);
+    return NULL;
+}
+
+struct top_k {
+    VALUE query;
+    VALUE candidates;
+    roaring_bitmap_t view;
+    roaring_bitmap_t *views;
+    bool query_locked;
+    long locked;
+    struct top_k_args args;
+};
+
+static VALUE top_k_run(VALUE ptr)
+{
+    struct top_k *t = (struct top_k *)ptr;
+    struct top_k_args *args = &t->args;
+
+    t->views = ALLOC_N(roaring_bitmap_t, args->count);
+    args->bounds = ALLOC_N(struct top_k_entry, args->count);
+    args->order = ALLOC_N(struct top_k_entry, args->count);
+    args->heap = ALLOC_N(struct top_k_entry, args->k);
+    args->batch_size = TOP_K_BATCH * rb_roaring_parallelism();
+    args->scores = ALLOC_N(double, args->batch_size);
+
+    t->view = readonly_view(lock_bitmap(t->query));
+    t->query_locked = true;
+    lock_bitmap_list(t->candidates, t->views, &t->locked);
+
+    args->query = &t->view;
+    args->candidates = t->views;
+    rb_thread_call_without_gvl(top_k_nogvl, args, NULL, NULL);
+
+    VALUE ary = rb_ary_new_capa(args->size);
+    for (long i = 0; i < args->size; i++) {
+        const struct top_k_entry *entry = &args->heap[i];
+        VALUE score = args->jaccard ? DBL2NUM(entry->score) : ULL2NUM((uint64_t)entry->score);
+        rb_ary_push(ary, rb_assoc_new(LONG2NUM(entry->index), score));
+    }
+    return ary;
+}
+
+static VALUE top_k_cleanup(VALUE ptr)
+{
+    struct top_k *t = (struct top_k *)ptr;
+    struct top_k_args *args = &t->args;
+
+    unlock_bitmap_list(t->candidates, t->locked);
+    if (t->query_locked) {
+        unlock_bitmap(t->query);
+    }
+    xfree(args->scores);
+    xfree(args->heap);
+    xfree(args->order);
+    xfree(args->bounds);
+    xfree(t->views);
+    return Qnil;
+}
+
+// Finds the `k` candidates overlapping most with `query`, using up to
+// {Roaring.parallelism} threads. Candidates are skipped when the largest
+// overlap their cardinality allows can't beat the `k` best found so far.
+// @param query [Bitmap32]
+// @param candidates [Array<Bitmap32>]
+// @param k [Integer] the maximum number of results
+// @param metric [Symbol] `:intersection` to rank by {and_cardinality}, or
+//   `:jaccard` to rank by {jaccard_index}
+// @return [Array<Array(Integer, Numeric)>] the indexes of the best
+//   candidates in `candidates` and their scores, best first. Ties are
+//   broken by index.
+static VALUE rb_roaring32_s_top_k_overlap(int argc, VALUE *argv, VALUE klass)
+{
+    VALUE query, candidates, kv, opts;
+    rb_scan_args(argc, argv, "3:", &query, &candidates, &kv, &opts);
+
+    bool jaccard = false;
+    if (!NIL_P(opts)) {
+        ID keys[1] = { rb_intern("metric") };
+        VALUE values[1];
+        rb_get_kwargs(opts, keys, 0, 1, values);
+        if (values[0] == ID2SYM(rb_intern("jaccard"))) {
+            jaccard = true;
+        } else if (values[0] != Qundef && values[0] != ID2SYM(rb_intern("intersection"))) {
+            rb_raise(rb_eArgError, "unknown metric %+"PRIsVALUE", expected :intersection or :jaccard", values[0]);
+        }
+    }
+
+    get_bitmap(query);
+    candidates = bitmap_list(candidates);
+    long count = RARRAY_LEN(candidates);
+    long k = NUM2LONG(kv);
+    if (k > count) {
+        k = count;
+    }
+    if (k <= 0) {
+        return rb_ary_new();
+    }
+
+    struct top_k t = {
+        .query = query,
+        .candidates = candidates,
+        .args = {
+            .count = count,
+            .k = k,
+            .jaccard = jaccard,
+        },
+    };
+    VALUE ary = rb_ensure(top_k_run, (VALUE)&t, top_k_cleanup, (VALUE)&t);
+    RB_GC_GUARD(query);
+    RB_GC_GUARD(candidates);
+    return ary;
+}
+
+struct deserialize_args {
+    const char **buffers;
+    size_t *lengths;
+    size_t count;
+    roaring_bitmap_t **results;
+};
+
+static void deserialize_task(void *ptr, size_t i)
+{
+    struct deserialize_args *args = ptr;
+    args->results[i] = roaring_bitmap_portable_deserialize_safe(args->buffers[i], args->lengths[i]);
+}
+
+static void *deserialize_many_nogvl(void *ptr)
+{
+    struct deserialize_args *args = ptr;
+    rb_roaring_parallel_for(args->count, deserialize_task, args);
+    return NULL;
+}
+
+struct deserialize_many {
+    VALUE strings;
+    struct deserialize_args args;
+};
+
+static VALUE deserialize_many_run(VALUE ptr)
+{
+    struct deserialize_many *d = (struct deserialize_many *)ptr;
+    struct deserialize_args *args = &d->args;
+    long count = RARRAY_LEN(d->strings);
+
+    args->buffers = ZALLOC_N(const char *, count);
+    args->lengths = ALLOC_N(size_t, count);
+    args->results = ZALLOC_N(roaring_bitmap_t *, count);
+
+    // `args->count` counts the strings prepared so far, for the cleanup
+    for (long i = 0; i < count; i++) {
+        // A frozen copy shares the original's buffer, but keeps it alive and
+        // unchanged even if the original string is modified meanwhile
+        VALUE str = RARRAY_AREF(d->strings, i);
+        str = rb_str_new_frozen(StringValue(str));
+        RARRAY_ASET(d->strings, i, str);
+
+        args->lengths[i] = RSTRING_LEN(str);
+        if (FL_TEST_RAW(str, RSTRING_NOEMBED)) {
+            args->buffers[i] = RSTRING_PTR(str);
+        } else {
+            // Embedded strings live inside the object, which GC compaction
+            // may move while we don't hold the GVL. They're small, so copy them.
+            char *copy = ALLOC_N(char, args->lengths[i]);
+            memcpy(copy, RSTRING_PTR(str), args->lengths[i]);
+            args->buffers[i] = copy;
+        }
+        args->count = i + 1;
+    }
+
+    rb_thread_call_without_gvl(deserialize_many_nogvl, args, NULL, NULL);
+
+    for (long i = 0; i < count; i++) {
+        if (!args->results[i]) {
+            rb_raise(rb_eArgError, "invalid serialized bitmap at index %ld", i);
+        }
+    }
+
+    VALUE ary = rb_ary_new_capa(count);
+    for (long i = 0; i < count; i++) {
+        rb_ary_push(ary, rb_roaring32_new(cRoaringBitmap32, args->results[i]));
+        args->results[i] = NULL;
+    }
+    return ary;
+}
+
+static VALUE deserialize_many_cleanup(VALUE ptr)
+{
+    struct deserialize_many *d = (struct deserialize_many *)ptr;
+    struct deserialize_args *args = &d->args;
+
+    for (size_t i = 0; i < args->count; i++) {
+        if (!FL_TEST_RAW(RARRAY_AREF(d->strings, i), RSTRING_NOEMBED)) {
+            xfree((char *)args->buffers[i]);
+        }
+        // The results which weren't wrapped before an exception
+        roaring_bitmap_free(args->results[i]);
+    }
+    xfree(args->results);
+    xfree(args->lengths);
+    xfree(args->buffers);
+    return Qnil;
+}
+
+// Loads many previously serialized bitmaps, using up to {Roaring.parallelism} threads
+// @param strings [Array<String>]
+// @return [Array<Bitmap32>]
+static VALUE rb_roaring32_deserialize_many(VALUE self, VALUE strings)
+{
+    struct deserialize_many d = {
+        .strings = rb_ary_dup(rb_convert_type(strings, T_ARRAY, "Array", "to_ary")),
+    };
+    VALUE ary = rb_ensure(deserialize_many_run, (VALUE)&d, deserialize_many_cleanup, (VALUE)&d);
+    RB_GC_GUARD(d.strings);
+    return ary;
+}
+
+// Copies the bitmap into a Bitmap64, container by container
+// @return [Bitmap64] a new bitmap containing the same elements as `self`
+static VALUE rb_roaring32_to_bitmap64(VALUE self)
+{
+    return rb_roaring64_wrap32(copy_unshared(get_bitmap(self)));
+}
+
+// Converts the bitmap into a flat Bitset, which is faster for random access
+// when the values are dense
+// @return [Bitset] a new bitset containing the same elements as `self`
+static VALUE rb_roaring32_to_bitset(VALUE self)
+{
+    return rb_roaring_bitset_from_bitmap(get_bitmap(self));
+}
+
+// Matches SERIAL_COOKIE, the cookie of portable bitmaps with run containers
+#define PORTABLE_COOKIE 12347
+
+static void ranges_push(VALUE ranges, uint64_t start, uint64_t length)
+{
+    long len = RSTRING_LEN(ranges);
+    if (len > 0) {
+        uint64_t last[2];
+        memcpy(last, RSTRING_PTR(ranges) + len - sizeof(last), sizeof(last));
+        if (last[0] + last[1] == start) {
+            last[1] += length;
+            memcpy(RSTRING_PTR(ranges) + len - sizeof(last), last, sizeof(last));
+            return;
+        }
+    }
+    uint64_t pair[2] = { start, length };
+    rb_str_cat(ranges, (const char *)pair, sizeof(pair));
+}
+
+// Appends the runs of a bitset container, a run of ones at a time
+static void bitset_container_ranges(const char *data, uint64_t base, VALUE ranges)
+{
+    uint64_t words[1024];
+    memcpy(words, data, sizeof(words));
+
+    size_t i = 0;
+    uint64_t word = words[0];
+    for (;;) {
+        while (word == 0) {
+            if (++i == 1024) return;
+            word = words[i];
+        }
+        uint64_t start = i * 64 + __builtin_ctzll(word);
+
+        // Ones below the run don't matter any more, and make it end at the
+        // first zero
+        word |= word - 1;
+        while (word == UINT64_MAX) {
+            if (++i == 1024) {
+                ranges_push(ranges, base + start, 65536 - start);
+                return;
+            }
+            word = words[i];
+        }
+        uint64_t end = i * 64 + __builtin_ctzll(~word);
+        ranges_push(ranges, base + start, end - start);
+        word &= word + 1;
+    }
+}
+
+// Appends the runs of container `i`, read from its portable serialization
+// since containers aren't part of CRoaring's public API
+static void container_ranges(const roaring_bitmap_t *bitmap, int32_t i, uint64_t base, VALUE ranges, VALUE scratch)
+{
+    roaring_bitmap_t view = slice_view(bitmap, i, 1);
+    size_t size = roaring_bitmap_portable_size_in_bytes(&view);
+    if ((size_t)RSTRING_LEN(scratch) < size) {
+        rb_str_resize(scratch, size);
+    }
+    const char *buf = RSTRING_PTR(scratch);
+    roaring_bitmap_portable_serialize(&view, RSTRING_PTR(scratch));
+
+    // A single container: its key and cardinality follow the header, then
+    // its data, without offsets when it's serialized with run containers
+    uint32_t cookie;
+    memcpy(&cookie, buf, sizeof(cookie));
+    bool run = false;
+    size_t header, pos;
+    if ((cookie & 0xFFFF) == PORTABLE_COOKIE) {
+        run = buf[4] & 1;
+        header = 5;
+        pos = header + 4;
+    } else {
+        header = 8;
+        pos = header + 4 + 4;
+    }
+    uint16_t key, cardinality_minus_one;
+    memcpy(&key, buf + header, sizeof(key));
+    memcpy(&cardinality_minus_one, buf + header + 2, sizeof(cardinality_minus_one));
+    base += (uint64_t)key << 16;
+
+    if (run) {
+        uint16_t n_runs;
+        memcpy(&n_runs, buf + pos, sizeof(n_runs));
+        pos += sizeof(n_runs);
+        for (uint16_t r = 0; r < n_runs; r++) {
+            uint16_t run_pair[2];
+            memcpy(run_pair, buf + pos + r * sizeof(run_pair), sizeof(run_pair));
+            ranges_push(ranges, base + run_pair[0], (uint64_t)run_pair[1] + 1);
+        }
+    } else if (cardinality_minus_one >= 4096) {
+        bitset_container_ranges(buf + pos, base, ranges);
+    } else {
+        for (uint32_t j = 0; j <= cardinality_minus_one; j++) {
+            uint16_t value;
+            memcpy(&value, buf + pos + j * sizeof(value), sizeof(value));
+            ranges_push(ranges, base + value, 1);
+        }
+    }
+    RB_GC_GUARD(scratch);
+}
+
+void rb_roaring32_ranges(const roaring_bitmap_t *bitmap, uint64_t base, VALUE ranges)
+{
+    const roaring_array_t *ra = &bitmap->high_low_container;
+    VALUE scratch = rb_str_buf_new(0);
+    for (int32_t i = 0; i < ra->size; i++) {
+        container_ranges(bitmap, i, base, ranges, scratch);
+    }
+    rb_str_resize(scratch, 0);
+}
+
+VALUE rb_roaring_ranges_result(VALUE ranges, VALUE opts)
+{
+    bool packed = false;
+    if (!NIL_P(opts)) {
+        ID keys[1] = { rb_intern("packed") };
+        VALUE values[1];
+        rb_get_kwargs(opts, keys, 0, 1, values);
+        packed = values[0] != Qundef && RTEST(values[0]);
+    }
+    if (packed) {
+        return ranges;
+    }
+
+    const char *ptr = RSTRING_PTR(ranges);
+    long count = RSTRING_LEN(ranges) / (2 * sizeof(uint64_t));
+    VALUE ary = rb_ary_new_capa(count);
+    for (long i = 0; i < count; i++) {
+        uint64_t pair[2];
+        memcpy(pair, ptr + i * sizeof(pair), sizeof(pair));
+        rb_ary_push(ary, rb_range_new(ULL2NUM(pair[0]), ULL2NUM(pair[0] + pair[1] - 1), 0));
+    }
+    RB_GC_GUARD(ranges);
+    return ary;
+}
+
+static uint64_t ranges_num2bound(VALUE num, uint64_t max)
+{
+    // Other Numerics would be truncated, adding values outside the range
+    if (!RB_INTEGER_TYPE_P(num)) {
+        rb_raise(rb_eTypeError, "range bounds must be Integers, not %s", rb_obj_classname(num));
+    }
+
+    int sign;
+    uint64_t value;
+    if (!rb_roaring_num2offset(num, &sign, &value) || sign < 0 || value > max) {
+        rb_raise(rb_eRangeError, "%+"PRIsVALUE" is out of range", num);
+    }
+    return value;
+}
+
+void rb_roaring_ranges_each_closed(VALUE list, uint64_t max, rb_roaring_range_func *func, void *arg)
+{
+    if (RB_TYPE_P(list, T_STRING)) {
+        const char *ptr = RSTRING_PTR(list);
+        long len = RSTRING_LEN(list);
+        if (len % (2 * sizeof(uint64_t))) {
+            rb_raise(rb_eArgError, "packed ranges must be pairs of 64-bit integers");
+        }
+        for (long i = 0; i < len; i += 2 * sizeof(uint64_t)) {
+            uint64_t pair[2];
+            memcpy(pair, ptr + i, sizeof(pair));
+            if (pair[1] == 0) continue;
+            if (pair[0] > max || pair[1] - 1 > max - pair[0]) {
+                rb_raise(rb_eRangeError, "range starting at %"PRIu64" is out of range", pair[0]);
+            }
+            func(arg, pair[0], pair[0] + pair[1] - 1);
+        }
+        RB_GC_GUARD(list);
+        return;
+    }
+
+    list = rb_convert_type(list, T_ARRAY, "Array", "to_ary");
+    for (long i = 0; i < RARRAY_LEN(list); i++) {
+        VALUE range = RARRAY_AREF(list, i);
+        VALUE first, last;
+        int exclude_end;
+        if (!rb_range_values(range, &first, &last, &exclude_end)) {
+            rb_raise(rb_eTypeError, "wrong argument type %s (expected Range)", rb_obj_classname(range));
+        }
+        uint64_t min = NIL_P(first) ? 0 : ranges_num2bound(first, max);
+        uint64_t limit = NIL_P(last) ? max : ranges_num2bound(last, max);
+        if (exclude_end && !NIL_P(last)) {
+            if (limit == 0) continue;
+            limit--;
+        }
+        if (limit < min) continue;
+        func(arg, min, limit);
+    }
+    RB_GC_GUARD(list);
+}
+
+// Yields the ranges collected in `ranges` and removes them, but the last one
+// when `keep_last`, since the runs of the next container may extend it
+static void ranges_yield(VALUE ranges, bool keep_last)
+{
+    const long pair_size = 2 * sizeof(uint64_t);
+    long count = RSTRING_LEN(ranges) / pair_size;
+    long yielded = keep_last && count > 0 ? count - 1 : count;
+    for (long i = 0; i < yielded; i++) {
+        uint64_t pair[2];
+        memcpy(pair, RSTRING_PTR(ranges) + i * pair_size, sizeof(pair));
+        rb_yield(rb_range_new(ULL2NUM(pair[0]), ULL2NUM(pair[0] + pair[1] - 1), 0));
+    }
+    if (yielded < count) {
+        memmove(RSTRING_PTR(ranges), RSTRING_PTR(ranges) + yielded * pair_size, pair_size);
+        rb_str_set_len(ranges, pair_size);
+    } else {
+        rb_str_set_len(ranges, 0);
+    }
+}
+
+void rb_roaring32_yield_ranges(const roaring_bitmap_t *bitmap, uint64_t base, VALUE ranges)
+{
+    const roaring_array_t *ra = &bitmap->high_low_container;
+    VALUE scratch = rb_str_buf_new(0);
+    for (int32_t i = 0; i < ra->size; i++) {
+        container_ranges(bitmap, i, base, ranges, scratch);
+        ranges_yield(ranges, true);
+    }
+    rb_str_resize(scratch, 0);
+}
+
+void rb_roaring_ranges_yield(VALUE ranges)
+{
+    ranges_yield(ranges, false);
+}
+
+// Iterates over the runs of consecutive elements, straight from the
+// containers: a run container yields each of its runs, a bitset container
+// each run of ones, and runs spanning several containers are joined. Runs
+// are yielded a container at a time, rather than all collected first.
+// @example
+//   Roaring::Bitmap32[1, 2, 3, 7, 9, 10].each_range.to_a # => [1..3, 7..7, 9..10]
+// @yieldparam range [Range] an inclusive range of elements
+// @return [self]
+static VALUE rb_roaring32_each_range(VALUE self)
+{
+    RETURN_ENUMERATOR(self, 0, 0);
+    VALUE ranges = rb_str_buf_new(0);
+    VALUE scratch = rb_str_buf_new(0);
+
+    // The bitmap is looked up for every container, since the block may
+    // modify it
+    for (int32_t i = 0; i < get_bitmap(self)->high_low_container.size; i++) {
+        container_ranges(get_bitmap(self), i, 0, ranges, scratch);
+        ranges_yield(ranges, true);
+    }
+    ranges_yield(ranges, false);
+    RB_GC_GUARD(scratch);
+    return self;
+}
+
+// The runs of consecutive elements, see {#each_range}. Its cost depends on
+// the number of runs and containers rather than on the number of elements.
+// @example
+//   Roaring::Bitmap32[1, 2, 3, 7].to_ranges # => [1..3, 7..7]
+//   Roaring::Bitmap32[1, 2, 3, 7].to_ranges(packed: true).unpack("Q*") # => [1, 3, 7, 1]
+// @param packed [Boolean] whether to return a String rather than Ranges
+// @return [Array<Range>, String] inclusive ranges, or with `packed: true`
+//   native-endian 64-bit unsigned (start, length) pairs (`unpack("Q*")`),
+//   which {.from_ranges} reads back
+static VALUE rb_roaring32_to_ranges(int argc, VALUE *argv, VALUE self)
+{
+    VALUE opts;
+    rb_scan_args(argc, argv, "0:", &opts);
+
+    VALUE ranges = rb_str_buf_new(0);
+    rb_roaring32_ranges(get_bitmap(self), 0, ranges);
+    return rb_roaring_ranges_result(ranges, opts);
+}
+
+static void from_ranges_add(void *arg, uint64_t min, uint64_t max)
+{
+    roaring_bitmap_add_range_closed(arg, (uint32_t)min, (uint32_t)max);
+}
+
+// Builds a bitmap from a list of ranges, adding each of them whole rather
+// than element by element
+// @example
+//   Roaring::Bitmap32.from_ranges([1..3, 7...9]) # => #<Roaring::Bitmap32 {1, 2, 3, 7, 8}>
+// @param list [Array<Range>, String] ranges, which may overlap and be in any
+//   order, or the packed (start, length) pairs of {#to_ranges}
+// @return [Bitmap32]
+static VALUE rb_roaring32_s_from_ranges(VALUE klass, VALUE list)
+{
+    VALUE obj = rb_roaring32_new(klass, roaring_bitmap_create());
+    rb_roaring_ranges_each_closed(list, UINT32_MAX, from_ranges_add, get_bitmap(obj));
+    return obj;
+}
+
+bool rb_roaring32_bitmap_p(VALUE obj)
+{
+    return rb_typeddata_is_kind_of(obj, &roaring_type);
+}
+
+const roaring_bitmap_t *rb_roaring32_lock(VALUE obj)
+{
+    return lock_bitmap(obj);
+}
+
+void rb_roaring32_unlock(VALUE obj)
+{
+    unlock_bitmap(obj);
+}
+
+roaring_bitmap_t rb_roaring32_view(const roaring_bitmap_t *bitmap)
+{
+    return readonly_view(bitmap);
+}
+
+roaring_bitmap_t *rb_roaring32_copy(const roaring_bitmap_t *bitmap)
+{
+    return copy_unshared(bitmap);
+}
+
+VALUE rb_roaring32_wrap(roaring_bitmap_t *bitmap)
+{
+    return rb_roaring32_new(cRoaringBitmap32, bitmap);
+}
+
 void
 rb_roaring32_init(void)
 {
   cRoaringBitmap32 = rb_define_class_under(rb_mRoaring, "Bitmap32", rb_cObject);
   rb_define_alloc_func(cRoaringBitmap32, rb_roaring32_alloc);
   rb_define_method(cRoaringBitmap32, "replace", rb_roaring32_replace, 1);
+  rb_define_method(cRoaringBitmap32, "freeze", rb_roaring32_freeze, 0);
+  rb_define_method(cRoaringBitmap32, "copy_on_write?", rb_roaring32_copy_on_write_p, 0);
+  rb_define_method(cRoaringBitmap32, "copy_on_write=", rb_roaring32_set_copy_on_write, 1);
   rb_define_method(cRoaringBitmap32, "empty?", rb_roaring32_empty_p, 0);
   rb_define_method(cRoaringBitmap32, "clear", rb_roaring32_clear, 0);
+  rb_define_method(cRoaringBitmap32, "generation", rb_roaring32_generation, 0);
   rb_define_method(cRoaringBitmap32, "cardinality", rb_roaring32_cardinality, 0);
   rb_define_method(cRoaringBitmap32, "add", rb_roaring32_add, 1);
   rb_define_method(cRoaringBitmap32, "add?", rb_roaring32_add_p, 1);
@@ -401,6 +2330,8 @@ rb_roaring32_init(void)
   rb_define_method(cRoaringBitmap32, "include?", rb_roaring32_include_p, 1);
   rb_define_method(cRoaringBitmap32, "each", rb_roaring32_each, 0);
   rb_define_method(cRoaringBitmap32, "[]", rb_roaring32_aref, 1);
+  rb_define_method(cRoaringBitmap32, "each_range", rb_roaring32_each_range, 0);
+  rb_define_method(cRoaringBitmap32, "to_ranges", rb_roaring32_to_ranges, -1);
 
   rb_define_method(cRoaringBitmap32, "and!", rb_roaring32_and_inplace, 1);
   rb_define_method(cRoaringBitmap32, "or!", rb_roaring32_or_inplace, 1);
@@ -416,6 +2347,19 @@ rb_roaring32_init(void)
   rb_define_method(cRoaringBitmap32, "<", rb_roaring32_lt, 1);
   rb_define_method(cRoaringBitmap32, "<=", rb_roaring32_lte, 1);
   rb_define_method(cRoaringBitmap32, "intersect?", rb_roaring32_intersect_p, 1);
+  rb_define_method(cRoaringBitmap32, "and_cardinality", rb_roaring32_and_cardinality, 1);
+  rb_define_method(cRoaringBitmap32, "and_cardinality_many", rb_roaring32_and_cardinality_many, 1);
+  rb_define_method(cRoaringBitmap32, "to_bitmap64", rb_roaring32_to_bitmap64, 0);
+  rb_define_method(cRoaringBitmap32, "to_bitset", rb_roaring32_to_bitset, 0);
+  rb_define_method(cRoaringBitmap32, "shift", rb_roaring32_shift, 1);
+  rb_define_method(cRoaringBitmap32, "shift!", rb_roaring32_shift_inplace, 1);
+  rb_define_method(cRoaringBitmap32, "sample", rb_roaring32_sample, -1);
+  rb_define_method(cRoaringBitmap32, "sample_bitmap", rb_roaring32_sample_bitmap, -1);
+  rb_define_method(cRoaringBitmap32, "minhash", rb_roaring32_minhash, -1);
+  rb_define_singleton_method(cRoaringBitmap32, "or_many", rb_roaring32_s_or_many, 1);
+  rb_define_singleton_method(cRoaringBitmap32, "and_many", rb_roaring32_s_and_many, 1);
+  rb_define_singleton_method(cRoaringBitmap32, "funnel", rb_roaring32_s_funnel, -1);
+  rb_define_singleton_method(cRoaringBitmap32, "top_k_overlap", rb_roaring32_s_top_k_overlap, -1);
 
   rb_define_method(cRoaringBitmap32, "min", rb_roaring32_min, 0);
   rb_define_method(cRoaringBitmap32, "max", rb_roaring32_max, 0);
@@ -425,4 +2369,6 @@ rb_roaring32_init(void)
 
   rb_define_method(cRoaringBitmap32, "serialize", rb_roaring32_serialize, 0);
   rb_define_singleton_method(cRoaringBitmap32, "deserialize", rb_roaring32_deserialize, 1);
+  rb_define_singleton_method(cRoaringBitmap32, "deserialize_many", rb_roaring32_deserialize_many, 1);
+  rb_define_singleton_method(cRoaringBitmap32, "from_ranges", rb_roaring32_s_from_ranges, 1);
 }
@@ -1,6 +1,9 @@
 #include "roaring_ruby.h"
 
 #include <stdio.h>
+#include <string.h>
+
+#include <ruby/thread.h>
 
 static VALUE cRoaringBitmap64;
 
@@ -15,17 +18,41 @@ NUM2UINT64(VALUE num) {
     }
 }
 
+typedef struct {
+    // Values are kept in a 32-bit bitmap as long as they all fit in 32 bits,
+    // which is faster than the 64-bit one for reads and operations, and
+    // moved to a 64-bit bitmap once one doesn't, see promote. Exactly one of
+    // the two is set.
+    roaring_bitmap_t *bitmap32;
+    roaring64_bitmap_t *bitmap;
+
+    // Number of operations currently reading the bitmap without the GVL.
+    // Like rb_str_locktmp, modifications raise while this is non-zero.
+    unsigned int locks;
+
+    // Changes on every modification, see rb_roaring_next_generation
+    uint64_t generation;
+} rb_roaring64_t;
+
 static void rb_roaring64_free(void *data)
 {
-    roaring64_bitmap_free(data);
+    rb_roaring64_t *wrapper = data;
+    roaring_bitmap_free(wrapper->bitmap32);
+    roaring64_bitmap_free(wrapper->bitmap);
+    ruby_xfree(wrapper);
 }
 
 static size_t rb_roaring64_memsize(const void *data)
 {
-    // This is probably an estimate, "frozen" refers to the "frozen"
-    // serialization format, which mimics the in-memory representation.
-    //return sizeof(roaring64_bitmap_t) + roaring64_bitmap_frozen_size_in_bytes(data);
-    return 0;
+    const rb_roaring64_t *wrapper = data;
+    if (wrapper->bitmap32) {
+        return sizeof(rb_roaring64_t) + roaring_bitmap_size_in_bytes(wrapper->bitmap32);
+    }
+
+    // CRoaring doesn't report the memory used by 64-bit bitmaps. Their
+    // portable size is an estimate of it, which stores every container
+    // as it is in memory.
+    return sizeof(rb_roaring64_t) + roaring64_bitmap_portable_size_in_bytes(wrapper->bitmap);
 }
 
 static const rb_data_type_t roaring64_type = {
@@ -34,105 +61,286 @@ static const rb_data_type_t roaring64_type = {
         .dfree = rb_roaring64_free,
         .dsize = rb_roaring64_memsize
     },
+#ifdef HAVE_RB_EXT_RACTOR_SAFE
+    .flags = RUBY_TYPED_FREE_IMMEDIATELY | RUBY_TYPED_FROZEN_SHAREABLE,
+#else
     .flags = RUBY_TYPED_FREE_IMMEDIATELY,
+#endif
 };
 
+// Moves the values of `bitmap32` into a new 64-bit bitmap, and frees it
+static roaring64_bitmap_t *widen(roaring_bitmap_t *bitmap32)
+{
+    roaring64_bitmap_t *bitmap = roaring64_bitmap_move_from_roaring32(bitmap32);
+    roaring_bitmap_free(bitmap32);
+    return bitmap;
+}
+
+// Wraps a bitmap in a new Bitmap64, which takes ownership of it. Only one of
+// `bitmap32` and `bitmap` may be set.
+static VALUE rb_roaring64_new_any(VALUE klass, roaring_bitmap_t *bitmap32, roaring64_bitmap_t *bitmap)
+{
+    if (!bitmap32 && !bitmap) {
+        rb_raise(rb_eNoMemError, "failed to allocate bitmap");
+    }
+
+    rb_roaring64_t *wrapper;
+    VALUE obj = TypedData_Make_Struct(klass, rb_roaring64_t, &roaring64_type, wrapper);
+    wrapper->bitmap32 = bitmap32;
+    wrapper->bitmap = bitmap;
+    wrapper->generation = rb_roaring_next_generation();
+    return obj;
+}
+
+static VALUE rb_roaring64_new(VALUE klass, roaring64_bitmap_t *bitmap)
+{
+    return rb_roaring64_new_any(klass, NULL, bitmap);
+}
+
+static VALUE rb_roaring64_new32(VALUE klass, roaring_bitmap_t *bitmap32)
+{
+    return rb_roaring64_new_any(klass, bitmap32, NULL);
+}
+
 static VALUE rb_roaring64_alloc(VALUE self)
 {
-    roaring64_bitmap_t *data = roaring64_bitmap_create();
-    return TypedData_Wrap_Struct(self, &roaring64_type, data);
+    return rb_roaring64_new32(self, roaring_bitmap_create());
 }
 
-static roaring64_bitmap_t *get_bitmap(VALUE obj) {
-    roaring64_bitmap_t *bitmap;
-    TypedData_Get_Struct(obj, roaring64_bitmap_t, &roaring64_type, bitmap);
-    return bitmap;
+static rb_roaring64_t *get_wrapper(VALUE obj) {
+    rb_roaring64_t *wrapper;
+    TypedData_Get_Struct(obj, rb_roaring64_t, &roaring64_type, wrapper);
+    return wrapper;
+}
+
+// Same as get_wrapper, but raises FrozenError if `obj` is frozen
+static rb_roaring64_t *get_wrapper_for_write(VALUE obj) {
+    rb_check_frozen(obj);
+    rb_roaring64_t *wrapper = get_wrapper(obj);
+    if (wrapper->locks) {
+        rb_raise(rb_eRuntimeError, "can't modify bitmap; temporarily locked");
+    }
+    wrapper->generation = rb_roaring_next_generation();
+    return wrapper;
+}
+
+// Switches `wrapper` to a 64-bit bitmap, for values which don't fit in 32 bits
+static roaring64_bitmap_t *promote(rb_roaring64_t *wrapper) {
+    if (wrapper->bitmap32) {
+        wrapper->bitmap = widen(wrapper->bitmap32);
+        wrapper->bitmap32 = NULL;
+    }
+    return wrapper->bitmap;
+}
+
+// Returns the 64-bit bitmap of `wrapper`, or a 64-bit copy of its 32-bit
+// one, which is also stored in `*temp` for the caller to free
+static const roaring64_bitmap_t *as_bitmap64(const rb_roaring64_t *wrapper, roaring64_bitmap_t **temp) {
+    if (wrapper->bitmap) {
+        *temp = NULL;
+        return wrapper->bitmap;
+    }
+    return *temp = widen(rb_roaring32_copy(wrapper->bitmap32));
+}
+
+// Prevents `obj` from being modified while it's read without the GVL.
+// Frozen bitmaps can't be modified anyway, and may be shared with other
+// Ractors, so they aren't counted.
+static rb_roaring64_t *lock_bitmap(VALUE obj) {
+    rb_roaring64_t *wrapper = get_wrapper(obj);
+    if (!OBJ_FROZEN(obj)) {
+        wrapper->locks++;
+    }
+    return wrapper;
+}
+
+static void unlock_bitmap(VALUE obj) {
+    if (!OBJ_FROZEN(obj)) {
+        get_wrapper(obj)->locks--;
+    }
 }
 
+// Operations between two bitmaps also take Bitmap32s, read through a
+// wrapper borrowing a view of their bitmap
+struct operand {
+    rb_roaring64_t borrowed;
+    roaring_bitmap_t view;
+};
+
+static void check_operand(VALUE obj) {
+    if (!rb_roaring32_bitmap_p(obj)) {
+        get_wrapper(obj);
+    }
+}
+
+static rb_roaring64_t *lock_operand(VALUE obj, struct operand *operand) {
+    if (rb_roaring32_bitmap_p(obj)) {
+        operand->view = rb_roaring32_view(rb_roaring32_lock(obj));
+        operand->borrowed = (rb_roaring64_t){ .bitmap32 = &operand->view };
+        return &operand->borrowed;
+    }
+    return lock_bitmap(obj);
+}
+
+static void unlock_operand(VALUE obj) {
+    if (rb_roaring32_bitmap_p(obj)) {
+        rb_roaring32_unlock(obj);
+    } else {
+        unlock_bitmap(obj);
+    }
+}
+
+// Replaces the contents of `self` with those of `other`, which may also be a
+// Bitmap32
+// @return [self]
 static VALUE rb_roaring64_replace(VALUE self, VALUE other) {
-    roaring64_bitmap_t *self_data = get_bitmap(self);
-    roaring64_bitmap_t *other_data = get_bitmap(other);
+    rb_roaring64_t *wrapper = get_wrapper_for_write(self);
+    check_operand(other);
+    if (rb_roaring64_bitmap_p(other) && get_wrapper(other) == wrapper) {
+        return self;
+    }
 
-    // FIXME: Very likely a newer version of CRoaring will have
-    //roaring64_bitmap_overwrite(self_data, other_data);
+    struct operand operand;
+    rb_roaring64_t *source = lock_operand(other, &operand);
+    roaring_bitmap_t *bitmap32 = NULL;
+    roaring64_bitmap_t *bitmap = NULL;
+    if (source->bitmap32) {
+        bitmap32 = rb_roaring32_copy(source->bitmap32);
+    } else {
+        bitmap = roaring64_bitmap_copy(source->bitmap);
+    }
+    unlock_operand(other);
 
-    roaring64_bitmap_clear(self_data);
-    roaring64_bitmap_or_inplace(self_data, other_data);
+    if (!bitmap32 && !bitmap) {
+        rb_raise(rb_eNoMemError, "failed to allocate bitmap");
+    }
+    roaring_bitmap_free(wrapper->bitmap32);
+    roaring64_bitmap_free(wrapper->bitmap);
+    wrapper->bitmap32 = bitmap32;
+    wrapper->bitmap = bitmap;
 
     return self;
 }
 
+static VALUE rb_roaring64_generation(VALUE self)
+{
+    return ULL2NUM(get_wrapper(self)->generation);
+}
+
 static VALUE rb_roaring64_cardinality(VALUE self)
 {
-    roaring64_bitmap_t *data = get_bitmap(self);
-    uint64_t cardinality = roaring64_bitmap_get_cardinality(data);
+    rb_roaring64_t *wrapper = get_wrapper(self);
+    uint64_t cardinality = wrapper->bitmap32
+        ? roaring_bitmap_get_cardinality(wrapper->bitmap32)
+        : roaring64_bitmap_get_cardinality(wrapper->bitmap);
     return ULONG2NUM(cardinality);
 }
 
 static VALUE rb_roaring64_add(VALUE self, VALUE val)
 {
-    roaring64_bitmap_t *data = get_bitmap(self);
-
     uint64_t num = NUM2UINT64(val);
-    roaring64_bitmap_add(data, num);
+    rb_roaring64_t *wrapper = get_wrapper_for_write(self);
+
+    if (wrapper->bitmap32 && num <= UINT32_MAX) {
+        roaring_bitmap_add(wrapper->bitmap32, (uint32_t)num);
+    } else {
+        roaring64_bitmap_add(promote(wrapper), num);
+    }
     return self;
 }
 
 static VALUE rb_roaring64_add_p(VALUE self, VALUE val)
 {
-    roaring64_bitmap_t *data = get_bitmap(self);
-
     uint64_t num = NUM2UINT64(val);
-    return roaring64_bitmap_add_checked(data, num) ? self : Qnil;
+    rb_roaring64_t *wrapper = get_wrapper_for_write(self);
+
+    bool added;
+    if (wrapper->bitmap32 && num <= UINT32_MAX) {
+        added = roaring_bitmap_add_checked(wrapper->bitmap32, (uint32_t)num);
+    } else {
+        added = roaring64_bitmap_add_checked(promote(wrapper), num);
+    }
+    return added ? self : Qnil;
 }
 
 static VALUE rb_roaring64_add_range_closed(VALUE self, VALUE minv, VALUE maxv)
 {
-    roaring64_bitmap_t *data = get_bitmap(self);
-
     uint64_t min = NUM2UINT64(minv);
     uint64_t max = NUM2UINT64(maxv);
+    rb_roaring64_t *wrapper = get_wrapper_for_write(self);
 
-    roaring64_bitmap_add_range_closed(data, min, max);
+    if (min > max) {
+        return self;
+    }
+    if (wrapper->bitmap32 && max <= UINT32_MAX) {
+        roaring_bitmap_add_range_closed(wrapper->bitmap32, (uint32_t)min, (uint32_t)max);
+    } else {
+        roaring64_bitmap_add_range_closed(promote(wrapper), min, max);
+    }
 
     return self;
 }
 
 static VALUE rb_roaring64_remove(VALUE self, VALUE val)
 {
-    roaring64_bitmap_t *data = get_bitmap(self);
-
     uint64_t num = NUM2UINT64(val);
-    roaring64_bitmap_remove(data, num);
+    rb_roaring64_t *wrapper = get_wrapper_for_write(self);
+
+    if (wrapper->bitmap) {
+        roaring64_bitmap_remove(wrapper->bitmap, num);
+    } else if (num <= UINT32_MAX) {
+        roaring_bitmap_remove(wrapper->bitmap32, (uint32_t)num);
+    }
     return self;
 }
 
 static VALUE rb_roaring64_remove_p(VALUE self, VALUE val)
 {
-    roaring64_bitmap_t *data = get_bitmap(self);
-
     uint64_t num = NUM2UINT64(val);
-    return roaring64_bitmap_remove_checked(data, num) ? self : Qnil;
+    rb_roaring64_t *wrapper = get_wrapper_for_write(self);
+
+    bool removed;
+    if (wrapper->bitmap) {
+        removed = roaring64_bitmap_remove_checked(wrapper->bitmap, num);
+    } else {
+        removed = num <= UINT32_MAX && roaring_bitmap_remove_checked(wrapper->bitmap32, (uint32_t)num);
+    }
+    return removed ? self : Qnil;
 }
 
 static VALUE rb_roaring64_include_p(VALUE self, VALUE val)
 {
-    roaring64_bitmap_t *data = get_bitmap(self);
-
     uint64_t num = NUM2UINT64(val);
-    return RBOOL(roaring64_bitmap_contains(data, num));
+    rb_roaring64_t *wrapper = get_wrapper(self);
+
+    if (wrapper->bitmap32) {
+        return RBOOL(num <= UINT32_MAX && roaring_bitmap_contains(wrapper->bitmap32, (uint32_t)num));
+    }
+    return RBOOL(roaring64_bitmap_contains(wrapper->bitmap, num));
 }
 
 static VALUE rb_roaring64_empty_p(VALUE self)
 {
-    roaring64_bitmap_t *data = get_bitmap(self);
-    return RBOOL(roaring64_bitmap_is_empty(data));
+    rb_roaring64_t *wrapper = get_wrapper(self);
+    return RBOOL(wrapper->bitmap32 ? roaring_bitmap_is_empty(wrapper->bitmap32) : roaring64_bitmap_is_empty(wrapper->bitmap));
 }
 
 static VALUE rb_roaring64_clear(VALUE self)
 {
-    roaring64_bitmap_t *data = get_bitmap(self);
-    roaring64_bitmap_clear(data);
+    rb_roaring64_t *wrapper = get_wrapper_for_write(self);
+
+    // An empty bitmap can go back to 32 bits
+    if (wrapper->bitmap) {
+        roaring_bitmap_t *bitmap32 = roaring_bitmap_create();
+        if (!bitmap32) {
+            rb_raise(rb_eNoMemError, "failed to allocate bitmap");
+        }
+        roaring64_bitmap_free(wrapper->bitmap);
+        wrapper->bitmap = NULL;
+        wrapper->bitmap32 = bitmap32;
+    } else {
+        roaring_bitmap_clear(wrapper->bitmap32);
+    }
     return self;
 }
 
@@ -141,21 +349,38 @@ bool rb_roaring64_each_i(uint64_t value, void *param) {
     return true;  // iterate till the end
 }
 
+static bool rb_roaring64_each32_i(uint32_t value, void *param) {
+    rb_yield(UINT2NUM(value));
+    return true;  // iterate till the end
+}
+
 static VALUE rb_roaring64_each(VALUE self)
 {
-    roaring64_bitmap_t *data = get_bitmap(self);
-    roaring64_bitmap_iterate(data, rb_roaring64_each_i, NULL);
+    rb_roaring64_t *wrapper = get_wrapper(self);
+    if (wrapper->bitmap32) {
+        roaring_iterate(wrapper->bitmap32, rb_roaring64_each32_i, NULL);
+    } else {
+        roaring64_bitmap_iterate(wrapper->bitmap, rb_roaring64_each_i, NULL);
+    }
     return self;
 }
 
 static VALUE rb_roaring64_aref(VALUE self, VALUE rankv)
 {
-    roaring64_bitmap_t *data = get_bitmap(self);
+    rb_roaring64_t *wrapper = get_wrapper(self);
 
     uint64_t rank = NUM2UINT64(rankv);
     uint64_t val;
 
-    if (roaring64_bitmap_select(data, rank, &val)) {
+    if (wrapper->bitmap32) {
+        uint32_t val32;
+        if (rank <= UINT32_MAX && roaring_bitmap_select(wrapper->bitmap32, (uint32_t)rank, &val32)) {
+            return UINT2NUM(val32);
+        }
+        return Qnil;
+    }
+
+    if (roaring64_bitmap_select(wrapper->bitmap, rank, &val)) {
         return ULL2NUM(val);
     } else {
         return Qnil;
@@ -165,61 +390,218 @@ static VALUE rb_roaring64_aref(VALUE self, VALUE rankv)
 
 static VALUE rb_roaring64_min(VALUE self)
 {
-    roaring64_bitmap_t *data = get_bitmap(self);
+    rb_roaring64_t *wrapper = get_wrapper(self);
+
+    if (wrapper->bitmap32) {
+        return roaring_bitmap_is_empty(wrapper->bitmap32) ? Qnil : UINT2NUM(roaring_bitmap_minimum(wrapper->bitmap32));
+    }
 
-    if (roaring64_bitmap_is_empty(data)) {
+    if (roaring64_bitmap_is_empty(wrapper->bitmap)) {
         return Qnil;
     } else {
-        uint64_t val = roaring64_bitmap_minimum(data);
+        uint64_t val = roaring64_bitmap_minimum(wrapper->bitmap);
         return ULL2NUM(val);
     }
 }
 
 static VALUE rb_roaring64_max(VALUE self)
 {
-    roaring64_bitmap_t *data = get_bitmap(self);
+    rb_roaring64_t *wrapper = get_wrapper(self);
+
+    if (wrapper->bitmap32) {
+        return roaring_bitmap_is_empty(wrapper->bitmap32) ? Qnil : UINT2NUM(roaring_bitmap_maximum(wrapper->bitmap32));
+    }
 
-    if (roaring64_bitmap_is_empty(data)) {
+    if (roaring64_bitmap_is_empty(wrapper->bitmap)) {
         return Qnil;
     } else {
-        uint64_t val = roaring64_bitmap_maximum(data);
+        uint64_t val = roaring64_bitmap_maximum(wrapper->bitmap);
         return ULL2NUM(val);
     }
 }
 
 static VALUE rb_roaring64_run_optimize(VALUE self)
 {
-    roaring64_bitmap_t *data = get_bitmap(self);
-    return RBOOL(roaring64_bitmap_run_optimize(data));
+    rb_roaring64_t *wrapper = get_wrapper_for_write(self);
+    if (wrapper->bitmap32) {
+        return RBOOL(roaring_bitmap_run_optimize(wrapper->bitmap32));
+    }
+    return RBOOL(roaring64_bitmap_run_optimize(wrapper->bitmap));
+}
+
+// 32-bit bitmaps are serialized in the 64-bit portable format, as a single
+// bucket of values with high bits 0
+static size_t serialized_size(const rb_roaring64_t *wrapper)
+{
+    if (wrapper->bitmap) {
+        return roaring64_bitmap_portable_size_in_bytes(wrapper->bitmap);
+    }
+    if (roaring_bitmap_is_empty(wrapper->bitmap32)) {
+        return sizeof(uint64_t);
+    }
+    return sizeof(uint64_t) + sizeof(uint32_t) + roaring_bitmap_portable_size_in_bytes(wrapper->bitmap32);
+}
+
+static size_t serialize(const rb_roaring64_t *wrapper, char *buf)
+{
+    if (wrapper->bitmap) {
+        return roaring64_bitmap_portable_serialize(wrapper->bitmap, buf);
+    }
+
+    uint64_t buckets = roaring_bitmap_is_empty(wrapper->bitmap32) ? 0 : 1;
+    memcpy(buf, &buckets, sizeof(buckets));
+    if (!buckets) {
+        return sizeof(buckets);
+    }
+
+    uint32_t high_bits = 0;
+    memcpy(buf + sizeof(buckets), &high_bits, sizeof(high_bits));
+    size_t header = sizeof(buckets) + sizeof(high_bits);
+    return header + roaring_bitmap_portable_serialize(wrapper->bitmap32, buf + header);
+}
+
+// Deserializes a bitmap in the 64-bit portable format, keeping it 32-bit if
+// its values fit. Sets either `*bitmap32` or `*bitmap`, or neither if `buf`
+// is invalid.
+static void deserialize(const char *buf, size_t length, roaring_bitmap_t **bitmap32, roaring64_bitmap_t **bitmap)
+{
+    *bitmap32 = NULL;
+    *bitmap = NULL;
+
+    uint64_t buckets;
+    uint32_t high_bits;
+    if (length >= sizeof(buckets)) {
+        memcpy(&buckets, buf, sizeof(buckets));
+        if (buckets == 0) {
+            *bitmap32 = roaring_bitmap_create();
+            return;
+        }
+    }
+    if (length >= sizeof(buckets) + sizeof(high_bits) && buckets == 1) {
+        memcpy(&high_bits, buf + sizeof(buckets), sizeof(high_bits));
+        if (high_bits == 0) {
+            size_t header = sizeof(buckets) + sizeof(high_bits);
+            *bitmap32 = roaring_bitmap_portable_deserialize_safe(buf + header, length - header);
+            return;
+        }
+    }
+    *bitmap = roaring64_bitmap_portable_deserialize_safe(buf, length);
+}
+
+struct serialize_args {
+    const rb_roaring64_t *wrapper;
+    char *buffer;
+    size_t written;
+};
+
+static void *serialize_nogvl(void *ptr)
+{
+    struct serialize_args *args = ptr;
+    args->written = serialize(args->wrapper, args->buffer);
+    return NULL;
 }
 
 static VALUE rb_roaring64_serialize(VALUE self)
 {
-    roaring64_bitmap_t *data = get_bitmap(self);
+    rb_roaring64_t *wrapper = get_wrapper(self);
 
-    size_t size = roaring64_bitmap_portable_size_in_bytes(data);
+    size_t size = serialized_size(wrapper);
     VALUE str = rb_str_buf_new(size);
 
-    size_t written = roaring64_bitmap_portable_serialize(data, RSTRING_PTR(str));
+    size_t written;
+    if (size >= rb_roaring_offload_threshold() && FL_TEST_RAW(str, RSTRING_NOEMBED)) {
+        struct serialize_args args = {
+            .wrapper = lock_bitmap(self),
+            .buffer = RSTRING_PTR(str),
+        };
+        int state = rb_roaring_offload(serialize_nogvl, &args);
+        unlock_bitmap(self);
+        if (state) {
+            rb_jump_tag(state);
+        }
+        written = args.written;
+    } else {
+        written = serialize(wrapper, RSTRING_PTR(str));
+    }
     rb_str_set_len(str, written);
 
+    RB_GC_GUARD(self);
     return str;
 }
 
+struct deserialize_one_args {
+    const char *buffer;
+    size_t length;
+    roaring_bitmap_t *result32;
+    roaring64_bitmap_t *result;
+};
+
+static void *deserialize_one_nogvl(void *ptr)
+{
+    struct deserialize_one_args *args = ptr;
+    deserialize(args->buffer, args->length, &args->result32, &args->result);
+    return NULL;
+}
+
 static VALUE rb_roaring64_deserialize(VALUE self, VALUE str)
 {
-    roaring64_bitmap_t *bitmap = roaring64_bitmap_portable_deserialize_safe(RSTRING_PTR(str), RSTRING_LEN(str));
+    StringValue(str);
+
+    struct deserialize_one_args args = {
+        .buffer = RSTRING_PTR(str),
+        .length = RSTRING_LEN(str),
+    };
+    bool offload = (size_t)RSTRING_LEN(str) >= rb_roaring_offload_threshold();
+    if (offload) {
+        str = rb_str_new_frozen(str);
+        args.buffer = RSTRING_PTR(str);
+    }
+    if (offload && FL_TEST_RAW(str, RSTRING_NOEMBED)) {
+        int state = rb_roaring_offload(deserialize_one_nogvl, &args);
+        if (state) {
+            roaring_bitmap_free(args.result32);
+            roaring64_bitmap_free(args.result);
+            rb_jump_tag(state);
+        }
+    } else {
+        deserialize_one_nogvl(&args);
+    }
+    RB_GC_GUARD(str);
 
-    return TypedData_Wrap_Struct(cRoaringBitmap64, &roaring64_type, bitmap);
+    if (!args.result32 && !args.result) {
+        rb_raise(rb_eArgError, "invalid serialized bitmap");
+    }
+
+    return rb_roaring64_new_any(cRoaringBitmap64, args.result32, args.result);
 }
 
 static VALUE rb_roaring64_statistics(VALUE self)
 {
-    roaring64_bitmap_t *data = get_bitmap(self);
+    rb_roaring64_t *wrapper = get_wrapper(self);
 
     roaring64_statistics_t stat;
 
-    roaring64_bitmap_statistics(data, &stat);
+    if (wrapper->bitmap32) {
+        roaring_statistics_t stat32;
+        roaring_bitmap_statistics(wrapper->bitmap32, &stat32);
+
+        stat.n_containers = stat32.n_containers;
+        stat.n_array_containers = stat32.n_array_containers;
+        stat.n_run_containers = stat32.n_run_containers;
+        stat.n_bitset_containers = stat32.n_bitset_containers;
+        stat.n_values_array_containers = stat32.n_values_array_containers;
+        stat.n_values_run_containers = stat32.n_values_run_containers;
+        stat.n_values_bitset_containers = stat32.n_values_bitset_containers;
+        stat.n_bytes_array_containers = stat32.n_bytes_array_containers;
+        stat.n_bytes_run_containers = stat32.n_bytes_run_containers;
+        stat.n_bytes_bitset_containers = stat32.n_bytes_bitset_containers;
+        stat.cardinality = stat32.cardinality;
+        // Match the 64-bit bitmap's extremes for empty bitmaps
+        stat.max_value = stat32.cardinality ? stat32.max_value : 0;
+        stat.min_value = stat32.cardinality ? stat32.min_value : UINT64_MAX;
+    } else {
+        roaring64_bitmap_statistics(wrapper->bitmap, &stat);
+    }
 
     VALUE ret = rb_hash_new();
 #define ADD_STAT(name) \
@@ -246,92 +628,1176 @@ static VALUE rb_roaring64_statistics(VALUE self)
 }
 
 typedef roaring64_bitmap_t *binary_func(const roaring64_bitmap_t *, const roaring64_bitmap_t *);
-static VALUE rb_roaring64_binary_op(VALUE self, VALUE other, binary_func func) {
-    roaring64_bitmap_t *self_data = get_bitmap(self);
-    roaring64_bitmap_t *other_data = get_bitmap(other);
+typedef roaring_bitmap_t *binary_func32(const roaring_bitmap_t *, const roaring_bitmap_t *);
+
+// An operation with both its 32-bit and 64-bit kernels
+struct binary_op {
+    binary_func32 *func32;
+    binary_func *func;
+};
+
+static const struct binary_op and_op = { roaring_bitmap_and, roaring64_bitmap_and };
+static const struct binary_op or_op = { roaring_bitmap_or, roaring64_bitmap_or };
+static const struct binary_op xor_op = { roaring_bitmap_xor, roaring64_bitmap_xor };
+static const struct binary_op andnot_op = { roaring_bitmap_andnot, roaring64_bitmap_andnot };
 
-    roaring64_bitmap_t *result = func(self_data, other_data);
+struct binary_op_args {
+    const struct binary_op *op;
+    const rb_roaring64_t *left, *right;
+    roaring_bitmap_t *result32;
+    roaring64_bitmap_t *result;
+};
+
+static void *binary_op_nogvl(void *ptr)
+{
+    struct binary_op_args *args = ptr;
+
+    if (args->left->bitmap32 && args->right->bitmap32) {
+        args->result32 = args->op->func32(args->left->bitmap32, args->right->bitmap32);
+        return NULL;
+    }
+
+    roaring64_bitmap_t *left_temp, *right_temp;
+    const roaring64_bitmap_t *left = as_bitmap64(args->left, &left_temp);
+    const roaring64_bitmap_t *right = as_bitmap64(args->right, &right_temp);
+    args->result = args->op->func(left, right);
+    roaring64_bitmap_free(left_temp);
+    roaring64_bitmap_free(right_temp);
+    return NULL;
+}
+
+// `self` and `other` may each be a Bitmap32 or a Bitmap64
+static VALUE rb_roaring64_binary_op(VALUE self, VALUE other, const struct binary_op *op) {
+    check_operand(self);
+    check_operand(other);
+
+    struct operand self_operand, other_operand;
+    struct binary_op_args args = {
+        .op = op,
+        .left = lock_operand(self, &self_operand),
+        .right = lock_operand(other, &other_operand),
+    };
+
+    int state = 0;
+    size_t threshold = rb_roaring_offload_threshold();
+    if (threshold == SIZE_MAX ||
+        serialized_size(args.left) + serialized_size(args.right) < threshold) {
+        binary_op_nogvl(&args);
+    } else {
+        state = rb_roaring_offload(binary_op_nogvl, &args);
+    }
+    unlock_operand(other);
+    unlock_operand(self);
+    RB_GC_GUARD(self);
+    RB_GC_GUARD(other);
+
+    if (state) {
+        roaring_bitmap_free(args.result32);
+        roaring64_bitmap_free(args.result);
+        rb_jump_tag(state);
+    }
 
-    return TypedData_Wrap_Struct(cRoaringBitmap64, &roaring64_type, result);
+    return rb_roaring64_new_any(cRoaringBitmap64, args.result32, args.result);
 }
 
 typedef void binary_func_inplace(roaring64_bitmap_t *, const roaring64_bitmap_t *);
-static VALUE rb_roaring64_binary_op_inplace(VALUE self, VALUE other, binary_func_inplace func) {
-    roaring64_bitmap_t *self_data = get_bitmap(self);
-    roaring64_bitmap_t *other_data = get_bitmap(other);
+typedef void binary_func_inplace32(roaring_bitmap_t *, const roaring_bitmap_t *);
+
+struct binary_op_inplace {
+    binary_func_inplace32 *func32;
+    binary_func_inplace *func;
+};
 
-    func(self_data, other_data);
+static const struct binary_op_inplace and_inplace_op = { roaring_bitmap_and_inplace, roaring64_bitmap_and_inplace };
+static const struct binary_op_inplace or_inplace_op = { roaring_bitmap_or_inplace, roaring64_bitmap_or_inplace };
+static const struct binary_op_inplace xor_inplace_op = { roaring_bitmap_xor_inplace, roaring64_bitmap_xor_inplace };
+static const struct binary_op_inplace andnot_inplace_op = { roaring_bitmap_andnot_inplace, roaring64_bitmap_andnot_inplace };
 
+// `other` may be a Bitmap32 or a Bitmap64
+static VALUE rb_roaring64_binary_op_inplace(VALUE self, VALUE other, const struct binary_op_inplace *op) {
+    rb_roaring64_t *self_wrapper = get_wrapper_for_write(self);
+    check_operand(other);
+
+    struct operand other_operand;
+    rb_roaring64_t *other_wrapper = lock_operand(other, &other_operand);
+
+    if (self_wrapper->bitmap32 && other_wrapper->bitmap32) {
+        op->func32(self_wrapper->bitmap32, other_wrapper->bitmap32);
+    } else {
+        roaring64_bitmap_t *temp;
+        const roaring64_bitmap_t *other_data = as_bitmap64(other_wrapper, &temp);
+        op->func(promote(self_wrapper), other_data);
+        roaring64_bitmap_free(temp);
+    }
+
+    unlock_operand(other);
     return self;
 }
 
 typedef bool binary_func_bool(const roaring64_bitmap_t *, const roaring64_bitmap_t *);
-static VALUE rb_roaring64_binary_op_bool(VALUE self, VALUE other, binary_func_bool func) {
-    roaring64_bitmap_t *self_data = get_bitmap(self);
-    roaring64_bitmap_t *other_data = get_bitmap(other);
+typedef bool binary_func_bool32(const roaring_bitmap_t *, const roaring_bitmap_t *);
+
+// `self` and `other` may each be a Bitmap32 or a Bitmap64
+static VALUE rb_roaring64_binary_op_bool(VALUE self, VALUE other, binary_func_bool32 func32, binary_func_bool func) {
+    check_operand(self);
+    check_operand(other);
+
+    struct operand self_operand, other_operand;
+    rb_roaring64_t *self_wrapper = lock_operand(self, &self_operand);
+    rb_roaring64_t *other_wrapper = lock_operand(other, &other_operand);
+
+    bool result;
+    if (self_wrapper->bitmap32 && other_wrapper->bitmap32) {
+        result = func32(self_wrapper->bitmap32, other_wrapper->bitmap32);
+    } else {
+        roaring64_bitmap_t *self_temp, *other_temp;
+        const roaring64_bitmap_t *self_data = as_bitmap64(self_wrapper, &self_temp);
+        const roaring64_bitmap_t *other_data = as_bitmap64(other_wrapper, &other_temp);
+        result = func(self_data, other_data);
+        roaring64_bitmap_free(self_temp);
+        roaring64_bitmap_free(other_temp);
+    }
 
-    bool result = func(self_data, other_data);
+    unlock_operand(other);
+    unlock_operand(self);
     return RBOOL(result);
 }
 
 static VALUE rb_roaring64_and_inplace(VALUE self, VALUE other)
 {
-    return rb_roaring64_binary_op_inplace(self, other, roaring64_bitmap_and_inplace);
+    return rb_roaring64_binary_op_inplace(self, other, &and_inplace_op);
 }
 
 static VALUE rb_roaring64_or_inplace(VALUE self, VALUE other)
 {
-    return rb_roaring64_binary_op_inplace(self, other, roaring64_bitmap_or_inplace);
+    return rb_roaring64_binary_op_inplace(self, other, &or_inplace_op);
 }
 
 static VALUE rb_roaring64_xor_inplace(VALUE self, VALUE other)
 {
-    return rb_roaring64_binary_op_inplace(self, other, roaring64_bitmap_xor_inplace);
+    return rb_roaring64_binary_op_inplace(self, other, &xor_inplace_op);
 }
 
 static VALUE rb_roaring64_andnot_inplace(VALUE self, VALUE other)
 {
-    return rb_roaring64_binary_op_inplace(self, other, roaring64_bitmap_andnot_inplace);
+    return rb_roaring64_binary_op_inplace(self, other, &andnot_inplace_op);
 }
 
 static VALUE rb_roaring64_and(VALUE self, VALUE other)
 {
-    return rb_roaring64_binary_op(self, other, roaring64_bitmap_and);
+    return rb_roaring64_binary_op(self, other, &and_op);
 }
 
 static VALUE rb_roaring64_or(VALUE self, VALUE other)
 {
-    return rb_roaring64_binary_op(self, other, roaring64_bitmap_or);
+    return rb_roaring64_binary_op(self, other, &or_op);
 }
 
 static VALUE rb_roaring64_xor(VALUE self, VALUE other)
 {
-    return rb_roaring64_binary_op(self, other, roaring64_bitmap_xor);
+    return rb_roaring64_binary_op(self, other, &xor_op);
 }
 
 static VALUE rb_roaring64_andnot(VALUE self, VALUE other)
 {
-    return rb_roaring64_binary_op(self, other, roaring64_bitmap_andnot);
+    return rb_roaring64_binary_op(self, other, &andnot_op);
 }
 
 static VALUE rb_roaring64_eq(VALUE self, VALUE other)
 {
-    return rb_roaring64_binary_op_bool(self, other, roaring64_bitmap_equals);
+    return rb_roaring64_binary_op_bool(self, other, roaring_bitmap_equals, roaring64_bitmap_equals);
 }
 
 static VALUE rb_roaring64_lt(VALUE self, VALUE other)
 {
-    return rb_roaring64_binary_op_bool(self, other, roaring64_bitmap_is_strict_subset);
+    return rb_roaring64_binary_op_bool(self, other, roaring_bitmap_is_strict_subset, roaring64_bitmap_is_strict_subset);
 }
 
 static VALUE rb_roaring64_lte(VALUE self, VALUE other)
 {
-    return rb_roaring64_binary_op_bool(self, other, roaring64_bitmap_is_subset);
+    return rb_roaring64_binary_op_bool(self, other, roaring_bitmap_is_subset, roaring64_bitmap_is_subset);
 }
 
 static VALUE rb_roaring64_intersect_p(VALUE self, VALUE other)
 {
-    return rb_roaring64_binary_op_bool(self, other, roaring64_bitmap_intersect);
+    return rb_roaring64_binary_op_bool(self, other, roaring_bitmap_intersect, roaring64_bitmap_intersect);
+}
+
+// The size of the intersection of two bitmaps, of either representation
+static uint64_t and_cardinality(const rb_roaring64_t *left, const rb_roaring64_t *right)
+{
+    if (left->bitmap32 && right->bitmap32) {
+        return roaring_bitmap_and_cardinality(left->bitmap32, right->bitmap32);
+    }
+
+    roaring64_bitmap_t *left_temp, *right_temp;
+    uint64_t result = roaring64_bitmap_and_cardinality(as_bitmap64(left, &left_temp), as_bitmap64(right, &right_temp));
+    roaring64_bitmap_free(left_temp);
+    roaring64_bitmap_free(right_temp);
+    return result;
+}
+
+static VALUE rb_roaring64_and_cardinality(VALUE self, VALUE other)
+{
+    check_operand(self);
+    check_operand(other);
+
+    struct operand self_operand, other_operand;
+    uint64_t result = and_cardinality(lock_operand(self, &self_operand), lock_operand(other, &other_operand));
+    unlock_operand(other);
+    unlock_operand(self);
+    return ULL2NUM(result);
+}
+
+// Returns a hidden copy of `ary` (so that it can't change under us) after
+// checking that it only contains bitmaps
+static VALUE bitmap_list(VALUE ary)
+{
+    ary = rb_ary_dup(rb_convert_type(ary, T_ARRAY, "Array", "to_ary"));
+    for (long i = 0; i < RARRAY_LEN(ary); i++) {
+        get_wrapper(RARRAY_AREF(ary, i));
+    }
+    return ary;
+}
+
+// Locks every bitmap in `ary` and fills `wrappers` with them
+static void lock_bitmap_list(VALUE ary, rb_roaring64_t **wrappers)
+{
+    for (long i = 0; i < RARRAY_LEN(ary); i++) {
+        wrappers[i] = lock_bitmap(RARRAY_AREF(ary, i));
+    }
+}
+
+static void unlock_bitmap_list(VALUE ary)
+{
+    for (long i = 0; i < RARRAY_LEN(ary); i++) {
+        unlock_bitmap(RARRAY_AREF(ary, i));
+    }
+}
+
+typedef void *reduce_func(const void *, const void *);
+typedef void reduce_func_inplace(void *, const void *);
+
+// An operation reducing bitmaps of one representation
+struct reduce_ops {
+    reduce_func *func;
+    reduce_func_inplace *func_inplace;
+    void *(*copy)(const void *);
+    void (*free)(void *);
+};
+
+static void *or32(const void *a, const void *b) { return roaring_bitmap_or(a, b); }
+static void *and32(const void *a, const void *b) { return roaring_bitmap_and(a, b); }
+static void or_inplace32(void *a, const void *b) { roaring_bitmap_or_inplace(a, b); }
+static void and_inplace32(void *a, const void *b) { roaring_bitmap_and_inplace(a, b); }
+static void *copy32(const void *bitmap) { return roaring_bitmap_copy(bitmap); }
+static void free32(void *bitmap) { roaring_bitmap_free(bitmap); }
+static void *or64(const void *a, const void *b) { return roaring64_bitmap_or(a, b); }
+static void *and64(const void *a, const void *b) { return roaring64_bitmap_and(a, b); }
+static void or_inplace64(void *a, const void *b) { roaring64_bitmap_or_inplace(a, b); }
+static void and_inplace64(void *a, const void *b) { roaring64_bitmap_and_inplace(a, b); }
+static void *copy64(const void *bitmap) { return roaring64_bitmap_copy(bitmap); }
+static void free64(void *bitmap) { roaring64_bitmap_free(bitmap); }
+
+static const struct reduce_ops or_ops32 = { or32, or_inplace32, copy32, free32 };
+static const struct reduce_ops and_ops32 = { and32, and_inplace32, copy32, free32 };
+static const struct reduce_ops or_ops64 = { or64, or_inplace64, copy64, free64 };
+static const struct reduce_ops and_ops64 = { and64, and_inplace64, copy64, free64 };
+
+struct reduce_args {
+    rb_roaring64_t **wrappers;
+
+    // 64-bit copies of the 32-bit inputs, when not all of them are 32-bit
+    roaring64_bitmap_t **temps;
+
+    void **bitmaps;
+    size_t count;
+
+    // Whether `bitmaps` are our own temporaries, rather than the inputs
+    bool owned;
+
+    const struct reduce_ops *ops;
+};
+
+static void reduce_pair_task(void *ptr, size_t i)
+{
+    struct reduce_args *args = ptr;
+    const struct reduce_ops *ops = args->ops;
+    void **pair = &args->bitmaps[i * 2];
+
+    if (i * 2 + 1 == args->count) {
+        // The odd one out moves up to the next level unchanged
+        if (!args->owned) {
+            pair[0] = ops->copy(pair[0]);
+        }
+    } else if (args->owned) {
+        ops->func_inplace(pair[0], pair[1]);
+        ops->free(pair[1]);
+    } else {
+        pair[0] = ops->func(pair[0], pair[1]);
+    }
+}
+
+// Combines neighbouring pairs of bitmaps until only one is left. The shape
+// of the tree only depends on the number of bitmaps, so the result is
+// identical however many threads compute it.
+static void *reduce_nogvl(void *ptr)
+{
+    struct reduce_args *args = ptr;
+
+    for (size_t i = 0; i < args->count; i++) {
+        rb_roaring64_t *wrapper = args->wrappers[i];
+        if (args->temps) {
+            args->bitmaps[i] = (void *)as_bitmap64(wrapper, &args->temps[i]);
+        } else {
+            args->bitmaps[i] = wrapper->bitmap32;
+        }
+    }
+
+    while (args->count > 1 || !args->owned) {
+        size_t pairs = (args->count + 1) / 2;
+        rb_roaring_parallel_for(pairs, reduce_pair_task, args);
+
+        for (size_t i = 0; i < pairs; i++) {
+            args->bitmaps[i] = args->bitmaps[i * 2];
+        }
+        args->count = pairs;
+        args->owned = true;
+    }
+
+    return NULL;
+}
+
+struct reduce {
+    VALUE ary;
+    const struct reduce_ops *ops32;
+    const struct reduce_ops *ops64;
+    bool locked;
+    struct reduce_args args;
+};
+
+static VALUE reduce_run(VALUE ptr)
+{
+    struct reduce *r = (struct reduce *)ptr;
+    struct reduce_args *args = &r->args;
+    long count = RARRAY_LEN(r->ary);
+
+    args->wrappers = ALLOC_N(rb_roaring64_t *, count);
+    args->bitmaps = ALLOC_N(void *, count);
+    lock_bitmap_list(r->ary, args->wrappers);
+    r->locked = true;
+
+    bool all32 = true;
+    for (long i = 0; i < count; i++) {
+        all32 = all32 && args->wrappers[i]->bitmap32;
+    }
+    args->temps = all32 ? NULL : ZALLOC_N(roaring64_bitmap_t *, count);
+    args->ops = all32 ? r->ops32 : r->ops64;
+    args->count = count;
+
+    // An interrupt may raise once the result is computed
+    rb_thread_call_without_gvl(reduce_nogvl, args, NULL, NULL);
+
+    void *result = args->bitmaps[0];
+    VALUE obj = all32 ? rb_roaring64_new32(cRoaringBitmap64, result) : rb_roaring64_new(cRoaringBitmap64, result);
+    args->count = 0;
+    return obj;
+}
+
+static VALUE reduce_cleanup(VALUE ptr)
+{
+    struct reduce *r = (struct reduce *)ptr;
+    struct reduce_args *args = &r->args;
+
+    if (args->owned) {
+        for (size_t i = 0; i < args->count; i++) {
+            args->ops->free(args->bitmaps[i]);
+        }
+    }
+    if (r->locked) {
+        unlock_bitmap_list(r->ary);
+    }
+    if (args->temps) {
+        for (long i = 0; i < RARRAY_LEN(r->ary); i++) {
+            roaring64_bitmap_free(args->temps[i]);
+        }
+        xfree(args->temps);
+    }
+    xfree(args->bitmaps);
+    xfree(args->wrappers);
+    return Qnil;
+}
+
+static VALUE rb_roaring64_reduce(VALUE ary, const struct reduce_ops *ops32, const struct reduce_ops *ops64)
+{
+    ary = bitmap_list(ary);
+    if (RARRAY_LEN(ary) == 0) {
+        return rb_roaring64_new32(cRoaringBitmap64, roaring_bitmap_create());
+    }
+
+    struct reduce r = {
+        .ary = ary,
+        .ops32 = ops32,
+        .ops64 = ops64,
+    };
+    VALUE result = rb_ensure(reduce_run, (VALUE)&r, reduce_cleanup, (VALUE)&r);
+    RB_GC_GUARD(ary);
+    return result;
+}
+
+static VALUE rb_roaring64_s_or_many(VALUE klass, VALUE bitmaps)
+{
+    return rb_roaring64_reduce(bitmaps, &or_ops32, &or_ops64);
+}
+
+static VALUE rb_roaring64_s_and_many(VALUE klass, VALUE bitmaps)
+{
+    return rb_roaring64_reduce(bitmaps, &and_ops32, &and_ops64);
+}
+
+struct and_cardinality_args {
+    const rb_roaring64_t *bitmap;
+    rb_roaring64_t **others;
+    size_t count;
+    uint64_t *results;
+};
+
+static void and_cardinality_task(void *ptr, size_t i)
+{
+    struct and_cardinality_args *args = ptr;
+    args->results[i] = and_cardinality(args->bitmap, args->others[i]);
+}
+
+static void *and_cardinality_many_nogvl(void *ptr)
+{
+    struct and_cardinality_args *args = ptr;
+    rb_roaring_parallel_for(args->count, and_cardinality_task, args);
+    return NULL;
+}
+
+struct and_cardinality_many {
+    VALUE self;
+    VALUE others;
+    bool locked;
+    rb_roaring64_t widened;
+    struct and_cardinality_args args;
+};
+
+static VALUE and_cardinality_many_run(VALUE ptr)
+{
+    struct and_cardinality_many *m = (struct and_cardinality_many *)ptr;
+    struct and_cardinality_args *args = &m->args;
+    long count = RARRAY_LEN(m->others);
+
+    args->others = ALLOC_N(rb_roaring64_t *, count);
+    args->results = ALLOC_N(uint64_t, count);
+    rb_roaring64_t *self_wrapper = lock_bitmap(m->self);
+    lock_bitmap_list(m->others, args->others);
+    m->locked = true;
+
+    // Convert a 32-bit `self` once, rather than for every 64-bit operand
+    args->bitmap = self_wrapper;
+    if (self_wrapper->bitmap32) {
+        for (long i = 0; i < count; i++) {
+            if (args->others[i]->bitmap) {
+                // 32-bit operands are then converted as they're intersected
+                m->widened.bitmap = widen(roaring_bitmap_copy(self_wrapper->bitmap32));
+                args->bitmap = &m->widened;
+                break;
+            }
+        }
+    }
+    args->count = count;
+    rb_thread_call_without_gvl(and_cardinality_many_nogvl, args, NULL, NULL);
+
+    VALUE ary = rb_ary_new_capa(count);
+    for (long i = 0; i < count; i++) {
+        rb_ary_push(ary, ULL2NUM(args->results[i]));
+    }
+    return ary;
+}
+
+static VALUE and_cardinality_many_cleanup(VALUE ptr)
+{
+    struct and_cardinality_many *m = (struct and_cardinality_many *)ptr;
+
+    if (m->locked) {
+        unlock_bitmap_list(m->others);
+        unlock_bitmap(m->self);
+    }
+    roaring64_bitmap_free(m->widened.bitmap);
+    xfree(m->args.results);
+    xfree(m->args.others);
+    return Qnil;
+}
+
+static VALUE rb_roaring64_and_cardinality_many(VALUE self, VALUE others)
+{
+    others = bitmap_list(others);
+    if (RARRAY_LEN(others) == 0) {
+        return rb_ary_new();
+    }
+
+    struct and_cardinality_many m = {
+        .self = self,
+        .others = others,
+    };
+    VALUE ary = rb_ensure(and_cardinality_many_run, (VALUE)&m, and_cardinality_many_cleanup, (VALUE)&m);
+    RB_GC_GUARD(self);
+    RB_GC_GUARD(others);
+    return ary;
+}
+
+struct deserialize_args {
+    const char **buffers;
+    size_t *lengths;
+    size_t count;
+    roaring_bitmap_t **results32;
+    roaring64_bitmap_t **results;
+};
+
+static void deserialize_task(void *ptr, size_t i)
+{
+    struct deserialize_args *args = ptr;
+    deserialize(args->buffers[i], args->lengths[i], &args->results32[i], &args->results[i]);
+}
+
+static void *deserialize_many_nogvl(void *ptr)
+{
+    struct deserialize_args *args = ptr;
+    rb_roaring_parallel_for(args->count, deserialize_task, args);
+    return NULL;
+}
+
+struct deserialize_many {
+    VALUE strings;
+    struct deserialize_args args;
+};
+
+static VALUE deserialize_many_run(VALUE ptr)
+{
+    struct deserialize_many *d = (struct deserialize_many *)ptr;
+    struct deserialize_args *args = &d->args;
+    long count = RARRAY_LEN(d->strings);
+
+    args->buffers = ZALLOC_N(const char *, count);
+    args->lengths = ALLOC_N(size_t, count);
+    args->results32 = ZALLOC_N(roaring_bitmap_t *, count);
+    args->results = ZALLOC_N(roaring64_bitmap_t *, count);
+
+    // `args->count` counts the strings prepared so far, for the cleanup
+    for (long i = 0; i < count; i++) {
+        // A frozen copy shares the original's buffer, but keeps it alive and
+        // unchanged even if the original string is modified meanwhile
+        VALUE str = RARRAY_AREF(d->strings, i);
+        str = rb_str_new_frozen(StringValue(str));
+        RARRAY_ASET(d->strings, i, str);
+
+        args->lengths[i] = RSTRING_LEN(str);
+        if (FL_TEST_RAW(str, RSTRING_NOEMBED)) {
+            args->buffers[i] = RSTRING_PTR(str);
+        } else {
+            // Embedded strings live inside the object, which GC compaction
+            // may move while we don't hold the GVL. They're small, so copy them.
+            char *copy = ALLOC_N(char, args->lengths[i]);
+            memcpy(copy, RSTRING_PTR(str), args->lengths[i]);
+            args->buffers[i] = copy;
+        }
+        args->count = i + 1;
+    }
+
+    rb_thread_call_without_gvl(deserialize_many_nogvl, args, NULL, NULL);
+
+    for (long i = 0; i < count; i++) {
+        if (!args->results32[i] && !args->results[i]) {
+            rb_raise(rb_eArgError, "invalid serialized bitmap at index %ld", i);
+        }
+    }
+
+    VALUE ary = rb_ary_new_capa(count);
+    for (long i = 0; i < count; i++) {
+        rb_ary_push(ary, rb_roaring64_new_any(cRoaringBitmap64, args->results32[i], args->results[i]));
+        args->results32[i] = NULL;
+        args->results[i] = NULL;
+    }
+    return ary;
+}
+
+static VALUE deserialize_many_cleanup(VALUE ptr)
+{
+    struct deserialize_many *d = (struct deserialize_many *)ptr;
+    struct deserialize_args *args = &d->args;
+
+    for (size_t i = 0; i < args->count; i++) {
+        if (!FL_TEST_RAW(RARRAY_AREF(d->strings, i), RSTRING_NOEMBED)) {
+            xfree((char *)args->buffers[i]);
+        }
+        // The results which weren't wrapped before an exception
+        roaring_bitmap_free(args->results32[i]);
+        roaring64_bitmap_free(args->results[i]);
+    }
+    xfree(args->results);
+    xfree(args->results32);
+    xfree(args->lengths);
+    xfree(args->buffers);
+    return Qnil;
+}
+
+static VALUE rb_roaring64_deserialize_many(VALUE self, VALUE strings)
+{
+    struct deserialize_many d = {
+        .strings = rb_ary_dup(rb_convert_type(strings, T_ARRAY, "Array", "to_ary")),
+    };
+    VALUE ary = rb_ensure(deserialize_many_run, (VALUE)&d, deserialize_many_cleanup, (VALUE)&d);
+    RB_GC_GUARD(d.strings);
+    return ary;
+}
+
+// The values of a 64-bit bitmap sharing the same high 32 bits, as a 32-bit
+// bitmap of their low bits. This is how the portable format stores them.
+struct bucket {
+    int64_t high_bits;
+    roaring_bitmap_t *bitmap;
+};
+
+// Splits a bitmap into its buckets, which the caller must free
+static struct bucket *split_buckets(const rb_roaring64_t *wrapper, size_t *count)
+{
+    if (wrapper->bitmap32) {
+        struct bucket *buckets = ALLOC_N(struct bucket, 1);
+        buckets[0] = (struct bucket){ 0, rb_roaring32_copy(wrapper->bitmap32) };
+        *count = 1;
+        return buckets;
+    }
+
+    size_t size = roaring64_bitmap_portable_size_in_bytes(wrapper->bitmap);
+    char *buf = ALLOC_N(char, size);
+    roaring64_bitmap_portable_serialize(wrapper->bitmap, buf);
+
+    uint64_t n;
+    memcpy(&n, buf, sizeof(n));
+    struct bucket *buckets = ALLOC_N(struct bucket, n);
+    size_t pos = sizeof(n);
+    for (uint64_t i = 0; i < n; i++) {
+        uint32_t high_bits;
+        memcpy(&high_bits, buf + pos, sizeof(high_bits));
+        pos += sizeof(high_bits);
+        size_t length = roaring_bitmap_portable_deserialize_size(buf + pos, size - pos);
+        buckets[i] = (struct bucket){ high_bits, roaring_bitmap_portable_deserialize_safe(buf + pos, length) };
+        pos += length;
+    }
+    xfree(buf);
+
+    *count = n;
+    return buckets;
+}
+
+// Joins buckets, in increasing order of their high bits, back into a bitmap.
+// Sets either `*bitmap32` or `*bitmap`.
+static void join_buckets(const struct bucket *buckets, size_t count, roaring_bitmap_t **bitmap32, roaring64_bitmap_t **bitmap)
+{
+    if (count == 0 || (count == 1 && buckets[0].high_bits == 0)) {
+        *bitmap32 = count ? rb_roaring32_copy(buckets[0].bitmap) : roaring_bitmap_create();
+        *bitmap = NULL;
+        return;
+    }
+
+    uint64_t n = count;
+    size_t size = sizeof(n);
+    for (size_t i = 0; i < count; i++) {
+        size += sizeof(uint32_t) + roaring_bitmap_portable_size_in_bytes(buckets[i].bitmap);
+    }
+    char *buf = ALLOC_N(char, size);
+    memcpy(buf, &n, sizeof(n));
+    size_t pos = sizeof(n);
+    for (size_t i = 0; i < count; i++) {
+        uint32_t high_bits = (uint32_t)buckets[i].high_bits;
+        memcpy(buf + pos, &high_bits, sizeof(high_bits));
+        pos += sizeof(high_bits);
+        pos += roaring_bitmap_portable_serialize(buckets[i].bitmap, buf + pos);
+    }
+
+    *bitmap32 = NULL;
+    *bitmap = roaring64_bitmap_portable_deserialize_safe(buf, size);
+    xfree(buf);
+}
+
+static void free_buckets(struct bucket *buckets, size_t count)
+{
+    for (size_t i = 0; i < count; i++) {
+        roaring_bitmap_free(buckets[i].bitmap);
+    }
+    xfree(buckets);
+}
+
+// Appends `bitmap` to `buckets` with the given high bits, merging it into
+// the last bucket if it has the same ones. Takes ownership of `bitmap`.
+static void append_bucket(struct bucket *buckets, size_t *count, int64_t high_bits, roaring_bitmap_t *bitmap)
+{
+    if (roaring_bitmap_is_empty(bitmap)) {
+        roaring_bitmap_free(bitmap);
+    } else if (*count && buckets[*count - 1].high_bits == high_bits) {
+        roaring_bitmap_or_inplace(buckets[*count - 1].bitmap, bitmap);
+        roaring_bitmap_free(bitmap);
+    } else {
+        buckets[(*count)++] = (struct bucket){ high_bits, bitmap };
+    }
+}
+
+// Adds `offset` to every value of `wrapper`, dropping those which end up
+// outside of 64 bits. Writing the offset as `high * 2**32 + low`, each
+// bucket moves `high` buckets up, and is split in two by shifting it by
+// `low` with roaring_bitmap_add_offset, which moves containers as a whole.
+static void shift(const rb_roaring64_t *wrapper, VALUE offset, roaring_bitmap_t **bitmap32, roaring64_bitmap_t **bitmap)
+{
+    int sign;
+    uint64_t magnitude;
+    if (!rb_roaring_num2offset(offset, &sign, &magnitude)) {
+        *bitmap32 = roaring_bitmap_create();
+        *bitmap = NULL;
+        return;
+    }
+
+    int64_t high = (int64_t)(magnitude >> 32);
+    int64_t low = (int64_t)(magnitude & UINT32_MAX);
+    if (sign < 0 && low) {
+        high = -high - 1;
+        low = ((int64_t)1 << 32) - low;
+    } else if (sign < 0) {
+        high = -high;
+    }
+
+    size_t count;
+    struct bucket *buckets = split_buckets(wrapper, &count);
+    struct bucket *shifted = ALLOC_N(struct bucket, count * 2);
+    size_t shifted_count = 0;
+    for (size_t i = 0; i < count; i++) {
+        int64_t target = buckets[i].high_bits + high;
+        if (target >= 0 && target <= UINT32_MAX) {
+            append_bucket(shifted, &shifted_count, target, roaring_bitmap_add_offset(buckets[i].bitmap, low));
+        }
+        if (low && target + 1 >= 0 && target + 1 <= UINT32_MAX) {
+            append_bucket(shifted, &shifted_count, target + 1, roaring_bitmap_add_offset(buckets[i].bitmap, low - ((int64_t)1 << 32)));
+        }
+    }
+
+    join_buckets(shifted, shifted_count, bitmap32, bitmap);
+    free_buckets(shifted, shifted_count);
+    free_buckets(buckets, count);
+}
+
+// Adds `offset` to every element of the bitmap. Elements which would end up
+// outside of {RANGE} are dropped.
+// @param offset [Integer] the amount to add, which may be negative
+// @return [Bitmap64] a new bitmap containing the shifted elements
+static VALUE rb_roaring64_shift(VALUE self, VALUE offset)
+{
+    roaring_bitmap_t *bitmap32;
+    roaring64_bitmap_t *bitmap;
+    shift(get_wrapper(self), offset, &bitmap32, &bitmap);
+    return rb_roaring64_new_any(cRoaringBitmap64, bitmap32, bitmap);
+}
+
+// Inplace version of {shift}
+// @return [self] the modified Bitmap
+static VALUE rb_roaring64_shift_inplace(VALUE self, VALUE offset)
+{
+    rb_roaring64_t *wrapper = get_wrapper_for_write(self);
+    roaring_bitmap_t *bitmap32;
+    roaring64_bitmap_t *bitmap;
+    shift(wrapper, offset, &bitmap32, &bitmap);
+    if (!bitmap32 && !bitmap) {
+        rb_raise(rb_eNoMemError, "failed to allocate bitmap");
+    }
+
+    roaring_bitmap_free(wrapper->bitmap32);
+    roaring64_bitmap_free(wrapper->bitmap);
+    wrapper->bitmap32 = bitmap32;
+    wrapper->bitmap = bitmap;
+    return self;
+}
+
+// Draws `k` distinct ranks below `n` with Floyd's algorithm, which takes one
+// random number per rank. They're collected in a Bitmap64, which sorts them
+// and is freed by the GC if `random` raises.
+static VALUE random_ranks(VALUE random, uint64_t n, uint64_t k)
+{
+    VALUE ranks = rb_roaring64_new(cRoaringBitmap64, roaring64_bitmap_create());
+    roaring64_bitmap_t *bitmap = get_wrapper(ranks)->bitmap;
+    if (k == n) {
+        roaring64_bitmap_add_range(bitmap, 0, n);
+        return ranks;
+    }
+    for (uint64_t j = n - k; j < n; j++) {
+        uint64_t rank = rb_random_ulong_limited(random, (unsigned long)j);
+        if (!roaring64_bitmap_add_checked(bitmap, rank)) {
+            roaring64_bitmap_add(bitmap, j);
+        }
+    }
+    return ranks;
+}
+
+// A few ranks are resolved faster one at a time than by splitting the
+// bitmap into buckets
+#define SAMPLE_SELECT_MAX 16
+
+// Resolves ascending `ranks` into the values of `wrapper` they select,
+// walking the buckets of 32-bit values once. Returns how many were found.
+static size_t select_many(const rb_roaring64_t *wrapper, const uint64_t *ranks, size_t count, uint64_t *values)
+{
+    size_t found = 0;
+    if (wrapper->bitmap32) {
+        uint32_t *values32 = ALLOC_N(uint32_t, count);
+        found = rb_roaring32_select_many(wrapper->bitmap32, 0, ranks, count, values32);
+        for (size_t i = 0; i < found; i++) {
+            values[i] = values32[i];
+        }
+        xfree(values32);
+        return found;
+    }
+
+    if (count <= SAMPLE_SELECT_MAX) {
+        while (found < count && roaring64_bitmap_select(wrapper->bitmap, ranks[found], &values[found])) {
+            found++;
+        }
+        return found;
+    }
+
+    size_t bucket_count;
+    struct bucket *buckets = split_buckets(wrapper, &bucket_count);
+    uint32_t *values32 = ALLOC_N(uint32_t, count);
+    uint64_t start = 0;
+    for (size_t i = 0; i < bucket_count && found < count; i++) {
+        size_t n = rb_roaring32_select_many(buckets[i].bitmap, start, ranks + found, count - found, values32);
+        for (size_t j = 0; j < n; j++) {
+            values[found + j] = (uint64_t)buckets[i].high_bits << 32 | values32[j];
+        }
+        found += n;
+        start += roaring_bitmap_get_cardinality(buckets[i].bitmap);
+    }
+    xfree(values32);
+    free_buckets(buckets, bucket_count);
+    return found;
+}
+
+// Picks elements uniformly at random, without building an array of all of
+// them: random ranks are drawn first, then resolved in a single pass over
+// the buckets of 32-bit values.
+// @overload sample(random: Random)
+//   @return [Integer, nil] a random element, or `nil` if the bitmap is empty
+// @overload sample(k, random: Random)
+//   @param k [Integer] the number of elements to pick
+//   @param random [Random] the random number generator to use
+//   @return [Array<Integer>] `k` distinct elements in increasing order, or all of them if there are fewer
+static VALUE rb_roaring64_sample(int argc, VALUE *argv, VALUE self)
+{
+    VALUE kv, opts;
+    rb_scan_args(argc, argv, "01:", &kv, &opts);
+    uint64_t k = rb_roaring_num2sample(kv);
+    VALUE random = rb_roaring_random_opt(opts);
+
+    rb_roaring64_t *wrapper = get_wrapper(self);
+    uint64_t n = wrapper->bitmap32 ? roaring_bitmap_get_cardinality(wrapper->bitmap32) : roaring64_bitmap_get_cardinality(wrapper->bitmap);
+    if (k > n) {
+        k = n;
+    }
+
+    // `random` may have modified `self`, whose elements are only read after
+    // all the ranks are drawn
+    VALUE ranks = random_ranks(random, n, k);
+    VALUE ranks_buf, values_buf;
+    uint64_t *rank_values = ALLOCV_N(uint64_t, ranks_buf, k);
+    uint64_t *values = ALLOCV_N(uint64_t, values_buf, k);
+    roaring64_bitmap_to_uint64_array(get_wrapper(ranks)->bitmap, rank_values);
+    size_t found = select_many(get_wrapper(self), rank_values, k, values);
+
+    VALUE result;
+    if (NIL_P(kv)) {
+        result = found ? ULL2NUM(values[0]) : Qnil;
+    } else {
+        result = rb_ary_new_capa(found);
+        for (size_t i = 0; i < found; i++) {
+            rb_ary_push(result, ULL2NUM(values[i]));
+        }
+    }
+    ALLOCV_END(ranks_buf);
+    ALLOCV_END(values_buf);
+    RB_GC_GUARD(ranks);
+    return result;
+}
+
+// Samples `self` bucket by bucket. Everything allocated is kept here to be
+// freed by sample_bitmap_cleanup if `random` raises.
+struct sample_bitmap {
+    VALUE self;
+    rb_roaring64_t *wrapper;
+    double fraction;
+    VALUE random;
+    struct bucket *buckets;
+    size_t count;
+    struct bucket *sampled;
+    size_t sampled_count;
+    roaring_bitmap_t *bitmap32;
+    roaring64_bitmap_t *bitmap;
+};
+
+static VALUE sample_bitmap_run(VALUE ptr)
+{
+    struct sample_bitmap *s = (struct sample_bitmap *)ptr;
+    if (s->wrapper->bitmap32) {
+        s->bitmap32 = roaring_bitmap_create();
+        rb_roaring32_bernoulli(s->wrapper->bitmap32, s->fraction, s->random, s->bitmap32);
+    } else {
+        s->buckets = split_buckets(s->wrapper, &s->count);
+        s->sampled = ALLOC_N(struct bucket, s->count);
+        for (size_t i = 0; i < s->count; i++) {
+            s->sampled[s->sampled_count++] = (struct bucket){ s->buckets[i].high_bits, roaring_bitmap_create() };
+            rb_roaring32_bernoulli(s->buckets[i].bitmap, s->fraction, s->random, s->sampled[i].bitmap);
+        }
+        join_buckets(s->sampled, s->sampled_count, &s->bitmap32, &s->bitmap);
+    }
+
+    VALUE result = rb_roaring64_new_any(cRoaringBitmap64, s->bitmap32, s->bitmap);
+    s->bitmap32 = NULL;
+    s->bitmap = NULL;
+    return result;
+}
+
+static VALUE sample_bitmap_cleanup(VALUE ptr)
+{
+    struct sample_bitmap *s = (struct sample_bitmap *)ptr;
+    unlock_bitmap(s->self);
+    if (s->buckets) {
+        free_buckets(s->buckets, s->count);
+    }
+    if (s->sampled) {
+        free_buckets(s->sampled, s->sampled_count);
+    }
+    roaring_bitmap_free(s->bitmap32);
+    roaring64_bitmap_free(s->bitmap);
+    return Qnil;
+}
+
+// Keeps each element with probability `fraction`, independently of the
+// others, a word of 64 elements at a time rather than one by one.
+// `fraction` is rounded down to a multiple of 2**-32.
+// @param fraction [Float] the probability of keeping each element, between 0 and 1
+// @param random [Random] the random number generator to use
+// @return [Bitmap64] a new bitmap containing the sampled elements
+static VALUE rb_roaring64_sample_bitmap(int argc, VALUE *argv, VALUE self)
+{
+    VALUE fractionv, opts;
+    rb_scan_args(argc, argv, "1:", &fractionv, &opts);
+    double fraction = rb_roaring_num2fraction(fractionv);
+    VALUE random = rb_roaring_random_opt(opts);
+
+    struct sample_bitmap s = {
+        .self = self,
+        .wrapper = lock_bitmap(self),
+        .fraction = fraction,
+        .random = random,
+    };
+    return rb_ensure(sample_bitmap_run, (VALUE)&s, sample_bitmap_cleanup, (VALUE)&s);
+}
+
+// The values of `bitmap` whose high 32 bits are `high_bits`, as a 32-bit
+// bitmap of their low bits. Like split_buckets, this reads the buckets from
+// the portable format, but only deserializes the one it's after, which
+// copies its containers as they are.
+static roaring_bitmap_t *slice32(const roaring64_bitmap_t *bitmap, uint32_t high_bits)
+{
+    size_t size = roaring64_bitmap_portable_size_in_bytes(bitmap);
+    char *buf = ALLOC_N(char, size);
+    roaring64_bitmap_portable_serialize(bitmap, buf);
+
+    uint64_t n;
+    memcpy(&n, buf, sizeof(n));
+    roaring_bitmap_t *result = NULL;
+    bool found = false;
+    size_t pos = sizeof(n);
+    for (uint64_t i = 0; i < n; i++) {
+        uint32_t bucket_high_bits;
+        memcpy(&bucket_high_bits, buf + pos, sizeof(bucket_high_bits));
+        pos += sizeof(bucket_high_bits);
+        if (bucket_high_bits > high_bits) {
+            break;
+        }
+        size_t length = roaring_bitmap_portable_deserialize_size(buf + pos, size - pos);
+        if (bucket_high_bits == high_bits) {
+            result = roaring_bitmap_portable_deserialize_safe(buf + pos, length);
+            found = true;
+            break;
+        }
+        pos += length;
+    }
+    xfree(buf);
+
+    return found ? result : roaring_bitmap_create();
+}
+
+// Extracts the values sharing the same high 32 bits into a Bitmap32, by
+// copying their containers.
+// @param high_bits [Integer] the high 32 bits of the values to extract
+// @return [Bitmap32] a new bitmap containing the low 32 bits of those values
+static VALUE rb_roaring64_to_bitmap32(int argc, VALUE *argv, VALUE self)
+{
+    VALUE opts;
+    rb_scan_args(argc, argv, ":", &opts);
+
+    uint64_t high_bits = 0;
+    if (!NIL_P(opts)) {
+        ID keys[1] = { rb_intern("high_bits") };
+        VALUE values[1];
+        rb_get_kwargs(opts, keys, 0, 1, values);
+        if (values[0] != Qundef) {
+            high_bits = NUM2ULL(values[0]);
+            if (high_bits > UINT32_MAX) {
+                rb_raise(rb_eRangeError, "high_bits must fit in 32 bits");
+            }
+        }
+    }
+
+    rb_roaring64_t *wrapper = get_wrapper(self);
+    roaring_bitmap_t *result;
+    if (wrapper->bitmap32) {
+        result = high_bits == 0 ? rb_roaring32_copy(wrapper->bitmap32) : roaring_bitmap_create();
+    } else {
+        result = slice32(wrapper->bitmap, (uint32_t)high_bits);
+    }
+    if (!result) {
+        rb_raise(rb_eNoMemError, "failed to allocate bitmap");
+    }
+    return rb_roaring32_wrap(result);
+}
+
+bool rb_roaring64_bitmap_p(VALUE obj)
+{
+    return rb_typeddata_is_kind_of(obj, &roaring64_type);
+}
+
+void rb_roaring64_lock(VALUE obj, const roaring_bitmap_t **bitmap32, const roaring64_bitmap_t **bitmap)
+{
+    rb_roaring64_t *wrapper = lock_bitmap(obj);
+    *bitmap32 = wrapper->bitmap32;
+    *bitmap = wrapper->bitmap;
+}
+
+void rb_roaring64_unlock(VALUE obj)
+{
+    unlock_bitmap(obj);
+}
+
+VALUE rb_roaring64_wrap(roaring64_bitmap_t *bitmap)
+{
+    return rb_roaring64_new(cRoaringBitmap64, bitmap);
+}
+
+VALUE rb_roaring64_wrap32(roaring_bitmap_t *bitmap)
+{
+    return rb_roaring64_new32(cRoaringBitmap64, bitmap);
+}
+
+VALUE rb_roaring64_mixed_op(VALUE left, VALUE right, rb_roaring_op op)
+{
+    switch (op) {
+    case RB_ROARING_AND: return rb_roaring64_and(left, right);
+    case RB_ROARING_OR: return rb_roaring64_or(left, right);
+    case RB_ROARING_XOR: return rb_roaring64_xor(left, right);
+    case RB_ROARING_ANDNOT: return rb_roaring64_andnot(left, right);
+    case RB_ROARING_EQ: return rb_roaring64_eq(left, right);
+    case RB_ROARING_LT: return rb_roaring64_lt(left, right);
+    case RB_ROARING_LTE: return rb_roaring64_lte(left, right);
+    case RB_ROARING_INTERSECT: return rb_roaring64_intersect_p(left, right);
+    case RB_ROARING_AND_CARDINALITY: return rb_roaring64_and_cardinality(left, right);
+    }
+    UNREACHABLE_RETURN(Qnil);
+}
+
+// The runs of consecutive elements, see {#each_range}
+// @param packed [Boolean] whether to return a String rather than Ranges
+// @return [Array<Range>, String] inclusive ranges, or with `packed: true`
+//   native-endian 64-bit unsigned (start, length) pairs (`unpack("Q*")`),
+//   which {.from_ranges} reads back
+static VALUE rb_roaring64_to_ranges(int argc, VALUE *argv, VALUE self)
+{
+    VALUE opts;
+    rb_scan_args(argc, argv, "0:", &opts);
+
+    const rb_roaring64_t *wrapper = get_wrapper(self);
+    VALUE ranges = rb_str_buf_new(0);
+    if (wrapper->bitmap32) {
+        rb_roaring32_ranges(wrapper->bitmap32, 0, ranges);
+    } else {
+        size_t count;
+        struct bucket *buckets = split_buckets(wrapper, &count);
+        for (size_t i = 0; i < count; i++) {
+            rb_roaring32_ranges(buckets[i].bitmap, (uint64_t)buckets[i].high_bits << 32, ranges);
+        }
+        free_buckets(buckets, count);
+    }
+    return rb_roaring_ranges_result(ranges, opts);
+}
+
+struct each_range {
+    struct bucket *buckets;
+    size_t count;
+};
+
+static VALUE each_range_run(VALUE ptr)
+{
+    struct each_range *e = (struct each_range *)ptr;
+    VALUE ranges = rb_str_buf_new(0);
+    for (size_t i = 0; i < e->count; i++) {
+        rb_roaring32_yield_ranges(e->buckets[i].bitmap, (uint64_t)e->buckets[i].high_bits << 32, ranges);
+    }
+    rb_roaring_ranges_yield(ranges);
+    return Qnil;
+}
+
+static VALUE each_range_cleanup(VALUE ptr)
+{
+    struct each_range *e = (struct each_range *)ptr;
+    free_buckets(e->buckets, e->count);
+    return Qnil;
+}
+
+// Iterates over the runs of consecutive elements, joining runs which span
+// several containers or buckets of 32-bit values. Runs are yielded a
+// container at a time, from a copy of the buckets, rather than all
+// collected first.
+// @example
+//   Roaring::Bitmap64[1, 2, 3, 2**40].each_range.to_a # => [1..3, 1099511627776..1099511627776]
+// @yieldparam range [Range] an inclusive range of elements
+// @return [self]
+static VALUE rb_roaring64_each_range(VALUE self)
+{
+    RETURN_ENUMERATOR(self, 0, 0);
+    struct each_range e;
+    e.buckets = split_buckets(get_wrapper(self), &e.count);
+    rb_ensure(each_range_run, (VALUE)&e, each_range_cleanup, (VALUE)&e);
+    return self;
+}
+
+static void from_ranges_add(void *arg, uint64_t min, uint64_t max)
+{
+    rb_roaring64_t *wrapper = arg;
+    if (wrapper->bitmap32 && max <= UINT32_MAX) {
+        roaring_bitmap_add_range_closed(wrapper->bitmap32, (uint32_t)min, (uint32_t)max);
+    } else {
+        roaring64_bitmap_add_range_closed(promote(wrapper), min, max);
+    }
+}
+
+// Builds a bitmap from a list of ranges, adding each of them whole rather
+// than element by element
+// @param list [Array<Range>, String] ranges, which may overlap and be in any
+//   order, or the packed (start, length) pairs of {#to_ranges}
+// @return [Bitmap64]
+static VALUE rb_roaring64_s_from_ranges(VALUE klass, VALUE list)
+{
+    VALUE obj = rb_roaring64_new32(klass, roaring_bitmap_create());
+    rb_roaring_ranges_each_closed(list, UINT64_MAX, from_ranges_add, get_wrapper(obj));
+    return obj;
 }
 
 void
@@ -342,6 +1808,7 @@ rb_roaring64_init(void)
   rb_define_method(cRoaringBitmap64, "replace", rb_roaring64_replace, 1);
   rb_define_method(cRoaringBitmap64, "empty?", rb_roaring64_empty_p, 0);
   rb_define_method(cRoaringBitmap64, "clear", rb_roaring64_clear, 0);
+  rb_define_method(cRoaringBitmap64, "generation", rb_roaring64_generation, 0);
   rb_define_method(cRoaringBitmap64, "cardinality", rb_roaring64_cardinality, 0);
   rb_define_method(cRoaringBitmap64, "add", rb_roaring64_add, 1);
   rb_define_method(cRoaringBitmap64, "add?", rb_roaring64_add_p, 1);
@@ -352,6 +1819,8 @@ rb_roaring64_init(void)
   rb_define_method(cRoaringBitmap64, "include?", rb_roaring64_include_p, 1);
   rb_define_method(cRoaringBitmap64, "each", rb_roaring64_each, 0);
   rb_define_method(cRoaringBitmap64, "[]", rb_roaring64_aref, 1);
+  rb_define_method(cRoaringBitmap64, "each_range", rb_roaring64_each_range, 0);
+  rb_define_method(cRoaringBitmap64, "to_ranges", rb_roaring64_to_ranges, -1);
 
   rb_define_method(cRoaringBitmap64, "and!", rb_roaring64_and_inplace, 1);
   rb_define_method(cRoaringBitmap64, "or!", rb_roaring64_or_inplace, 1);
@@ -367,6 +1836,15 @@ rb_roaring64_init(void)
   rb_define_method(cRoaringBitmap64, "<", rb_roaring64_lt, 1);
   rb_define_method(cRoaringBitmap64, "<=", rb_roaring64_lte, 1);
   rb_define_method(cRoaringBitmap64, "intersect?", rb_roaring64_intersect_p, 1);
+  rb_define_method(cRoaringBitmap64, "and_cardinality", rb_roaring64_and_cardinality, 1);
+  rb_define_method(cRoaringBitmap64, "and_cardinality_many", rb_roaring64_and_cardinality_many, 1);
+  rb_define_method(cRoaringBitmap64, "to_bitmap32", rb_roaring64_to_bitmap32, -1);
+  rb_define_method(cRoaringBitmap64, "shift", rb_roaring64_shift, 1);
+  rb_define_method(cRoaringBitmap64, "shift!", rb_roaring64_shift_inplace, 1);
+  rb_define_method(cRoaringBitmap64, "sample", rb_roaring64_sample, -1);
+  rb_define_method(cRoaringBitmap64, "sample_bitmap", rb_roaring64_sample_bitmap, -1);
+  rb_define_singleton_method(cRoaringBitmap64, "or_many", rb_roaring64_s_or_many, 1);
+  rb_define_singleton_method(cRoaringBitmap64, "and_many", rb_roaring64_s_and_many, 1);
 
   rb_define_method(cRoaringBitmap64, "min", rb_roaring64_min, 0);
   rb_define_method(cRoaringBitmap64, "max", rb_roaring64_max, 0);
@@ -376,4 +1854,6 @@ rb_roaring64_init(void)
 
   rb_define_method(cRoaringBitmap64, "serialize", rb_roaring64_serialize, 0);
   rb_define_singleton_method(cRoaringBitmap64, "deserialize", rb_roaring64_deserialize, 1);
+  rb_define_singleton_method(cRoaringBitmap64, "deserialize_many", rb_roaring64_deserialize_many, 1);
+  rb_define_singleton_method(cRoaringBitmap64, "from_ranges", rb_roaring64_s_from_ranges, 1);
 }
@@ -0,0 +1,647 @@
+#include "roaring_ruby.h"
+
+#include <string.h>
+
+static VALUE cRoaringBitset;
+
+static inline uint32_t
+NUM2UINT32(VALUE num) {
+    if (!FIXNUM_P(num) && !RB_TYPE_P(num, T_BIGNUM)) {
+        rb_raise(rb_eTypeError, "wrong argument type %s (expected Integer)", rb_obj_classname(num));
+    } else if ((SIGNED_VALUE)num < (SIGNED_VALUE)INT2FIX(0)) {
+        rb_raise(rb_eRangeError, "Integer %"PRIdVALUE " must be >= 0 to use with Roaring::Bitset", num);
+    } else {
+        return FIX2UINT(num);
+    }
+}
+
+typedef struct {
+    bitset_t *bitset;
+
+    // Changes on every modification, see rb_roaring_next_generation
+    uint64_t generation;
+} rb_roaring_bitset_t;
+
+static void rb_roaring_bitset_free(void *data)
+{
+    rb_roaring_bitset_t *wrapper = data;
+    bitset_free(wrapper->bitset);
+    ruby_xfree(wrapper);
+}
+
+static size_t rb_roaring_bitset_memsize(const void *data)
+{
+    const rb_roaring_bitset_t *wrapper = data;
+    return sizeof(rb_roaring_bitset_t) + sizeof(bitset_t) + wrapper->bitset->capacity * sizeof(uint64_t);
+}
+
+static const rb_data_type_t bitset_type = {
+    .wrap_struct_name = "roaring/bitset",
+    .function = {
+        .dfree = rb_roaring_bitset_free,
+        .dsize = rb_roaring_bitset_memsize
+    },
+#ifdef HAVE_RB_EXT_RACTOR_SAFE
+    .flags = RUBY_TYPED_FREE_IMMEDIATELY | RUBY_TYPED_FROZEN_SHAREABLE,
+#else
+    .flags = RUBY_TYPED_FREE_IMMEDIATELY,
+#endif
+};
+
+// Wraps a bitset in a new Bitset, which takes ownership of it
+static VALUE rb_roaring_bitset_new(VALUE klass, bitset_t *bitset)
+{
+    if (!bitset) {
+        rb_raise(rb_eNoMemError, "failed to allocate bitset");
+    }
+
+    rb_roaring_bitset_t *wrapper;
+    VALUE obj = TypedData_Make_Struct(klass, rb_roaring_bitset_t, &bitset_type, wrapper);
+    wrapper->bitset = bitset;
+    wrapper->generation = rb_roaring_next_generation();
+    return obj;
+}
+
+static VALUE rb_roaring_bitset_alloc(VALUE self)
+{
+    return rb_roaring_bitset_new(self, bitset_create());
+}
+
+static rb_roaring_bitset_t *get_wrapper(VALUE obj) {
+    rb_roaring_bitset_t *wrapper;
+    TypedData_Get_Struct(obj, rb_roaring_bitset_t, &bitset_type, wrapper);
+    return wrapper;
+}
+
+static bitset_t *get_bitset(VALUE obj) {
+    return get_wrapper(obj)->bitset;
+}
+
+// Same as get_bitset, but raises FrozenError if `obj` is frozen
+static bitset_t *get_bitset_for_write(VALUE obj) {
+    rb_check_frozen(obj);
+    rb_roaring_bitset_t *wrapper = get_wrapper(obj);
+    wrapper->generation = rb_roaring_next_generation();
+    return wrapper->bitset;
+}
+
+// Makes room for bit `i`. bitset_set grows the bitset too, but silently
+// does nothing if that fails.
+static void reserve(bitset_t *bitset, size_t i)
+{
+    if (i / 64 >= bitset->arraysize && !bitset_grow(bitset, i / 64 + 1)) {
+        rb_raise(rb_eNoMemError, "failed to allocate bitset");
+    }
+}
+
+static VALUE rb_roaring_bitset_replace(VALUE self, VALUE other)
+{
+    bitset_t *data = get_bitset_for_write(self);
+    const bitset_t *other_data = get_bitset(other);
+    if (data == other_data) {
+        return self;
+    }
+
+    if (!bitset_resize(data, other_data->arraysize, false)) {
+        rb_raise(rb_eNoMemError, "failed to allocate bitset");
+    }
+    if (other_data->arraysize) {
+        memcpy(data->array, other_data->array, other_data->arraysize * sizeof(uint64_t));
+    }
+    return self;
+}
+
+// @see Bitmap32#generation
+// @return [Integer]
+static VALUE rb_roaring_bitset_generation(VALUE self)
+{
+    return ULL2NUM(get_wrapper(self)->generation);
+}
+
+// @return [Integer] the number of elements in the bitset
+static VALUE rb_roaring_bitset_cardinality(VALUE self)
+{
+    return SIZET2NUM(bitset_count(get_bitset(self)));
+}
+
+// Adds an element to the bitset, growing it to hold `val` if needed
+// @param val [Integer] the value to add
+static VALUE rb_roaring_bitset_add(VALUE self, VALUE val)
+{
+    bitset_t *data = get_bitset_for_write(self);
+
+    uint32_t num = NUM2UINT32(val);
+    reserve(data, num);
+    bitset_set(data, num);
+    return self;
+}
+
+// Adds an element to the bitset
+// @see {add}
+// @return `self` if value was add, `nil` if value was already in the bitset
+static VALUE rb_roaring_bitset_add_p(VALUE self, VALUE val)
+{
+    bitset_t *data = get_bitset_for_write(self);
+
+    uint32_t num = NUM2UINT32(val);
+    if (bitset_get(data, num)) {
+        return Qnil;
+    }
+    reserve(data, num);
+    bitset_set(data, num);
+    return self;
+}
+
+// Adds all values from `min` to `max`, both included
+static VALUE rb_roaring_bitset_add_range_closed(VALUE self, VALUE minv, VALUE maxv)
+{
+    bitset_t *data = get_bitset_for_write(self);
+
+    uint32_t min = NUM2UINT32(minv);
+    uint32_t max = NUM2UINT32(maxv);
+    if (min > max) {
+        return self;
+    }
+
+    reserve(data, max);
+    size_t first = min / 64, last = max / 64;
+    uint64_t first_mask = UINT64_MAX << (min % 64);
+    uint64_t last_mask = UINT64_MAX >> (63 - max % 64);
+    if (first == last) {
+        data->array[first] |= first_mask & last_mask;
+    } else {
+        data->array[first] |= first_mask;
+        for (size_t i = first + 1; i < last; i++) {
+            data->array[i] = UINT64_MAX;
+        }
+        data->array[last] |= last_mask;
+    }
+    return self;
+}
+
+// Removes an element from the bitset
+static VALUE rb_roaring_bitset_remove(VALUE self, VALUE val)
+{
+    bitset_t *data = get_bitset_for_write(self);
+
+    uint32_t num = NUM2UINT32(val);
+    // bitset_set_to_value would grow the bitset to clear a bit past its end
+    if (bitset_get(data, num)) {
+        bitset_set_to_value(data, num, false);
+    }
+    return self;
+}
+
+// Removes an element from the bitset
+// @see {remove}
+// @return `self` if the value existed in the bitset, `nil` if it didn't
+static VALUE rb_roaring_bitset_remove_p(VALUE self, VALUE val)
+{
+    bitset_t *data = get_bitset_for_write(self);
+
+    uint32_t num = NUM2UINT32(val);
+    if (!bitset_get(data, num)) {
+        return Qnil;
+    }
+    bitset_set_to_value(data, num, false);
+    return self;
+}
+
+// @return [Boolean] `true` if the bitset contains `val`, otherwise `false`
+static VALUE rb_roaring_bitset_include_p(VALUE self, VALUE val)
+{
+    return RBOOL(bitset_get(get_bitset(self), NUM2UINT32(val)));
+}
+
+// @return [Boolean] `true` if the bitset is empty, otherwise `false`
+static VALUE rb_roaring_bitset_empty_p(VALUE self)
+{
+    size_t i = 0;
+    return RBOOL(!bitset_next_set_bit(get_bitset(self), &i));
+}
+
+// Removes all elements from the bitset, keeping its memory
+static VALUE rb_roaring_bitset_clear(VALUE self)
+{
+    bitset_clear(get_bitset_for_write(self));
+    return self;
+}
+
+#define EACH_BUFFER_SIZE 256
+
+// Iterates over every element in the bitset
+// @return [self]
+static VALUE rb_roaring_bitset_each(VALUE self)
+{
+    size_t buffer[EACH_BUFFER_SIZE];
+    size_t count;
+    // The block may replace the bitset, see {trim}
+    for (size_t start = 0; (count = bitset_next_set_bits(get_bitset(self), buffer, EACH_BUFFER_SIZE, &start)) > 0; start++) {
+        for (size_t i = 0; i < count; i++) {
+            rb_yield(SIZET2NUM(buffer[i]));
+        }
+    }
+    return self;
+}
+
+// Find the nth smallest integer in the bitset
+// @return [Integer,nil] The nth integer in the bitset, or `nil` if `rankv` is `>= cardinality`
+static VALUE rb_roaring_bitset_aref(VALUE self, VALUE rankv)
+{
+    const bitset_t *data = get_bitset(self);
+
+    uint64_t rank = NUM2UINT32(rankv);
+    for (size_t i = 0; i < data->arraysize; i++) {
+        uint64_t word = data->array[i];
+        uint64_t count = roaring_hamming(word);
+        if (rank < count) {
+            while (rank--) {
+                word &= word - 1;
+            }
+            return SIZET2NUM(i * 64 + roaring_trailing_zeroes(word));
+        }
+        rank -= count;
+    }
+    return Qnil;
+}
+
+// Find the smallest integer in the bitset
+// @return [Integer,nil] The smallest integer in the bitset, or `nil` if it is empty
+static VALUE rb_roaring_bitset_min(VALUE self)
+{
+    if (RTEST(rb_roaring_bitset_empty_p(self))) {
+        return Qnil;
+    }
+    return SIZET2NUM(bitset_minimum(get_bitset(self)));
+}
+
+// Find the largest integer in the bitset
+// @return [Integer,nil] The largest integer in the bitset, or `nil` if it is empty
+static VALUE rb_roaring_bitset_max(VALUE self)
+{
+    if (RTEST(rb_roaring_bitset_empty_p(self))) {
+        return Qnil;
+    }
+    return SIZET2NUM(bitset_maximum(get_bitset(self)));
+}
+
+// Returns the memory past the largest element to the system
+// @return [self]
+static VALUE rb_roaring_bitset_trim(VALUE self)
+{
+    rb_check_frozen(self);
+    rb_roaring_bitset_t *wrapper = get_wrapper(self);
+
+    // bitset_trim would realloc an empty bitset to 0 bytes, which frees it
+    if (RTEST(rb_roaring_bitset_empty_p(self))) {
+        bitset_t *empty = bitset_create();
+        if (!empty) {
+            rb_raise(rb_eNoMemError, "failed to allocate bitset");
+        }
+        bitset_free(wrapper->bitset);
+        wrapper->bitset = empty;
+    } else if (!bitset_trim(wrapper->bitset)) {
+        rb_raise(rb_eNoMemError, "failed to allocate bitset");
+    }
+    return self;
+}
+
+typedef bool binary_func_inplace(bitset_t *, const bitset_t *);
+
+static bool and_inplace(bitset_t *a, const bitset_t *b) { bitset_inplace_intersection(a, b); return true; }
+static bool andnot_inplace(bitset_t *a, const bitset_t *b) { bitset_inplace_difference(a, b); return true; }
+
+// The bitset functions don't allow both operands to be the same bitset
+static void apply_inplace(bitset_t *a, const bitset_t *b, binary_func_inplace *func)
+{
+    if (a == b) {
+        if (func == bitset_inplace_symmetric_difference || func == andnot_inplace) {
+            bitset_clear(a);
+        }
+    } else if (!func(a, b)) {
+        rb_raise(rb_eNoMemError, "failed to allocate bitset");
+    }
+}
+
+static VALUE rb_roaring_bitset_binary_op_inplace(VALUE self, VALUE other, binary_func_inplace *func)
+{
+    bitset_t *data = get_bitset_for_write(self);
+    apply_inplace(data, get_bitset(other), func);
+    return self;
+}
+
+static VALUE rb_roaring_bitset_binary_op(VALUE self, VALUE other, binary_func_inplace *func)
+{
+    const bitset_t *other_data = get_bitset(other);
+    VALUE result = rb_roaring_bitset_new(cRoaringBitset, bitset_copy(get_bitset(self)));
+    apply_inplace(get_bitset(result), other_data, func);
+    return result;
+}
+
+// Inplace version of {and}
+// @return [self] the modified Bitset
+static VALUE rb_roaring_bitset_and_inplace(VALUE self, VALUE other)
+{
+    return rb_roaring_bitset_binary_op_inplace(self, other, and_inplace);
+}
+
+// Inplace version of {or}
+// @return [self] the modified Bitset
+static VALUE rb_roaring_bitset_or_inplace(VALUE self, VALUE other)
+{
+    return rb_roaring_bitset_binary_op_inplace(self, other, bitset_inplace_union);
+}
+
+// Inplace version of {xor}
+// @return [self] the modified Bitset
+static VALUE rb_roaring_bitset_xor_inplace(VALUE self, VALUE other)
+{
+    return rb_roaring_bitset_binary_op_inplace(self, other, bitset_inplace_symmetric_difference);
+}
+
+// Inplace version of {andnot}
+// @return [self] the modified Bitset
+static VALUE rb_roaring_bitset_andnot_inplace(VALUE self, VALUE other)
+{
+    return rb_roaring_bitset_binary_op_inplace(self, other, andnot_inplace);
+}
+
+// Computes the intersection between two bitsets
+// @return [Bitset] a new bitset containing all elements in both `self` and `other`
+static VALUE rb_roaring_bitset_and(VALUE self, VALUE other)
+{
+    return rb_roaring_bitset_binary_op(self, other, and_inplace);
+}
+
+// Computes the union between two bitsets
+// @return [Bitset] a new bitset containing all elements in either `self` or `other`
+static VALUE rb_roaring_bitset_or(VALUE self, VALUE other)
+{
+    return rb_roaring_bitset_binary_op(self, other, bitset_inplace_union);
+}
+
+// Computes the exclusive or between two bitsets
+// @return [Bitset] a new bitset containing all elements in one of `self` or `other`, but not both
+static VALUE rb_roaring_bitset_xor(VALUE self, VALUE other)
+{
+    return rb_roaring_bitset_binary_op(self, other, bitset_inplace_symmetric_difference);
+}
+
+// Computes the difference between two bitsets
+// @return [Bitset] a new bitset containing all elements in `self`, but not in `other`
+static VALUE rb_roaring_bitset_andnot(VALUE self, VALUE other)
+{
+    return rb_roaring_bitset_binary_op(self, other, andnot_inplace);
+}
+
+// bitset_contains_all, allowing both operands to be the same bitset
+static bool contains_all(const bitset_t *a, const bitset_t *b)
+{
+    return a == b || bitset_contains_all(a, b);
+}
+
+// Compare equality between two bitsets, whatever their capacity
+// @return [Boolean] `true` if both bitsets contain all the same elements, otherwise `false`
+static VALUE rb_roaring_bitset_eq(VALUE self, VALUE other)
+{
+    const bitset_t *data = get_bitset(self);
+    const bitset_t *other_data = get_bitset(other);
+    return RBOOL(contains_all(data, other_data) && contains_all(other_data, data));
+}
+
+// Check if `self` is a strict subset of `other`
+// @return [Boolean] `true` if `self` is a strict subset of `other`, otherwise `false`
+static VALUE rb_roaring_bitset_lt(VALUE self, VALUE other)
+{
+    const bitset_t *data = get_bitset(self);
+    const bitset_t *other_data = get_bitset(other);
+    return RBOOL(contains_all(other_data, data) && !contains_all(data, other_data));
+}
+
+// Check if `self` is a (non-strict) subset of `other`
+// @return [Boolean] `true` if `self` is a subset of `other`, otherwise `false`
+static VALUE rb_roaring_bitset_lte(VALUE self, VALUE other)
+{
+    return RBOOL(contains_all(get_bitset(other), get_bitset(self)));
+}
+
+// Checks whether `self` intersects `other`
+// @return [Boolean] `true` if `self` intersects `other`, otherwise `false`
+static VALUE rb_roaring_bitset_intersect_p(VALUE self, VALUE other)
+{
+    const bitset_t *data = get_bitset(self);
+    const bitset_t *other_data = get_bitset(other);
+    if (data == other_data) {
+        return RBOOL(!RTEST(rb_roaring_bitset_empty_p(self)));
+    }
+    return RBOOL(bitsets_intersect(data, other_data));
+}
+
+// Computes the size of the intersection between two bitsets, without building it
+// @return [Integer] the number of elements in both `self` and `other`
+static VALUE rb_roaring_bitset_and_cardinality(VALUE self, VALUE other)
+{
+    const bitset_t *data = get_bitset(self);
+    const bitset_t *other_data = get_bitset(other);
+    if (data == other_data) {
+        return SIZET2NUM(bitset_count(data));
+    }
+    return SIZET2NUM(bitset_intersection_count(data, other_data));
+}
+
+// The portable format of roaring bitmaps, as written by
+// roaring_bitmap_portable_serialize without run containers: a cookie, the
+// number of containers, the key and cardinality - 1 of each container, the
+// offset of each container, and the containers. Containers of more than
+// 4096 values are bitsets of 2**16 bits, and sorted arrays of 16-bit values
+// otherwise.
+#define SERIAL_COOKIE_NO_RUNCONTAINER 12346
+#define CHUNK_WORDS 1024
+#define ARRAY_MAX_CARDINALITY 4096
+
+static uint32_t chunk_count(const bitset_t *bitset)
+{
+    return (uint32_t)((bitset->arraysize + CHUNK_WORDS - 1) / CHUNK_WORDS);
+}
+
+static uint32_t chunk_cardinality(const bitset_t *bitset, uint32_t chunk)
+{
+    size_t start = (size_t)chunk * CHUNK_WORDS;
+    size_t end = start + CHUNK_WORDS < bitset->arraysize ? start + CHUNK_WORDS : bitset->arraysize;
+    uint32_t cardinality = 0;
+    for (size_t i = start; i < end; i++) {
+        cardinality += roaring_hamming(bitset->array[i]);
+    }
+    return cardinality;
+}
+
+// Writes `bitset` in the portable format into `buf`, if it isn't NULL.
+// Returns the number of bytes written, or needed.
+static size_t portable_serialize(const bitset_t *bitset, char *buf)
+{
+    uint32_t chunks = chunk_count(bitset);
+    uint32_t containers = 0;
+    size_t data_size = 0;
+    for (uint32_t chunk = 0; chunk < chunks; chunk++) {
+        uint32_t cardinality = chunk_cardinality(bitset, chunk);
+        if (cardinality) {
+            containers++;
+            data_size += cardinality > ARRAY_MAX_CARDINALITY ? CHUNK_WORDS * sizeof(uint64_t) : cardinality * sizeof(uint16_t);
+        }
+    }
+
+    size_t header_size = 2 * sizeof(uint32_t) + (size_t)containers * 2 * sizeof(uint32_t);
+    if (!buf) {
+        return header_size + data_size;
+    }
+
+    uint32_t header[2] = { SERIAL_COOKIE_NO_RUNCONTAINER, containers };
+    memcpy(buf, header, sizeof(header));
+    char *descriptions = buf + sizeof(header);
+    char *offsets = descriptions + (size_t)containers * 2 * sizeof(uint16_t);
+    size_t pos = header_size;
+
+    for (uint32_t chunk = 0, i = 0; chunk < chunks; chunk++) {
+        uint32_t cardinality = chunk_cardinality(bitset, chunk);
+        if (!cardinality) {
+            continue;
+        }
+
+        uint16_t description[2] = { (uint16_t)chunk, (uint16_t)(cardinality - 1) };
+        uint32_t offset = (uint32_t)pos;
+        memcpy(descriptions + i * sizeof(description), description, sizeof(description));
+        memcpy(offsets + i * sizeof(offset), &offset, sizeof(offset));
+        i++;
+
+        size_t start = (size_t)chunk * CHUNK_WORDS;
+        size_t words = bitset->arraysize - start < CHUNK_WORDS ? bitset->arraysize - start : CHUNK_WORDS;
+        if (cardinality > ARRAY_MAX_CARDINALITY) {
+            memcpy(buf + pos, bitset->array + start, words * sizeof(uint64_t));
+            memset(buf + pos + words * sizeof(uint64_t), 0, (CHUNK_WORDS - words) * sizeof(uint64_t));
+            pos += CHUNK_WORDS * sizeof(uint64_t);
+        } else {
+            for (size_t w = 0; w < words; w++) {
+                for (uint64_t word = bitset->array[start + w]; word; word &= word - 1) {
+                    uint16_t value = (uint16_t)(w * 64 + roaring_trailing_zeroes(word));
+                    memcpy(buf + pos, &value, sizeof(value));
+                    pos += sizeof(value);
+                }
+            }
+        }
+    }
+    return pos;
+}
+
+// Converts a bitset into a roaring bitmap, one container per 2**16 bits
+static roaring_bitmap_t *bitset_to_bitmap(const bitset_t *bitset)
+{
+    size_t size = portable_serialize(bitset, NULL);
+    char *buf = ALLOC_N(char, size);
+    portable_serialize(bitset, buf);
+    roaring_bitmap_t *bitmap = roaring_bitmap_portable_deserialize_safe(buf, size);
+    xfree(buf);
+    return bitmap;
+}
+
+// Serializes the bitset in the same portable format as {Bitmap32#serialize}
+// @return [String]
+static VALUE rb_roaring_bitset_serialize(VALUE self)
+{
+    const bitset_t *data = get_bitset(self);
+
+    size_t size = portable_serialize(data, NULL);
+    VALUE str = rb_str_buf_new(size);
+    size_t written = portable_serialize(data, RSTRING_PTR(str));
+    rb_str_set_len(str, written);
+    return str;
+}
+
+// Converts a bitmap into a new bitset
+static bitset_t *bitmap_to_bitset(const roaring_bitmap_t *bitmap)
+{
+    bitset_t *bitset = bitset_create();
+    if (bitset && !roaring_bitmap_to_bitset(bitmap, bitset)) {
+        bitset_free(bitset);
+        return NULL;
+    }
+    return bitset;
+}
+
+// Loads a bitset serialized by {serialize} or {Bitmap32#serialize}
+// @return [Bitset]
+static VALUE rb_roaring_bitset_deserialize(VALUE self, VALUE str)
+{
+    StringValue(str);
+    roaring_bitmap_t *bitmap = roaring_bitmap_portable_deserialize_safe(RSTRING_PTR(str), RSTRING_LEN(str));
+    if (!bitmap) {
+        rb_raise(rb_eArgError, "invalid serialized bitset");
+    }
+    bitset_t *bitset = bitmap_to_bitset(bitmap);
+    roaring_bitmap_free(bitmap);
+    return rb_roaring_bitset_new(self, bitset);
+}
+
+// Converts the bitset into a Bitmap32, copying every 2**16 bits at once
+// @return [Bitmap32]
+static VALUE rb_roaring_bitset_to_bitmap32(VALUE self)
+{
+    roaring_bitmap_t *bitmap = bitset_to_bitmap(get_bitset(self));
+    if (!bitmap) {
+        rb_raise(rb_eNoMemError, "failed to allocate bitmap");
+    }
+    return rb_roaring32_wrap(bitmap);
+}
+
+VALUE rb_roaring_bitset_from_bitmap(const roaring_bitmap_t *bitmap)
+{
+    return rb_roaring_bitset_new(cRoaringBitset, bitmap_to_bitset(bitmap));
+}
+
+roaring_bitmap_t *rb_roaring_bitset_to_bitmap(const bitset_t *bitset)
+{
+    return bitset_to_bitmap(bitset);
+}
+
+void
+rb_roaring_bitset_init(void)
+{
+  cRoaringBitset = rb_define_class_under(rb_mRoaring, "Bitset", rb_cObject);
+  rb_define_alloc_func(cRoaringBitset, rb_roaring_bitset_alloc);
+  rb_define_method(cRoaringBitset, "replace", rb_roaring_bitset_replace, 1);
+  rb_define_method(cRoaringBitset, "empty?", rb_roaring_bitset_empty_p, 0);
+  rb_define_method(cRoaringBitset, "clear", rb_roaring_bitset_clear, 0);
+  rb_define_method(cRoaringBitset, "generation", rb_roaring_bitset_generation, 0);
+  rb_define_method(cRoaringBitset, "cardinality", rb_roaring_bitset_cardinality, 0);
+  rb_define_method(cRoaringBitset, "add", rb_roaring_bitset_add, 1);
+  rb_define_method(cRoaringBitset, "add?", rb_roaring_bitset_add_p, 1);
+  rb_define_method(cRoaringBitset, "add_range_closed", rb_roaring_bitset_add_range_closed, 2);
+  rb_define_method(cRoaringBitset, "remove", rb_roaring_bitset_remove, 1);
+  rb_define_method(cRoaringBitset, "remove?", rb_roaring_bitset_remove_p, 1);
+  rb_define_method(cRoaringBitset, "include?", rb_roaring_bitset_include_p, 1);
+  rb_define_method(cRoaringBitset, "each", rb_roaring_bitset_each, 0);
+  rb_define_method(cRoaringBitset, "[]", rb_roaring_bitset_aref, 1);
+
+  rb_define_method(cRoaringBitset, "and!", rb_roaring_bitset_and_inplace, 1);
+  rb_define_method(cRoaringBitset, "or!", rb_roaring_bitset_or_inplace, 1);
+  rb_define_method(cRoaringBitset, "xor!", rb_roaring_bitset_xor_inplace, 1);
+  rb_define_method(cRoaringBitset, "andnot!", rb_roaring_bitset_andnot_inplace, 1);
+
+  rb_define_method(cRoaringBitset, "and", rb_roaring_bitset_and, 1);
+  rb_define_method(cRoaringBitset, "or", rb_roaring_bitset_or, 1);
+  rb_define_method(cRoaringBitset, "xor", rb_roaring_bitset_xor, 1);
+  rb_define_method(cRoaringBitset, "andnot", rb_roaring_bitset_andnot, 1);
+
+  rb_define_method(cRoaringBitset, "==", rb_roaring_bitset_eq, 1);
+  rb_define_method(cRoaringBitset, "<", rb_roaring_bitset_lt, 1);
+  rb_define_method(cRoaringBitset, "<=", rb_roaring_bitset_lte, 1);
+  rb_define_method(cRoaringBitset, "intersect?", rb_roaring_bitset_intersect_p, 1);
+  rb_define_method(cRoaringBitset, "and_cardinality", rb_roaring_bitset_and_cardinality, 1);
+
+  rb_define_method(cRoaringBitset, "min", rb_roaring_bitset_min, 0);
+  rb_define_method(cRoaringBitset, "max", rb_roaring_bitset_max, 0);
+  rb_define_method(cRoaringBitset, "trim", rb_roaring_bitset_trim, 0);
+
+  rb_define_method(cRoaringBitset, "to_bitmap32", rb_roaring_bitset_to_bitmap32, 0);
+  rb_define_method(cRoaringBitset, "serialize", rb_roaring_bitset_serialize, 0);
+  rb_define_singleton_method(cRoaringBitset, "deserialize", rb_roaring_bitset_deserialize, 1);
+}
@@ -2,10 +2,29 @@
 
 VALUE rb_mRoaring;
 
+static uint64_t generation_counter = 0;
+
+uint64_t rb_roaring_next_generation(void)
+{
+  return __atomic_add_fetch(&generation_counter, 1, __ATOMIC_RELAXED);
+}
+
 RUBY_FUNC_EXPORTED void
 Init_roaring(void)
 {
+#ifdef HAVE_RB_EXT_RACTOR_SAFE
+  rb_ext_ractor_safe(true);
+#endif
+
   rb_mRoaring = rb_define_module("Roaring");
   rb_roaring32_init();
   rb_roaring64_init();
+  rb_roaring_pool_init();
+  rb_roaring_offload_init();
+  rb_roaring_query_init();
+  rb_roaring_inverted_index_init();
+  rb_roaring_dictionary_init();
+  rb_roaring_bitset_init();
+  rb_roaring_matrix_init();
+  rb_roaring_column_init();
 }
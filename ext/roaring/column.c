@@ -0,0 +1,1131 @@
+#include "roaring_ruby.h"
+
+#include <math.h>
+#include <string.h>
+
+#include <ruby/thread.h>
+
+#ifdef HAVE_RB_IO_BUFFER_GET_BYTES_FOR_WRITING
+#include <ruby/io/buffer.h>
+#endif
+
+#if CROARING_IS_X64 && (defined(__GNUC__) || defined(__clang__))
+#define COLUMN_AVX2 1
+#include <immintrin.h>
+
+// CRoaring's check of the instructions the CPU supports, which picks its own
+// AVX2 kernels. Bit 1 is AVX2.
+int croaring_hardware_support(void);
+#define COLUMN_SUPPORTS_AVX2 1
+#endif
+
+// Packed columns: binary Strings holding one number per row, in native byte
+// order, as produced by Array#pack or read from columnar files. Row `i` is
+// the i-th number, and rows are identified by their position in Bitmap32s.
+
+typedef enum {
+    COLUMN_INT8,
+    COLUMN_UINT8,
+    COLUMN_INT16,
+    COLUMN_UINT16,
+    COLUMN_INT32,
+    COLUMN_UINT32,
+    COLUMN_INT64,
+    COLUMN_UINT64,
+    COLUMN_FLOAT,
+    COLUMN_DOUBLE,
+} column_type;
+
+static const struct {
+    const char *name;
+    size_t size;
+} column_types[] = {
+    [COLUMN_INT8] = { "int8", 1 },
+    [COLUMN_UINT8] = { "uint8", 1 },
+    [COLUMN_INT16] = { "int16", 2 },
+    [COLUMN_UINT16] = { "uint16", 2 },
+    [COLUMN_INT32] = { "int32", 4 },
+    [COLUMN_UINT32] = { "uint32", 4 },
+    [COLUMN_INT64] = { "int64", 8 },
+    [COLUMN_UINT64] = { "uint64", 8 },
+    [COLUMN_FLOAT] = { "float", 4 },
+    [COLUMN_DOUBLE] = { "double", 8 },
+};
+
+#define COLUMN_TYPES (sizeof(column_types) / sizeof(column_types[0]))
+
+struct column {
+    const char *data;
+    size_t rows;
+    column_type type;
+};
+
+static column_type column_type_get(VALUE type)
+{
+    if (SYMBOL_P(type)) {
+        const char *name = rb_id2name(SYM2ID(type));
+        for (size_t i = 0; i < COLUMN_TYPES; i++) {
+            if (strcmp(name, column_types[i].name) == 0) {
+                return (column_type)i;
+            }
+        }
+    }
+    rb_raise(rb_eArgError, "unknown column type %+"PRIsVALUE", expected one of :int8, :uint8, :int16, :uint16, :int32, :uint32, :int64, :uint64, :float or :double", type);
+}
+
+// Reads the `type:` keyword argument, which is required
+static column_type column_type_opt(VALUE opts)
+{
+    ID keys[1] = { rb_intern("type") };
+    VALUE values[1];
+    rb_get_kwargs(opts, keys, 1, 0, values);
+    return column_type_get(values[0]);
+}
+
+// Fills `column` from `*str`, which is replaced by a frozen copy that other
+// threads can't modify while the column is read without the GVL
+static void column_get(VALUE *str, column_type type, struct column *column)
+{
+    *str = rb_str_new_frozen(StringValue(*str));
+
+    size_t size = column_types[type].size;
+    size_t length = RSTRING_LEN(*str);
+    if (length % size != 0) {
+        rb_raise(rb_eArgError, "column length %zu isn't a multiple of %zu bytes", length, size);
+    }
+    if (length / size > (size_t)UINT32_MAX + 1) {
+        rb_raise(rb_eArgError, "columns can't have more than 2**32 rows");
+    }
+
+    column->data = RSTRING_PTR(*str);
+    column->rows = length / size;
+    column->type = type;
+}
+
+// Returns row `i` of an integer column, as an int64_t for signed columns
+// and a uint64_t for unsigned ones
+static uint64_t column_integer(const struct column *column, size_t i)
+{
+    const char *p = column->data + i * column_types[column->type].size;
+    switch (column->type) {
+    case COLUMN_INT8: { int8_t v; memcpy(&v, p, sizeof(v)); return (uint64_t)(int64_t)v; }
+    case COLUMN_UINT8: { uint8_t v; memcpy(&v, p, sizeof(v)); return v; }
+    case COLUMN_INT16: { int16_t v; memcpy(&v, p, sizeof(v)); return (uint64_t)(int64_t)v; }
+    case COLUMN_UINT16: { uint16_t v; memcpy(&v, p, sizeof(v)); return v; }
+    case COLUMN_INT32: { int32_t v; memcpy(&v, p, sizeof(v)); return (uint64_t)(int64_t)v; }
+    case COLUMN_UINT32: { uint32_t v; memcpy(&v, p, sizeof(v)); return v; }
+    case COLUMN_INT64: case COLUMN_UINT64: { uint64_t v; memcpy(&v, p, sizeof(v)); return v; }
+    default: return 0;
+    }
+}
+
+static double column_float(const struct column *column, size_t i)
+{
+    const char *p = column->data + i * column_types[column->type].size;
+    if (column->type == COLUMN_FLOAT) {
+        float v;
+        memcpy(&v, p, sizeof(v));
+        return v;
+    }
+    double v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static bool column_floating_p(const struct column *column)
+{
+    return column->type == COLUMN_FLOAT || column->type == COLUMN_DOUBLE;
+}
+
+static bool column_signed_p(const struct column *column)
+{
+    return column->type == COLUMN_INT8 || column->type == COLUMN_INT16 ||
+           column->type == COLUMN_INT32 || column->type == COLUMN_INT64;
+}
+
+// The bits of row `i`, as a key equal for equal values: floats are widened
+// to doubles, and -0.0 is the same as 0.0
+static uint64_t column_key(const struct column *column, size_t i)
+{
+    if (!column_floating_p(column)) {
+        return column_integer(column, i);
+    }
+    double v = column_float(column, i) + 0.0;
+    uint64_t key;
+    memcpy(&key, &v, sizeof(key));
+    return key;
+}
+
+static VALUE column_key2num(const struct column *column, uint64_t key)
+{
+    if (column_floating_p(column)) {
+        double v;
+        memcpy(&v, &key, sizeof(v));
+        return DBL2NUM(v);
+    }
+    return column_signed_p(column) ? LL2NUM((int64_t)key) : ULL2NUM(key);
+}
+
+struct group {
+    uint64_t key;
+    roaring_bitmap_t *rows;
+    roaring_bulk_context_t context;
+};
+
+// An open-addressing table from keys to the rows holding them
+struct group_args {
+    struct column column;
+    struct group *groups;
+    size_t capacity;
+    size_t count;
+};
+
+static size_t group_hash(uint64_t key)
+{
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdULL;
+    key ^= key >> 33;
+    return (size_t)key;
+}
+
+static void group_grow(struct group_args *args)
+{
+    size_t capacity = args->capacity * 2;
+    struct group *groups = roaring_calloc(capacity, sizeof(*groups));
+    for (size_t i = 0; i < args->capacity; i++) {
+        struct group *group = &args->groups[i];
+        if (group->rows) {
+            size_t slot = group_hash(group->key) & (capacity - 1);
+            while (groups[slot].rows) {
+                slot = (slot + 1) & (capacity - 1);
+            }
+            groups[slot] = *group;
+        }
+    }
+    roaring_free(args->groups);
+    args->groups = groups;
+    args->capacity = capacity;
+}
+
+static struct group *group_find(struct group_args *args, uint64_t key)
+{
+    size_t slot = group_hash(key) & (args->capacity - 1);
+    while (args->groups[slot].rows) {
+        if (args->groups[slot].key == key) {
+            return &args->groups[slot];
+        }
+        slot = (slot + 1) & (args->capacity - 1);
+    }
+
+    if ((args->count + 1) * 2 > args->capacity) {
+        group_grow(args);
+        return group_find(args, key);
+    }
+    struct group *group = &args->groups[slot];
+    group->key = key;
+    group->rows = roaring_bitmap_create();
+    args->count++;
+    return group;
+}
+
+static void *group_nogvl(void *ptr)
+{
+    struct group_args *args = ptr;
+    const struct column *column = &args->column;
+    bool floating = column_floating_p(column);
+
+    // Columns often repeat values over consecutive rows, which can skip the
+    // table lookup
+    struct group *last = NULL;
+    for (size_t i = 0; i < column->rows; i++) {
+        if (floating && isnan(column_float(column, i))) {
+            continue;
+        }
+        uint64_t key = column_key(column, i);
+        if (!last || last->key != key) {
+            last = group_find(args, key);
+        }
+        roaring_bitmap_add_bulk(last->rows, &last->context, (uint32_t)i);
+    }
+    return NULL;
+}
+
+static int group_cmp_unsigned(const void *a, const void *b)
+{
+    uint64_t x = ((const struct group *)a)->key;
+    uint64_t y = ((const struct group *)b)->key;
+    return (x > y) - (x < y);
+}
+
+static int group_cmp_signed(const void *a, const void *b)
+{
+    int64_t x = (int64_t)((const struct group *)a)->key;
+    int64_t y = (int64_t)((const struct group *)b)->key;
+    return (x > y) - (x < y);
+}
+
+static int group_cmp_floating(const void *a, const void *b)
+{
+    double x, y;
+    memcpy(&x, &((const struct group *)a)->key, sizeof(x));
+    memcpy(&y, &((const struct group *)b)->key, sizeof(y));
+    return (x > y) - (x < y);
+}
+
+// Splits the rows of a packed column by value, in one pass over the column.
+// Rows holding NaN are left out.
+// @example
+//   column = [3, 1, 3, 2].pack("C*")
+//   Roaring::Bitmap32.group_column(column, type: :uint8)
+//   # => {1=>#<Roaring::Bitmap32 {1}>, 2=>#<Roaring::Bitmap32 {3}>, 3=>#<Roaring::Bitmap32 {0, 2}>}
+// @param column [String] one number per row, in native byte order
+// @param type [Symbol] the type of the numbers: `:int8`, `:uint8`, `:int16`,
+//   `:uint16`, `:int32`, `:uint32`, `:int64`, `:uint64`, `:float` or `:double`
+// @return [Hash{Numeric => Bitmap32}] the rows holding each distinct value,
+//   in ascending order of value
+static VALUE rb_roaring_column_s_group_column(int argc, VALUE *argv, VALUE klass)
+{
+    VALUE str, opts;
+    rb_scan_args(argc, argv, "1:", &str, &opts);
+
+    struct group_args args = {
+        .capacity = 16,
+    };
+    column_get(&str, column_type_opt(opts), &args.column);
+    args.groups = roaring_calloc(args.capacity, sizeof(*args.groups));
+    rb_thread_call_without_gvl(group_nogvl, &args, NULL, NULL);
+    RB_GC_GUARD(str);
+
+    // Moves the groups to the front of the table, to sort them
+    size_t count = 0;
+    for (size_t i = 0; i < args.capacity; i++) {
+        if (args.groups[i].rows) {
+            args.groups[count++] = args.groups[i];
+        }
+    }
+    qsort(args.groups, count, sizeof(*args.groups),
+          column_floating_p(&args.column) ? group_cmp_floating :
+          column_signed_p(&args.column) ? group_cmp_signed : group_cmp_unsigned);
+
+    VALUE hash = rb_hash_new();
+    for (size_t i = 0; i < count; i++) {
+        roaring_bitmap_t *rows = args.groups[i].rows;
+        args.groups[i].rows = NULL;
+        rb_hash_aset(hash, column_key2num(&args.column, args.groups[i].key), rb_roaring32_wrap(rows));
+    }
+    roaring_free(args.groups);
+
+    return hash;
+}
+
+// Scans are split in chunks of this many rows, the rows of a container
+#define COLUMN_CHUNK_ROWS 65536
+
+// A predicate on a column: whether values are between `lo` and `hi`
+// inclusive, in the type of the column, or the opposite if `negate`
+struct column_range {
+    bool empty;
+    bool negate;
+    union {
+        int64_t i;
+        uint64_t u;
+        float f;
+        double d;
+    } lo, hi;
+};
+
+static ID id_eq;
+static ID id_neq;
+static ID id_lt;
+static ID id_lte;
+static ID id_gt;
+static ID id_gte;
+static ID id_between;
+static ID id_floor;
+static ID id_ceil;
+
+// Rounds a bound which isn't an Integer down or up, for Numerics such as
+// Rationals, and converts other objects with to_int
+static VALUE round_bound(VALUE v, ID rounding)
+{
+    if (!RB_INTEGER_TYPE_P(v) && rb_obj_is_kind_of(v, rb_cNumeric)) {
+        return rb_funcall(v, rounding, 0);
+    }
+    return rb_to_int(v);
+}
+
+// The smallest Integer greater than or equal to `v`, or greater than `v` if
+// `exclusive`. Infinite Floats are returned as is, and NaN as nil.
+static VALUE integer_lower_bound(VALUE v, bool exclusive)
+{
+    if (RB_FLOAT_TYPE_P(v)) {
+        double d = RFLOAT_VALUE(v);
+        if (isnan(d)) {
+            return Qnil;
+        } else if (isinf(d)) {
+            return v;
+        }
+        VALUE bound = rb_dbl2big(exclusive ? floor(d) : ceil(d));
+        return exclusive ? rb_funcall(bound, '+', 1, INT2FIX(1)) : bound;
+    }
+    v = round_bound(v, exclusive ? id_floor : id_ceil);
+    return exclusive ? rb_funcall(v, '+', 1, INT2FIX(1)) : v;
+}
+
+// The largest Integer less than or equal to `v`, or less than `v` if
+// `exclusive`, see integer_lower_bound
+static VALUE integer_upper_bound(VALUE v, bool exclusive)
+{
+    if (RB_FLOAT_TYPE_P(v)) {
+        double d = RFLOAT_VALUE(v);
+        if (isnan(d)) {
+            return Qnil;
+        } else if (isinf(d)) {
+            return v;
+        }
+        VALUE bound = rb_dbl2big(exclusive ? ceil(d) : floor(d));
+        return exclusive ? rb_funcall(bound, '-', 1, INT2FIX(1)) : bound;
+    }
+    v = round_bound(v, exclusive ? id_ceil : id_floor);
+    return exclusive ? rb_funcall(v, '-', 1, INT2FIX(1)) : v;
+}
+
+// Fills `range` with the integers between `lo` and `hi`, which are Qundef
+// when unbounded, clamped to the values of `type`
+static void integer_range(const struct column *column, VALUE lo, bool lo_exclusive, VALUE hi, bool hi_exclusive, struct column_range *range)
+{
+    int bits = (int)column_types[column->type].size * 8;
+    bool is_signed = column_signed_p(column);
+    VALUE min = is_signed ? LL2NUM(bits == 64 ? INT64_MIN : -(INT64_C(1) << (bits - 1))) : INT2FIX(0);
+    VALUE max = is_signed ? LL2NUM(bits == 64 ? INT64_MAX : (INT64_C(1) << (bits - 1)) - 1)
+                          : ULL2NUM(bits == 64 ? UINT64_MAX : (UINT64_C(1) << bits) - 1);
+
+    lo = lo == Qundef ? min : integer_lower_bound(lo, lo_exclusive);
+    hi = hi == Qundef ? max : integer_upper_bound(hi, hi_exclusive);
+    if (NIL_P(lo) || NIL_P(hi) || RTEST(rb_funcall(lo, '>', 1, hi)) ||
+        RTEST(rb_funcall(lo, '>', 1, max)) || RTEST(rb_funcall(hi, '<', 1, min))) {
+        range->empty = true;
+        return;
+    }
+    if (RTEST(rb_funcall(lo, '<', 1, min))) {
+        lo = min;
+    }
+    if (RTEST(rb_funcall(hi, '>', 1, max))) {
+        hi = max;
+    }
+
+    if (is_signed) {
+        range->lo.i = NUM2LL(lo);
+        range->hi.i = NUM2LL(hi);
+    } else {
+        range->lo.u = NUM2ULL(lo);
+        range->hi.u = NUM2ULL(hi);
+    }
+}
+
+// Fills `range` with the numbers between `lo` and `hi`, which are Qundef
+// when unbounded, rounded inwards to floats for float columns
+static void floating_range(const struct column *column, VALUE lo, bool lo_exclusive, VALUE hi, bool hi_exclusive, struct column_range *range)
+{
+    double dlo = lo == Qundef ? -INFINITY : NUM2DBL(lo);
+    double dhi = hi == Qundef ? INFINITY : NUM2DBL(hi);
+    if ((lo_exclusive && dlo == INFINITY) || (hi_exclusive && dhi == -INFINITY)) {
+        range->empty = true;
+        return;
+    }
+    if (lo_exclusive) {
+        dlo = nextafter(dlo, INFINITY);
+    }
+    if (hi_exclusive) {
+        dhi = nextafter(dhi, -INFINITY);
+    }
+    if (!(dlo <= dhi)) {
+        range->empty = true;
+        return;
+    }
+
+    if (column->type == COLUMN_FLOAT) {
+        float flo = (float)dlo;
+        float fhi = (float)dhi;
+        if (flo < dlo) {
+            flo = nextafterf(flo, INFINITY);
+        }
+        if (fhi > dhi) {
+            fhi = nextafterf(fhi, -INFINITY);
+        }
+        if (!(flo <= fhi)) {
+            range->empty = true;
+            return;
+        }
+        range->lo.f = flo;
+        range->hi.f = fhi;
+    } else {
+        range->lo.d = dlo;
+        range->hi.d = dhi;
+    }
+}
+
+static void column_range_get(const struct column *column, VALUE op, VALUE value, struct column_range *range)
+{
+    ID id = SYMBOL_P(op) ? SYM2ID(op) : 0;
+    VALUE lo = Qundef, hi = Qundef;
+    bool lo_exclusive = false, hi_exclusive = false;
+
+    if (id == id_eq || id == id_neq) {
+        lo = hi = value;
+        range->negate = id == id_neq;
+    } else if (id == id_lt || id == id_lte) {
+        hi = value;
+        hi_exclusive = id == id_lt;
+    } else if (id == id_gt || id == id_gte) {
+        lo = value;
+        lo_exclusive = id == id_gt;
+    } else if (id == id_between) {
+        VALUE begin, end;
+        int exclusive;
+        if (!rb_range_values(value, &begin, &end, &exclusive)) {
+            rb_raise(rb_eTypeError, "wrong argument type %s (expected Range)", rb_obj_classname(value));
+        }
+        lo = NIL_P(begin) ? Qundef : begin;
+        hi = NIL_P(end) ? Qundef : end;
+        hi_exclusive = exclusive && !NIL_P(end);
+    } else {
+        rb_raise(rb_eArgError, "unknown operator %+"PRIsVALUE", expected :==, :!=, :<, :<=, :>, :>= or :between", op);
+    }
+
+    if (column_floating_p(column)) {
+        floating_range(column, lo, lo_exclusive, hi, hi_exclusive, range);
+    } else {
+        integer_range(column, lo, lo_exclusive, hi, hi_exclusive, range);
+    }
+}
+
+// Sets bit `row % 64` of `words[row / 64]` to whether the value of `row` is
+// in `range`, for every row from `start`, a multiple of 64, to `end`
+typedef void column_scan_func(const char *data, size_t start, size_t end, const struct column_range *range, uint64_t *words);
+
+#define DEFINE_COLUMN_SCAN(name, type, field)                                       \
+    static void name(const char *data, size_t start, size_t end,                    \
+                     const struct column_range *range, uint64_t *words)             \
+    {                                                                               \
+        type lo = (type)range->lo.field;                                            \
+        type hi = (type)range->hi.field;                                            \
+        for (size_t row = start; row < end; row += 64) {                            \
+            size_t count = end - row < 64 ? end - row : 64;                         \
+            uint64_t word = 0;                                                      \
+            for (size_t j = 0; j < count; j++) {                                    \
+                type v;                                                             \
+                memcpy(&v, data + (row + j) * sizeof(type), sizeof(type));          \
+                word |= (uint64_t)(v >= lo && v <= hi) << j;                        \
+            }                                                                       \
+            words[row / 64] = word;                                                 \
+        }                                                                           \
+    }
+
+DEFINE_COLUMN_SCAN(scan_int8, int8_t, i)
+DEFINE_COLUMN_SCAN(scan_uint8, uint8_t, u)
+DEFINE_COLUMN_SCAN(scan_int16, int16_t, i)
+DEFINE_COLUMN_SCAN(scan_uint16, uint16_t, u)
+DEFINE_COLUMN_SCAN(scan_int32, int32_t, i)
+DEFINE_COLUMN_SCAN(scan_uint32, uint32_t, u)
+DEFINE_COLUMN_SCAN(scan_int64, int64_t, i)
+DEFINE_COLUMN_SCAN(scan_uint64, uint64_t, u)
+DEFINE_COLUMN_SCAN(scan_float, float, f)
+DEFINE_COLUMN_SCAN(scan_double, double, d)
+
+static column_scan_func *const column_scanners[] = {
+    [COLUMN_INT8] = scan_int8,
+    [COLUMN_UINT8] = scan_uint8,
+    [COLUMN_INT16] = scan_int16,
+    [COLUMN_UINT16] = scan_uint16,
+    [COLUMN_INT32] = scan_int32,
+    [COLUMN_UINT32] = scan_uint32,
+    [COLUMN_INT64] = scan_int64,
+    [COLUMN_UINT64] = scan_uint64,
+    [COLUMN_FLOAT] = scan_float,
+    [COLUMN_DOUBLE] = scan_double,
+};
+
+#ifdef COLUMN_AVX2
+// AVX2 scans of 64 rows at a time, which return the row they stopped at.
+// Integers are compared as signed, after flipping the sign bit of unsigned
+// ones with `bias`.
+
+__attribute__((target("avx2")))
+static inline size_t scan_32_avx2(const char *data, size_t start, size_t end, int32_t lo, int32_t hi, int32_t bias, uint64_t *words)
+{
+    __m256i vbias = _mm256_set1_epi32(bias);
+    __m256i vlo = _mm256_set1_epi32(lo ^ bias);
+    __m256i vhi = _mm256_set1_epi32(hi ^ bias);
+
+    size_t row = start;
+    for (; row + 64 <= end; row += 64) {
+        const __m256i *p = (const __m256i *)(data + row * 4);
+        uint64_t word = 0;
+        for (int k = 0; k < 8; k++) {
+            __m256i v = _mm256_xor_si256(_mm256_loadu_si256(p + k), vbias);
+            __m256i outside = _mm256_or_si256(_mm256_cmpgt_epi32(vlo, v), _mm256_cmpgt_epi32(v, vhi));
+            word |= (uint64_t)(uint8_t)~_mm256_movemask_ps(_mm256_castsi256_ps(outside)) << (k * 8);
+        }
+        words[row / 64] = word;
+    }
+    return row;
+}
+
+__attribute__((target("avx2")))
+static inline size_t scan_64_avx2(const char *data, size_t start, size_t end, int64_t lo, int64_t hi, int64_t bias, uint64_t *words)
+{
+    __m256i vbias = _mm256_set1_epi64x(bias);
+    __m256i vlo = _mm256_set1_epi64x(lo ^ bias);
+    __m256i vhi = _mm256_set1_epi64x(hi ^ bias);
+
+    size_t row = start;
+    for (; row + 64 <= end; row += 64) {
+        const __m256i *p = (const __m256i *)(data + row * 8);
+        uint64_t word = 0;
+        for (int k = 0; k < 16; k++) {
+            __m256i v = _mm256_xor_si256(_mm256_loadu_si256(p + k), vbias);
+            __m256i outside = _mm256_or_si256(_mm256_cmpgt_epi64(vlo, v), _mm256_cmpgt_epi64(v, vhi));
+            word |= (uint64_t)(~_mm256_movemask_pd(_mm256_castsi256_pd(outside)) & 0xF) << (k * 4);
+        }
+        words[row / 64] = word;
+    }
+    return row;
+}
+
+__attribute__((target("avx2")))
+static void scan_int32_avx2(const char *data, size_t start, size_t end, const struct column_range *range, uint64_t *words)
+{
+    size_t row = scan_32_avx2(data, start, end, (int32_t)range->lo.i, (int32_t)range->hi.i, 0, words);
+    scan_int32(data, row, end, range, words);
+}
+
+__attribute__((target("avx2")))
+static void scan_uint32_avx2(const char *data, size_t start, size_t end, const struct column_range *range, uint64_t *words)
+{
+    size_t row = scan_32_avx2(data, start, end, (int32_t)(uint32_t)range->lo.u, (int32_t)(uint32_t)range->hi.u, INT32_MIN, words);
+    scan_uint32(data, row, end, range, words);
+}
+
+__attribute__((target("avx2")))
+static void scan_int64_avx2(const char *data, size_t start, size_t end, const struct column_range *range, uint64_t *words)
+{
+    size_t row = scan_64_avx2(data, start, end, range->lo.i, range->hi.i, 0, words);
+    scan_int64(data, row, end, range, words);
+}
+
+__attribute__((target("avx2")))
+static void scan_uint64_avx2(const char *data, size_t start, size_t end, const struct column_range *range, uint64_t *words)
+{
+    size_t row = scan_64_avx2(data, start, end, (int64_t)range->lo.u, (int64_t)range->hi.u, INT64_MIN, words);
+    scan_uint64(data, row, end, range, words);
+}
+
+__attribute__((target("avx2")))
+static void scan_float_avx2(const char *data, size_t start, size_t end, const struct column_range *range, uint64_t *words)
+{
+    __m256 vlo = _mm256_set1_ps(range->lo.f);
+    __m256 vhi = _mm256_set1_ps(range->hi.f);
+
+    size_t row = start;
+    for (; row + 64 <= end; row += 64) {
+        const float *p = (const float *)(data + row * 4);
+        uint64_t word = 0;
+        for (int k = 0; k < 8; k++) {
+            __m256 v = _mm256_loadu_ps(p + k * 8);
+            __m256 inside = _mm256_and_ps(_mm256_cmp_ps(v, vlo, _CMP_GE_OQ), _mm256_cmp_ps(v, vhi, _CMP_LE_OQ));
+            word |= (uint64_t)(uint8_t)_mm256_movemask_ps(inside) << (k * 8);
+        }
+        words[row / 64] = word;
+    }
+    scan_float(data, row, end, range, words);
+}
+
+__attribute__((target("avx2")))
+static void scan_double_avx2(const char *data, size_t start, size_t end, const struct column_range *range, uint64_t *words)
+{
+    __m256d vlo = _mm256_set1_pd(range->lo.d);
+    __m256d vhi = _mm256_set1_pd(range->hi.d);
+
+    size_t row = start;
+    for (; row + 64 <= end; row += 64) {
+        const double *p = (const double *)(data + row * 8);
+        uint64_t word = 0;
+        for (int k = 0; k < 16; k++) {
+            __m256d v = _mm256_loadu_pd(p + k * 4);
+            __m256d inside = _mm256_and_pd(_mm256_cmp_pd(v, vlo, _CMP_GE_OQ), _mm256_cmp_pd(v, vhi, _CMP_LE_OQ));
+            word |= (uint64_t)_mm256_movemask_pd(inside) << (k * 4);
+        }
+        words[row / 64] = word;
+    }
+    scan_double(data, row, end, range, words);
+}
+#endif
+
+static column_scan_func *column_scanner(column_type type)
+{
+#ifdef COLUMN_AVX2
+    if (croaring_hardware_support() & COLUMN_SUPPORTS_AVX2) {
+        switch (type) {
+        case COLUMN_INT32: return scan_int32_avx2;
+        case COLUMN_UINT32: return scan_uint32_avx2;
+        case COLUMN_INT64: return scan_int64_avx2;
+        case COLUMN_UINT64: return scan_uint64_avx2;
+        case COLUMN_FLOAT: return scan_float_avx2;
+        case COLUMN_DOUBLE: return scan_double_avx2;
+        default: break;
+        }
+    }
+#endif
+    return column_scanners[type];
+}
+
+struct where_args {
+    struct column column;
+    struct column_range range;
+    column_scan_func *scan;
+
+    // One bit per row
+    uint64_t *words;
+};
+
+static void where_chunk_task(void *ptr, size_t chunk)
+{
+    struct where_args *args = ptr;
+    size_t start = chunk * COLUMN_CHUNK_ROWS;
+    size_t end = start + COLUMN_CHUNK_ROWS < args->column.rows ? start + COLUMN_CHUNK_ROWS : args->column.rows;
+
+    args->scan(args->column.data, start, end, &args->range, args->words);
+
+    if (args->range.negate) {
+        for (size_t w = start / 64; w < (end + 63) / 64; w++) {
+            args->words[w] = ~args->words[w];
+        }
+        if (end % 64) {
+            args->words[end / 64] &= (UINT64_C(1) << (end % 64)) - 1;
+        }
+    }
+}
+
+static void *where_nogvl(void *ptr)
+{
+    struct where_args *args = ptr;
+    size_t chunks = (args->column.rows + COLUMN_CHUNK_ROWS - 1) / COLUMN_CHUNK_ROWS;
+    rb_roaring_parallel_for(chunks, where_chunk_task, args);
+    return NULL;
+}
+
+// Finds the rows of a packed column whose value matches a comparison, using
+// up to {Roaring.parallelism} threads and AVX2 where the CPU supports it.
+// Rows are compared straight into the bitset and array containers of the
+// result, without going through a list of matching rows.
+//
+// NaN matches no comparison but `:!=`, like in Ruby.
+// @example
+//   prices = [9.5, 120.0, 42.0].pack("d*")
+//   Roaring::Bitmap32.where(prices, :<, 50, type: :double) # => #<Roaring::Bitmap32 {0, 2}>
+//   Roaring::Bitmap32.where(prices, :between, 10...100, type: :double) # => #<Roaring::Bitmap32 {2}>
+// @param column [String] one number per row, in native byte order
+// @param op [Symbol] `:==`, `:!=`, `:<`, `:<=`, `:>`, `:>=`, or `:between`
+//   to match a Range of values
+// @param value [Numeric, Range]
+// @param type [Symbol] the type of the numbers, see {.group_column}
+// @return [Bitmap32] the rows whose value matches
+static VALUE rb_roaring_column_s_where(int argc, VALUE *argv, VALUE klass)
+{
+    VALUE str, op, value, opts;
+    rb_scan_args(argc, argv, "3:", &str, &op, &value, &opts);
+
+    struct where_args args = { 0 };
+    column_get(&str, column_type_opt(opts), &args.column);
+    column_range_get(&args.column, op, value, &args.range);
+
+    if (args.range.empty || args.column.rows == 0) {
+        roaring_bitmap_t *bitmap = roaring_bitmap_create();
+        if (args.range.negate && args.column.rows > 0) {
+            roaring_bitmap_add_range_closed(bitmap, 0, (uint32_t)(args.column.rows - 1));
+        }
+        return rb_roaring32_wrap(bitmap);
+    }
+
+    bitset_t *bitset = bitset_create_with_capacity(args.column.rows);
+    if (!bitset) {
+        rb_raise(rb_eNoMemError, "failed to allocate bitset");
+    }
+    args.scan = column_scanner(args.column.type);
+    args.words = bitset->array;
+    rb_thread_call_without_gvl(where_nogvl, &args, NULL, NULL);
+    RB_GC_GUARD(str);
+
+    roaring_bitmap_t *bitmap = rb_roaring_bitset_to_bitmap(bitset);
+    bitset_free(bitset);
+    if (!bitmap) {
+        rb_raise(rb_eNoMemError, "failed to allocate bitmap");
+    }
+    return rb_roaring32_wrap(bitmap);
+}
+
+// Rows are read from bitmaps this many at a time
+#define GATHER_BATCH 256
+
+struct gather_args {
+    roaring_bitmap_t bitmap;
+    struct column column;
+
+    // The values of the rows, packed, for gather
+    char *out;
+
+    // The sum of the values for gather_sum: a two's complement 128-bit
+    // integer for integer columns, or a compensated double for floats
+    uint64_t sum_lo;
+    uint64_t sum_hi;
+    double sum;
+    double compensation;
+
+    // The smallest and largest values for gather_minmax, and whether any
+    // value was found
+    bool found;
+    union {
+        int64_t i;
+        uint64_t u;
+        double d;
+    } min, max;
+};
+
+// Returns the number of rows in `self`, after checking that they're all in
+// `column`
+static uint64_t gather_check_rows(VALUE self, const struct column *column)
+{
+    const roaring_bitmap_t *bitmap = rb_roaring32_lock(self);
+    uint64_t cardinality = roaring_bitmap_get_cardinality(bitmap);
+    uint32_t max = roaring_bitmap_maximum(bitmap);
+    rb_roaring32_unlock(self);
+
+    if (cardinality > 0 && max >= column->rows) {
+        rb_raise(rb_eIndexError, "row %u is past the end of the column (%zu rows)", max, column->rows);
+    }
+    return cardinality;
+}
+
+#define GATHER_COPY(type)                                                   \
+    for (uint32_t k = 0; k < count; k++) {                                  \
+        type v;                                                             \
+        memcpy(&v, data + (size_t)rows[k] * sizeof(type), sizeof(type));   \
+        memcpy(out + (size_t)k * sizeof(type), &v, sizeof(type));           \
+    }
+
+static void *gather_nogvl(void *ptr)
+{
+    struct gather_args *args = ptr;
+    const char *data = args->column.data;
+    size_t size = column_types[args->column.type].size;
+    char *out = args->out;
+
+    roaring_uint32_iterator_t it;
+    roaring_iterator_init(&args->bitmap, &it);
+    uint32_t rows[GATHER_BATCH];
+    uint32_t count;
+    while ((count = roaring_uint32_iterator_read(&it, rows, GATHER_BATCH)) > 0) {
+        switch (size) {
+        case 1: GATHER_COPY(uint8_t); break;
+        case 2: GATHER_COPY(uint16_t); break;
+        case 4: GATHER_COPY(uint32_t); break;
+        default: GATHER_COPY(uint64_t); break;
+        }
+        out += (size_t)count * size;
+    }
+    return NULL;
+}
+
+// Adds an integer, sign-extended to 64 bits, to a 128-bit sum
+static inline void gather_add(struct gather_args *args, uint64_t value, bool negative)
+{
+    args->sum_lo += value;
+    args->sum_hi += (args->sum_lo < value) - (uint64_t)negative;
+}
+
+// Adds a double with Kahan-Babuska summation, like Array#sum, which also
+// decides how NaN and infinities combine
+static inline void gather_add_float(struct gather_args *args, double value)
+{
+    if (isnan(args->sum)) {
+        return;
+    } else if (isnan(value)) {
+        args->sum = value;
+        return;
+    } else if (isinf(value)) {
+        if (isinf(args->sum) && signbit(value) != signbit(args->sum)) {
+            args->sum = NAN;
+        } else {
+            args->sum = value;
+        }
+        return;
+    } else if (isinf(args->sum)) {
+        return;
+    }
+
+    double t = args->sum + value;
+    if (fabs(args->sum) >= fabs(value)) {
+        args->compensation += (args->sum - t) + value;
+    } else {
+        args->compensation += (value - t) + args->sum;
+    }
+    args->sum = t;
+}
+
+static void gather_add_min_max(struct gather_args *args, const struct column *column, size_t row)
+{
+    if (column_floating_p(column)) {
+        double v = column_float(column, row);
+        if (isnan(v)) {
+            return;
+        }
+        if (!args->found || v < args->min.d) args->min.d = v;
+        if (!args->found || v > args->max.d) args->max.d = v;
+    } else if (column_signed_p(column)) {
+        int64_t v = (int64_t)column_integer(column, row);
+        if (!args->found || v < args->min.i) args->min.i = v;
+        if (!args->found || v > args->max.i) args->max.i = v;
+    } else {
+        uint64_t v = column_integer(column, row);
+        if (!args->found || v < args->min.u) args->min.u = v;
+        if (!args->found || v > args->max.u) args->max.u = v;
+    }
+    args->found = true;
+}
+
+#define GATHER_SUM(type, add)                                               \
+    for (uint32_t k = 0; k < count; k++) {                                  \
+        type v;                                                             \
+        memcpy(&v, data + (size_t)rows[k] * sizeof(type), sizeof(type));   \
+        add;                                                                \
+    }
+
+static void *gather_sum_nogvl(void *ptr)
+{
+    struct gather_args *args = ptr;
+    const char *data = args->column.data;
+
+    roaring_uint32_iterator_t it;
+    roaring_iterator_init(&args->bitmap, &it);
+    uint32_t rows[GATHER_BATCH];
+    uint32_t count;
+    while ((count = roaring_uint32_iterator_read(&it, rows, GATHER_BATCH)) > 0) {
+        switch (args->column.type) {
+        case COLUMN_INT8: GATHER_SUM(int8_t, gather_add(args, (uint64_t)(int64_t)v, v < 0)); break;
+        case COLUMN_UINT8: GATHER_SUM(uint8_t, gather_add(args, v, false)); break;
+        case COLUMN_INT16: GATHER_SUM(int16_t, gather_add(args, (uint64_t)(int64_t)v, v < 0)); break;
+        case COLUMN_UINT16: GATHER_SUM(uint16_t, gather_add(args, v, false)); break;
+        case COLUMN_INT32: GATHER_SUM(int32_t, gather_add(args, (uint64_t)(int64_t)v, v < 0)); break;
+        case COLUMN_UINT32: GATHER_SUM(uint32_t, gather_add(args, v, false)); break;
+        case COLUMN_INT64: GATHER_SUM(int64_t, gather_add(args, (uint64_t)v, v < 0)); break;
+        case COLUMN_UINT64: GATHER_SUM(uint64_t, gather_add(args, v, false)); break;
+        case COLUMN_FLOAT: GATHER_SUM(float, gather_add_float(args, v)); break;
+        case COLUMN_DOUBLE: GATHER_SUM(double, gather_add_float(args, v)); break;
+        }
+    }
+    return NULL;
+}
+
+static void *gather_minmax_nogvl(void *ptr)
+{
+    struct gather_args *args = ptr;
+
+    roaring_uint32_iterator_t it;
+    roaring_iterator_init(&args->bitmap, &it);
+    uint32_t rows[GATHER_BATCH];
+    uint32_t count;
+    while ((count = roaring_uint32_iterator_read(&it, rows, GATHER_BATCH)) > 0) {
+        for (uint32_t k = 0; k < count; k++) {
+            gather_add_min_max(args, &args->column, rows[k]);
+        }
+    }
+    return NULL;
+}
+
+struct gather {
+    VALUE self;
+    VALUE into;
+    bool locked;
+    struct gather_args *args;
+    void *(*func)(void *);
+};
+
+static VALUE gather_call(VALUE ptr)
+{
+    struct gather *g = (struct gather *)ptr;
+    g->args->bitmap = rb_roaring32_view(rb_roaring32_lock(g->self));
+    g->locked = true;
+    rb_thread_call_without_gvl(g->func, g->args, NULL, NULL);
+    return Qnil;
+}
+
+static VALUE gather_cleanup(VALUE ptr)
+{
+    struct gather *g = (struct gather *)ptr;
+    if (g->locked) {
+        rb_roaring32_unlock(g->self);
+    }
+    if (RB_TYPE_P(g->into, T_STRING)) {
+        rb_str_unlocktmp(g->into);
+    }
+#ifdef HAVE_RB_IO_BUFFER_GET_BYTES_FOR_WRITING
+    else if (!NIL_P(g->into)) {
+        rb_io_buffer_unlock(g->into);
+    }
+#endif
+    return Qnil;
+}
+
+// Locks `self` and calls `func` without the GVL, then unlocks `self` and
+// `into`, the String or IO::Buffer the caller locked for `func` to write to,
+// even if that raises
+static void gather_run(VALUE self, struct gather_args *args, void *(*func)(void *), VALUE into)
+{
+    struct gather g = {
+        .self = self,
+        .into = into,
+        .args = args,
+        .func = func,
+    };
+    rb_ensure(gather_call, (VALUE)&g, gather_cleanup, (VALUE)&g);
+}
+
+// Collects the values of a packed column at the rows in the bitmap, in
+// order, without building an Array.
+// @example
+//   prices = [9.5, 120.0, 42.0].pack("d*")
+//   Roaring::Bitmap32[0, 2].gather(prices, type: :double).unpack("d*") # => [9.5, 42.0]
+// @param column [String] one number per row, in native byte order
+// @param type [Symbol] the type of the numbers, see {.group_column}
+// @param into [String, IO::Buffer, nil] where to write the values: appended
+//   to a String, or at the start of an IO::Buffer
+// @return [String, IO::Buffer] the values, packed like `column`
+// @raise [IndexError] if the bitmap has rows past the end of the column
+static VALUE rb_roaring_column_gather(int argc, VALUE *argv, VALUE self)
+{
+    VALUE str, opts;
+    rb_scan_args(argc, argv, "1:", &str, &opts);
+
+    ID keys[2] = { rb_intern("type"), rb_intern("into") };
+    VALUE values[2];
+    rb_get_kwargs(opts, keys, 1, 1, values);
+    VALUE into = values[1] == Qundef ? Qnil : values[1];
+
+    struct gather_args args = { 0 };
+    column_get(&str, column_type_get(values[0]), &args.column);
+    size_t length = gather_check_rows(self, &args.column) * column_types[args.column.type].size;
+
+    if (NIL_P(into) || RB_TYPE_P(into, T_STRING)) {
+        VALUE result = NIL_P(into) ? rb_str_buf_new(length) : into;
+        long offset = RSTRING_LEN(result);
+        rb_str_modify_expand(result, length);
+        rb_str_locktmp(result);
+        args.out = RSTRING_PTR(result) + offset;
+        gather_run(self, &args, gather_nogvl, result);
+        rb_str_set_len(result, offset + length);
+        RB_GC_GUARD(str);
+        return result;
+    }
+
+#ifdef HAVE_RB_IO_BUFFER_GET_BYTES_FOR_WRITING
+    if (rb_obj_is_kind_of(into, rb_cIOBuffer)) {
+        void *base;
+        size_t size;
+        rb_io_buffer_get_bytes_for_writing(into, &base, &size);
+        if (size < length) {
+            rb_raise(rb_eArgError, "buffer of %zu bytes is too small for %zu bytes", size, length);
+        }
+        rb_io_buffer_lock(into);
+        args.out = base;
+        gather_run(self, &args, gather_nogvl, into);
+        RB_GC_GUARD(str);
+        return into;
+    }
+#endif
+
+    rb_raise(rb_eTypeError, "wrong argument type %s (expected String or IO::Buffer)", rb_obj_classname(into));
+}
+
+// Sums the values of a packed column at the rows in the bitmap. Integers
+// are summed exactly, and floats with Kahan-Babuska summation like
+// Array#sum.
+// @example
+//   prices = [9.5, 120.0, 42.0].pack("d*")
+//   Roaring::Bitmap32[0, 2].gather_sum(prices, type: :double) # => 51.5
+// @param column [String] one number per row, in native byte order
+// @param type [Symbol] the type of the numbers, see {.group_column}
+// @return [Integer, Float]
+// @raise [IndexError] if the bitmap has rows past the end of the column
+static VALUE rb_roaring_column_gather_sum(int argc, VALUE *argv, VALUE self)
+{
+    VALUE str, opts;
+    rb_scan_args(argc, argv, "1:", &str, &opts);
+
+    struct gather_args args = { 0 };
+    column_get(&str, column_type_opt(opts), &args.column);
+    gather_check_rows(self, &args.column);
+    gather_run(self, &args, gather_sum_nogvl, Qnil);
+    RB_GC_GUARD(str);
+
+    if (column_floating_p(&args.column)) {
+        return DBL2NUM(args.sum + args.compensation);
+    }
+    uint64_t words[2] = { args.sum_lo, args.sum_hi };
+    int flags = INTEGER_PACK_LSWORD_FIRST | INTEGER_PACK_NATIVE_BYTE_ORDER;
+    if (column_signed_p(&args.column)) {
+        flags |= INTEGER_PACK_2COMP;
+    }
+    return rb_integer_unpack(words, 2, sizeof(uint64_t), 0, flags);
+}
+
+// Finds the smallest and largest values of a packed column at the rows in
+// the bitmap, leaving out NaN
+// @example
+//   prices = [9.5, 120.0, 42.0].pack("d*")
+//   Roaring::Bitmap32[1, 2].gather_minmax(prices, type: :double) # => [42.0, 120.0]
+// @param column [String] one number per row, in native byte order
+// @param type [Symbol] the type of the numbers, see {.group_column}
+// @return [Array(Numeric, Numeric), Array(nil, nil)] like Enumerable#minmax
+// @raise [IndexError] if the bitmap has rows past the end of the column
+static VALUE rb_roaring_column_gather_minmax(int argc, VALUE *argv, VALUE self)
+{
+    VALUE str, opts;
+    rb_scan_args(argc, argv, "1:", &str, &opts);
+
+    struct gather_args args = { 0 };
+    column_get(&str, column_type_opt(opts), &args.column);
+    gather_check_rows(self, &args.column);
+    gather_run(self, &args, gather_minmax_nogvl, Qnil);
+    RB_GC_GUARD(str);
+
+    if (!args.found) {
+        return rb_assoc_new(Qnil, Qnil);
+    } else if (column_floating_p(&args.column)) {
+        return rb_assoc_new(DBL2NUM(args.min.d), DBL2NUM(args.max.d));
+    } else if (column_signed_p(&args.column)) {
+        return rb_assoc_new(LL2NUM(args.min.i), LL2NUM(args.max.i));
+    }
+    return rb_assoc_new(ULL2NUM(args.min.u), ULL2NUM(args.max.u));
+}
+
+void
+rb_roaring_column_init(void)
+{
+  id_eq = rb_intern("==");
+  id_neq = rb_intern("!=");
+  id_lt = rb_intern("<");
+  id_lte = rb_intern("<=");
+  id_gt = rb_intern(">");
+  id_gte = rb_intern(">=");
+  id_between = rb_intern("between");
+  id_floor = rb_intern("floor");
+  id_ceil = rb_intern("ceil");
+
+  VALUE cRoaringBitmap32 = rb_const_get(rb_mRoaring, rb_intern("Bitmap32"));
+  rb_define_singleton_method(cRoaringBitmap32, "group_column", rb_roaring_column_s_group_column, -1);
+  rb_define_singleton_method(cRoaringBitmap32, "where", rb_roaring_column_s_where, -1);
+  rb_define_method(cRoaringBitmap32, "gather", rb_roaring_column_gather, -1);
+  rb_define_method(cRoaringBitmap32, "gather_sum", rb_roaring_column_gather_sum, -1);
+  rb_define_method(cRoaringBitmap32, "gather_minmax", rb_roaring_column_gather_minmax, -1);
+}
@@ -0,0 +1,321 @@
+#include "roaring_ruby.h"
+
+#include <string.h>
+
+#ifdef HAVE_SYS_MMAN_H
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+static VALUE cRoaringDictionary;
+
+typedef struct {
+    rb_roaring_strtab_t strings;
+
+    // The file mapped by Dictionary.mmap, which `strings` points into. Such
+    // dictionaries are frozen.
+    void *map;
+    size_t map_len;
+} rb_roaring_dictionary_t;
+
+static void rb_roaring_dictionary_free(void *data)
+{
+    rb_roaring_dictionary_t *dictionary = data;
+#ifdef HAVE_SYS_MMAN_H
+    if (dictionary->map) {
+        munmap(dictionary->map, dictionary->map_len);
+    } else
+#endif
+    {
+        rb_roaring_strtab_free(&dictionary->strings);
+    }
+    xfree(dictionary);
+}
+
+static size_t rb_roaring_dictionary_memsize(const void *data)
+{
+    const rb_roaring_dictionary_t *dictionary = data;
+    if (dictionary->map) {
+        return sizeof(rb_roaring_dictionary_t);
+    }
+    return sizeof(rb_roaring_dictionary_t) + rb_roaring_strtab_memsize(&dictionary->strings);
+}
+
+static const rb_data_type_t dictionary_type = {
+    .wrap_struct_name = "roaring/dictionary",
+    .function = {
+        .dfree = rb_roaring_dictionary_free,
+        .dsize = rb_roaring_dictionary_memsize
+    },
+#ifdef HAVE_RB_EXT_RACTOR_SAFE
+    .flags = RUBY_TYPED_FREE_IMMEDIATELY | RUBY_TYPED_FROZEN_SHAREABLE,
+#else
+    .flags = RUBY_TYPED_FREE_IMMEDIATELY,
+#endif
+};
+
+static VALUE rb_roaring_dictionary_alloc(VALUE klass)
+{
+    rb_roaring_dictionary_t *dictionary;
+    VALUE obj = TypedData_Make_Struct(klass, rb_roaring_dictionary_t, &dictionary_type, dictionary);
+    rb_roaring_strtab_init(&dictionary->strings);
+    return obj;
+}
+
+static rb_roaring_strtab_t *get_strings(VALUE obj)
+{
+    rb_roaring_dictionary_t *dictionary;
+    TypedData_Get_Struct(obj, rb_roaring_dictionary_t, &dictionary_type, dictionary);
+    return &dictionary->strings;
+}
+
+// Returns the id of `str`, adding it unless the dictionary is frozen
+static uint32_t dictionary_intern(VALUE self, rb_roaring_strtab_t *strings, VALUE str)
+{
+    StringValue(str);
+    uint32_t id = rb_roaring_strtab_find(strings, RSTRING_PTR(str), RSTRING_LEN(str));
+    if (id == UINT32_MAX) {
+        rb_check_frozen(self);
+        id = rb_roaring_strtab_intern(strings, RSTRING_PTR(str), RSTRING_LEN(str));
+    }
+    return id;
+}
+
+static VALUE rb_roaring_dictionary_initialize_copy(VALUE self, VALUE other)
+{
+    rb_check_frozen(self);
+    rb_roaring_strtab_t *strings = get_strings(self);
+    const rb_roaring_strtab_t *source = get_strings(other);
+    if (strings == source) {
+        return self;
+    }
+
+    rb_roaring_strtab_t copy;
+    rb_roaring_strtab_copy(&copy, source);
+    rb_roaring_strtab_free(strings);
+    *strings = copy;
+    return self;
+}
+
+// Returns the id of a string, adding it to the dictionary if needed
+// @param str [String]
+// @return [Integer]
+static VALUE rb_roaring_dictionary_intern(VALUE self, VALUE str)
+{
+    return UINT2NUM(dictionary_intern(self, get_strings(self), str));
+}
+
+// @param str [String]
+// @return [Integer, nil] the id of a string, or nil if it isn't in the dictionary
+static VALUE rb_roaring_dictionary_id(VALUE self, VALUE str)
+{
+    StringValue(str);
+    uint32_t id = rb_roaring_strtab_find(get_strings(self), RSTRING_PTR(str), RSTRING_LEN(str));
+    return id == UINT32_MAX ? Qnil : UINT2NUM(id);
+}
+
+// @param id [Integer]
+// @return [String, nil] the string with the given id, or nil if there's none
+static VALUE rb_roaring_dictionary_string(VALUE self, VALUE id)
+{
+    const rb_roaring_strtab_t *strings = get_strings(self);
+    if (!RB_INTEGER_TYPE_P(id)) {
+        rb_raise(rb_eTypeError, "wrong argument type %s (expected Integer)", rb_obj_classname(id));
+    }
+    if (!FIXNUM_P(id) || FIX2LONG(id) < 0 || (unsigned long)FIX2LONG(id) >= strings->count) {
+        return Qnil;
+    }
+    return rb_roaring_strtab_str(strings, (uint32_t)FIX2LONG(id));
+}
+
+// @return [Integer] the number of strings in the dictionary
+static VALUE rb_roaring_dictionary_size(VALUE self)
+{
+    return UINT2NUM(get_strings(self)->count);
+}
+
+// Iterates over the strings in the dictionary, in the order of their ids
+// @return [self]
+static VALUE rb_roaring_dictionary_each(VALUE self)
+{
+    RETURN_SIZED_ENUMERATOR(self, 0, 0, rb_roaring_dictionary_size);
+
+    // The dictionary may grow while iterating, but ids never change
+    for (uint32_t i = 0; i < get_strings(self)->count; i++) {
+        rb_yield(rb_roaring_strtab_str(get_strings(self), i));
+    }
+    return self;
+}
+
+// Converts strings to a bitmap of their ids, adding the strings missing
+// from the dictionary
+// @param strings [Array<String>]
+// @return [Bitmap32]
+static VALUE rb_roaring_dictionary_encode(VALUE self, VALUE strings)
+{
+    rb_roaring_strtab_t *table = get_strings(self);
+    Check_Type(strings, T_ARRAY);
+
+    long len = RARRAY_LEN(strings);
+    VALUE buf_v;
+    uint32_t *ids = ALLOCV_N(uint32_t, buf_v, len);
+    for (long i = 0; i < len; i++) {
+        ids[i] = dictionary_intern(self, table, RARRAY_AREF(strings, i));
+    }
+
+    roaring_bitmap_t *bitmap = roaring_bitmap_create();
+    if (bitmap) {
+        roaring_bitmap_add_many(bitmap, len, ids);
+    }
+    ALLOCV_END(buf_v);
+
+    RB_GC_GUARD(strings);
+    return rb_roaring32_wrap(bitmap);
+}
+
+// Converts a bitmap of ids back to their strings, in the order of their ids
+// @param bitmap [Bitmap32]
+// @return [Array<String>]
+static VALUE rb_roaring_dictionary_decode(VALUE self, VALUE bitmap)
+{
+    const rb_roaring_strtab_t *strings = get_strings(self);
+    if (!rb_roaring32_bitmap_p(bitmap)) {
+        rb_raise(rb_eTypeError, "wrong argument type %s (expected Roaring::Bitmap32)", rb_obj_classname(bitmap));
+    }
+
+    const roaring_bitmap_t *data = rb_roaring32_lock(bitmap);
+    uint64_t cardinality = roaring_bitmap_get_cardinality(data);
+    bool valid = cardinality == 0 || roaring_bitmap_maximum(data) < strings->count;
+    VALUE buf_v = 0;
+    uint32_t *ids = NULL;
+    if (valid) {
+        ids = ALLOCV_N(uint32_t, buf_v, cardinality);
+        roaring_bitmap_to_uint32_array(data, ids);
+    }
+    rb_roaring32_unlock(bitmap);
+
+    if (!valid) {
+        rb_raise(rb_eIndexError, "bitmap holds ids missing from the dictionary");
+    }
+
+    VALUE result = rb_ary_new_capa(cardinality);
+    for (uint64_t i = 0; i < cardinality; i++) {
+        rb_ary_push(result, rb_roaring_strtab_str(strings, ids[i]));
+    }
+    ALLOCV_END(buf_v);
+    return result;
+}
+
+// Serializes the dictionary into a string. The format is the dictionary's
+// in-memory layout, so that {.mmap} can use a file holding it as is.
+// @return [String]
+static VALUE rb_roaring_dictionary_serialize(VALUE self)
+{
+    const rb_roaring_strtab_t *strings = get_strings(self);
+    size_t size = rb_roaring_strtab_serialized_size(strings);
+    VALUE str = rb_str_buf_new(size);
+    rb_roaring_strtab_serialize(strings, RSTRING_PTR(str));
+    rb_str_set_len(str, size);
+    RB_GC_GUARD(self);
+    return str;
+}
+
+// Loads a previously serialized dictionary
+// @param str [String]
+// @return [Dictionary]
+static VALUE rb_roaring_dictionary_s_deserialize(VALUE klass, VALUE str)
+{
+    StringValue(str);
+
+    // Views must be aligned, which the contents of a String may not be
+    VALUE buf_v;
+    long len = RSTRING_LEN(str);
+    uint32_t *buf = ALLOCV_N(uint32_t, buf_v, len / 4 + 1);
+    memcpy(buf, RSTRING_PTR(str), len);
+
+    rb_roaring_strtab_t view;
+    bool valid = rb_roaring_strtab_view(&view, (const char *)buf, len);
+    VALUE obj = Qnil;
+    if (valid) {
+        obj = rb_roaring_dictionary_alloc(klass);
+        rb_roaring_strtab_t *strings = get_strings(obj);
+        rb_roaring_strtab_t copy;
+        rb_roaring_strtab_copy(&copy, &view);
+        rb_roaring_strtab_free(strings);
+        *strings = copy;
+    }
+    ALLOCV_END(buf_v);
+
+    if (!valid) {
+        rb_raise(rb_eArgError, "invalid serialized dictionary");
+    }
+    return obj;
+}
+
+#ifdef HAVE_SYS_MMAN_H
+// Maps a file written with {#serialize} into memory, and uses it in place
+// rather than loading it. The dictionary is frozen, and the file must not
+// be modified while it's in use.
+// @param path [String]
+// @return [Dictionary]
+static VALUE rb_roaring_dictionary_s_mmap(VALUE klass, VALUE path)
+{
+    FilePathValue(path);
+
+    int fd = open(RSTRING_PTR(path), O_RDONLY);
+    if (fd < 0) {
+        rb_sys_fail_str(path);
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        rb_sys_fail_str(path);
+    }
+
+    size_t len = (size_t)st.st_size;
+    void *map = len ? mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (map == MAP_FAILED) {
+        if (len) {
+            rb_sys_fail_str(path);
+        }
+        rb_raise(rb_eArgError, "invalid serialized dictionary");
+    }
+
+    rb_roaring_strtab_t view;
+    if (!rb_roaring_strtab_view(&view, map, len)) {
+        munmap(map, len);
+        rb_raise(rb_eArgError, "invalid serialized dictionary");
+    }
+
+    rb_roaring_dictionary_t *dictionary;
+    VALUE obj = TypedData_Make_Struct(klass, rb_roaring_dictionary_t, &dictionary_type, dictionary);
+    dictionary->strings = view;
+    dictionary->map = map;
+    dictionary->map_len = len;
+    return rb_obj_freeze(obj);
+}
+#endif
+
+void
+rb_roaring_dictionary_init(void)
+{
+    cRoaringDictionary = rb_define_class_under(rb_mRoaring, "Dictionary", rb_cObject);
+    rb_include_module(cRoaringDictionary, rb_mEnumerable);
+    rb_define_alloc_func(cRoaringDictionary, rb_roaring_dictionary_alloc);
+    rb_define_method(cRoaringDictionary, "initialize_copy", rb_roaring_dictionary_initialize_copy, 1);
+    rb_define_method(cRoaringDictionary, "intern", rb_roaring_dictionary_intern, 1);
+    rb_define_method(cRoaringDictionary, "id", rb_roaring_dictionary_id, 1);
+    rb_define_method(cRoaringDictionary, "string", rb_roaring_dictionary_string, 1);
+    rb_define_method(cRoaringDictionary, "size", rb_roaring_dictionary_size, 0);
+    rb_define_method(cRoaringDictionary, "each", rb_roaring_dictionary_each, 0);
+    rb_define_method(cRoaringDictionary, "encode", rb_roaring_dictionary_encode, 1);
+    rb_define_method(cRoaringDictionary, "decode", rb_roaring_dictionary_decode, 1);
+    rb_define_method(cRoaringDictionary, "serialize", rb_roaring_dictionary_serialize, 0);
+    rb_define_singleton_method(cRoaringDictionary, "deserialize", rb_roaring_dictionary_s_deserialize, 1);
+#ifdef HAVE_SYS_MMAN_H
+    rb_define_singleton_method(cRoaringDictionary, "mmap", rb_roaring_dictionary_s_mmap, 1);
+#endif
+}
@@ -4,4 +4,10 @@ require "mkmf"
 
 $CFLAGS << " -fvisibility=hidden "
 
+have_header("pthread.h")
+have_header("sys/mman.h")
+have_func("rb_fiber_scheduler_current", "ruby/fiber/scheduler.h")
+have_func("rb_io_wait", "ruby/io.h")
+have_func("rb_io_buffer_get_bytes_for_writing", "ruby/io/buffer.h")
+
 create_makefile("roaring/roaring")
@@ -0,0 +1,751 @@
+#include "roaring_ruby.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <ruby/thread.h>
+
+static VALUE cRoaringInvertedIndex;
+
+static ID id_and;
+static ID id_or;
+static ID id_not;
+
+typedef struct {
+    // Term ids are indices into `postings`
+    rb_roaring_strtab_t terms;
+    roaring_bitmap_t **postings;
+    size_t postings_capa;
+
+    // Documents indexed and not deleted since
+    roaring_bitmap_t *docs;
+
+    // Deleted documents still present in `postings`, see #compact
+    roaring_bitmap_t *deleted;
+
+    // Number of searches currently reading the index without the GVL.
+    // Modifications raise while this is non-zero.
+    unsigned int locks;
+} rb_roaring_index_t;
+
+static void rb_roaring_index_free(void *data)
+{
+    rb_roaring_index_t *index = data;
+    for (uint32_t i = 0; i < index->terms.count; i++) {
+        roaring_bitmap_free(index->postings[i]);
+    }
+    xfree(index->postings);
+    rb_roaring_strtab_free(&index->terms);
+    roaring_bitmap_free(index->docs);
+    roaring_bitmap_free(index->deleted);
+    xfree(index);
+}
+
+static size_t rb_roaring_index_memsize(const void *data)
+{
+    const rb_roaring_index_t *index = data;
+    size_t size = sizeof(rb_roaring_index_t) + rb_roaring_strtab_memsize(&index->terms);
+    size += index->postings_capa * sizeof(roaring_bitmap_t *);
+    for (uint32_t i = 0; i < index->terms.count; i++) {
+        size += roaring_bitmap_size_in_bytes(index->postings[i]);
+    }
+    size += roaring_bitmap_size_in_bytes(index->docs);
+    size += roaring_bitmap_size_in_bytes(index->deleted);
+    return size;
+}
+
+static const rb_data_type_t index_type = {
+    .wrap_struct_name = "roaring/inverted_index",
+    .function = {
+        .dfree = rb_roaring_index_free,
+        .dsize = rb_roaring_index_memsize
+    },
+#ifdef HAVE_RB_EXT_RACTOR_SAFE
+    .flags = RUBY_TYPED_FREE_IMMEDIATELY | RUBY_TYPED_FROZEN_SHAREABLE,
+#else
+    .flags = RUBY_TYPED_FREE_IMMEDIATELY,
+#endif
+};
+
+static VALUE rb_roaring_index_alloc(VALUE klass)
+{
+    rb_roaring_index_t *index;
+    VALUE obj = TypedData_Make_Struct(klass, rb_roaring_index_t, &index_type, index);
+    rb_roaring_strtab_init(&index->terms);
+    index->docs = roaring_bitmap_create();
+    index->deleted = roaring_bitmap_create();
+    if (!index->docs || !index->deleted) {
+        rb_raise(rb_eNoMemError, "failed to allocate bitmap");
+    }
+    return obj;
+}
+
+static rb_roaring_index_t *get_index(VALUE obj)
+{
+    rb_roaring_index_t *index;
+    TypedData_Get_Struct(obj, rb_roaring_index_t, &index_type, index);
+    return index;
+}
+
+// Same as get_index, but raises if the index is frozen or being searched
+static rb_roaring_index_t *get_index_for_write(VALUE obj)
+{
+    rb_check_frozen(obj);
+    rb_roaring_index_t *index = get_index(obj);
+    if (index->locks) {
+        rb_raise(rb_eRuntimeError, "can't modify index; temporarily locked");
+    }
+    return index;
+}
+
+static uint32_t NUM2DOC(VALUE num)
+{
+    if (!RB_INTEGER_TYPE_P(num)) {
+        rb_raise(rb_eTypeError, "wrong argument type %s (expected Integer)", rb_obj_classname(num));
+    }
+    if (FIXNUM_P(num) ? FIX2LONG(num) < 0 : RTEST(rb_funcall(num, '<', 1, INT2FIX(0)))) {
+        rb_raise(rb_eRangeError, "document id %"PRIsVALUE" must be >= 0", num);
+    }
+    return NUM2UINT(num);
+}
+
+// Returns the postings of `term`, creating them if needed
+static roaring_bitmap_t *index_postings_for(rb_roaring_index_t *index, VALUE term)
+{
+    StringValue(term);
+
+    // Grow first, so that every term has postings even if this raises
+    uint32_t count = index->terms.count;
+    if (count >= index->postings_capa) {
+        size_t capa = index->postings_capa ? index->postings_capa * 2 : 16;
+        REALLOC_N(index->postings, roaring_bitmap_t *, capa);
+        index->postings_capa = capa;
+    }
+
+    uint32_t id = rb_roaring_strtab_intern(&index->terms, RSTRING_PTR(term), RSTRING_LEN(term));
+    if (id < count) {
+        return index->postings[id];
+    }
+    index->postings[id] = roaring_bitmap_create();
+    if (!index->postings[id]) {
+        rb_raise(rb_eNoMemError, "failed to allocate bitmap");
+    }
+    return index->postings[id];
+}
+
+static VALUE rb_roaring_index_initialize_copy(VALUE self, VALUE other)
+{
+    rb_roaring_index_t *index = get_index_for_write(self);
+    const rb_roaring_index_t *source = get_index(other);
+    if (index == source) {
+        return self;
+    }
+
+    for (uint32_t i = 0; i < source->terms.count; i++) {
+        const char *ptr = rb_roaring_strtab_ptr(&source->terms, i);
+        size_t len = rb_roaring_strtab_len(&source->terms, i);
+        roaring_bitmap_overwrite(index_postings_for(index, rb_str_new(ptr, len)), source->postings[i]);
+    }
+    roaring_bitmap_overwrite(index->docs, source->docs);
+    roaring_bitmap_overwrite(index->deleted, source->deleted);
+    return self;
+}
+
+// Removes every trace of a deleted document, so that it can be indexed again
+static void index_purge(rb_roaring_index_t *index, uint32_t doc)
+{
+    for (uint32_t i = 0; i < index->terms.count; i++) {
+        roaring_bitmap_remove(index->postings[i], doc);
+    }
+    roaring_bitmap_remove(index->deleted, doc);
+}
+
+// Indexes a document under each of `terms`. Indexing a document again adds
+// to its terms.
+// @param doc_id [Integer]
+// @param terms [Array<String>, String]
+// @return [self]
+static VALUE rb_roaring_index_index(VALUE self, VALUE doc_id, VALUE terms)
+{
+    rb_roaring_index_t *index = get_index_for_write(self);
+    uint32_t doc = NUM2DOC(doc_id);
+
+    if (RB_TYPE_P(terms, T_STRING)) {
+        terms = rb_ary_new_from_args(1, terms);
+    }
+    Check_Type(terms, T_ARRAY);
+
+    if (roaring_bitmap_contains(index->deleted, doc)) {
+        index_purge(index, doc);
+    }
+    for (long i = 0; i < RARRAY_LEN(terms); i++) {
+        roaring_bitmap_add(index_postings_for(index, RARRAY_AREF(terms, i)), doc);
+    }
+    roaring_bitmap_add(index->docs, doc);
+
+    RB_GC_GUARD(terms);
+    return self;
+}
+
+// Deletes a document. It's left out of search results right away, and
+// removed from the postings of its terms on the next {#compact}.
+// @param doc_id [Integer]
+// @return [self]
+static VALUE rb_roaring_index_delete(VALUE self, VALUE doc_id)
+{
+    rb_roaring_index_t *index = get_index_for_write(self);
+    uint32_t doc = NUM2DOC(doc_id);
+
+    if (roaring_bitmap_remove_checked(index->docs, doc)) {
+        roaring_bitmap_add(index->deleted, doc);
+    }
+    return self;
+}
+
+// Removes deleted documents from the postings of every term, and optimizes
+// the postings for size
+// @return [self]
+static VALUE rb_roaring_index_compact(VALUE self)
+{
+    rb_roaring_index_t *index = get_index_for_write(self);
+
+    for (uint32_t i = 0; i < index->terms.count; i++) {
+        roaring_bitmap_andnot_inplace(index->postings[i], index->deleted);
+        roaring_bitmap_run_optimize(index->postings[i]);
+        roaring_bitmap_shrink_to_fit(index->postings[i]);
+    }
+    roaring_bitmap_clear(index->deleted);
+    return self;
+}
+
+// @return [Boolean] whether a document is indexed, and not deleted
+static VALUE rb_roaring_index_include_p(VALUE self, VALUE doc_id)
+{
+    return RBOOL(roaring_bitmap_contains(get_index(self)->docs, NUM2DOC(doc_id)));
+}
+
+// @return [Integer] the number of documents indexed, and not deleted
+static VALUE rb_roaring_index_doc_count(VALUE self)
+{
+    return ULL2NUM(roaring_bitmap_get_cardinality(get_index(self)->docs));
+}
+
+// @return [Integer] the number of distinct terms
+static VALUE rb_roaring_index_term_count(VALUE self)
+{
+    return UINT2NUM(get_index(self)->terms.count);
+}
+
+// @return [Array<String>] every term, in the order they were first indexed
+static VALUE rb_roaring_index_terms(VALUE self)
+{
+    rb_roaring_index_t *index = get_index(self);
+    VALUE terms = rb_ary_new_capa(index->terms.count);
+    for (uint32_t i = 0; i < index->terms.count; i++) {
+        rb_ary_push(terms, rb_roaring_strtab_str(&index->terms, i));
+    }
+    return terms;
+}
+
+// @return [Bitmap32] the documents indexed, and not deleted
+static VALUE rb_roaring_index_docs(VALUE self)
+{
+    return rb_roaring32_wrap(roaring_bitmap_copy(get_index(self)->docs));
+}
+
+// @param term [String]
+// @return [Bitmap32] the documents indexed under `term`
+static VALUE rb_roaring_index_postings(VALUE self, VALUE term)
+{
+    rb_roaring_index_t *index = get_index(self);
+    StringValue(term);
+
+    uint32_t id = rb_roaring_strtab_find(&index->terms, RSTRING_PTR(term), RSTRING_LEN(term));
+    if (id == UINT32_MAX) {
+        return rb_roaring32_wrap(roaring_bitmap_create());
+    }
+    return rb_roaring32_wrap(roaring_bitmap_andnot(index->postings[id], index->deleted));
+}
+
+enum search_op {
+    SEARCH_TERM,
+    SEARCH_AND,
+    SEARCH_OR,
+    SEARCH_NOT,
+};
+
+struct search_node {
+    enum search_op op;
+
+    // SEARCH_TERM: the postings of the term, or NULL if it isn't indexed
+    const roaring_bitmap_t *bitmap;
+
+    struct search_node *children;
+    long count;
+
+    // The most documents the node can match, to order intersections
+    uint64_t cardinality;
+};
+
+struct search {
+    VALUE self;
+    rb_roaring_index_t *index;
+    VALUE query;
+    bool count;
+    bool locked;
+
+    struct search_node root;
+    roaring_bitmap_t *result;
+    uint64_t cardinality;
+};
+
+// Intersections evaluate their smallest terms first, and exclusions last
+static int search_node_cmp(const void *a, const void *b)
+{
+    const struct search_node *x = a, *y = b;
+    if ((x->op == SEARCH_NOT) != (y->op == SEARCH_NOT)) {
+        return x->op == SEARCH_NOT ? 1 : -1;
+    }
+    return (x->cardinality > y->cardinality) - (x->cardinality < y->cardinality);
+}
+
+static void search_build(struct search *s, struct search_node *node, VALUE query)
+{
+    if (RB_TYPE_P(query, T_STRING)) {
+        uint32_t id = rb_roaring_strtab_find(&s->index->terms, RSTRING_PTR(query), RSTRING_LEN(query));
+        node->op = SEARCH_TERM;
+        node->bitmap = id == UINT32_MAX ? NULL : s->index->postings[id];
+        node->cardinality = node->bitmap ? roaring_bitmap_get_cardinality(node->bitmap) : 0;
+        return;
+    }
+
+    if (!RB_TYPE_P(query, T_ARRAY) || RARRAY_LEN(query) < 2 || !SYMBOL_P(RARRAY_AREF(query, 0))) {
+        rb_raise(rb_eArgError, "invalid query %"PRIsVALUE" (expected a term or [:and | :or | :not, *queries])", rb_inspect(query));
+    }
+
+    ID op = SYM2ID(RARRAY_AREF(query, 0));
+    if (op == id_and) {
+        node->op = SEARCH_AND;
+    } else if (op == id_or) {
+        node->op = SEARCH_OR;
+    } else if (op == id_not && RARRAY_LEN(query) == 2) {
+        node->op = SEARCH_NOT;
+    } else {
+        rb_raise(rb_eArgError, "invalid query %"PRIsVALUE" (expected a term or [:and | :or | :not, *queries])", rb_inspect(query));
+    }
+
+    long count = RARRAY_LEN(query) - 1;
+    node->children = ZALLOC_N(struct search_node, count);
+    node->count = count;
+    for (long i = 0; i < count; i++) {
+        search_build(s, &node->children[i], RARRAY_AREF(query, i + 1));
+    }
+
+    switch (node->op) {
+    case SEARCH_AND:
+        qsort(node->children, count, sizeof(struct search_node), search_node_cmp);
+        node->cardinality = node->children[0].op == SEARCH_NOT ? UINT64_MAX : node->children[0].cardinality;
+        break;
+    case SEARCH_OR:
+        node->cardinality = 0;
+        for (long i = 0; i < count; i++) {
+            node->cardinality += node->children[i].cardinality;
+        }
+        break;
+    default:
+        node->cardinality = UINT64_MAX;
+        break;
+    }
+}
+
+static void search_node_free(struct search_node *node)
+{
+    for (long i = 0; i < node->count; i++) {
+        search_node_free(&node->children[i]);
+    }
+    xfree(node->children);
+}
+
+// Returns the documents matching `node`, which the caller must free if
+// `*owned` is set, and otherwise not modify
+static roaring_bitmap_t *search_eval(const rb_roaring_index_t *index, const struct search_node *node, bool *owned)
+{
+    switch (node->op) {
+    case SEARCH_TERM:
+        if (node->bitmap) {
+            *owned = false;
+            return (roaring_bitmap_t *)node->bitmap;
+        }
+        *owned = true;
+        return roaring_bitmap_create();
+
+    case SEARCH_AND: {
+        bool acc_owned;
+        roaring_bitmap_t *acc = search_eval(index, &node->children[0], &acc_owned);
+        for (long i = 1; i < node->count && !roaring_bitmap_is_empty(acc); i++) {
+            const struct search_node *child = &node->children[i];
+            bool negate = child->op == SEARCH_NOT;
+            bool child_owned;
+            roaring_bitmap_t *other = search_eval(index, negate ? &child->children[0] : child, &child_owned);
+
+            if (acc_owned) {
+                if (negate) {
+                    roaring_bitmap_andnot_inplace(acc, other);
+                } else {
+                    roaring_bitmap_and_inplace(acc, other);
+                }
+            } else {
+                acc = negate ? roaring_bitmap_andnot(acc, other) : roaring_bitmap_and(acc, other);
+                acc_owned = true;
+            }
+            if (child_owned) {
+                roaring_bitmap_free(other);
+            }
+        }
+        *owned = acc_owned;
+        return acc;
+    }
+
+    case SEARCH_OR: {
+        roaring_bitmap_t **results = malloc(node->count * sizeof(roaring_bitmap_t *));
+        bool *results_owned = malloc(node->count * sizeof(bool));
+        for (long i = 0; i < node->count; i++) {
+            results[i] = search_eval(index, &node->children[i], &results_owned[i]);
+        }
+
+        roaring_bitmap_t *result = roaring_bitmap_or_many(node->count, (const roaring_bitmap_t **)results);
+        for (long i = 0; i < node->count; i++) {
+            if (results_owned[i]) {
+                roaring_bitmap_free(results[i]);
+            }
+        }
+        free(results);
+        free(results_owned);
+        *owned = true;
+        return result;
+    }
+
+    case SEARCH_NOT: {
+        bool child_owned;
+        roaring_bitmap_t *child = search_eval(index, &node->children[0], &child_owned);
+        roaring_bitmap_t *result = roaring_bitmap_andnot(index->docs, child);
+        if (child_owned) {
+            roaring_bitmap_free(child);
+        }
+        *owned = true;
+        return result;
+    }
+    }
+
+    return NULL;
+}
+
+static void *search_nogvl(void *ptr)
+{
+    struct search *s = ptr;
+    const rb_roaring_index_t *index = s->index;
+
+    bool owned;
+    roaring_bitmap_t *result = search_eval(index, &s->root, &owned);
+
+    if (s->count) {
+        s->cardinality = roaring_bitmap_get_cardinality(result)
+            - roaring_bitmap_and_cardinality(result, index->deleted);
+    } else if (owned) {
+        roaring_bitmap_andnot_inplace(result, index->deleted);
+        s->result = result;
+        owned = false;
+    } else {
+        s->result = roaring_bitmap_andnot(result, index->deleted);
+    }
+
+    if (owned) {
+        roaring_bitmap_free(result);
+    }
+    return NULL;
+}
+
+// The size of the postings a search reads
+static size_t search_size(const struct search_node *node)
+{
+    size_t size = node->bitmap ? roaring_bitmap_size_in_bytes(node->bitmap) : 0;
+    for (long i = 0; i < node->count; i++) {
+        size += search_size(&node->children[i]);
+    }
+    return size;
+}
+
+static VALUE search_run(VALUE ptr)
+{
+    struct search *s = (struct search *)ptr;
+
+    search_build(s, &s->root, s->query);
+
+    // Frozen indexes can't be modified anyway, and may be shared with other
+    // Ractors, so they aren't counted
+    if (!OBJ_FROZEN(s->self)) {
+        s->index->locks++;
+        s->locked = true;
+    }
+
+    size_t threshold = rb_roaring_offload_threshold();
+    if (threshold != SIZE_MAX && search_size(&s->root) >= threshold) {
+        int state = rb_roaring_offload(search_nogvl, s);
+        if (state) {
+            rb_jump_tag(state);
+        }
+    } else {
+        rb_thread_call_without_gvl(search_nogvl, s, NULL, NULL);
+    }
+
+    if (s->count) {
+        return ULL2NUM(s->cardinality);
+    }
+    VALUE result = rb_roaring32_wrap(s->result);
+    s->result = NULL;
+    return result;
+}
+
+static VALUE search_cleanup(VALUE ptr)
+{
+    struct search *s = (struct search *)ptr;
+
+    if (s->locked) {
+        s->index->locks--;
+    }
+    search_node_free(&s->root);
+    roaring_bitmap_free(s->result);
+    RB_GC_GUARD(s->self);
+    return Qnil;
+}
+
+static VALUE index_search(VALUE self, VALUE query, bool count)
+{
+    struct search s = {
+        .self = self,
+        .index = get_index(self),
+        .query = query,
+        .count = count,
+    };
+    return rb_ensure(search_run, (VALUE)&s, search_cleanup, (VALUE)&s);
+}
+
+// Finds the documents matching a query, which is either a term, or an Array
+// combining queries: `[:and, *queries]`, `[:or, *queries]` or `[:not, query]`.
+//
+// @example
+//   index.search([:and, "red", [:or, "shirt", "dress"], [:not, "sold-out"]])
+// @param query [String, Array]
+// @return [Bitmap32]
+static VALUE rb_roaring_index_search(VALUE self, VALUE query)
+{
+    return index_search(self, query, false);
+}
+
+// Counts the documents matching a query, see {#search}
+// @param query [String, Array]
+// @return [Integer]
+static VALUE rb_roaring_index_count(VALUE self, VALUE query)
+{
+    return index_search(self, query, true);
+}
+
+// The serialized format, in little-endian:
+//
+//   "RIDX", u32 version, u32 term count,
+//   for each term: u32 length, bytes,
+//   for each term's postings, then the documents, then the deleted
+//   documents: u64 length, bitmap in the portable format
+#define INDEX_MAGIC "RIDX"
+#define INDEX_VERSION 1
+
+static void put_u32(char *buf, uint32_t value)
+{
+    for (int i = 0; i < 4; i++) {
+        buf[i] = (char)(value >> (i * 8));
+    }
+}
+
+static void put_u64(char *buf, uint64_t value)
+{
+    for (int i = 0; i < 8; i++) {
+        buf[i] = (char)(value >> (i * 8));
+    }
+}
+
+static uint64_t get_uint(const char *buf, int bytes)
+{
+    uint64_t value = 0;
+    for (int i = 0; i < bytes; i++) {
+        value |= (uint64_t)(unsigned char)buf[i] << (i * 8);
+    }
+    return value;
+}
+
+static size_t serialize_bitmap(char *buf, const roaring_bitmap_t *bitmap)
+{
+    size_t written = roaring_bitmap_portable_serialize(bitmap, buf + 8);
+    put_u64(buf, written);
+    return 8 + written;
+}
+
+// Serializes the index into a string, with postings in the portable format
+// @return [String]
+static VALUE rb_roaring_index_serialize(VALUE self)
+{
+    rb_roaring_index_t *index = get_index(self);
+    uint32_t count = index->terms.count;
+
+    size_t size = 12 + (size_t)count * 12 + index->terms.offsets[count] + 16
+        + roaring_bitmap_portable_size_in_bytes(index->docs)
+        + roaring_bitmap_portable_size_in_bytes(index->deleted);
+    for (uint32_t i = 0; i < count; i++) {
+        size += roaring_bitmap_portable_size_in_bytes(index->postings[i]);
+    }
+
+    VALUE str = rb_str_buf_new(size);
+    char *buf = RSTRING_PTR(str);
+    char *p = buf;
+
+    memcpy(p, INDEX_MAGIC, 4);
+    put_u32(p + 4, INDEX_VERSION);
+    put_u32(p + 8, count);
+    p += 12;
+    for (uint32_t i = 0; i < count; i++) {
+        size_t len = rb_roaring_strtab_len(&index->terms, i);
+        put_u32(p, (uint32_t)len);
+        memcpy(p + 4, rb_roaring_strtab_ptr(&index->terms, i), len);
+        p += 4 + len;
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        p += serialize_bitmap(p, index->postings[i]);
+    }
+    p += serialize_bitmap(p, index->docs);
+    p += serialize_bitmap(p, index->deleted);
+
+    rb_str_set_len(str, p - buf);
+    RB_GC_GUARD(self);
+    return str;
+}
+
+struct deserialize {
+    VALUE obj;
+    const char *p;
+    const char *end;
+};
+
+static NORETURN(void deserialize_invalid(void));
+static void deserialize_invalid(void)
+{
+    rb_raise(rb_eArgError, "invalid serialized index");
+}
+
+static uint64_t deserialize_uint(struct deserialize *d, int bytes)
+{
+    if (d->end - d->p < bytes) {
+        deserialize_invalid();
+    }
+    uint64_t value = get_uint(d->p, bytes);
+    d->p += bytes;
+    return value;
+}
+
+static roaring_bitmap_t *deserialize_bitmap(struct deserialize *d)
+{
+    uint64_t len = deserialize_uint(d, 8);
+    if (len > (uint64_t)(d->end - d->p)) {
+        deserialize_invalid();
+    }
+    roaring_bitmap_t *bitmap = roaring_bitmap_portable_deserialize_safe(d->p, len);
+    if (!bitmap || roaring_bitmap_portable_size_in_bytes(bitmap) != len) {
+        roaring_bitmap_free(bitmap);
+        deserialize_invalid();
+    }
+    d->p += len;
+    return bitmap;
+}
+
+// Loads a previously serialized index
+// @param str [String]
+// @return [InvertedIndex]
+static VALUE rb_roaring_index_s_deserialize(VALUE klass, VALUE str)
+{
+    StringValue(str);
+    str = rb_str_new_frozen(str);
+
+    struct deserialize d = {
+        .obj = rb_roaring_index_alloc(klass),
+        .p = RSTRING_PTR(str),
+        .end = RSTRING_END(str),
+    };
+    rb_roaring_index_t *index = get_index(d.obj);
+
+    if (d.end - d.p < 4 || memcmp(d.p, INDEX_MAGIC, 4) != 0) {
+        deserialize_invalid();
+    }
+    d.p += 4;
+    if (deserialize_uint(&d, 4) != INDEX_VERSION) {
+        rb_raise(rb_eArgError, "unsupported serialized index version");
+    }
+
+    // Each term takes at least 12 bytes
+    uint32_t count = (uint32_t)deserialize_uint(&d, 4);
+    if (count > (d.end - d.p) / 12) {
+        deserialize_invalid();
+    }
+    index->postings = ZALLOC_N(roaring_bitmap_t *, count);
+    index->postings_capa = count;
+
+    for (uint32_t i = 0; i < count; i++) {
+        uint64_t len = deserialize_uint(&d, 4);
+        if (len > (uint64_t)(d.end - d.p)
+            || rb_roaring_strtab_find(&index->terms, d.p, len) != UINT32_MAX) {
+            deserialize_invalid();
+        }
+        rb_roaring_strtab_intern(&index->terms, d.p, len);
+        d.p += len;
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+        index->postings[i] = deserialize_bitmap(&d);
+    }
+
+    roaring_bitmap_free(index->docs);
+    index->docs = NULL;
+    index->docs = deserialize_bitmap(&d);
+    roaring_bitmap_free(index->deleted);
+    index->deleted = NULL;
+    index->deleted = deserialize_bitmap(&d);
+
+    if (d.p != d.end) {
+        deserialize_invalid();
+    }
+
+    RB_GC_GUARD(str);
+    return d.obj;
+}
+
+void
+rb_roaring_inverted_index_init(void)
+{
+    id_and = rb_intern("and");
+    id_or = rb_intern("or");
+    id_not = rb_intern("not");
+
+    cRoaringInvertedIndex = rb_define_class_under(rb_mRoaring, "InvertedIndex", rb_cObject);
+    rb_define_alloc_func(cRoaringInvertedIndex, rb_roaring_index_alloc);
+    rb_define_method(cRoaringInvertedIndex, "initialize_copy", rb_roaring_index_initialize_copy, 1);
+    rb_define_method(cRoaringInvertedIndex, "index", rb_roaring_index_index, 2);
+    rb_define_method(cRoaringInvertedIndex, "delete", rb_roaring_index_delete, 1);
+    rb_define_method(cRoaringInvertedIndex, "compact", rb_roaring_index_compact, 0);
+    rb_define_method(cRoaringInvertedIndex, "include?", rb_roaring_index_include_p, 1);
+    rb_define_method(cRoaringInvertedIndex, "doc_count", rb_roaring_index_doc_count, 0);
+    rb_define_method(cRoaringInvertedIndex, "term_count", rb_roaring_index_term_count, 0);
+    rb_define_method(cRoaringInvertedIndex, "terms", rb_roaring_index_terms, 0);
+    rb_define_method(cRoaringInvertedIndex, "docs", rb_roaring_index_docs, 0);
+    rb_define_method(cRoaringInvertedIndex, "postings", rb_roaring_index_postings, 1);
+    rb_define_method(cRoaringInvertedIndex, "search", rb_roaring_index_search, 1);
+    rb_define_method(cRoaringInvertedIndex, "count", rb_roaring_index_count, 1);
+    rb_define_method(cRoaringInvertedIndex, "serialize", rb_roaring_index_serialize, 0);
+    rb_define_singleton_method(cRoaringInvertedIndex, "deserialize", rb_roaring_index_s_deserialize, 1);
+}
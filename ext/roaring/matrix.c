@@ -0,0 +1,317 @@
+#include "roaring_ruby.h"
+
+#include <string.h>
+
+#include <ruby/thread.h>
+
+// Computations over every pair of bitmaps in a list, which would otherwise
+// take one Ruby method call per pair.
+
+// Pairs are computed in square tiles of this many rows and columns, so that
+// the bitmaps of a tile's columns stay in cache while its rows go through them
+#define PAIRWISE_TILE 32
+
+// Returns a hidden copy of `ary` after checking that it only contains Bitmap32s
+static VALUE bitmap32_list(VALUE ary)
+{
+    ary = rb_ary_dup(rb_convert_type(ary, T_ARRAY, "Array", "to_ary"));
+    for (long i = 0; i < RARRAY_LEN(ary); i++) {
+        VALUE bitmap = RARRAY_AREF(ary, i);
+        if (!rb_roaring32_bitmap_p(bitmap)) {
+            rb_raise(rb_eTypeError, "wrong argument type %s (expected Roaring::Bitmap32)", rb_obj_classname(bitmap));
+        }
+    }
+    return ary;
+}
+
+// Locks every bitmap in `ary` and fills `views` with read-only views of them.
+// `*locked` counts the bitmaps locked so far, in case locking one raises.
+static void lock_bitmap32_list(VALUE ary, roaring_bitmap_t *views, long *locked)
+{
+    for (long i = 0; i < RARRAY_LEN(ary); i++) {
+        views[i] = rb_roaring32_view(rb_roaring32_lock(RARRAY_AREF(ary, i)));
+        *locked = i + 1;
+    }
+}
+
+// Unlocks the first `locked` bitmaps of `ary`
+static void unlock_bitmap32_list(VALUE ary, long locked)
+{
+    for (long i = 0; i < locked; i++) {
+        rb_roaring32_unlock(RARRAY_AREF(ary, i));
+    }
+}
+
+struct pairwise_args {
+    const roaring_bitmap_t *bitmaps;
+    uint64_t *cardinalities;
+    size_t count;
+    size_t tiles;
+    bool jaccard;
+
+    // The N×N matrix, row by row: uint64_t intersections, or double indexes
+    char *matrix;
+};
+
+static void pairwise_cardinality_task(void *ptr, size_t i)
+{
+    struct pairwise_args *args = ptr;
+    args->cardinalities[i] = roaring_bitmap_get_cardinality(&args->bitmaps[i]);
+}
+
+static void pairwise_set(struct pairwise_args *args, size_t i, size_t j, uint64_t intersection)
+{
+    if (args->jaccard) {
+        uint64_t union_size = args->cardinalities[i] + args->cardinalities[j] - intersection;
+        double index = union_size ? (double)intersection / (double)union_size : 1.0;
+        memcpy(args->matrix + (i * args->count + j) * sizeof(index), &index, sizeof(index));
+        memcpy(args->matrix + (j * args->count + i) * sizeof(index), &index, sizeof(index));
+    } else {
+        memcpy(args->matrix + (i * args->count + j) * sizeof(intersection), &intersection, sizeof(intersection));
+        memcpy(args->matrix + (j * args->count + i) * sizeof(intersection), &intersection, sizeof(intersection));
+    }
+}
+
+// Computes tile `t` of the upper triangle of tiles, numbered row by row,
+// and mirrors it into the lower one
+static void pairwise_tile_task(void *ptr, size_t t)
+{
+    struct pairwise_args *args = ptr;
+
+    size_t row = 0;
+    while (t >= args->tiles - row) {
+        t -= args->tiles - row;
+        row++;
+    }
+    size_t column = row + t;
+
+    size_t row_start = row * PAIRWISE_TILE;
+    size_t row_end = row_start + PAIRWISE_TILE < args->count ? row_start + PAIRWISE_TILE : args->count;
+    size_t column_start = column * PAIRWISE_TILE;
+    size_t column_end = column_start + PAIRWISE_TILE < args->count ? column_start + PAIRWISE_TILE : args->count;
+
+    for (size_t i = row_start; i < row_end; i++) {
+        if (row == column) {
+            pairwise_set(args, i, i, args->cardinalities[i]);
+        }
+        for (size_t j = row == column ? i + 1 : column_start; j < column_end; j++) {
+            pairwise_set(args, i, j, roaring_bitmap_and_cardinality(&args->bitmaps[i], &args->bitmaps[j]));
+        }
+    }
+}
+
+static void *pairwise_nogvl(void *ptr)
+{
+    struct pairwise_args *args = ptr;
+    rb_roaring_parallel_for(args->count, pairwise_cardinality_task, args);
+    rb_roaring_parallel_for(args->tiles * (args->tiles + 1) / 2, pairwise_tile_task, args);
+    return NULL;
+}
+
+struct pairwise {
+    VALUE bitmaps;
+    roaring_bitmap_t *views;
+    long locked;
+    struct pairwise_args args;
+};
+
+static VALUE pairwise_run(VALUE ptr)
+{
+    struct pairwise *p = (struct pairwise *)ptr;
+    struct pairwise_args *args = &p->args;
+
+    p->views = ALLOC_N(roaring_bitmap_t, args->count);
+    args->cardinalities = ALLOC_N(uint64_t, args->count);
+    lock_bitmap32_list(p->bitmaps, p->views, &p->locked);
+
+    args->bitmaps = p->views;
+    rb_thread_call_without_gvl(pairwise_nogvl, args, NULL, NULL);
+    return Qnil;
+}
+
+static VALUE pairwise_cleanup(VALUE ptr)
+{
+    struct pairwise *p = (struct pairwise *)ptr;
+
+    unlock_bitmap32_list(p->bitmaps, p->locked);
+    xfree(p->args.cardinalities);
+    xfree(p->views);
+    return Qnil;
+}
+
+// Computes a metric between every pair of bitmaps, using up to
+// {Roaring.parallelism} threads. Only one half of the symmetric matrix is
+// computed, in tiles which keep the bitmaps they compare in cache.
+// @example
+//   matrix = Roaring.pairwise(bitmaps, metric: :jaccard)
+//   rows = matrix.unpack("d*").each_slice(bitmaps.size).to_a
+// @param bitmaps [Array<Bitmap32>]
+// @param metric [Symbol] `:intersection` for the cardinality of the
+//   intersection of each pair, or `:jaccard` for its Jaccard index
+// @return [String] the N×N matrix row by row, as native-endian 64-bit
+//   unsigned integers for `:intersection` (`unpack("Q*")`), or doubles for
+//   `:jaccard` (`unpack("d*")`)
+static VALUE rb_roaring_s_pairwise(int argc, VALUE *argv, VALUE self)
+{
+    VALUE bitmaps, opts;
+    rb_scan_args(argc, argv, "1:", &bitmaps, &opts);
+
+    bool jaccard = false;
+    if (!NIL_P(opts)) {
+        ID keys[1] = { rb_intern("metric") };
+        VALUE values[1];
+        rb_get_kwargs(opts, keys, 0, 1, values);
+        if (values[0] == ID2SYM(rb_intern("jaccard"))) {
+            jaccard = true;
+        } else if (values[0] != Qundef && values[0] != ID2SYM(rb_intern("intersection"))) {
+            rb_raise(rb_eArgError, "unknown metric %+"PRIsVALUE", expected :intersection or :jaccard", values[0]);
+        }
+    }
+
+    bitmaps = bitmap32_list(bitmaps);
+    size_t count = RARRAY_LEN(bitmaps);
+    if (count > 0 && count > SIZE_MAX / count / sizeof(uint64_t)) {
+        rb_raise(rb_eArgError, "too many bitmaps");
+    }
+    VALUE matrix = rb_str_new(NULL, count * count * sizeof(uint64_t));
+    if (count == 0) {
+        return matrix;
+    }
+
+    struct pairwise p = {
+        .bitmaps = bitmaps,
+        .args = {
+            .count = count,
+            .tiles = (count + PAIRWISE_TILE - 1) / PAIRWISE_TILE,
+            .jaccard = jaccard,
+            .matrix = RSTRING_PTR(matrix),
+        },
+    };
+    rb_ensure(pairwise_run, (VALUE)&p, pairwise_cleanup, (VALUE)&p);
+    RB_GC_GUARD(bitmaps);
+    RB_GC_GUARD(matrix);
+
+    return matrix;
+}
+
+struct retention_args {
+    const roaring_bitmap_t *cohorts;
+    const roaring_bitmap_t *activity;
+    size_t cohort_count;
+    size_t activity_count;
+    uint64_t *matrix;
+};
+
+// Computes the row of cohort `i`, whose bitmap stays in cache while it's
+// intersected with every later activity bitmap
+static void retention_row_task(void *ptr, size_t i)
+{
+    struct retention_args *args = ptr;
+    const roaring_bitmap_t *cohort = &args->cohorts[i];
+    uint64_t *row = args->matrix + i * args->activity_count;
+
+    if (roaring_bitmap_is_empty(cohort)) {
+        return;
+    }
+    for (size_t j = i; j < args->activity_count; j++) {
+        row[j - i] = roaring_bitmap_and_cardinality(cohort, &args->activity[j]);
+    }
+}
+
+static void *retention_nogvl(void *ptr)
+{
+    struct retention_args *args = ptr;
+    rb_roaring_parallel_for(args->cohort_count, retention_row_task, args);
+    return NULL;
+}
+
+struct retention {
+    VALUE cohorts;
+    VALUE activity;
+    roaring_bitmap_t *cohort_views;
+    roaring_bitmap_t *activity_views;
+    long cohorts_locked, activity_locked;
+    struct retention_args args;
+};
+
+static VALUE retention_run(VALUE ptr)
+{
+    struct retention *r = (struct retention *)ptr;
+    struct retention_args *args = &r->args;
+
+    r->cohort_views = ALLOC_N(roaring_bitmap_t, RARRAY_LEN(r->cohorts));
+    r->activity_views = ALLOC_N(roaring_bitmap_t, RARRAY_LEN(r->activity));
+    lock_bitmap32_list(r->cohorts, r->cohort_views, &r->cohorts_locked);
+    lock_bitmap32_list(r->activity, r->activity_views, &r->activity_locked);
+
+    args->cohorts = r->cohort_views;
+    args->activity = r->activity_views;
+    rb_thread_call_without_gvl(retention_nogvl, args, NULL, NULL);
+    return Qnil;
+}
+
+static VALUE retention_cleanup(VALUE ptr)
+{
+    struct retention *r = (struct retention *)ptr;
+
+    unlock_bitmap32_list(r->activity, r->activity_locked);
+    unlock_bitmap32_list(r->cohorts, r->cohorts_locked);
+    xfree(r->activity_views);
+    xfree(r->cohort_views);
+    return Qnil;
+}
+
+// Computes a retention triangle: how many members of each cohort, such as
+// the users who signed up on a given day, are in each later activity
+// bitmap, such as the users active on a given day. Cohort `i` is compared
+// to `activity[i]`, `activity[i + 1]`... using up to {Roaring.parallelism}
+// threads, without building any intersection.
+// @example
+//   matrix = Roaring.retention(signups_by_day, active_by_day)
+//   rows = matrix.unpack("Q*").each_slice(active_by_day.size).to_a
+//   rows[2][7] # => how many users who signed up on day 2 were active on day 9
+// @param cohorts [Array<Bitmap32>]
+// @param activity [Array<Bitmap32>]
+// @return [String] a matrix with a row per cohort and a column per activity
+//   bitmap, as native-endian 64-bit unsigned integers (`unpack("Q*")`). Column
+//   `d` of row `i` is the cardinality of `cohorts[i] & activity[i + d]`, or 0
+//   when `i + d` is past the end of `activity`.
+static VALUE rb_roaring_s_retention(VALUE self, VALUE cohorts, VALUE activity)
+{
+    cohorts = bitmap32_list(cohorts);
+    activity = bitmap32_list(activity);
+    size_t cohort_count = RARRAY_LEN(cohorts);
+    size_t activity_count = RARRAY_LEN(activity);
+    if (activity_count > 0 && cohort_count > SIZE_MAX / activity_count / sizeof(uint64_t)) {
+        rb_raise(rb_eArgError, "too many bitmaps");
+    }
+    VALUE matrix = rb_str_new(NULL, cohort_count * activity_count * sizeof(uint64_t));
+    memset(RSTRING_PTR(matrix), 0, RSTRING_LEN(matrix));
+    if (cohort_count == 0 || activity_count == 0) {
+        return matrix;
+    }
+
+    struct retention r = {
+        .cohorts = cohorts,
+        .activity = activity,
+        .args = {
+            // Only cohorts with a later activity bitmap have anything to compute
+            .cohort_count = cohort_count < activity_count ? cohort_count : activity_count,
+            .activity_count = activity_count,
+            .matrix = (uint64_t *)RSTRING_PTR(matrix),
+        },
+    };
+    rb_ensure(retention_run, (VALUE)&r, retention_cleanup, (VALUE)&r);
+    RB_GC_GUARD(cohorts);
+    RB_GC_GUARD(activity);
+    RB_GC_GUARD(matrix);
+
+    return matrix;
+}
+
+void
+rb_roaring_matrix_init(void)
+{
+  rb_define_singleton_method(rb_mRoaring, "pairwise", rb_roaring_s_pairwise, -1);
+  rb_define_singleton_method(rb_mRoaring, "retention", rb_roaring_s_retention, 2);
+}
@@ -0,0 +1,155 @@
+#include "roaring_ruby.h"
+
+#if defined(HAVE_PTHREAD_H) && defined(HAVE_RB_FIBER_SCHEDULER_CURRENT) && defined(HAVE_RB_IO_WAIT)
+#define ROARING_OFFLOAD 1
+#endif
+
+#ifdef ROARING_OFFLOAD
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include <ruby/fiber/scheduler.h>
+#include <ruby/io.h>
+#include <ruby/thread.h>
+#endif
+
+// Heavy operations called from a non-blocking fiber can be moved to a
+// separate native thread, so that only the calling fiber waits for them
+// while the fiber scheduler keeps running the others.
+//
+// The calling fiber waits on a pipe which the native thread writes to once
+// it's done, since waiting for IO is what every fiber scheduler supports.
+
+// Minimum size in bytes of the data an operation works on for it to be
+// offloaded. SIZE_MAX when offloading is disabled.
+static size_t offload_threshold = SIZE_MAX;
+
+size_t rb_roaring_offload_threshold(void)
+{
+#ifdef ROARING_OFFLOAD
+    if (offload_threshold != SIZE_MAX && rb_fiber_scheduler_current() != Qnil) {
+        return offload_threshold;
+    }
+#endif
+    return SIZE_MAX;
+}
+
+#ifdef ROARING_OFFLOAD
+
+struct offload_job {
+    void *(*func)(void *);
+    void *arg;
+    int fd;
+};
+
+static void *offload_thread(void *ptr)
+{
+    struct offload_job *job = ptr;
+    job->func(job->arg);
+
+    // Wake up the waiting fiber
+    char c = 0;
+    while (write(job->fd, &c, 1) < 0 && errno == EINTR);
+
+    return NULL;
+}
+
+static VALUE offload_wait(VALUE io)
+{
+    return rb_io_wait(io, RB_INT2NUM(RUBY_IO_READABLE), Qnil);
+}
+
+static void *offload_join(void *ptr)
+{
+    pthread_join(*(pthread_t *)ptr, NULL);
+    return NULL;
+}
+
+int rb_roaring_offload(void *(*func)(void *), void *arg)
+{
+    int fds[2];
+    if (rb_pipe(fds) < 0) {
+        func(arg);
+        return 0;
+    }
+    VALUE io = rb_io_fdopen(fds[0], O_RDONLY, NULL);
+
+    struct offload_job job = {
+        .func = func,
+        .arg = arg,
+        .fd = fds[1],
+    };
+
+    // The thread never runs Ruby code, so keep signals on Ruby's own threads
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    pthread_t thread;
+    int err = pthread_create(&thread, NULL, offload_thread, &job);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    int state = 0;
+    if (err) {
+        func(arg);
+    } else {
+        // Waiting can be interrupted, for example when the fiber is stopped,
+        // but the thread is still using `arg`, so it must finish before we return
+        while (!RTEST(rb_protect(offload_wait, io, &state)) && !state);
+        rb_thread_call_without_gvl(offload_join, &thread, NULL, NULL);
+    }
+
+    rb_io_close(io);
+    close(fds[1]);
+    RB_GC_GUARD(io);
+
+    return state;
+}
+
+#else
+
+int rb_roaring_offload(void *(*func)(void *), void *arg)
+{
+    func(arg);
+    return 0;
+}
+
+#endif
+
+// @return [Integer,nil] the minimum size of operations moved off the current fiber, see {offload_threshold=}
+static VALUE rb_roaring_get_offload_threshold(VALUE self)
+{
+    return offload_threshold == SIZE_MAX ? Qnil : SIZET2NUM(offload_threshold);
+}
+
+// Makes heavy operations called while a fiber scheduler is active (see
+// `Fiber.set_scheduler`) run on a separate native thread. Only the calling
+// fiber waits for them, so the scheduler keeps running other fibers.
+//
+// This applies to {Bitmap32#and}, {Bitmap32#or}, {Bitmap32#xor},
+// {Bitmap32#andnot}, {Bitmap32#serialize} and {Bitmap32.deserialize} (and
+// their Bitmap64 equivalents), when the data involved is at least
+// `bytes` in serialized size. Smaller operations stay on the fiber, where
+// they are cheaper than a thread hand-off.
+//
+// Bitmaps being read by an offloaded operation can't be modified until it
+// finishes.
+// @param bytes [Integer,nil] the threshold, or `nil` (the default) to never offload
+static VALUE rb_roaring_set_offload_threshold(VALUE self, VALUE bytes)
+{
+    if (NIL_P(bytes)) {
+        offload_threshold = SIZE_MAX;
+    } else {
+        offload_threshold = NUM2SIZET(bytes);
+    }
+    return bytes;
+}
+
+void
+rb_roaring_offload_init(void)
+{
+    rb_define_singleton_method(rb_mRoaring, "offload_threshold", rb_roaring_get_offload_threshold, 0);
+    rb_define_singleton_method(rb_mRoaring, "offload_threshold=", rb_roaring_set_offload_threshold, 1);
+}
@@ -0,0 +1,235 @@
+#include "roaring_ruby.h"
+
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#include <signal.h>
+#endif
+
+// A small pool of native threads used to run independent pieces of bitmap
+// work in parallel, such as the pairs of one level of a tree reduction.
+//
+// Jobs are submitted with rb_roaring_parallel_for, which must be called
+// without the GVL. The calling thread works on its job alongside the pool.
+// Jobs from several threads can run at once: workers help with the most
+// recently submitted job first, and every caller keeps running tasks of its
+// own job, so none of them waits for another. Workers are started lazily,
+// the first time a job can use them.
+
+static int parallelism = 1;
+
+#ifdef HAVE_PTHREAD_H
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_work_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t pool_done_cond = PTHREAD_COND_INITIALIZER;
+
+// Number of worker threads started so far
+static int pool_size = 0;
+
+// A job submitted by rb_roaring_parallel_for, which lives on the stack of
+// its caller. Fields are protected by pool_lock.
+struct pool_job {
+    rb_roaring_task_func *func;
+    void *arg;
+    size_t count;
+    size_t next;
+
+    // Number of workers allowed to take part in the job
+    int workers;
+
+    // Number of workers currently running one of its tasks
+    int running;
+
+    // The next job with tasks left to claim
+    struct pool_job *link;
+};
+
+// Jobs with tasks left to claim, most recently submitted first
+static struct pool_job *pool_jobs = NULL;
+
+// Claims the next task of `job`, unlinking the job once all its tasks are
+// claimed. Must be called with pool_lock held.
+static size_t pool_claim(struct pool_job *job)
+{
+    size_t index = job->next++;
+    if (job->next == job->count) {
+        struct pool_job **link = &pool_jobs;
+        while (*link != job) {
+            link = &(*link)->link;
+        }
+        *link = job->link;
+    }
+    return index;
+}
+
+static void *pool_worker(void *ptr)
+{
+    int id = (int)(intptr_t)ptr;
+
+    pthread_mutex_lock(&pool_lock);
+    for (;;) {
+        struct pool_job *job = pool_jobs;
+        while (job && id >= job->workers) {
+            job = job->link;
+        }
+        if (!job) {
+            pthread_cond_wait(&pool_work_cond, &pool_lock);
+            continue;
+        }
+
+        size_t index = pool_claim(job);
+        job->running++;
+        pthread_mutex_unlock(&pool_lock);
+        job->func(job->arg, index);
+        pthread_mutex_lock(&pool_lock);
+        if (--job->running == 0 && job->next == job->count) {
+            pthread_cond_broadcast(&pool_done_cond);
+        }
+    }
+
+    return NULL;
+}
+
+// Starts workers until there are `count` of them, returning how many are
+// available. Must be called with pool_lock held.
+static int pool_grow(int count)
+{
+    if (pool_size >= count) {
+        return count;
+    }
+
+    // Workers never run Ruby code, so keep signals on Ruby's own threads
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    while (pool_size < count) {
+        pthread_t thread;
+        if (pthread_create(&thread, &attr, pool_worker, (void *)(intptr_t)pool_size) != 0) {
+            break;
+        }
+        pool_size++;
+    }
+
+    pthread_attr_destroy(&attr);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    return pool_size;
+}
+
+// The workers don't survive fork, and the lock may have been held by a
+// thread which doesn't exist in the child.
+static void pool_atfork_child(void)
+{
+    pthread_mutex_init(&pool_lock, NULL);
+    pthread_cond_init(&pool_work_cond, NULL);
+    pthread_cond_init(&pool_done_cond, NULL);
+    pool_size = 0;
+    pool_jobs = NULL;
+}
+
+void rb_roaring_parallel_for(size_t count, rb_roaring_task_func *func, void *arg)
+{
+    if (count == 0) {
+        return;
+    }
+
+    int workers = __atomic_load_n(&parallelism, __ATOMIC_RELAXED) - 1;
+    if ((size_t)workers > count - 1) {
+        workers = (int)(count - 1);
+    }
+
+    // Jobs which can't use the pool, such as every job at the default
+    // parallelism of 1, run on the calling thread without touching its lock
+    if (workers > 0) {
+        pthread_mutex_lock(&pool_lock);
+        workers = pool_grow(workers);
+        if (workers == 0) {
+            pthread_mutex_unlock(&pool_lock);
+        }
+    }
+    if (workers == 0) {
+        for (size_t i = 0; i < count; i++) {
+            func(arg, i);
+        }
+        return;
+    }
+
+    struct pool_job job = {
+        .func = func,
+        .arg = arg,
+        .count = count,
+        .workers = workers,
+        .link = pool_jobs,
+    };
+    pool_jobs = &job;
+    pthread_cond_broadcast(&pool_work_cond);
+
+    while (job.next < job.count) {
+        size_t index = pool_claim(&job);
+        pthread_mutex_unlock(&pool_lock);
+        func(arg, index);
+        pthread_mutex_lock(&pool_lock);
+    }
+    while (job.running > 0) {
+        pthread_cond_wait(&pool_done_cond, &pool_lock);
+    }
+
+    pthread_mutex_unlock(&pool_lock);
+}
+
+#else
+
+void rb_roaring_parallel_for(size_t count, rb_roaring_task_func *func, void *arg)
+{
+    for (size_t i = 0; i < count; i++) {
+        func(arg, i);
+    }
+}
+
+#endif
+
+int rb_roaring_parallelism(void)
+{
+    return __atomic_load_n(&parallelism, __ATOMIC_RELAXED);
+}
+
+// @return [Integer] the number of threads used by operations on many bitmaps
+static VALUE rb_roaring_get_parallelism(VALUE self)
+{
+    return INT2NUM(parallelism);
+}
+
+// Sets the number of threads used by operations on many bitmaps, like
+// {Bitmap32.or_many}, and by binary operations between large Bitmap32s. The
+// calling thread counts as one of them, so `1` (the default) runs everything
+// on the calling thread. Results don't depend on this setting.
+//
+// Without pthreads, the setting is accepted but work stays on the calling thread.
+// @param value [Integer]
+static VALUE rb_roaring_set_parallelism(VALUE self, VALUE value)
+{
+    int n = NUM2INT(value);
+    if (n < 1) {
+        rb_raise(rb_eArgError, "parallelism must be at least 1");
+    }
+
+    __atomic_store_n(&parallelism, n, __ATOMIC_RELAXED);
+
+    return value;
+}
+
+void
+rb_roaring_pool_init(void)
+{
+#ifdef HAVE_PTHREAD_H
+    pthread_atfork(NULL, NULL, pool_atfork_child);
+#endif
+
+    rb_define_singleton_method(rb_mRoaring, "parallelism", rb_roaring_get_parallelism, 0);
+    rb_define_singleton_method(rb_mRoaring, "parallelism=", rb_roaring_set_parallelism, 1);
+}
@@ -0,0 +1,866 @@
+#include "roaring_ruby.h"
+
+#include <ruby/thread.h>
+
+// Evaluates the expression trees built by Roaring::Query in one native call.
+//
+// A tree is either a bitmap, or a frozen Array holding an operator Symbol
+// followed by two or more subtrees. Every bitmap in a tree is locked while it
+// is evaluated, then the whole tree is computed without the GVL. Temporary
+// results are reused in place wherever possible, and unions are computed
+// lazily, repairing cardinalities once per union rather than once per operand.
+//
+// Before evaluation, a planner rewrites the tree using the size of every
+// operand: intersections start from their smallest operand, unions from their
+// largest, and differences are moved after the intersections around them.
+// Intersections and differences stop as soon as their result is empty, and
+// an intersection already much smaller than a union it's about to be
+// intersected with is pushed down into the operands of the union.
+
+static VALUE cRoaringQuery;
+static ID id_tree;
+
+enum query_op {
+    QUERY_LEAF,
+    QUERY_AND,
+    QUERY_OR,
+    QUERY_XOR,
+    QUERY_ANDNOT,
+    QUERY_OP_COUNT
+};
+
+static const char *const query_op_names[QUERY_OP_COUNT] = { "bitmap", "and", "or", "xor", "andnot" };
+
+enum query_mode {
+    QUERY_TO_BITMAP,
+    QUERY_COUNT,
+    QUERY_ANY,
+    QUERY_EACH,
+    QUERY_PLAN
+};
+
+struct query_node {
+    enum query_op op;
+
+    // For QUERY_LEAF. `narrow` marks Bitmap64s still holding a 32-bit bitmap.
+    VALUE object;
+    const void *bitmap;
+    bool narrow;
+
+    // For everything else, the operands, applied left to right
+    struct query_node *children;
+    long count;
+
+    // Exact for leaves, otherwise upper bounds
+    uint64_t cardinality;
+    size_t bytes;
+};
+
+typedef void *query_binary_func(const void *, const void *);
+typedef void query_inplace_func(void *, const void *);
+typedef uint64_t query_cardinality_func(const void *, const void *);
+typedef bool query_predicate_func(const void *, const void *);
+
+// The operations the evaluator needs, for one type of bitmap
+struct query_ops {
+    bool (*is_bitmap)(VALUE obj);
+    const void *(*lock)(VALUE obj, bool *narrow);
+    void (*unlock)(VALUE obj);
+    VALUE (*wrap)(void *bitmap);
+
+    // Indexed by enum query_op. Unions may leave the result in need of a
+    // call to `repair`, if there is one.
+    query_binary_func *binary[QUERY_OP_COUNT];
+    query_inplace_func *inplace[QUERY_OP_COUNT];
+    query_cardinality_func *binary_cardinality[QUERY_OP_COUNT];
+    void (*repair)(void *bitmap);
+
+    void *(*copy)(const void *bitmap);
+    void (*free)(void *bitmap);
+    uint64_t (*cardinality)(const void *bitmap);
+    size_t (*size_in_bytes)(const void *bitmap);
+    bool (*is_empty)(const void *bitmap);
+    bool (*contains)(const void *bitmap, uint64_t value);
+    query_predicate_func *intersect;
+    query_predicate_func *equals;
+    query_predicate_func *is_subset;
+
+    void *(*iterator_create)(const void *bitmap);
+    size_t (*iterator_read)(void *it, uint64_t *buf, size_t count);
+    void (*iterator_free)(void *it);
+};
+
+#define QUERY_CHUNK 256
+
+static const void *lock32(VALUE obj, bool *narrow) { *narrow = false; return rb_roaring32_lock(obj); }
+static VALUE wrap32(void *bitmap) { return rb_roaring32_wrap(bitmap); }
+static void *and32(const void *a, const void *b) { return roaring_bitmap_and(a, b); }
+static void *or32(const void *a, const void *b) { return roaring_bitmap_lazy_or(a, b, false); }
+static void *xor32(const void *a, const void *b) { return roaring_bitmap_xor(a, b); }
+static void *andnot32(const void *a, const void *b) { return roaring_bitmap_andnot(a, b); }
+static void and_inplace32(void *a, const void *b) { roaring_bitmap_and_inplace(a, b); }
+static void or_inplace32(void *a, const void *b) { roaring_bitmap_lazy_or_inplace(a, b, false); }
+static void xor_inplace32(void *a, const void *b) { roaring_bitmap_xor_inplace(a, b); }
+static void andnot_inplace32(void *a, const void *b) { roaring_bitmap_andnot_inplace(a, b); }
+static uint64_t and_cardinality32(const void *a, const void *b) { return roaring_bitmap_and_cardinality(a, b); }
+static uint64_t or_cardinality32(const void *a, const void *b) { return roaring_bitmap_or_cardinality(a, b); }
+static uint64_t xor_cardinality32(const void *a, const void *b) { return roaring_bitmap_xor_cardinality(a, b); }
+static uint64_t andnot_cardinality32(const void *a, const void *b) { return roaring_bitmap_andnot_cardinality(a, b); }
+static void repair32(void *bitmap) { roaring_bitmap_repair_after_lazy(bitmap); }
+static void *copy32(const void *bitmap) { return rb_roaring32_copy(bitmap); }
+static void free32(void *bitmap) { roaring_bitmap_free(bitmap); }
+static uint64_t cardinality32(const void *bitmap) { return roaring_bitmap_get_cardinality(bitmap); }
+static size_t size_in_bytes32(const void *bitmap) { return roaring_bitmap_portable_size_in_bytes(bitmap); }
+static bool is_empty32(const void *bitmap) { return roaring_bitmap_is_empty(bitmap); }
+static bool contains32(const void *bitmap, uint64_t value) { return value <= UINT32_MAX && roaring_bitmap_contains(bitmap, (uint32_t)value); }
+static bool intersect32(const void *a, const void *b) { return roaring_bitmap_intersect(a, b); }
+static bool equals32(const void *a, const void *b) { return roaring_bitmap_equals(a, b); }
+static bool is_subset32(const void *a, const void *b) { return roaring_bitmap_is_subset(a, b); }
+static void *iterator_create32(const void *bitmap) { return roaring_iterator_create(bitmap); }
+static void iterator_free32(void *it) { roaring_uint32_iterator_free(it); }
+
+static size_t iterator_read32(void *it, uint64_t *buf, size_t count)
+{
+    uint32_t values[QUERY_CHUNK];
+    uint32_t read = roaring_uint32_iterator_read(it, values, (uint32_t)(count < QUERY_CHUNK ? count : QUERY_CHUNK));
+    for (uint32_t i = 0; i < read; i++) {
+        buf[i] = values[i];
+    }
+    return read;
+}
+
+static const struct query_ops query32_ops = {
+    .is_bitmap = rb_roaring32_bitmap_p,
+    .lock = lock32,
+    .unlock = rb_roaring32_unlock,
+    .wrap = wrap32,
+    .binary = { NULL, and32, or32, xor32, andnot32 },
+    .inplace = { NULL, and_inplace32, or_inplace32, xor_inplace32, andnot_inplace32 },
+    .binary_cardinality = { NULL, and_cardinality32, or_cardinality32, xor_cardinality32, andnot_cardinality32 },
+    .repair = repair32,
+    .copy = copy32,
+    .free = free32,
+    .cardinality = cardinality32,
+    .size_in_bytes = size_in_bytes32,
+    .is_empty = is_empty32,
+    .contains = contains32,
+    .intersect = intersect32,
+    .equals = equals32,
+    .is_subset = is_subset32,
+    .iterator_create = iterator_create32,
+    .iterator_read = iterator_read32,
+    .iterator_free = iterator_free32,
+};
+
+static VALUE wrap64(void *bitmap) { return rb_roaring64_wrap(bitmap); }
+static VALUE wrap64_narrow(void *bitmap) { return rb_roaring64_wrap32(bitmap); }
+
+static const void *lock64(VALUE obj, bool *narrow)
+{
+    const roaring_bitmap_t *bitmap32;
+    const roaring64_bitmap_t *bitmap;
+    rb_roaring64_lock(obj, &bitmap32, &bitmap);
+    *narrow = bitmap32 != NULL;
+    return bitmap32 ? (const void *)bitmap32 : bitmap;
+}
+static void *and64(const void *a, const void *b) { return roaring64_bitmap_and(a, b); }
+static void *or64(const void *a, const void *b) { return roaring64_bitmap_or(a, b); }
+static void *xor64(const void *a, const void *b) { return roaring64_bitmap_xor(a, b); }
+static void *andnot64(const void *a, const void *b) { return roaring64_bitmap_andnot(a, b); }
+static void and_inplace64(void *a, const void *b) { roaring64_bitmap_and_inplace(a, b); }
+static void or_inplace64(void *a, const void *b) { roaring64_bitmap_or_inplace(a, b); }
+static void xor_inplace64(void *a, const void *b) { roaring64_bitmap_xor_inplace(a, b); }
+static void andnot_inplace64(void *a, const void *b) { roaring64_bitmap_andnot_inplace(a, b); }
+static uint64_t and_cardinality64(const void *a, const void *b) { return roaring64_bitmap_and_cardinality(a, b); }
+static uint64_t or_cardinality64(const void *a, const void *b) { return roaring64_bitmap_or_cardinality(a, b); }
+static uint64_t xor_cardinality64(const void *a, const void *b) { return roaring64_bitmap_xor_cardinality(a, b); }
+static uint64_t andnot_cardinality64(const void *a, const void *b) { return roaring64_bitmap_andnot_cardinality(a, b); }
+static void *copy64(const void *bitmap) { return roaring64_bitmap_copy(bitmap); }
+static void free64(void *bitmap) { roaring64_bitmap_free(bitmap); }
+static uint64_t cardinality64(const void *bitmap) { return roaring64_bitmap_get_cardinality(bitmap); }
+static size_t size_in_bytes64(const void *bitmap) { return roaring64_bitmap_portable_size_in_bytes(bitmap); }
+static bool is_empty64(const void *bitmap) { return roaring64_bitmap_is_empty(bitmap); }
+static bool contains64(const void *bitmap, uint64_t value) { return roaring64_bitmap_contains(bitmap, value); }
+static bool intersect64(const void *a, const void *b) { return roaring64_bitmap_intersect(a, b); }
+static bool equals64(const void *a, const void *b) { return roaring64_bitmap_equals(a, b); }
+static bool is_subset64(const void *a, const void *b) { return roaring64_bitmap_is_subset(a, b); }
+static void *iterator_create64(const void *bitmap) { return roaring64_iterator_create(bitmap); }
+static size_t iterator_read64(void *it, uint64_t *buf, size_t count) { return roaring64_iterator_read(it, buf, count); }
+static void iterator_free64(void *it) { roaring64_iterator_free(it); }
+
+static const struct query_ops query64_ops = {
+    .is_bitmap = rb_roaring64_bitmap_p,
+    .lock = lock64,
+    .unlock = rb_roaring64_unlock,
+    .wrap = wrap64,
+    .binary = { NULL, and64, or64, xor64, andnot64 },
+    .inplace = { NULL, and_inplace64, or_inplace64, xor_inplace64, andnot_inplace64 },
+    .binary_cardinality = { NULL, and_cardinality64, or_cardinality64, xor_cardinality64, andnot_cardinality64 },
+    .repair = NULL,
+    .copy = copy64,
+    .free = free64,
+    .cardinality = cardinality64,
+    .size_in_bytes = size_in_bytes64,
+    .is_empty = is_empty64,
+    .contains = contains64,
+    .intersect = intersect64,
+    .equals = equals64,
+    .is_subset = is_subset64,
+    .iterator_create = iterator_create64,
+    .iterator_read = iterator_read64,
+    .iterator_free = iterator_free64,
+};
+
+// For queries over Bitmap64s which all still hold 32-bit bitmaps
+static const struct query_ops query64_narrow_ops = {
+    .is_bitmap = rb_roaring64_bitmap_p,
+    .lock = lock64,
+    .unlock = rb_roaring64_unlock,
+    .wrap = wrap64_narrow,
+    .binary = { NULL, and32, or32, xor32, andnot32 },
+    .inplace = { NULL, and_inplace32, or_inplace32, xor_inplace32, andnot_inplace32 },
+    .binary_cardinality = { NULL, and_cardinality32, or_cardinality32, xor_cardinality32, andnot_cardinality32 },
+    .repair = repair32,
+    .copy = copy32,
+    .free = free32,
+    .cardinality = cardinality32,
+    .size_in_bytes = size_in_bytes32,
+    .is_empty = is_empty32,
+    .contains = contains32,
+    .intersect = intersect32,
+    .equals = equals32,
+    .is_subset = is_subset32,
+    .iterator_create = iterator_create32,
+    .iterator_read = iterator_read32,
+    .iterator_free = iterator_free32,
+};
+
+struct query {
+    const struct query_ops *ops;
+    enum query_mode mode;
+    VALUE tree;
+
+    // The bitmaps locked while building the tree, to be unlocked afterwards
+    VALUE leaves;
+    struct query_node root;
+
+    // 64-bit copies of narrow leaves, when mixed with wider ones
+    void **widened;
+    long widened_count;
+
+    // Stands in for `root` once `left` is known to be the final result
+    struct query_node result_root;
+
+    // The evaluated operands of the root's last operation: `left` holds the
+    // result of all but the last operand, and `right` the last one. Once
+    // done, `left` holds the final result, except when iterating over an
+    // intersection or difference, which is filtered on the fly instead.
+    const void *left, *right;
+    bool left_owned, right_owned;
+
+    uint64_t cardinality;
+    bool any;
+    void *iterator;
+};
+
+static void query_build(struct query *q, struct query_node *node, VALUE tree)
+{
+    if (!RB_TYPE_P(tree, T_ARRAY)) {
+        if (!q->ops) {
+            if (rb_roaring32_bitmap_p(tree)) {
+                q->ops = &query32_ops;
+            } else if (rb_roaring64_bitmap_p(tree)) {
+                q->ops = &query64_ops;
+            }
+        }
+        if (!q->ops || !q->ops->is_bitmap(tree)) {
+            rb_raise(rb_eTypeError, "wrong operand type %s (expected bitmaps of a single class)", rb_obj_classname(tree));
+        }
+
+        node->op = QUERY_LEAF;
+        node->object = tree;
+        rb_ary_push(q->leaves, tree);
+        node->bitmap = q->ops->lock(tree, &node->narrow);
+        return;
+    }
+
+    if (RARRAY_LEN(tree) < 3) {
+        rb_raise(rb_eArgError, "query operations need at least two operands");
+    }
+
+    ID op = rb_sym2id(RARRAY_AREF(tree, 0));
+    if (op == rb_intern("and")) {
+        node->op = QUERY_AND;
+    } else if (op == rb_intern("or")) {
+        node->op = QUERY_OR;
+    } else if (op == rb_intern("xor")) {
+        node->op = QUERY_XOR;
+    } else if (op == rb_intern("andnot")) {
+        node->op = QUERY_ANDNOT;
+    } else {
+        rb_raise(rb_eArgError, "unknown query operation %"PRIsVALUE, RARRAY_AREF(tree, 0));
+    }
+
+    node->count = RARRAY_LEN(tree) - 1;
+    node->children = ZALLOC_N(struct query_node, node->count);
+    for (long i = 0; i < node->count; i++) {
+        query_build(q, &node->children[i], RARRAY_AREF(tree, i + 1));
+    }
+}
+
+static bool query_any_wide(const struct query_node *node)
+{
+    if (node->op == QUERY_LEAF) {
+        return !node->narrow;
+    }
+    for (long i = 0; i < node->count; i++) {
+        if (query_any_wide(&node->children[i])) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void query_widen_leaves(struct query *q, struct query_node *node)
+{
+    if (node->op == QUERY_LEAF && node->narrow) {
+        roaring_bitmap_t *copy = rb_roaring32_copy(node->bitmap);
+        roaring64_bitmap_t *bitmap = roaring64_bitmap_move_from_roaring32(copy);
+        roaring_bitmap_free(copy);
+        q->widened[q->widened_count++] = bitmap;
+        node->bitmap = bitmap;
+        node->narrow = false;
+    }
+    for (long i = 0; i < node->count; i++) {
+        query_widen_leaves(q, &node->children[i]);
+    }
+}
+
+// Bitmap64 queries use 32-bit operations while every operand is still
+// 32-bit, and otherwise widen the 32-bit ones
+static void query_widen(struct query *q)
+{
+    if (q->ops != &query64_ops) {
+        return;
+    }
+    if (!query_any_wide(&q->root)) {
+        q->ops = &query64_narrow_ops;
+        return;
+    }
+    q->widened = ZALLOC_N(void *, RARRAY_LEN(q->leaves));
+    query_widen_leaves(q, &q->root);
+}
+
+// The serialized size of every operand of `node`
+static size_t query_size(const struct query_ops *ops, const struct query_node *node)
+{
+    if (node->op == QUERY_LEAF) {
+        return ops->size_in_bytes(node->bitmap);
+    }
+
+    size_t size = 0;
+    for (long i = 0; i < node->count; i++) {
+        size += query_size(ops, &node->children[i]);
+    }
+    return size;
+}
+
+static bool query_mergeable(const struct query_node *node, long i)
+{
+    const struct query_node *child = &node->children[i];
+    return child->op == node->op && (node->op != QUERY_ANDNOT || i == 0);
+}
+
+// Merges operands which are themselves the same operation into `node`, like
+// `(a & b) & c` into `a & b & c`. For differences, only the first operand
+// can be merged.
+static void query_flatten(struct query_node *node)
+{
+    long count = 0;
+    for (long i = 0; i < node->count; i++) {
+        count += query_mergeable(node, i) ? node->children[i].count : 1;
+    }
+    if (count == node->count) {
+        return;
+    }
+
+    struct query_node *children = ALLOC_N(struct query_node, count);
+    long k = 0;
+    for (long i = 0; i < node->count; i++) {
+        struct query_node *child = &node->children[i];
+        if (query_mergeable(node, i)) {
+            MEMCPY(children + k, child->children, struct query_node, child->count);
+            k += child->count;
+            xfree(child->children);
+        } else {
+            children[k++] = *child;
+        }
+    }
+
+    xfree(node->children);
+    node->children = children;
+    node->count = count;
+}
+
+// Rewrites an intersection with differences among its operands, like
+// `a & (b - c) & d`, into `(a & b & d) - c`, so that the subtractions apply
+// to the smaller result of the intersection. Returns whether it did.
+static bool query_hoist_andnot(struct query_node *node)
+{
+    long subtrahends = 0;
+    for (long i = 0; i < node->count; i++) {
+        if (node->children[i].op == QUERY_ANDNOT) {
+            subtrahends += node->children[i].count - 1;
+        }
+    }
+    if (subtrahends == 0) {
+        return false;
+    }
+
+    struct query_node *operands = ALLOC_N(struct query_node, node->count);
+    struct query_node *children = ZALLOC_N(struct query_node, subtrahends + 1);
+
+    long k = 1;
+    for (long i = 0; i < node->count; i++) {
+        struct query_node *child = &node->children[i];
+        if (child->op == QUERY_ANDNOT) {
+            operands[i] = child->children[0];
+            MEMCPY(children + k, child->children + 1, struct query_node, child->count - 1);
+            k += child->count - 1;
+            xfree(child->children);
+        } else {
+            operands[i] = *child;
+        }
+    }
+    children[0].op = QUERY_AND;
+    children[0].children = operands;
+    children[0].count = node->count;
+
+    xfree(node->children);
+    node->op = QUERY_ANDNOT;
+    node->children = children;
+    node->count = subtrahends + 1;
+    return true;
+}
+
+static int query_compare_cardinality(const void *a, const void *b)
+{
+    uint64_t x = ((const struct query_node *)a)->cardinality;
+    uint64_t y = ((const struct query_node *)b)->cardinality;
+    return (x > y) - (x < y);
+}
+
+static int query_compare_bytes_desc(const void *a, const void *b)
+{
+    size_t x = ((const struct query_node *)a)->bytes;
+    size_t y = ((const struct query_node *)b)->bytes;
+    return (x < y) - (x > y);
+}
+
+static uint64_t saturating_add(uint64_t a, uint64_t b)
+{
+    return a + b < a ? UINT64_MAX : a + b;
+}
+
+// Orders the operands of `node`, whose operands are already planned, and
+// estimates its result
+static void query_order(struct query_node *node)
+{
+    struct query_node *children = node->children;
+
+    switch (node->op) {
+    case QUERY_AND:
+        // Every step can only shrink the result, so start from the smallest
+        qsort(children, node->count, sizeof(struct query_node), query_compare_cardinality);
+        node->cardinality = children[0].cardinality;
+        node->bytes = children[0].bytes;
+        break;
+
+    case QUERY_OR:
+        // Start from the largest, so that the others are added into it
+        qsort(children, node->count, sizeof(struct query_node), query_compare_bytes_desc);
+        /* fall through */
+    case QUERY_XOR:
+        node->cardinality = 0;
+        node->bytes = 0;
+        for (long i = 0; i < node->count; i++) {
+            node->cardinality = saturating_add(node->cardinality, children[i].cardinality);
+            node->bytes += children[i].bytes;
+        }
+        break;
+
+    case QUERY_ANDNOT:
+        node->cardinality = children[0].cardinality;
+        node->bytes = children[0].bytes;
+        break;
+
+    default:
+        break;
+    }
+}
+
+static void query_plan(const struct query_ops *ops, struct query_node *node)
+{
+    if (node->op == QUERY_LEAF) {
+        node->cardinality = ops->cardinality(node->bitmap);
+        node->bytes = ops->size_in_bytes(node->bitmap);
+        return;
+    }
+
+    for (long i = 0; i < node->count; i++) {
+        query_plan(ops, &node->children[i]);
+    }
+    query_flatten(node);
+
+    if (node->op == QUERY_AND && query_hoist_andnot(node)) {
+        query_flatten(&node->children[0]);
+        query_order(&node->children[0]);
+    }
+    query_order(node);
+}
+
+// @return [Array] `node` as `[operation, estimated cardinality, *operands]`,
+//   or `[:bitmap, cardinality, bitmap]` for bitmaps
+static VALUE query_plan_to_a(const struct query_node *node)
+{
+    VALUE ary = rb_ary_new_capa(node->count + 2);
+    rb_ary_push(ary, ID2SYM(rb_intern(query_op_names[node->op])));
+    rb_ary_push(ary, ULL2NUM(node->cardinality));
+
+    if (node->op == QUERY_LEAF) {
+        rb_ary_push(ary, node->object);
+    }
+    for (long i = 0; i < node->count; i++) {
+        rb_ary_push(ary, query_plan_to_a(&node->children[i]));
+    }
+    return ary;
+}
+
+static void query_free_node(struct query_node *node)
+{
+    for (long i = 0; i < node->count; i++) {
+        query_free_node(&node->children[i]);
+    }
+    xfree(node->children);
+}
+
+static const void *query_eval(const struct query_ops *ops, const struct query_node *node, bool *owned);
+
+// Combines `acc` with `operand`, reusing either of them if we own it
+static const void *query_combine(const struct query_ops *ops, enum query_op op, const void *acc, bool *acc_owned, const void *operand, bool operand_owned)
+{
+    void *result;
+    if (*acc_owned) {
+        result = (void *)acc;
+        ops->inplace[op](result, operand);
+    } else if (operand_owned && op != QUERY_ANDNOT) {
+        result = (void *)operand;
+        ops->inplace[op](result, acc);
+    } else {
+        result = ops->binary[op](acc, operand);
+    }
+
+    if (operand_owned && operand != result) {
+        ops->free((void *)operand);
+    }
+    *acc_owned = true;
+    return result;
+}
+
+// Intersections with a union at least this many times larger than the
+// intersection so far intersect each operand of the union instead
+#define QUERY_RESTRICT_RATIO 64
+
+static bool query_should_restrict(const struct query_ops *ops, const void *acc, const struct query_node *node)
+{
+    return node->op == QUERY_OR && ops->cardinality(acc) < node->cardinality / QUERY_RESTRICT_RATIO;
+}
+
+// Computes `acc & node` for a union `node` as the union of `acc` intersected
+// with each of its operands, which only ever builds small bitmaps
+static void *query_restrict(const struct query_ops *ops, const void *acc, const struct query_node *node)
+{
+    void *result = NULL;
+    for (long i = 0; i < node->count; i++) {
+        bool owned;
+        const void *operand = query_eval(ops, &node->children[i], &owned);
+        void *part = ops->binary[QUERY_AND](acc, operand);
+        if (owned) {
+            ops->free((void *)operand);
+        }
+
+        if (result) {
+            ops->inplace[QUERY_OR](result, part);
+            ops->free(part);
+        } else {
+            result = part;
+        }
+    }
+    if (ops->repair) {
+        ops->repair(result);
+    }
+    return result;
+}
+
+// Applies `op` to `nodes` from left to right
+static const void *query_reduce(const struct query_ops *ops, enum query_op op, const struct query_node *nodes, long count, bool *owned)
+{
+    const void *acc = query_eval(ops, &nodes[0], owned);
+    for (long i = 1; i < count; i++) {
+        if ((op == QUERY_AND || op == QUERY_ANDNOT) && ops->is_empty(acc)) {
+            break;
+        }
+
+        if (op == QUERY_AND && query_should_restrict(ops, acc, &nodes[i])) {
+            void *result = query_restrict(ops, acc, &nodes[i]);
+            if (*owned) {
+                ops->free((void *)acc);
+            }
+            acc = result;
+            *owned = true;
+            continue;
+        }
+
+        bool operand_owned;
+        const void *operand = query_eval(ops, &nodes[i], &operand_owned);
+        acc = query_combine(ops, op, acc, owned, operand, operand_owned);
+    }
+    if (op == QUERY_OR && count > 1 && ops->repair) {
+        ops->repair((void *)acc);
+    }
+    return acc;
+}
+
+// Evaluates `node`. `owned` is set when the result is a new bitmap, rather
+// than one of the operands.
+static const void *query_eval(const struct query_ops *ops, const struct query_node *node, bool *owned)
+{
+    if (node->op == QUERY_LEAF) {
+        *owned = false;
+        return node->bitmap;
+    }
+    return query_reduce(ops, node->op, node->children, node->count, owned);
+}
+
+static void *query_eval_nogvl(void *ptr)
+{
+    struct query *q = ptr;
+    const struct query_ops *ops = q->ops;
+    const struct query_node *root = &q->root;
+
+    if (root->op == QUERY_LEAF) {
+        q->left = root->bitmap;
+    } else if (q->mode == QUERY_TO_BITMAP) {
+        q->left = query_reduce(ops, root->op, root->children, root->count, &q->left_owned);
+    } else {
+        // The last operation is left to the terminal, which may not need its result
+        q->left = query_reduce(ops, root->op, root->children, root->count - 1, &q->left_owned);
+        const struct query_node *last = &root->children[root->count - 1];
+        if ((root->op == QUERY_AND || root->op == QUERY_ANDNOT) && ops->is_empty(q->left)) {
+            // Nothing can come out of it, `left` is the result
+            root = &q->result_root;
+        } else if (root->op == QUERY_AND && query_should_restrict(ops, q->left, last)) {
+            const void *result = query_restrict(ops, q->left, last);
+            if (q->left_owned) {
+                ops->free((void *)q->left);
+            }
+            q->left = result;
+            q->left_owned = true;
+            root = &q->result_root;
+        } else {
+            q->right = query_eval(ops, last, &q->right_owned);
+        }
+    }
+
+    switch (q->mode) {
+    case QUERY_TO_BITMAP:
+        if (!q->left_owned) {
+            q->left = ops->copy(q->left);
+            q->left_owned = true;
+        }
+        break;
+
+    case QUERY_COUNT:
+        if (root->op == QUERY_LEAF) {
+            q->cardinality = ops->cardinality(q->left);
+        } else {
+            q->cardinality = ops->binary_cardinality[root->op](q->left, q->right);
+        }
+        break;
+
+    case QUERY_ANY:
+        switch (root->op) {
+        case QUERY_LEAF:
+            q->any = !ops->is_empty(q->left);
+            break;
+        case QUERY_AND:
+            q->any = ops->intersect(q->left, q->right);
+            break;
+        case QUERY_OR:
+            q->any = !ops->is_empty(q->left) || !ops->is_empty(q->right);
+            break;
+        case QUERY_XOR:
+            q->any = !ops->equals(q->left, q->right);
+            break;
+        case QUERY_ANDNOT:
+            q->any = !ops->is_subset(q->left, q->right);
+            break;
+        default:
+            break;
+        }
+        break;
+
+    case QUERY_EACH:
+        if (root->op == QUERY_AND) {
+            // Walk the smaller side, looking values up in the other
+            if (ops->cardinality(q->left) > ops->cardinality(q->right)) {
+                const void *tmp = q->left;
+                bool tmp_owned = q->left_owned;
+                q->left = q->right;
+                q->left_owned = q->right_owned;
+                q->right = tmp;
+                q->right_owned = tmp_owned;
+            }
+        } else if (root->op == QUERY_OR || root->op == QUERY_XOR) {
+            q->left = query_combine(ops, root->op, q->left, &q->left_owned, q->right, q->right_owned);
+            q->right = NULL;
+            q->right_owned = false;
+            if (root->op == QUERY_OR && ops->repair) {
+                ops->repair((void *)q->left);
+            }
+        }
+        break;
+
+    case QUERY_PLAN:
+        break;
+    }
+
+    return NULL;
+}
+
+static VALUE query_run(VALUE ptr)
+{
+    struct query *q = (struct query *)ptr;
+
+    query_build(q, &q->root, q->tree);
+    query_widen(q);
+    const struct query_ops *ops = q->ops;
+
+    query_plan(ops, &q->root);
+    if (q->mode == QUERY_PLAN) {
+        return query_plan_to_a(&q->root);
+    }
+
+    size_t threshold = rb_roaring_offload_threshold();
+    if (threshold != SIZE_MAX && query_size(ops, &q->root) >= threshold) {
+        int state = rb_roaring_offload(query_eval_nogvl, q);
+        if (state) {
+            rb_jump_tag(state);
+        }
+    } else {
+        rb_thread_call_without_gvl(query_eval_nogvl, q, NULL, NULL);
+    }
+
+    switch (q->mode) {
+    case QUERY_TO_BITMAP:
+        q->left_owned = false;
+        return ops->wrap((void *)q->left);
+
+    case QUERY_COUNT:
+        return ULL2NUM(q->cardinality);
+
+    case QUERY_ANY:
+        return RBOOL(q->any);
+
+    case QUERY_EACH:
+    case QUERY_PLAN:
+        break;
+    }
+
+    // For intersections and differences, `right` filters the values of `left`
+    bool keep = q->root.op != QUERY_ANDNOT;
+    uint64_t buf[QUERY_CHUNK];
+    size_t count;
+
+    q->iterator = ops->iterator_create(q->left);
+    while ((count = ops->iterator_read(q->iterator, buf, QUERY_CHUNK)) > 0) {
+        for (size_t i = 0; i < count; i++) {
+            if (!q->right || ops->contains(q->right, buf[i]) == keep) {
+                rb_yield(ULL2NUM(buf[i]));
+            }
+        }
+    }
+
+    return Qnil;
+}
+
+static VALUE query_cleanup(VALUE ptr)
+{
+    struct query *q = (struct query *)ptr;
+    const struct query_ops *ops = q->ops;
+
+    if (q->iterator) {
+        ops->iterator_free(q->iterator);
+    }
+    if (q->left_owned) {
+        ops->free((void *)q->left);
+    }
+    if (q->right_owned) {
+        ops->free((void *)q->right);
+    }
+    query_free_node(&q->root);
+    for (long i = 0; i < q->widened_count; i++) {
+        roaring64_bitmap_free(q->widened[i]);
+    }
+    xfree(q->widened);
+
+    // Only the bitmaps locked before any error are in `leaves`
+    for (long i = 0; i < RARRAY_LEN(q->leaves); i++) {
+        ops->unlock(RARRAY_AREF(q->leaves, i));
+    }
+
+    return Qnil;
+}
+
+// @private
+// Evaluates the query
+// @param mode [Symbol] one of `:to_bitmap`, `:count`, `:any?`, `:each`, or `:plan`
+//   to return the plan instead
+static VALUE rb_roaring_query_evaluate(VALUE self, VALUE mode)
+{
+    struct query q = { 0 };
+
+    ID id = rb_sym2id(mode);
+    if (id == rb_intern("to_bitmap")) {
+        q.mode = QUERY_TO_BITMAP;
+    } else if (id == rb_intern("count")) {
+        q.mode = QUERY_COUNT;
+    } else if (id == rb_intern("any?")) {
+        q.mode = QUERY_ANY;
+    } else if (id == rb_intern("each")) {
+        q.mode = QUERY_EACH;
+        rb_need_block();
+    } else if (id == rb_intern("plan")) {
+        q.mode = QUERY_PLAN;
+    } else {
+        rb_raise(rb_eArgError, "unknown query mode %"PRIsVALUE, mode);
+    }
+
+    q.tree = rb_ivar_get(self, id_tree);
+    q.leaves = rb_ary_new();
+
+    VALUE result = rb_ensure(query_run, (VALUE)&q, query_cleanup, (VALUE)&q);
+
+    RB_GC_GUARD(q.tree);
+    RB_GC_GUARD(q.leaves);
+    return q.mode == QUERY_EACH ? self : result;
+}
+
+void
+rb_roaring_query_init(void)
+{
+    id_tree = rb_intern("@tree");
+
+    cRoaringQuery = rb_define_class_under(rb_mRoaring, "Query", rb_cObject);
+    rb_define_private_method(cRoaringQuery, "evaluate", rb_roaring_query_evaluate, 1);
+}
@@ -11,7 +11,190 @@
 
 extern VALUE rb_mRoaring;
 
+// Splits an Integer offset into its sign (-1, 0 or 1) and its magnitude.
+// Returns false if the magnitude doesn't fit in 64 bits.
+static inline bool rb_roaring_num2offset(VALUE num, int *sign, uint64_t *magnitude)
+{
+    *sign = rb_integer_pack(rb_to_int(num), magnitude, 1, sizeof(*magnitude), 0,
+                            INTEGER_PACK_LSWORD_FIRST | INTEGER_PACK_NATIVE_BYTE_ORDER);
+    return *sign >= -1 && *sign <= 1;
+}
+
+// The `random:` keyword argument of sampling methods, Random by default
+static inline VALUE rb_roaring_random_opt(VALUE opts)
+{
+    VALUE random = Qundef;
+    if (!NIL_P(opts)) {
+        ID keys[1] = { rb_intern("random") };
+        rb_get_kwargs(opts, keys, 0, 1, &random);
+    }
+    return random == Qundef ? rb_cRandom : random;
+}
+
+// The number of elements to sample, a single one if `num` is nil
+static inline uint64_t rb_roaring_num2sample(VALUE num)
+{
+    if (NIL_P(num)) {
+        return 1;
+    }
+    long k = NUM2LONG(num);
+    if (k < 0) {
+        rb_raise(rb_eArgError, "negative sample number");
+    }
+    return (uint64_t)k;
+}
+
+static inline double rb_roaring_num2fraction(VALUE num)
+{
+    double fraction = NUM2DBL(num);
+    if (!(fraction >= 0 && fraction <= 1)) {
+        rb_raise(rb_eArgError, "fraction must be between 0 and 1");
+    }
+    return fraction;
+}
+
 void rb_roaring32_init();
 void rb_roaring64_init();
+void rb_roaring_pool_init();
+void rb_roaring_offload_init();
+void rb_roaring_query_init();
+void rb_roaring_inverted_index_init();
+void rb_roaring_dictionary_init();
+void rb_roaring_bitset_init();
+void rb_roaring_matrix_init();
+void rb_roaring_column_init();
+
+// Access to bitmaps for other parts of the extension. Locked bitmaps can't be
+// modified, and can be read without the GVL until they're unlocked. Wrapping
+// a bitmap in a new Ruby object hands over its ownership.
+bool rb_roaring32_bitmap_p(VALUE obj);
+const roaring_bitmap_t *rb_roaring32_lock(VALUE obj);
+void rb_roaring32_unlock(VALUE obj);
+VALUE rb_roaring32_wrap(roaring_bitmap_t *bitmap);
+VALUE rb_roaring_bitset_from_bitmap(const roaring_bitmap_t *bitmap);
+
+// Converts a bitset into a new bitmap, with a bitset or array container for
+// every 2**16 bits. Returns NULL if it can't be allocated.
+roaring_bitmap_t *rb_roaring_bitset_to_bitmap(const bitset_t *bitset);
+
+// A read-only view of a locked bitmap, which operations can read without
+// sharing its containers with their results, and a copy of a bitmap owning
+// all its containers, including those shared through copy-on-write.
+roaring_bitmap_t rb_roaring32_view(const roaring_bitmap_t *bitmap);
+roaring_bitmap_t *rb_roaring32_copy(const roaring_bitmap_t *bitmap);
+
+// Sampling building blocks shared with Bitmap64, which samples its buckets
+// of 32-bit values with them. rb_roaring32_select_many resolves ascending
+// `ranks`, counted from `base`, into `values` and returns how many it found.
+// rb_roaring32_bernoulli calls `random`, which may raise, so `bitmap` must
+// be locked and `result` owned by a Ruby object or freed on exceptions.
+size_t rb_roaring32_select_many(const roaring_bitmap_t *bitmap, uint64_t base, const uint64_t *ranks, size_t count, uint32_t *values);
+void rb_roaring32_bernoulli(const roaring_bitmap_t *bitmap, double fraction, VALUE random, roaring_bitmap_t *result);
+
+// Runs of consecutive values, collected in a String as native-endian uint64
+// (start, length) pairs. rb_roaring32_ranges appends those of `bitmap`, plus
+// `base`, joining a run with the previous one when they touch.
+// rb_roaring_ranges_result turns them into the result of `to_ranges(packed:)`.
+// rb_roaring32_yield_ranges yields them instead, a container at a time,
+// keeping the last one in `ranges` since the next bitmap may extend it, and
+// rb_roaring_ranges_yield yields what's left.
+// rb_roaring_ranges_each_closed calls `func` with the bounds of each Range of
+// `list`, or pair of a packed String, after checking they're at most `max`.
+typedef void rb_roaring_range_func(void *arg, uint64_t min, uint64_t max);
+void rb_roaring32_ranges(const roaring_bitmap_t *bitmap, uint64_t base, VALUE ranges);
+VALUE rb_roaring_ranges_result(VALUE ranges, VALUE opts);
+void rb_roaring32_yield_ranges(const roaring_bitmap_t *bitmap, uint64_t base, VALUE ranges);
+void rb_roaring_ranges_yield(VALUE ranges);
+void rb_roaring_ranges_each_closed(VALUE list, uint64_t max, rb_roaring_range_func *func, void *arg);
+
+// Bitmap64s hold their values in a 32-bit bitmap until one doesn't fit in
+// 32 bits. Locking one sets whichever of `bitmap32` and `bitmap` it uses,
+// and the other to NULL.
+bool rb_roaring64_bitmap_p(VALUE obj);
+void rb_roaring64_lock(VALUE obj, const roaring_bitmap_t **bitmap32, const roaring64_bitmap_t **bitmap);
+void rb_roaring64_unlock(VALUE obj);
+VALUE rb_roaring64_wrap(roaring64_bitmap_t *bitmap);
+VALUE rb_roaring64_wrap32(roaring_bitmap_t *bitmap);
+
+// Operations between a Bitmap32 and a Bitmap64, in either order. Set
+// operations return a Bitmap64.
+typedef enum {
+    RB_ROARING_AND,
+    RB_ROARING_OR,
+    RB_ROARING_XOR,
+    RB_ROARING_ANDNOT,
+    RB_ROARING_EQ,
+    RB_ROARING_LT,
+    RB_ROARING_LTE,
+    RB_ROARING_INTERSECT,
+    RB_ROARING_AND_CARDINALITY,
+} rb_roaring_op;
+VALUE rb_roaring64_mixed_op(VALUE left, VALUE right, rb_roaring_op op);
+
+// Returns a number never returned before, to stamp the bitmaps it modifies
+// or creates with, see Bitmap32#generation
+uint64_t rb_roaring_next_generation(void);
+
+// The number of threads jobs are spread across, see Roaring.parallelism=
+int rb_roaring_parallelism(void);
+
+typedef void rb_roaring_task_func(void *arg, size_t index);
+
+// Calls `func(arg, i)` for every i in 0...count, spread across the thread
+// pool (see Roaring.parallelism). Must be called without the GVL.
+void rb_roaring_parallel_for(size_t count, rb_roaring_task_func *func, void *arg);
+
+// The minimum size in bytes of operations to pass to rb_roaring_offload,
+// or SIZE_MAX if they shouldn't be, see Roaring.offload_threshold=
+size_t rb_roaring_offload_threshold(void);
+
+// Calls `func(arg)` on a separate native thread while the current fiber
+// waits for it through the fiber scheduler, letting other fibers run.
+// `func` always runs to completion. Returns the state of an exception
+// raised while waiting, to be re-raised with rb_jump_tag after cleaning up.
+int rb_roaring_offload(void *(*func)(void *), void *arg);
+
+// Interns byte strings as dense uint32 ids, see strtab.c
+typedef struct {
+    char *arena;
+    size_t arena_capa;
+    uint32_t *offsets;
+    size_t offsets_capa;
+    uint32_t count;
+    uint32_t *slots;
+    uint32_t mask;
+} rb_roaring_strtab_t;
+
+void rb_roaring_strtab_init(rb_roaring_strtab_t *t);
+void rb_roaring_strtab_free(rb_roaring_strtab_t *t);
+size_t rb_roaring_strtab_memsize(const rb_roaring_strtab_t *t);
+
+// Returns the id of a string, or UINT32_MAX if it isn't in the table
+uint32_t rb_roaring_strtab_find(const rb_roaring_strtab_t *t, const char *ptr, size_t len);
+
+// Returns the id of a string, adding it to the table if needed
+uint32_t rb_roaring_strtab_intern(rb_roaring_strtab_t *t, const char *ptr, size_t len);
+
+// Returns the string with the given id as a new UTF-8 String
+VALUE rb_roaring_strtab_str(const rb_roaring_strtab_t *t, uint32_t id);
+
+// Serializes a table in a format which can be read in place, see
+// rb_roaring_strtab_view. `buf` must hold rb_roaring_strtab_serialized_size bytes.
+size_t rb_roaring_strtab_serialized_size(const rb_roaring_strtab_t *t);
+void rb_roaring_strtab_serialize(const rb_roaring_strtab_t *t, char *buf);
+bool rb_roaring_strtab_view(rb_roaring_strtab_t *t, const char *buf, size_t len);
+
+// Initializes `dest` with a copy of `src`, which may be a view
+void rb_roaring_strtab_copy(rb_roaring_strtab_t *dest, const rb_roaring_strtab_t *src);
+
+static inline const char *rb_roaring_strtab_ptr(const rb_roaring_strtab_t *t, uint32_t id)
+{
+    return t->arena + t->offsets[id];
+}
+
+static inline size_t rb_roaring_strtab_len(const rb_roaring_strtab_t *t, uint32_t id)
+{
+    return t->offsets[id + 1] - t->offsets[id];
+}
 
 #endif
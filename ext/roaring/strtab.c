@@ -0,0 +1,283 @@
+#include "roaring_ruby.h"
+
+#include <string.h>
+
+// A table interning byte strings, giving each one a dense uint32 id in the
+// order they were added.
+//
+// The strings are stored back to back in one arena, with the offset of each
+// one in `offsets`. `offsets` has an extra entry at the end, so the length
+// of string `id` is `offsets[id + 1] - offsets[id]`. Lookups go through an
+// open addressing hash table with linear probing, whose slots hold `id + 1`,
+// 0 marking empty slots. The hash function is fixed, so that the table can
+// be stored and loaded as is.
+
+#define STRTAB_MIN_SLOTS 16
+
+// FNV-1a
+static uint32_t strtab_hash(const char *ptr, size_t len)
+{
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (unsigned char)ptr[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+void rb_roaring_strtab_init(rb_roaring_strtab_t *t)
+{
+    memset(t, 0, sizeof(*t));
+    t->offsets = ZALLOC_N(uint32_t, 1);
+    t->offsets_capa = 1;
+    t->slots = ZALLOC_N(uint32_t, STRTAB_MIN_SLOTS);
+    t->mask = STRTAB_MIN_SLOTS - 1;
+}
+
+void rb_roaring_strtab_free(rb_roaring_strtab_t *t)
+{
+    xfree(t->arena);
+    xfree(t->offsets);
+    xfree(t->slots);
+}
+
+size_t rb_roaring_strtab_memsize(const rb_roaring_strtab_t *t)
+{
+    return t->arena_capa + t->offsets_capa * sizeof(uint32_t) + (t->mask + 1) * sizeof(uint32_t);
+}
+
+static bool strtab_equal(const rb_roaring_strtab_t *t, uint32_t id, const char *ptr, size_t len)
+{
+    return rb_roaring_strtab_len(t, id) == len && memcmp(rb_roaring_strtab_ptr(t, id), ptr, len) == 0;
+}
+
+// Returns the slot holding `ptr`, or the empty slot where it would go
+static uint32_t strtab_slot(const rb_roaring_strtab_t *t, const char *ptr, size_t len)
+{
+    uint32_t slot = strtab_hash(ptr, len) & t->mask;
+    while (t->slots[slot] && !strtab_equal(t, t->slots[slot] - 1, ptr, len)) {
+        slot = (slot + 1) & t->mask;
+    }
+    return slot;
+}
+
+uint32_t rb_roaring_strtab_find(const rb_roaring_strtab_t *t, const char *ptr, size_t len)
+{
+    return t->slots[strtab_slot(t, ptr, len)] - 1;
+}
+
+static void strtab_rehash(rb_roaring_strtab_t *t, uint32_t slot_count)
+{
+    xfree(t->slots);
+    t->slots = ZALLOC_N(uint32_t, slot_count);
+    t->mask = slot_count - 1;
+
+    for (uint32_t id = 0; id < t->count; id++) {
+        uint32_t slot = strtab_slot(t, rb_roaring_strtab_ptr(t, id), rb_roaring_strtab_len(t, id));
+        t->slots[slot] = id + 1;
+    }
+}
+
+uint32_t rb_roaring_strtab_intern(rb_roaring_strtab_t *t, const char *ptr, size_t len)
+{
+    uint32_t slot = strtab_slot(t, ptr, len);
+    if (t->slots[slot]) {
+        return t->slots[slot] - 1;
+    }
+
+    uint32_t end = t->offsets[t->count];
+    if (t->count >= UINT32_MAX - 1 || len > UINT32_MAX - end) {
+        rb_raise(rb_eRangeError, "string table is full");
+    }
+
+    if (end + len > t->arena_capa) {
+        size_t capa = t->arena_capa ? t->arena_capa : 64;
+        while (capa < end + len) {
+            capa *= 2;
+        }
+        REALLOC_N(t->arena, char, capa);
+        t->arena_capa = capa;
+    }
+    if (t->count + 2 > t->offsets_capa) {
+        t->offsets_capa *= 2;
+        REALLOC_N(t->offsets, uint32_t, t->offsets_capa);
+    }
+
+    uint32_t id = t->count++;
+    memcpy(t->arena + end, ptr, len);
+    t->offsets[id + 1] = end + (uint32_t)len;
+    t->slots[slot] = id + 1;
+
+    // Keep the load factor under 1/2
+    if ((size_t)t->count * 2 > (size_t)t->mask + 1) {
+        strtab_rehash(t, (t->mask + 1) * 2);
+    }
+
+    return id;
+}
+
+VALUE rb_roaring_strtab_str(const rb_roaring_strtab_t *t, uint32_t id)
+{
+    return rb_utf8_str_new(rb_roaring_strtab_ptr(t, id), rb_roaring_strtab_len(t, id));
+}
+
+// The serialized format is the table's own memory layout, so that a table
+// can be read in place from a mapped file. All integers are little-endian
+// uint32s, and every section starts 4-byte aligned:
+//
+//   "RSTR", version, count, slot count,
+//   offsets (count + 1), slots (slot count), arena (offsets[count] bytes)
+#define STRTAB_MAGIC "RSTR"
+#define STRTAB_VERSION 1
+#define STRTAB_HEADER_SIZE 16
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define STRTAB_NATIVE 0
+#else
+#define STRTAB_NATIVE 1
+#endif
+
+size_t rb_roaring_strtab_serialized_size(const rb_roaring_strtab_t *t)
+{
+    return STRTAB_HEADER_SIZE + ((size_t)t->count + 1 + t->mask + 1) * sizeof(uint32_t) + t->offsets[t->count];
+}
+
+static void strtab_put(char *buf, const uint32_t *values, size_t count)
+{
+#if STRTAB_NATIVE
+    memcpy(buf, values, count * sizeof(uint32_t));
+#else
+    for (size_t i = 0; i < count; i++) {
+        uint32_t value = values[i];
+        for (int b = 0; b < 4; b++) {
+            buf[i * 4 + b] = (char)(value >> (b * 8));
+        }
+    }
+#endif
+}
+
+void rb_roaring_strtab_serialize(const rb_roaring_strtab_t *t, char *buf)
+{
+    uint32_t header[4] = { 0, STRTAB_VERSION, t->count, t->mask + 1 };
+    strtab_put(buf, header, 4);
+    memcpy(buf, STRTAB_MAGIC, 4);
+    buf += STRTAB_HEADER_SIZE;
+
+    strtab_put(buf, t->offsets, (size_t)t->count + 1);
+    buf += ((size_t)t->count + 1) * sizeof(uint32_t);
+    strtab_put(buf, t->slots, (size_t)t->mask + 1);
+    buf += ((size_t)t->mask + 1) * sizeof(uint32_t);
+    memcpy(buf, t->arena, t->offsets[t->count]);
+}
+
+static uint32_t strtab_get(const char *buf)
+{
+    const unsigned char *p = (const unsigned char *)buf;
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+// Checks that every id is in exactly one slot, which leaves an empty slot
+// for lookups to stop at, and that each one can be found from the slot its
+// string hashes to: no empty slot may come between the two.
+static bool strtab_valid_slots(const rb_roaring_strtab_t *t)
+{
+    uint32_t slot_count = t->mask + 1;
+    uint32_t start = 0;
+    while (start < slot_count && t->slots[start]) {
+        start++;
+    }
+    if (start == slot_count) {
+        return false;
+    }
+
+    // Go around the table once from an empty slot, so that the last empty
+    // slot before each id is known
+    bool valid = true;
+    uint32_t filled = 0;
+    uint32_t last_empty = start;
+    char *seen = ZALLOC_N(char, t->count);
+    for (uint32_t i = 1; i < slot_count && valid; i++) {
+        uint32_t slot = (start + i) & t->mask;
+        uint32_t value = t->slots[slot];
+        if (!value) {
+            last_empty = slot;
+            continue;
+        }
+
+        uint32_t id = value - 1;
+        if (value > t->count || seen[id]) {
+            valid = false;
+            break;
+        }
+        seen[id] = 1;
+        filled++;
+
+        uint32_t home = strtab_hash(rb_roaring_strtab_ptr(t, id), rb_roaring_strtab_len(t, id)) & t->mask;
+        if (((slot - home) & t->mask) >= ((slot - last_empty) & t->mask)) {
+            valid = false;
+        }
+    }
+    xfree(seen);
+
+    return valid && filled == t->count;
+}
+
+// Points `t` into a serialized table in `buf`, which must be 4-byte aligned
+// and outlive `t`. Returns false if `buf` isn't a valid table, or can't be
+// read in place on this platform. The table must not be modified or freed.
+bool rb_roaring_strtab_view(rb_roaring_strtab_t *t, const char *buf, size_t len)
+{
+    if (!STRTAB_NATIVE || ((uintptr_t)buf & 3) || len < STRTAB_HEADER_SIZE
+        || memcmp(buf, STRTAB_MAGIC, 4) != 0 || strtab_get(buf + 4) != STRTAB_VERSION) {
+        return false;
+    }
+
+    uint32_t count = strtab_get(buf + 8);
+    uint32_t slot_count = strtab_get(buf + 12);
+    // The table needs an empty slot for lookups to end
+    if (count == UINT32_MAX || slot_count <= count || (slot_count & (slot_count - 1))) {
+        return false;
+    }
+
+    size_t arrays = ((size_t)count + 1 + slot_count) * sizeof(uint32_t);
+    if (arrays > len - STRTAB_HEADER_SIZE) {
+        return false;
+    }
+
+    const uint32_t *offsets = (const uint32_t *)(buf + STRTAB_HEADER_SIZE);
+    const uint32_t *slots = offsets + count + 1;
+    size_t arena_len = len - STRTAB_HEADER_SIZE - arrays;
+    if (offsets[0] != 0 || offsets[count] != arena_len) {
+        return false;
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        if (offsets[i] > offsets[i + 1]) {
+            return false;
+        }
+    }
+
+    memset(t, 0, sizeof(*t));
+    t->arena = (char *)(slots + slot_count);
+    t->offsets = (uint32_t *)offsets;
+    t->slots = (uint32_t *)slots;
+    t->count = count;
+    t->mask = slot_count - 1;
+    return strtab_valid_slots(t);
+}
+
+void rb_roaring_strtab_copy(rb_roaring_strtab_t *dest, const rb_roaring_strtab_t *src)
+{
+    size_t arena_len = src->offsets[src->count];
+
+    memset(dest, 0, sizeof(*dest));
+    dest->arena_capa = arena_len;
+    dest->arena = ALLOC_N(char, arena_len);
+    memcpy(dest->arena, src->arena, arena_len);
+    dest->offsets_capa = (size_t)src->count + 1;
+    dest->offsets = ALLOC_N(uint32_t, dest->offsets_capa);
+    memcpy(dest->offsets, src->offsets, dest->offsets_capa * sizeof(uint32_t));
+    dest->slots = ALLOC_N(uint32_t, (size_t)src->mask + 1);
+    memcpy(dest->slots, src->slots, ((size_t)src->mask + 1) * sizeof(uint32_t));
+    dest->count = src->count;
+    dest->mask = src->mask;
+}
@@ -2,6 +2,13 @@
 
 require_relative "roaring/version"
 require_relative "roaring/roaring"
+require_relative "roaring/query"
+require_relative "roaring/result_cache"
+require_relative "roaring/inverted_index"
+require_relative "roaring/dictionary"
+require_relative "roaring/lsh_index"
+require_relative "roaring/windowed_bitmap"
+require_relative "roaring/range_encoded_index"
 require "set"
 
 module Roaring
@@ -147,6 +154,15 @@ module Roaring
       !intersect?(other)
     end
 
+    # The size of the intersection of `self` and `other` over the size of
+    # their union, computed without building either
+    # @return [Float] between 0.0 and 1.0, or 1.0 if both are empty
+    def jaccard_index(other)
+      intersection = and_cardinality(other)
+      union = cardinality + other.cardinality - intersection
+      union.zero? ? 1.0 : intersection.fdiv(union)
+    end
+
     def _dump level
       serialize
     end
@@ -179,6 +195,13 @@ module Roaring
     MIN = 0
     MAX = (2**32) - 1
     RANGE = MIN..MAX
+
+    # @private
+    def initialize_clone(other, **kwargs)
+      super
+      # Frozen bitmaps must not share containers, see {#freeze}
+      self.copy_on_write = false if kwargs[:freeze]
+    end
   end
 
   class Bitmap64
@@ -190,5 +213,37 @@ module Roaring
     MIN = 0
     MAX = (2**64) - 1
     RANGE = MIN..MAX
+
+    def initialize(enum = nil)
+      # Bitmap32s are copied container by container, see #replace
+      if Bitmap32 === enum
+        replace(enum)
+      else
+        super
+      end
+    end
+  end
+
+  # A flat bitset of 32-bit integers, with the same API as {Bitmap32}. It
+  # uses one bit for every integer up to its largest element, which makes
+  # {#include?} and {#add} faster than a Bitmap32's for dense values in a
+  # small range, and wasteful for sparse ones.
+  class Bitset
+    include BitmapCommon
+    extend BitmapCommon::ClassMethods
+
+    define_roaring_aliases!
+
+    MIN = 0
+    MAX = (2**32) - 1
+    RANGE = MIN..MAX
+
+    def initialize(enum = nil)
+      if Bitmap32 === enum
+        replace(enum.to_bitset)
+      else
+        super
+      end
+    end
   end
 end
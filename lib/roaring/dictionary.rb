@@ -0,0 +1,59 @@
+# frozen_string_literal: true
+
+module Roaring
+  # Interns strings as dense Integer ids, so that sets of strings can be
+  # stored and combined as {Bitmap32}s of their ids.
+  #
+  # Strings are kept back to back in a single buffer, and ids are never
+  # reused, so bitmaps encoded with a dictionary stay valid as it grows.
+  # Strings are compared by their bytes, and decoded as UTF-8.
+  #
+  # @example
+  #   dictionary = Roaring::Dictionary.new
+  #   customers = dictionary.encode(["alice@example.com", "bob@example.com"])
+  #   subscribers = dictionary.encode(["bob@example.com", "carol@example.com"])
+  #   dictionary.decode(customers & subscribers) # => ["bob@example.com"]
+  class Dictionary
+    class << self
+      # Loads a dictionary written with {#dump_file}, mapping the file into
+      # memory where supported (see {.mmap})
+      # @param path [String]
+      # @return [Dictionary]
+      def load_file(path)
+        if respond_to?(:mmap)
+          mmap(path)
+        else
+          deserialize(File.binread(path)).freeze
+        end
+      end
+
+      def _load(args)
+        deserialize(args)
+      end
+    end
+
+    alias_method :length, :size
+
+    # @param str [String]
+    # @return [Boolean] whether `str` is in the dictionary
+    def include?(str)
+      !id(str).nil?
+    end
+
+    # Writes the dictionary to a file, to be loaded with {.load_file}
+    # @param path [String]
+    # @return [self]
+    def dump_file(path)
+      File.binwrite(path, serialize)
+      self
+    end
+
+    def _dump(_level)
+      serialize
+    end
+
+    def inspect
+      "#<#{self.class} (#{size} strings)>"
+    end
+  end
+end
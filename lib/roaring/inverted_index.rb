@@ -0,0 +1,35 @@
+# frozen_string_literal: true
+
+module Roaring
+  # Maps terms to the documents containing them, as {Bitmap32} postings.
+  #
+  # Documents are identified by Integer ids between 0 and 2**32 - 1. Searches
+  # combine the postings of terms natively, intersecting the smallest ones
+  # first, without building a bitmap for every step in Ruby.
+  #
+  # @example
+  #   index = Roaring::InvertedIndex.new
+  #   index.index(1, ["red", "shirt"])
+  #   index.index(2, ["blue", "shirt"])
+  #   index.index(3, ["red", "dress"])
+  #   index.search([:and, "red", [:or, "shirt", "dress"]]) # => #<Roaring::Bitmap32 {1, 3}>
+  #   index.delete(3)
+  #   index.count("red") # => 1
+  class InvertedIndex
+    class << self
+      def _load(args)
+        deserialize(args)
+      end
+    end
+
+    alias_method :size, :doc_count
+
+    def _dump(_level)
+      serialize
+    end
+
+    def inspect
+      "#<#{self.class} (#{doc_count} documents, #{term_count} terms)>"
+    end
+  end
+end
@@ -0,0 +1,140 @@
+# frozen_string_literal: true
+
+module Roaring
+  # Finds bitmaps similar to a query bitmap, by {BitmapCommon#jaccard_index},
+  # without comparing it to every bitmap in the index.
+  #
+  # Bitmaps are indexed by their {Bitmap32#minhash} signature, split into
+  # `bands` bands of `rows` hashes. Bitmaps sharing a whole band with the
+  # query are candidates, and only those are compared to it exactly. A pair
+  # with Jaccard index `s` shares at least one band with probability
+  # `1 - (1 - s**rows)**bands`, so more rows make candidates more similar,
+  # and more bands make similar bitmaps less likely to be missed.
+  #
+  # Bitmaps are indexed as they are when added, add them again after
+  # modifying them.
+  #
+  # @example
+  #   index = Roaring::LSHIndex.new
+  #   index.add(:a, Roaring::Bitmap32.new(0...1000))
+  #   index.add(:b, Roaring::Bitmap32.new(10...1000))
+  #   index.add(:c, Roaring::Bitmap32.new(5000...6000))
+  #   index.search(Roaring::Bitmap32.new(0...990), threshold: 0.5) # => [[:a, 0.99], [:b, 0.98]]
+  class LSHIndex
+    include Enumerable
+
+    attr_reader :bands, :rows, :seed
+
+    # @param bands [Integer] the number of bands signatures are split into
+    # @param rows [Integer] the number of hashes in each band
+    # @param seed [Integer] picks the hash functions, see {Bitmap32#minhash}
+    def initialize(bands: 32, rows: 4, seed: 0)
+      raise ArgumentError, "bands and rows must be positive" unless bands.positive? && rows.positive?
+
+      @bands = bands
+      @rows = rows
+      @seed = seed
+      @entries = {}
+      @buckets = Array.new(bands) { {} }
+    end
+
+    # Adds a bitmap under `key`, replacing the one already there
+    # @param key [Object] identifies the bitmap in results
+    # @param bitmap [Bitmap32]
+    # @return [self]
+    def add(key, bitmap)
+      delete(key)
+      signature = signature(bitmap)
+      @entries[key] = [bitmap, signature]
+      each_band(signature) { |bucket, band| (bucket[band] ||= []) << key }
+      self
+    end
+    alias_method :[]=, :add
+
+    # Removes the bitmap under `key`
+    # @return [Bitmap32, nil] the removed bitmap
+    def delete(key)
+      bitmap, signature = @entries.delete(key)
+      return unless bitmap
+
+      each_band(signature) do |bucket, band|
+        keys = bucket[band]
+        keys.delete(key)
+        bucket.delete(band) if keys.empty?
+      end
+      bitmap
+    end
+
+    # @return [Bitmap32, nil] the bitmap under `key`
+    def [](key)
+      @entries[key]&.first
+    end
+
+    def include?(key)
+      @entries.key?(key)
+    end
+
+    def size
+      @entries.size
+    end
+    alias_method :length, :size
+
+    def empty?
+      @entries.empty?
+    end
+
+    # Yields every key and bitmap
+    def each
+      return enum_for(:each) { size } unless block_given?
+
+      @entries.each { |key, (bitmap, _)| yield key, bitmap }
+      self
+    end
+
+    # The keys of the bitmaps sharing at least one band with `bitmap`, which
+    # are likely to be similar to it
+    # @param bitmap [Bitmap32]
+    # @return [Array] keys, in the order they were added
+    def candidates(bitmap)
+      found = {}
+      each_band(signature(bitmap)) do |bucket, band|
+        bucket[band]&.each { |key| found[key] = true }
+      end
+      found.keys
+    end
+
+    # The bitmaps similar to `bitmap`. Only candidates are compared to it,
+    # so a few similar bitmaps may be missed, see {LSHIndex}.
+    # @param bitmap [Bitmap32]
+    # @param threshold [Float] the minimum Jaccard index of the results
+    # @param limit [Integer, nil] the maximum number of results
+    # @return [Array<Array(Object, Float)>] keys and their exact Jaccard
+    #   index with `bitmap`, most similar first
+    def search(bitmap, threshold: 0.5, limit: nil)
+      results = []
+      candidates(bitmap).each do |key|
+        similarity = @entries[key].first.jaccard_index(bitmap)
+        results << [key, similarity] if similarity >= threshold
+      end
+      results.sort_by! { |_, similarity| -similarity }
+      limit ? results.first(limit) : results
+    end
+
+    def inspect
+      "#<#{self.class} (#{size} bitmaps, #{bands}x#{rows})>"
+    end
+
+    private
+
+    def signature(bitmap)
+      bitmap.minhash(bands * rows, seed: seed)
+    end
+
+    # Bands are bucketed by their hash, since collisions only add candidates
+    def each_band(signature)
+      @buckets.each_with_index do |bucket, i|
+        yield bucket, signature[i * rows, rows].hash
+      end
+    end
+  end
+end
@@ -0,0 +1,174 @@
+# frozen_string_literal: true
+
+module Roaring
+  # A boolean expression over bitmaps, evaluated in a single native call.
+  #
+  # Combining bitmaps with `&`, `|`, `^` and `-` directly allocates a new
+  # bitmap for every operator. A query instead records the operators, and
+  # computes the whole expression at once, reusing intermediate results in
+  # place and without going back to Ruby in between.
+  #
+  # All operands must be of the same class, either {Bitmap32} or {Bitmap64}.
+  # They're read when the query is evaluated, not when it's built, and can't
+  # be modified while a query is evaluating them (including from the block
+  # given to {#each}).
+  #
+  # @example
+  #   query = (Roaring::Query[a] | b | c) & (Roaring::Query[d] - e) & f
+  #   query.count      # => the size of the result, without building it
+  #   query.to_bitmap  # => the result, as a new bitmap
+  class Query
+    include Enumerable
+
+    # @private
+    attr_reader :tree
+
+    # @param bitmap [Bitmap32,Bitmap64,Query] the first operand
+    # @return [Query]
+    def self.[](bitmap)
+      new(bitmap)
+    end
+
+    # @param bitmap [Bitmap32,Bitmap64,Query] the first operand
+    def initialize(bitmap)
+      @tree = operand(bitmap)
+    end
+
+    # @param other [Query,Bitmap32,Bitmap64]
+    # @return [Query] the intersection of `self` and `other`
+    def &(other)
+      combine(:and, other)
+    end
+
+    # @param other [Query,Bitmap32,Bitmap64]
+    # @return [Query] the union of `self` and `other`
+    def |(other)
+      combine(:or, other)
+    end
+
+    # @param other [Query,Bitmap32,Bitmap64]
+    # @return [Query] the symmetric difference of `self` and `other`
+    def ^(other)
+      combine(:xor, other)
+    end
+
+    # @param other [Query,Bitmap32,Bitmap64]
+    # @return [Query] the elements of `self` which aren't in `other`
+    def -(other)
+      combine(:andnot, other)
+    end
+
+    alias_method :and, :&
+    alias_method :or, :|
+    alias_method :xor, :^
+    alias_method :andnot, :-
+
+    # @return [Bitmap32,Bitmap64] the result of the query
+    def to_bitmap
+      evaluate(:to_bitmap)
+    end
+
+    # Counts the elements in the result, without building it unless `item`
+    # or a block is given
+    # @return [Integer]
+    def count(*args, &block)
+      return super if block || !args.empty?
+
+      evaluate(:count)
+    end
+
+    alias_method :size, :count
+    alias_method :cardinality, :count
+
+    # @return [Boolean] whether the result is non-empty, computed without
+    #   building it unless a pattern or a block is given
+    def any?(*args, &block)
+      return super if block || !args.empty?
+
+      evaluate(:any?)
+    end
+
+    # @return [Boolean] whether the result is empty
+    def empty?
+      !any?
+    end
+
+    # Iterates over the elements of the result in order. Intersections and
+    # differences are filtered as they're iterated rather than built.
+    # @return [self]
+    def each(&block)
+      return enum_for(:each) unless block
+
+      evaluate(:each, &block)
+    end
+
+    # Describes how the query will be evaluated: in which order operations
+    # and their operands run, with the number of elements each one holds, or
+    # at most holds for operations.
+    #
+    # @example
+    #   puts (Roaring::Query[large] & (Roaring::Query[medium] - excluded) & small).explain
+    #   # andnot (<= 10)
+    #   #   and (<= 10)
+    #   #     Bitmap32 (10)
+    #   #     Bitmap32 (5000)
+    #   #     Bitmap32 (100000)
+    #   #   Bitmap32 (300)
+    # @return [String]
+    def explain
+      lines = []
+      explain_node(evaluate(:plan), 0, lines)
+      lines.join("\n")
+    end
+
+    def inspect
+      "#<#{self.class} #{describe(@tree)}>"
+    end
+
+    private
+
+    def operand(value)
+      case value
+      when Query then value.tree
+      when BitmapCommon then value
+      else raise TypeError, "wrong operand type #{value.class} (expected a bitmap or a Query)"
+      end
+    end
+
+    def combine(op, other)
+      right = operand(other)
+
+      # Chains of the same operator are evaluated as one, from left to right
+      operands = Array === @tree && @tree[0] == op ? @tree.drop(1) : [@tree]
+      if op != :andnot && Array === right && right[0] == op
+        operands.concat(right.drop(1))
+      else
+        operands << right
+      end
+
+      query = Query.allocate
+      query.instance_variable_set(:@tree, [op, *operands].freeze)
+      query
+    end
+
+    OPERATORS = { and: "&", or: "|", xor: "^", andnot: "-" }.freeze
+    private_constant :OPERATORS
+
+    def explain_node(node, depth, lines)
+      op, cardinality, *operands = node
+      indent = "  " * depth
+      if op == :bitmap
+        lines << "#{indent}#{operands[0].class.name.split("::").last} (#{cardinality})"
+      else
+        lines << "#{indent}#{op} (<= #{cardinality})"
+        operands.each { |operand| explain_node(operand, depth + 1, lines) }
+      end
+    end
+
+    def describe(tree)
+      return "#{tree.class.name.split("::").last}(#{tree.cardinality})" unless Array === tree
+
+      "(#{tree.drop(1).map { |operand| describe(operand) }.join(" #{OPERATORS[tree[0]]} ")})"
+    end
+  end
+end
@@ -0,0 +1,192 @@
+# frozen_string_literal: true
+
+module Roaring
+  # Filters the rows of a column of ordered values by range, for columns with
+  # few distinct values, such as age brackets or priorities.
+  #
+  # For each distinct value `v`, the index keeps the {Bitmap32} of rows whose
+  # value is at most `v`. Any range of values is then the difference of two
+  # of these bitmaps, and counting its rows doesn't need any bitmap operation.
+  #
+  # Rows are identified by Integers between 0 and 2**32 - 1, such as their
+  # position in the column, and each row has at most one value.
+  #
+  # @example
+  #   priorities = [3, 1, 2, 3, 0].pack("C*")
+  #   index = Roaring::RangeEncodedIndex.build(priorities, type: :uint8)
+  #   index.ge(2) # => #<Roaring::Bitmap32 {0, 2, 3}>
+  #   index.between(1, 2) # => #<Roaring::Bitmap32 {1, 2}>
+  #   index.count(1, 2) # => 2
+  class RangeEncodedIndex
+    MAGIC = "RREI"
+    FORMAT_VERSION = 1
+
+    # How values are serialized
+    VALUE_FORMATS = ["q<", "Q<", "E"].freeze
+
+    class << self
+      # Indexes a packed column, see {Bitmap32.group_column}
+      # @param column [String] one number per row, in native byte order
+      # @param type [Symbol] the type of the numbers, such as `:uint8`
+      # @return [RangeEncodedIndex]
+      def build(column, type:)
+        new(Bitmap32.group_column(column, type: type))
+      end
+
+      # Loads an index written with {#serialize}
+      # @param data [String]
+      # @return [RangeEncodedIndex]
+      def deserialize(data)
+        magic, version, kind, count = data.unpack("a4L<L<L<")
+        raise ArgumentError, "invalid serialized index" unless magic == MAGIC && count && VALUE_FORMATS[kind]
+        raise ArgumentError, "unsupported index format version #{version}" unless version == FORMAT_VERSION
+
+        offset = 16 + count * 8
+        values = data.byteslice(16, count * 8).unpack("#{VALUE_FORMATS[kind]}*")
+        raise ArgumentError, "invalid serialized index" if values.size != count
+
+        groups = values.to_h do |value|
+          length = data.byteslice(offset, 8)&.unpack1("Q<")
+          raise ArgumentError, "invalid serialized index" if length.nil? || offset + 8 + length > data.bytesize
+
+          rows = Bitmap32.deserialize(data.byteslice(offset + 8, length))
+          offset += 8 + length
+          [value, rows]
+        end
+        raise ArgumentError, "invalid serialized index" if offset != data.bytesize
+
+        new(groups)
+      end
+
+      def _load(args)
+        deserialize(args)
+      end
+    end
+
+    # @return [Array] the distinct values of the indexed rows, in ascending order
+    attr_reader :values
+
+    # @param groups [Hash{Comparable => Bitmap32}] the rows holding each value,
+    #   which mustn't overlap
+    def initialize(groups = {})
+      @values = groups.keys.sort.freeze
+      rows = Bitmap32.new
+      @cumulative = @values.map { |value| rows |= groups.fetch(value) }
+      @cumulative.each(&:freeze)
+    end
+
+    # @return [Bitmap32] every indexed row
+    def rows
+      at_most(@values.size).dup
+    end
+
+    # @return [Integer] the number of indexed rows
+    def size
+      at_most(@values.size).cardinality
+    end
+    alias_method :length, :size
+
+    # @return [Bitmap32] the rows whose value is `value`
+    def eq(value)
+      slice(rank(value), rank(value, inclusive: true))
+    end
+    alias_method :[], :eq
+
+    # @return [Bitmap32] the rows whose value is less than `value`
+    def lt(value)
+      slice(0, rank(value))
+    end
+
+    # @return [Bitmap32] the rows whose value is less than or equal to `value`
+    def le(value)
+      slice(0, rank(value, inclusive: true))
+    end
+
+    # @return [Bitmap32] the rows whose value is greater than `value`
+    def gt(value)
+      slice(rank(value, inclusive: true), @values.size)
+    end
+
+    # @return [Bitmap32] the rows whose value is greater than or equal to `value`
+    def ge(value)
+      slice(rank(value), @values.size)
+    end
+
+    # @return [Bitmap32] the rows whose value is between `min` and `max`, inclusive
+    def between(min, max)
+      slice(rank(min), rank(max, inclusive: true))
+    end
+
+    # Counts the rows whose value is between `min` and `max`, inclusive,
+    # without building a bitmap
+    # @return [Integer]
+    def count(min, max)
+      lower = rank(min)
+      upper = rank(max, inclusive: true)
+      return 0 if upper <= lower
+
+      at_most(upper).cardinality - at_most(lower).cardinality
+    end
+
+    # Serializes the index in a portable format, little-endian:
+    #
+    #   "RREI", u32 version, u32 value format (0 for int64, 1 for uint64,
+    #   2 for double), u32 value count, the values, then for each value:
+    #   u64 length, and the rows holding it as a portable bitmap
+    #
+    # Rows are stored once for the value they hold, rather than in every
+    # cumulative bitmap, which {.deserialize} rebuilds.
+    # @return [String]
+    def serialize
+      kind = value_format
+      header = [MAGIC, FORMAT_VERSION, kind, @values.size].pack("a4L<L<L<")
+      values = @values.pack("#{VALUE_FORMATS[kind]}*")
+      previous = Bitmap32.new
+      groups = @cumulative.map do |rows|
+        data = (rows - previous).serialize
+        previous = rows
+        [data.bytesize].pack("Q<") + data
+      end
+      header + values + groups.join
+    end
+
+    def _dump(_level)
+      serialize
+    end
+
+    def inspect
+      "#<#{self.class} (#{@values.size} values, #{size} rows)>"
+    end
+
+    private
+
+    # The number of distinct values less than `value`, or at most `value`
+    def rank(value, inclusive: false)
+      index = @values.bsearch_index { |v| inclusive ? v > value : v >= value }
+      index || @values.size
+    end
+
+    # The rows holding one of the `count` smallest values
+    def at_most(count)
+      count.zero? ? Bitmap32.new : @cumulative[count - 1]
+    end
+
+    # The rows holding one of the values ranked from `lower` to `upper` - 1
+    def slice(lower, upper)
+      return Bitmap32.new if upper <= lower
+      return at_most(upper).dup if lower.zero?
+
+      at_most(upper) - at_most(lower)
+    end
+
+    def value_format
+      if @values.all?(Integer)
+        @values.first.to_i.negative? ? 0 : 1
+      elsif @values.all?(Numeric)
+        2
+      else
+        raise TypeError, "only indexes of numbers can be serialized"
+      end
+    end
+  end
+end
@@ -0,0 +1,157 @@
+# frozen_string_literal: true
+
+require "objspace"
+
+module Roaring
+  # Memoizes the results of operations on bitmaps, for workloads evaluating
+  # the same combinations of rarely changing bitmaps over and over.
+  #
+  # Results are keyed by the operation and the {Bitmap32#generation} of each
+  # operand, which changes whenever an operand is modified, so a cached result
+  # is never returned for operands which changed since. Results are frozen,
+  # since they're shared between callers.
+  #
+  # The cache holds results up to `max_bytes` in total (as measured by
+  # `ObjectSpace.memsize_of`), evicting the least recently used ones first.
+  # It's safe to use from several threads.
+  #
+  # @example
+  #   cache = Roaring::ResultCache.new(max_bytes: 16 * 1024 * 1024)
+  #   cache.and(segment, filter) # computed
+  #   cache.and(segment, filter) # cached
+  #   segment << 42
+  #   cache.and(segment, filter) # computed again
+  class ResultCache
+    # @return [Integer] the maximum total size of the cached results
+    attr_reader :max_bytes
+
+    # @return [Integer] the total size of the cached results
+    attr_reader :bytes
+
+    # @return [Integer] the number of results found in the cache
+    attr_reader :hits
+
+    # @return [Integer] the number of results which had to be computed
+    attr_reader :misses
+
+    # @param max_bytes [Integer]
+    def initialize(max_bytes: 64 * 1024 * 1024)
+      @max_bytes = max_bytes
+      @entries = {}
+      @bytes = 0
+      @hits = 0
+      @misses = 0
+      @mutex = Mutex.new
+    end
+
+    # @return [Bitmap32,Bitmap64] `a & b`
+    def and(a, b)
+      fetch(:and, a, b) { a & b }
+    end
+
+    # @return [Bitmap32,Bitmap64] `a | b`
+    def or(a, b)
+      fetch(:or, a, b) { a | b }
+    end
+
+    # @return [Bitmap32,Bitmap64] `a ^ b`
+    def xor(a, b)
+      fetch(:xor, a, b) { a ^ b }
+    end
+
+    # @return [Bitmap32,Bitmap64] `a - b`
+    def andnot(a, b)
+      fetch(:andnot, a, b) { a - b }
+    end
+
+    # @param bitmaps [Array<Bitmap32>,Array<Bitmap64>]
+    # @return [Bitmap32,Bitmap64] the intersection of all `bitmaps`
+    def and_many(bitmaps)
+      fetch(:and_many, *bitmaps) { bitmaps[0].class.and_many(bitmaps) }
+    end
+
+    # @param bitmaps [Array<Bitmap32>,Array<Bitmap64>]
+    # @return [Bitmap32,Bitmap64] the union of all `bitmaps`
+    def or_many(bitmaps)
+      fetch(:or_many, *bitmaps) { bitmaps[0].class.or_many(bitmaps) }
+    end
+
+    # @param query [Query]
+    # @return [Bitmap32,Bitmap64] the result of `query`
+    def query(query)
+      key = [:query, query_key(query.tree)]
+      lookup(key) || store(key, query.to_bitmap)
+    end
+
+    # @return [Integer] the number of cached results
+    def size
+      @mutex.synchronize { @entries.size }
+    end
+
+    # Removes every cached result
+    # @return [self]
+    def clear
+      @mutex.synchronize do
+        @entries.clear
+        @bytes = 0
+      end
+      self
+    end
+
+    private
+
+    # Intersections, unions and symmetric differences don't depend on the
+    # order of their operands, so they share a key
+    COMMUTATIVE = [:and, :or, :xor, :and_many, :or_many].freeze
+    private_constant :COMMUTATIVE
+
+    def fetch(op, *operands)
+      generations = operands.map(&:generation)
+      generations.sort! if COMMUTATIVE.include?(op)
+      key = [op, operands[0]&.class, *generations]
+      lookup(key) || store(key, yield)
+    end
+
+    def query_key(tree)
+      case tree
+      when Array then tree.map { |node| query_key(node) }
+      when Symbol then tree
+      else [tree.class, tree.generation]
+      end
+    end
+
+    def lookup(key)
+      @mutex.synchronize do
+        entry = @entries.delete(key)
+        if entry
+          @hits += 1
+          @entries[key] = entry
+          entry[0]
+        else
+          @misses += 1
+          nil
+        end
+      end
+    end
+
+    def store(key, result)
+      result.freeze
+      size = ObjectSpace.memsize_of(result)
+      return result if size > @max_bytes
+
+      @mutex.synchronize do
+        # Another thread may have computed the same result meanwhile
+        old = @entries.delete(key)
+        @bytes -= old[1] if old
+
+        @entries[key] = [result, size]
+        @bytes += size
+        while @bytes > @max_bytes
+          _, (_, evicted_size) = @entries.shift
+          @bytes -= evicted_size
+        end
+      end
+      result
+    end
+  end
+end
@@ -0,0 +1,208 @@
+# frozen_string_literal: true
+
+module Roaring
+  # A sliding window of `size` buckets of values, such as one per minute,
+  # for questions like "which users were seen in the last 5 minutes" or
+  # "which users were seen in at least 3 of the last 60 minutes".
+  #
+  # Values are added to the current bucket, and {#rotate} starts a new one,
+  # dropping the oldest. Rather than computing the union of the buckets for
+  # every query, the window keeps two counters for each value, stored one
+  # bit per bitmap ("bit-sliced"): how many closed buckets hold it, and how
+  # many buckets ago it was last seen. Rotating and querying take a few
+  # bitmap operations for each bit of `size`, however many buckets are
+  # involved.
+  #
+  # @example
+  #   window = Roaring::WindowedBitmap.new(60)
+  #   window << 1 << 2
+  #   window.rotate
+  #   window << 2 << 3
+  #   window.union(last: 1) # => #<Roaring::Bitmap32 {2, 3}>
+  #   window.union # => #<Roaring::Bitmap32 {1, 2, 3}>
+  #   window.at_least(2) # => #<Roaring::Bitmap32 {2}>
+  class WindowedBitmap
+    # @return [Integer] the number of buckets in the window, including the current one
+    attr_reader :size
+
+    # @return [Integer] the number of rotations so far
+    attr_reader :rotations
+
+    # @param size [Integer] the number of buckets in the window
+    def initialize(size)
+      raise ArgumentError, "size must be positive" unless size.positive?
+
+      @size = size
+      clear
+    end
+
+    # Empties every bucket
+    # @return [self]
+    def clear
+      @buckets = Array.new(size) { Bitmap32.new }
+      @head = 0
+      @rotations = 0
+
+      # Values in any closed bucket, how many buckets ago they were last seen,
+      # and how many closed buckets hold them, as bit-sliced counters
+      @seen = Bitmap32.new
+      @ages = Array.new(size.bit_length) { Bitmap32.new }
+      @counts = []
+      self
+    end
+
+    # @return [Bitmap32] the bucket values are added to
+    def current
+      @buckets[@head]
+    end
+
+    # @param ago [Integer] 0 for the current bucket, 1 for the one before...
+    # @return [Bitmap32, nil] a bucket, or nil if it isn't in the window.
+    #   Closed buckets are frozen, since the window's counters rely on them.
+    def bucket(ago)
+      return unless ago.between?(0, size - 1)
+
+      @buckets[(@head - ago) % size]
+    end
+
+    # Adds a value to the current bucket
+    # @return [self]
+    def add(value)
+      current.add(value)
+      self
+    end
+    alias_method :<<, :add
+
+    # Adds the values of a bitmap to the current bucket
+    # @param bitmap [Bitmap32]
+    # @return [self]
+    def merge(bitmap)
+      current.or!(bitmap)
+      self
+    end
+
+    # Closes the current bucket and starts new ones, dropping the oldest
+    # @param steps [Integer] the number of buckets to start
+    # @return [self]
+    def rotate(steps = 1)
+      if steps >= size
+        rotations = @rotations + steps
+        clear
+        @rotations = rotations
+        return self
+      end
+
+      steps.times { rotate_once }
+      self
+    end
+
+    # @param value [Integer]
+    # @param last [Integer] the number of most recent buckets to look at
+    # @return [Boolean] whether `value` is in one of the last `last` buckets
+    def include?(value, last: size)
+      return false if last <= 0
+      return true if current.include?(value)
+      return false unless @seen.include?(value)
+
+      age = @ages.each_with_index.sum { |plane, bit| plane.include?(value) ? 1 << bit : 0 }
+      age < last
+    end
+
+    # @param last [Integer] the number of most recent buckets to look at
+    # @return [Bitmap32] the values in any of the last `last` buckets
+    def union(last: size)
+      return Bitmap32.new if last <= 0
+      return current | @seen if last >= size
+
+      current | @seen.andnot(at_least_value(@ages, last, @seen))
+    end
+
+    # @param last [Integer] the number of most recent buckets to look at
+    # @return [Integer] the number of distinct values in the last `last` buckets
+    def cardinality(last: size)
+      union(last: last).cardinality
+    end
+    alias_method :count, :cardinality
+
+    # @param k [Integer]
+    # @return [Bitmap32] the values found in at least `k` buckets of the window
+    def at_least(k)
+      return union if k <= 1
+
+      at_least_value(@counts, k, @seen) | (current & at_least_value(@counts, k - 1, @seen))
+    end
+
+    def inspect
+      "#<#{self.class} (#{size} buckets, #{cardinality} values)>"
+    end
+
+    private
+
+    def rotate_once
+      closed = current.freeze
+      @head = (@head + 1) % size
+      oldest = current
+
+      decrement(@counts, oldest) unless oldest.empty?
+      increment(@counts, closed)
+
+      # Values of the closed bucket were last seen 0 buckets ago, and
+      # everything gets one bucket older
+      @ages.each { |plane| plane.andnot!(closed) }
+      @seen.or!(closed)
+      increment(@ages, @seen)
+      expired = at_least_value(@ages, size, @seen)
+      unless expired.empty?
+        @seen.andnot!(expired)
+        @ages.each { |plane| plane.andnot!(expired) }
+      end
+
+      @buckets[@head] = Bitmap32.new
+      @rotations += 1
+    end
+
+    # Adds 1 to the counters of the values of `bitmap`, carrying into more
+    # planes as needed
+    def increment(planes, bitmap)
+      carry = bitmap
+      planes.each do |plane|
+        break if carry.empty?
+
+        next_carry = plane & carry
+        plane.xor!(carry)
+        carry = next_carry
+      end
+      planes << carry.dup unless carry.empty?
+    end
+
+    # Subtracts 1 from the counters of the values of `bitmap`, which must
+    # all be at least 1
+    def decrement(planes, bitmap)
+      borrow = bitmap
+      planes.each do |plane|
+        break if borrow.empty?
+
+        next_borrow = borrow - plane
+        plane.xor!(borrow)
+        borrow = next_borrow
+      end
+    end
+
+    # The values of `universe` whose counter is at least `k`, comparing one
+    # plane at a time from the most significant
+    def at_least_value(planes, k, universe)
+      greater = Bitmap32.new
+      equal = universe.dup
+      [planes.size, k.bit_length].max.downto(0) do |bit|
+        plane = planes[bit]
+        if k[bit] == 1
+          plane ? equal.and!(plane) : equal.clear
+        elsif plane
+          greater.or!(equal & plane)
+          equal.andnot!(plane)
+        end
+      end
+      greater.or!(equal)
+    end
+  end
+end
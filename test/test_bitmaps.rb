@@ -4,6 +4,7 @@ require "test_helper"
 
 module BitmapTests
   include Roaring
+  include InterruptAssertions
 
   def test_simple_example
     bitmap = bitmap_class.new
@@ -308,6 +309,80 @@ module BitmapTests
     assert_equal [1, 2], result.to_a
   end
 
+  def test_and_cardinality
+    r1 = bitmap_class[1, 2, 3, 4]
+    r2 = bitmap_class[3, 4, 5, 6]
+    assert_equal 2, r1.and_cardinality(r2)
+    assert_equal 0, r1.and_cardinality(bitmap_class[])
+  end
+
+  def test_and_cardinality_many
+    r1 = bitmap_class[1, 2, 3, 4]
+    others = [bitmap_class[3, 4, 5, 6], bitmap_class[], r1, bitmap_class[4, 100]]
+    assert_equal [2, 0, 4, 1], r1.and_cardinality_many(others)
+    assert_equal [], r1.and_cardinality_many([])
+    assert_raises(TypeError) { r1.and_cardinality_many([r1, 1]) }
+  end
+
+  def test_or_many
+    bitmaps = 9.times.map { |i| bitmap_class[i, i * 10, 1000] }
+    assert_equal bitmaps.inject(:|), bitmap_class.or_many(bitmaps)
+    assert_equal bitmap_class[], bitmap_class.or_many([])
+
+    result = bitmap_class.or_many([bitmaps[0]])
+    refute_same bitmaps[0], result
+    assert_equal bitmaps[0], result
+  end
+
+  def test_and_many
+    bitmaps = 9.times.map { |i| bitmap_class[i, 500, 1000] }
+    assert_equal [500, 1000], bitmap_class.and_many(bitmaps).to_a
+    assert_equal bitmap_class[], bitmap_class.and_many([])
+    assert_equal bitmap_class[], bitmap_class.and_many(bitmaps + [bitmap_class[]])
+  end
+
+  def test_many_in_parallel
+    bitmaps = 100.times.map do |i|
+      bitmap = bitmap_class.new((i * 1000)...(i * 1000 + 70_000))
+      50.times { |j| bitmap << (i * 7919 + j * 104729) }
+      bitmap
+    end
+
+    serial_or = bitmap_class.or_many(bitmaps)
+    serial_and = bitmap_class.and_many(bitmaps.first(20))
+    serial_cardinalities = bitmaps[0].and_cardinality_many(bitmaps)
+
+    Roaring.parallelism = 4
+    assert_equal serial_or.serialize, bitmap_class.or_many(bitmaps).serialize
+    assert_equal serial_and.serialize, bitmap_class.and_many(bitmaps.first(20)).serialize
+    assert_equal serial_cardinalities, bitmaps[0].and_cardinality_many(bitmaps)
+    assert_equal bitmaps, bitmap_class.deserialize_many(bitmaps.map(&:serialize))
+  ensure
+    Roaring.parallelism = 1
+  end
+
+  def test_many_from_several_threads
+    bitmaps = 40.times.map { |i| bitmap_class.new((i * 1000)...(i * 1000 + 70_000)) }
+    expected = bitmap_class.or_many(bitmaps)
+
+    [1, 3].each do |parallelism|
+      Roaring.parallelism = parallelism
+      threads = 4.times.map do |t|
+        Thread.new { 10.times.map { bitmap_class.or_many(bitmaps.rotate(t)) } }
+      end
+      threads.each { |thread| thread.value.each { |result| assert_equal expected, result } }
+    end
+  ensure
+    Roaring.parallelism = 1
+  end
+
+  def test_many_interrupted
+    bitmaps = 40.times.map { |i| bitmap_class.new((i * 1000)...(i * 1000 + 70_000)) }
+    assert_unlocked_when_interrupted(bitmaps) { bitmap_class.or_many(bitmaps) }
+    assert_unlocked_when_interrupted(bitmaps) { bitmap_class.and_many(bitmaps) }
+    assert_unlocked_when_interrupted(bitmaps) { bitmaps[0].and_cardinality_many(bitmaps) }
+  end
+
   def test_min_and_max
     bitmap = bitmap_class.new
     bitmap << 5 << 2 << 9 << 7
@@ -338,6 +413,17 @@ module BitmapTests
     assert_equal original, bitmap
   end
 
+  def test_deserialize_many
+    originals = [bitmap_class[1, 2, 3, 4], bitmap_class[], bitmap_class[0...100_000]]
+
+    bitmaps = bitmap_class.deserialize_many(originals.map(&:serialize))
+    assert_equal originals, bitmaps
+
+    assert_raises(ArgumentError) do
+      bitmap_class.deserialize_many([originals[0].serialize, "invalid"])
+    end
+  end
+
   def test_marshal
     original = bitmap_class[1, 2, 3, 4]
 
@@ -360,6 +446,47 @@ module BitmapTests
     assert_equal [5], (r1 - r2).to_a
   end
 
+  def test_frozen
+    bitmap = bitmap_class[1, 2, 3].freeze
+    other = bitmap_class[3, 4]
+
+    assert_raises(FrozenError) { bitmap << 4 }
+    assert_raises(FrozenError) { bitmap.add?(4) }
+    assert_raises(FrozenError) { bitmap.add_range(4, 10) }
+    assert_raises(FrozenError) { bitmap.remove(1) }
+    assert_raises(FrozenError) { bitmap.remove?(1) }
+    assert_raises(FrozenError) { bitmap.clear }
+    assert_raises(FrozenError) { bitmap.replace(other) }
+    assert_raises(FrozenError) { bitmap.run_optimize }
+    assert_raises(FrozenError) { bitmap.and!(other) }
+    assert_raises(FrozenError) { bitmap.or!(other) }
+    assert_raises(FrozenError) { bitmap.xor!(other) }
+    assert_raises(FrozenError) { bitmap.andnot!(other) }
+    assert_equal [1, 2, 3], bitmap.to_a
+
+    assert_equal [1, 2, 3, 4], (bitmap | other).to_a
+    refute bitmap.dup.frozen?
+    assert bitmap.clone.frozen?
+  end
+
+  def test_ractor_shareable
+    skip "Ractor unavailable" unless defined?(Ractor)
+
+    bitmap = Ractor.make_shareable(bitmap_class[1, 2, 3])
+    assert Ractor.shareable?(bitmap)
+    refute Ractor.shareable?(bitmap_class[1, 2, 3])
+
+    experimental, Warning[:experimental] = Warning[:experimental], false
+    ractors = 2.times.map do
+      Ractor.new(bitmap) { |b| [b.cardinality, b.include?(2), (b & b).to_a] }
+    end
+    ractors.each do |ractor|
+      assert_equal [3, true, [1, 2, 3]], ractor.take
+    end
+  ensure
+    Warning[:experimental] = experimental if defined?(Ractor)
+  end
+
   def test_statistics
     bitmap = bitmap_class[]
 
@@ -405,6 +532,98 @@ module BitmapTests
     assert_equal bitmap1.hash, bitmap2.hash
   end
 
+  def test_jaccard_index
+    a = bitmap_class.new(0...100)
+    b = bitmap_class.new(50...150)
+
+    assert_in_delta 50 / 150.0, a.jaccard_index(b)
+    assert_equal 1.0, a.jaccard_index(a.dup)
+    assert_equal 0.0, a.jaccard_index(bitmap_class.new)
+    assert_equal 1.0, bitmap_class.new.jaccard_index(bitmap_class.new)
+  end
+
+  def test_sample
+    bitmap = bitmap_class.new(0...100_000) | bitmap_class[1_000_000, 2**31]
+
+    sample = bitmap.sample(1000)
+    assert_equal 1000, sample.size
+    assert_equal sample.sort.uniq, sample
+    assert sample.all? { |x| bitmap.include?(x) }
+    assert_includes bitmap, bitmap.sample
+    assert_equal bitmap.sample(5, random: Random.new(42)), bitmap.sample(5, random: Random.new(42))
+    assert_equal bitmap.to_a, bitmap.sample(200_000)
+    assert_equal [], bitmap.sample(0)
+    assert_nil bitmap_class.new.sample
+    assert_equal [], bitmap_class.new.sample(3)
+    assert_raises(ArgumentError) { bitmap.sample(-1) }
+
+    counts = Hash.new(0)
+    small = bitmap_class[1, 2, 70_000]
+    3000.times { counts[small.sample] += 1 }
+    assert_equal [1, 2, 70_000], counts.keys.sort
+    assert counts.values.all? { |count| count > 800 }
+  end
+
+  def test_sample_bitmap
+    bitmap = bitmap_class.new(0...200_000) | bitmap_class[1_000_000, 2**31]
+
+    half = bitmap.sample_bitmap(0.5)
+    assert_instance_of bitmap_class, half
+    assert_operator half, :<=, bitmap
+    assert_in_delta 100_000, half.size, 2_000
+    assert_in_delta 20_000, bitmap.sample_bitmap(0.1).size, 1_000
+    assert_equal bitmap.sample_bitmap(0.3, random: Random.new(1)), bitmap.sample_bitmap(0.3, random: Random.new(1))
+    assert_equal bitmap, bitmap.sample_bitmap(1)
+    assert_empty bitmap.sample_bitmap(0)
+    assert_empty bitmap_class.new.sample_bitmap(0.5)
+    assert_raises(ArgumentError) { bitmap.sample_bitmap(1.5) }
+    assert_raises(ArgumentError) { bitmap.sample_bitmap(Float::NAN) }
+
+    failing = Object.new
+    def failing.bytes(_n)
+      raise "no randomness"
+    end
+    assert_raises(RuntimeError) { bitmap.sample_bitmap(0.5, random: failing) }
+    assert_includes bitmap << 5_000_000, 5_000_000
+  end
+
+  def test_ranges
+    # An array container, a bitset container and a run container, with runs
+    # spanning containers
+    bitmap = bitmap_class[3, 5, 6, 7] | bitmap_class.new(0.step(100_000, 3)).add_range(65_530, 65_600)
+    bitmap.add_range(200_000, 400_000)
+    bitmap.run_optimize
+    bitmap << 2**32 - 1
+
+    expected = bitmap.to_a.slice_when { |a, b| b != a + 1 }.map { |run| run.first..run.last }
+    assert_equal expected, bitmap.to_ranges
+    assert_equal expected, bitmap.each_range.to_a
+    assert_equal expected.flat_map { |r| [r.begin, r.size] }, bitmap.to_ranges(packed: true).unpack("Q*")
+    assert_same bitmap, bitmap.each_range {}
+
+    assert_equal bitmap, bitmap_class.from_ranges(bitmap.to_ranges)
+    assert_equal bitmap, bitmap_class.from_ranges(bitmap.to_ranges(packed: true))
+    assert_equal [], bitmap_class.new.to_ranges
+    assert_equal "", bitmap_class.new.to_ranges(packed: true)
+    assert_equal [0..(2**32 - 1)], bitmap_class.from_ranges([..(2**32 - 1)]).to_ranges
+
+    assert_equal bitmap_class[1, 2, 3, 7, 8], bitmap_class.from_ranges([7...9, 1..3, 2..2, 5...5, 9..8])
+    assert_empty bitmap_class.from_ranges([1, 0].pack("Q*"))
+    assert_raises(TypeError) { bitmap_class.from_ranges([1]) }
+    assert_raises(RangeError) { bitmap_class.from_ranges([-1..2]) }
+    assert_raises(TypeError) { bitmap_class.from_ranges([1.5..3.5]) }
+    assert_raises(TypeError) { bitmap_class.from_ranges([1..Rational(7, 2)]) }
+    assert_raises(ArgumentError) { bitmap_class.from_ranges("abc") }
+  end
+
+  def test_each_range_streams
+    bitmap = bitmap_class.new(0.step(1_000_000, 2))
+    allocated = GC.stat(:total_allocated_objects)
+    assert_equal 0..0, bitmap.each_range { |range| break range }
+    assert_operator GC.stat(:total_allocated_objects) - allocated, :<, 100
+    assert_equal 2..2, bitmap.each_range.lazy.drop(1).first
+  end
+
 end
 
 class Bitmap32Test < Minitest::Test
@@ -428,6 +647,348 @@ class Bitmap32Test < Minitest::Test
     assert ObjectSpace.memsize_of(bitmap) < 1000
   end
 
+  def test_shift
+    max = bitmap_class::MAX
+    bitmap = bitmap_class[0, 5, 70_000, max]
+
+    assert_equal [10, 15, 70_010], bitmap.shift(10).to_a
+    assert_equal [65_536, 65_541, 135_536], bitmap.shift(65_536).to_a
+    assert_equal [69_994, max - 6], bitmap.shift(-6).to_a
+    assert_equal bitmap, bitmap.shift(0)
+    assert_equal [max], bitmap.shift(max).to_a
+    assert_equal [0], bitmap.shift(-max).to_a
+    assert_empty bitmap.shift(max + 1)
+    assert_empty bitmap.shift(-(2**70))
+
+    large = bitmap_class.new(0...1_000_000)
+    assert_equal (300_000...1_300_000).to_a, large.shift(300_000).to_a
+    assert_equal [0, 5, 70_000, max], bitmap.to_a
+
+    assert_same bitmap, bitmap.shift!(-5)
+    assert_equal [0, 69_995, max - 5], bitmap.to_a
+    assert_raises(FrozenError) { bitmap.freeze.shift!(1) }
+    assert_raises(TypeError) { large.shift("1") }
+  end
+
+  def test_copy_on_write
+    require "objspace"
+
+    base = bitmap_class.new
+    0.step(1_000_000, 3) { |i| base << i }
+    refute base.copy_on_write?
+    base.copy_on_write = true
+    assert base.copy_on_write?
+
+    copy = base.dup
+    assert copy.copy_on_write?
+    assert_equal base, copy
+    assert ObjectSpace.memsize_of(copy) < 1000
+
+    copy << 1
+    copy.remove(3)
+    assert_equal 333_334, base.cardinality
+    assert base.include?(3)
+    refute base.include?(1)
+    assert_equal [1], (copy - base).to_a
+    assert_equal [3], (base - copy).to_a
+    assert ObjectSpace.memsize_of(copy) < 50_000
+
+    base.clear
+    assert_equal 333_334, copy.cardinality
+  end
+
+  def test_parallel_binary_ops
+    r1 = bitmap_class.new
+    r2 = bitmap_class.new
+    0.step(40_000_000, 997) { |i| r1 << i }
+    0.step(80_000_000, 1999) { |i| r2 << i }
+    r1.add_range(10_000_000, 12_000_000)
+
+    expected = %i[& | ^ -].map { |op| [r1.send(op, r2), r2.send(op, r1)] }
+
+    Roaring.parallelism = 4
+    %i[& | ^ -].zip(expected) do |op, (forward, backward)|
+      assert_equal forward.serialize, r1.send(op, r2).serialize
+      assert_equal backward.serialize, r2.send(op, r1).serialize
+    end
+  ensure
+    Roaring.parallelism = 1
+  end
+
+  def test_parallel_binary_ops_on_shared_containers
+    base = bitmap_class.new((1..200).map { |i| i << 16 })
+    base.copy_on_write = true
+    copy = base.dup
+    small = bitmap_class[1, 2, 3]
+
+    Roaring.parallelism = 4
+    assert_equal 203, (base | small).cardinality
+    assert_equal 203, (small | copy).cardinality
+    assert_equal 0, (copy & small).cardinality
+    assert_equal 200, (base - small).cardinality
+  ensure
+    Roaring.parallelism = 1
+  end
+
+  def test_copies_of_shared_containers
+    # One value in each of 200 containers, none of them in `small`'s
+    base = bitmap_class.new((1..200).map { |i| i << 16 })
+    base.copy_on_write = true
+    copy = base.dup
+    small = bitmap_class[1, 2, 3]
+
+    assert_equal 203, bitmap_class.or_many([base, small]).cardinality
+    assert_equal 203, bitmap_class.or_many([small, copy]).cardinality
+    assert_equal 200, bitmap_class.or_many([base, copy, base]).cardinality
+    assert_equal base, Roaring::Query[copy].to_bitmap
+    assert_equal base.to_a, copy.to_bitmap64.to_a
+    assert base.copy_on_write?
+    assert copy.copy_on_write?
+  end
+
+  def test_mixed_widths_with_shared_containers
+    base = bitmap_class.new((1..200).map { |i| i << 16 })
+    base.copy_on_write = true
+    copy = base.dup
+    wide = Roaring::Bitmap64[1]
+
+    assert_equal 201, (base | wide).cardinality
+    assert_equal 201, (wide | copy).cardinality
+    assert_equal 200, (copy - wide).cardinality
+    wide.or!(copy)
+    assert_equal 201, wide.cardinality
+    assert_equal base.to_a, Roaring::Bitmap64.new.replace(copy).to_a
+  end
+
+  def test_mixed_widths
+    narrow = bitmap_class[1, 2, 3]
+    wide = Roaring::Bitmap64[2, 3, 2**40]
+
+    assert_kind_of Roaring::Bitmap64, narrow & wide
+    assert_equal [2, 3], (narrow & wide).to_a
+    assert_equal [1, 2, 3, 2**40], (narrow | wide).to_a
+    assert_equal [1, 2**40], (narrow ^ wide).to_a
+    assert_equal [1], (narrow - wide).to_a
+    assert_equal [2**40], (wide - narrow).to_a
+    assert_equal 2, narrow.and_cardinality(wide)
+    assert narrow.intersect?(wide)
+    assert narrow < wide.dup.tap { |b| b << 1 }
+    assert_equal narrow, Roaring::Bitmap64[1, 2, 3]
+    assert_equal Roaring::Bitmap64[1, 2, 3], narrow
+
+    wide.and!(narrow)
+    assert_equal [2, 3], wide.to_a
+    assert_equal [1, 2, 3], narrow.to_a
+  end
+
+  def test_top_k_overlap
+    query = bitmap_class.new(0...1000)
+    candidates = [
+      bitmap_class.new(0...100),
+      bitmap_class.new(500...2000),
+      bitmap_class.new(0...10),
+      bitmap_class.new(900...1100),
+      bitmap_class.new(400...500),
+      bitmap_class.new(5000...6000),
+    ]
+
+    assert_equal [[1, 500], [0, 100], [3, 100]], bitmap_class.top_k_overlap(query, candidates, 3)
+    assert_equal [[0, 0.1], [1, 0.25]], bitmap_class.top_k_overlap(query, candidates, 2, metric: :jaccard).sort
+    assert_equal 6, bitmap_class.top_k_overlap(query, candidates, 10).size
+    assert_equal [[5, 0]], bitmap_class.top_k_overlap(query, candidates, 6).last(1)
+    assert_equal [], bitmap_class.top_k_overlap(query, candidates, 0)
+    assert_equal [], bitmap_class.top_k_overlap(query, [], 3)
+    assert_raises(ArgumentError) { bitmap_class.top_k_overlap(query, candidates, 3, metric: :cosine) }
+    assert_raises(TypeError) { bitmap_class.top_k_overlap(query, [query, 1], 3) }
+
+    random = Random.new(3)
+    many = Array.new(500) { bitmap_class.new(Array.new(random.rand(1..300)) { random.rand(3000) }) }
+    expected = query.and_cardinality_many(many).each_with_index.map { |size, i| [i, size] }.sort_by { |i, size| [-size, i] }
+    assert_equal expected.first(20), bitmap_class.top_k_overlap(query, many, 20)
+    Roaring.parallelism = 4
+    assert_equal expected.first(20), bitmap_class.top_k_overlap(query, many, 20)
+  ensure
+    Roaring.parallelism = 1
+  end
+
+  def test_top_k_overlap_interrupted
+    bitmaps = 40.times.map { |i| bitmap_class.new((i * 1000)...(i * 1000 + 70_000)) }
+    assert_unlocked_when_interrupted(bitmaps) { bitmap_class.top_k_overlap(bitmaps[0], bitmaps, 5) }
+  end
+
+  def test_group_column
+    groups = bitmap_class.group_column([3, -1, 3, 2**40].pack("q*"), type: :int64)
+    assert_equal [-1, 3, 2**40], groups.keys
+    assert_equal [bitmap_class[1], bitmap_class[0, 2], bitmap_class[3]], groups.values
+    assert_equal [255, 1], bitmap_class.group_column([1, 255].pack("C*"), type: :uint8).keys.reverse
+    assert_equal({}, bitmap_class.group_column("", type: :uint32))
+    assert_raises(ArgumentError) { bitmap_class.group_column("abc", type: :uint16) }
+    assert_raises(ArgumentError) { bitmap_class.group_column("abc") }
+  end
+
+  def test_where
+    random = Random.new(9)
+    values = Array.new(5000) { random.rand(-1000..1000) }
+    rows = ->(&block) { bitmap_class.new(values.each_index.select { |i| block.call(values[i]) }) }
+
+    %i[int16 int32 int64].zip(%w[s l q]).each do |type, format|
+      column = values.pack("#{format}*")
+      assert_equal rows.call { |v| v == 7 }, bitmap_class.where(column, :==, 7, type: type)
+      assert_equal rows.call { |v| v != 7 }, bitmap_class.where(column, :!=, 7, type: type)
+      assert_equal rows.call { |v| v < -3 }, bitmap_class.where(column, :<, -3, type: type)
+      assert_equal rows.call { |v| v <= 2.5 }, bitmap_class.where(column, :<=, 2.5, type: type)
+      assert_equal rows.call { |v| v > 500 }, bitmap_class.where(column, :>, 500, type: type)
+      assert_equal rows.call { |v| v >= -2**40 }, bitmap_class.where(column, :>=, -2**40, type: type)
+      assert_equal rows.call { |v| (-10...10).cover?(v) }, bitmap_class.where(column, :between, -10...10, type: type)
+      assert_equal rows.call { |v| v >= 900 }, bitmap_class.where(column, :between, 900.., type: type)
+    end
+
+    column = values.map { |v| v / 10.0 }.pack("e*")
+    assert_equal rows.call { |v| v / 10.0 < 1.5 }, bitmap_class.where(column, :<, 1.5, type: :float)
+    assert_equal rows.call { |v| v.abs <= 5 }, bitmap_class.where(column, :between, -0.5..0.5, type: :float)
+
+    column = [1.0, Float::NAN, 3.0, Float::INFINITY].pack("d*")
+    assert_equal bitmap_class[0, 2], bitmap_class.where(column, :<, Float::INFINITY, type: :double)
+    assert_equal bitmap_class[1, 2, 3], bitmap_class.where(column, :!=, 1, type: :double)
+    assert_empty bitmap_class.where(column, :==, Float::NAN, type: :double)
+    assert_equal bitmap_class[0, 1, 2, 3], bitmap_class.where([0, 255].pack("C*") * 2, :between, 0..255, type: :uint8)
+    assert_equal bitmap_class[0, 1], bitmap_class.where([2**32 - 1, 2**31].pack("L*"), :>, 2**30, type: :uint32)
+    assert_empty bitmap_class.where("", :!=, 1, type: :uint32)
+
+    column = [0, 1, 2, 3].pack("l*")
+    assert_equal bitmap_class[2, 3], bitmap_class.where(column, :>=, 3/2r, type: :int32)
+    assert_equal bitmap_class[0, 1], bitmap_class.where(column, :<, 3/2r, type: :int32)
+    assert_equal bitmap_class[2], bitmap_class.where(column, :between, 3/2r..5/2r, type: :int32)
+    assert_empty bitmap_class.where(column, :==, 3/2r, type: :int32)
+    assert_raises(ArgumentError) { bitmap_class.where(column, :=~, 1, type: :double) }
+    assert_raises(TypeError) { bitmap_class.where(column, :between, 1, type: :double) }
+    assert_raises(TypeError) { bitmap_class.where(column, :<, "1", type: :int32) }
+  end
+
+  def test_gather
+    random = Random.new(4)
+    values = Array.new(3000) { random.rand(-2**40..2**40) }
+    column = values.pack("q*")
+    rows = bitmap_class.new(Array.new(500) { random.rand(3000) })
+    expected = rows.map { |i| values[i] }
+
+    assert_equal expected, rows.gather(column, type: :int64).unpack("q*")
+    assert_equal expected.sum, rows.gather_sum(column, type: :int64)
+    assert_equal expected.minmax, rows.gather_minmax(column, type: :int64)
+    assert_equal "ab".b + expected.pack("q*"), rows.gather(column, type: :int64, into: "ab".b)
+    assert_equal expected.map { |v| v & 0xFF }, rows.gather(column.unpack("C*").each_slice(8).map(&:first).pack("C*"), type: :uint8).unpack("C*")
+
+    assert_equal 2**65 - 2, bitmap_class[0, 1].gather_sum([2**64 - 1, 2**64 - 1].pack("Q*"), type: :uint64)
+    assert_equal(-2**64, bitmap_class[0, 1].gather_sum([-2**63, -2**63].pack("q*"), type: :int64))
+    assert_equal [0.1, 0.2, 0.3].sum, bitmap_class[0, 1, 2].gather_sum([0.1, 0.2, 0.3].pack("d*"), type: :double)
+    assert_equal [-1.5, 2.0], bitmap_class[0, 1, 2].gather_minmax([2.0, Float::NAN, -1.5].pack("e*"), type: :float)
+    assert_equal [nil, nil], bitmap_class.new.gather_minmax(column, type: :int64)
+    assert_equal 0, bitmap_class.new.gather_sum(column, type: :int64)
+    assert_equal "", bitmap_class.new.gather(column, type: :int64)
+    assert_raises(IndexError) { bitmap_class[3000].gather(column, type: :int64) }
+    assert_raises(IndexError) { bitmap_class[3000].gather_sum(column, type: :int64) }
+    assert_raises(TypeError) { rows.gather(column, type: :int64, into: []) }
+  end
+
+  def test_gather_sum_of_infinities
+    inf = Float::INFINITY
+    [[1.0, inf], [inf, 1.0], [-inf, 2.0, -inf], [inf, -inf], [Float::NAN, inf], [1.0, Float::NAN, 2.0]].each do |values|
+      expected = values.sum
+      sum = bitmap_class.new(0...values.size).gather_sum(values.pack("d*"), type: :double)
+      if expected.nan?
+        assert sum.nan?, values.inspect
+      else
+        assert_equal expected, sum, values.inspect
+      end
+    end
+  end
+
+  def test_gather_interrupted
+    column = Array.new(1_000_000, 1).pack("l*")
+    rows = bitmap_class.new(0...1_000_000)
+    out = nil
+    assert_unlocked_when_interrupted([rows]) { rows.gather(column, type: :int32, into: out = String.new) }
+    out << "x"
+  end
+
+  def test_gather_into_io_buffer
+    skip "IO::Buffer isn't available" unless defined?(IO::Buffer)
+
+    experimental = Warning[:experimental]
+    Warning[:experimental] = false
+    buffer = IO::Buffer.new(24)
+    assert_same buffer, bitmap_class[0, 2].gather([1.5, 2.5, 3.5].pack("d*"), type: :double, into: buffer)
+    assert_equal [1.5, 3.5, 0.0], buffer.get_string.unpack("d*")
+    assert_raises(ArgumentError) { bitmap_class[0, 1, 2, 3].gather([0, 1, 2, 3].pack("Q*"), type: :uint64, into: buffer) }
+  ensure
+    Warning[:experimental] = experimental unless experimental.nil?
+  end
+
+  def test_funnel
+    steps = [bitmap_class.new(0...1000), bitmap_class.new(500...2000), bitmap_class.new(0...600), bitmap_class[550, 5000]]
+
+    assert_equal [1000, 500, 100, 1], bitmap_class.funnel(steps)
+    counts, result = bitmap_class.funnel(steps, bitmap: true)
+    assert_equal [1000, 500, 100, 1], counts
+    assert_equal bitmap_class[550], result
+    assert_equal [1000], bitmap_class.funnel(steps.first(1))
+    assert_equal [1000, 0, 0, 0], bitmap_class.funnel([steps[0], bitmap_class[5000], *steps.drop(2)])
+    assert_equal [0, 0], bitmap_class.funnel([bitmap_class.new, steps[0]], bitmap: true).first
+    assert_equal [[], bitmap_class.new], bitmap_class.funnel([], bitmap: true)
+    assert_equal (0...1000).to_a, steps[0].to_a
+    assert_raises(TypeError) { bitmap_class.funnel([steps[0], 1]) }
+  end
+
+  def test_funnel_interrupted
+    bitmaps = 40.times.map { |i| bitmap_class.new((i * 1000)...(i * 1000 + 70_000)) }
+    assert_unlocked_when_interrupted(bitmaps) { bitmap_class.funnel(bitmaps, bitmap: true) }
+  end
+
+  def test_minhash
+    a = bitmap_class.new(0...10_000)
+    b = bitmap_class.new(2_000...12_000)
+
+    signature = a.minhash(256)
+    assert_equal 256, signature.size
+    assert signature.all? { |hash| hash.between?(0, 2**32 - 1) }
+    assert_equal signature, a.dup.minhash(256)
+    assert_equal signature.first(8), a.minhash(8)
+    refute_equal signature, a.minhash(256, seed: 1)
+    assert_equal [2**32 - 1] * 4, bitmap_class.new.minhash(4)
+    assert_raises(ArgumentError) { a.minhash(0) }
+    assert_raises(ArgumentError) { a.minhash(2**32) }
+    assert_raises(ArgumentError) { bitmap_class[1].minhash(922337203685477581) }
+
+    estimate = signature.zip(b.minhash(256)).count { |x, y| x == y } / 256.0
+    assert_in_delta a.jaccard_index(b), estimate, 0.1
+  end
+
+  def test_copy_on_write_turned_off_after_copying
+    base = bitmap_class.new((1..200).map { |i| i << 16 })
+    base.copy_on_write = true
+    copy = base.dup
+    base.copy_on_write = false
+    copy.freeze
+    small = bitmap_class[1, 2, 3]
+
+    refute base.copy_on_write?
+    assert_equal 203, (base | small).cardinality
+    assert_equal 203, (small | copy).cardinality
+    assert_equal 200, bitmap_class.or_many([copy, base]).cardinality
+  end
+
+  def test_frozen_disables_copy_on_write
+    bitmap = bitmap_class[1, 2, 3]
+    bitmap.copy_on_write = true
+    assert bitmap.clone(freeze: true).frozen?
+    refute bitmap.clone(freeze: true).copy_on_write?
+
+    bitmap.freeze
+    refute bitmap.copy_on_write?
+    refute bitmap.dup.copy_on_write?
+    assert_raises(FrozenError) { bitmap.copy_on_write = true }
+  end
+
   def bitmap_class
     Roaring::Bitmap32
   end
@@ -439,4 +1000,118 @@ class Bitmap64Test < Minitest::Test
   def bitmap_class
     Roaring::Bitmap64
   end
+
+  def test_values_crossing_32_bits
+    narrow = [0, 1, 2**31, 2**32 - 1]
+    wide = [2**32, 2**40, 2**64 - 1]
+
+    small = Roaring::Bitmap64.new(narrow)
+    large = Roaring::Bitmap64.new(narrow.first(2) + wide)
+
+    assert_equal narrow, small.to_a
+    assert_equal narrow.first(2) + wide, large.to_a
+    refute_includes small, 2**32
+    assert_equal 2**40, large[3]
+    assert_equal 2**32 - 1, small.max
+
+    assert_equal narrow.first(2), (small & large).to_a
+    assert_equal (narrow + wide).sort, (small | large).to_a
+    assert_equal narrow.last(2) + wide, (small ^ large).to_a
+    assert_equal narrow.last(2), (small - large).to_a
+    assert_equal wide, (large - small).to_a
+    assert_equal 2, small.and_cardinality(large)
+    assert_equal [2, 4], small.and_cardinality_many([large, small])
+    assert_equal (narrow + wide).sort, Roaring::Bitmap64.or_many([small, large, small]).to_a
+    assert_equal narrow.first(2), Roaring::Bitmap64.and_many([small, large]).to_a
+    assert small.intersect?(large)
+    assert Roaring::Bitmap64[1] < large
+
+    copy = small.dup
+    copy << 2**33
+    assert_equal narrow + [2**33], copy.to_a
+    copy.remove(2**33)
+    assert_equal small, copy
+    assert_equal small.hash, copy.hash
+
+    copy.or!(large)
+    assert_equal small | large, copy
+    copy.clear
+    copy.add_range(2**32 - 2, 2**32 + 1)
+    assert_equal [2**32 - 2, 2**32 - 1, 2**32], copy.to_a
+  end
+
+  def test_conversions_between_widths
+    narrow = Roaring::Bitmap32.new(0.step(1_000_000, 7))
+    converted = narrow.to_bitmap64
+    assert_kind_of Roaring::Bitmap64, converted
+    assert_equal narrow.to_a, converted.to_a
+    assert_equal converted, Roaring::Bitmap64.new(narrow)
+    assert_equal narrow, converted.to_bitmap32
+
+    converted << 2**40
+    assert_equal narrow, converted.to_bitmap32
+    assert_equal narrow.to_a, converted.to_a.first(narrow.size)
+
+    wide = Roaring::Bitmap64.new(((2**33)...(2**33 + 5000)))
+    wide << 2**34 + 1
+    wide << 7
+    assert_equal [7], wide.to_bitmap32.to_a
+    assert_equal (0...5000).to_a, wide.to_bitmap32(high_bits: 2).to_a
+    assert_equal [1], wide.to_bitmap32(high_bits: 4).to_a
+    assert_empty wide.to_bitmap32(high_bits: 3)
+    assert_empty Roaring::Bitmap64[5].to_bitmap32(high_bits: 1)
+    assert_equal 1, wide.tap(&:run_optimize).to_bitmap32(high_bits: 2).statistics[:n_run_containers]
+
+    assert_raises(RangeError) { wide.to_bitmap32(high_bits: 2**32) }
+    assert_raises(RangeError) { wide.to_bitmap32(high_bits: -1) }
+    assert_raises(ArgumentError) { wide.to_bitmap32(high: 1) }
+  end
+
+  def test_shift_across_32_bits
+    bitmap = Roaring::Bitmap64[3, 70_000, 2**32 - 1, 2**32 + 1, 2**40]
+    offset = 2**32 - 70_000
+
+    assert_equal bitmap.map { |x| x + offset }, bitmap.shift(offset).to_a
+    assert_equal [0, 2**32 - 70_001, 2**32 - 69_999, 2**40 - 70_000], bitmap.shift(-70_000).to_a
+    assert_equal [1, 2**40 - 2**32], bitmap.shift(-(2**32)).to_a
+    assert_equal [2**64 - 1], bitmap.shift(2**64 - 1 - 2**40).to_a.last(1)
+    assert_equal bitmap, bitmap.shift(2**32).shift!(-(2**32))
+  end
+
+  def test_serialization_is_independent_of_width
+    narrow = Roaring::Bitmap64[1, 2, 70_000]
+    demoted = Roaring::Bitmap64[1, 2, 70_000, 2**40]
+    demoted.remove(2**40)
+
+    assert_equal narrow.serialize, demoted.serialize
+    assert_equal Roaring::Bitmap64[].serialize, Roaring::Bitmap64[2**40].tap { |b| b.remove(2**40) }.serialize
+    [narrow, demoted, Roaring::Bitmap64[], Roaring::Bitmap64[2**33, 5]].each do |bitmap|
+      assert_equal bitmap, Roaring::Bitmap64.deserialize(bitmap.serialize)
+    end
+  end
+
+  def test_sample_across_32_bits
+    bitmap = Roaring::Bitmap64.new(0...100_000) | Roaring::Bitmap64[2**40, 2**40 + 1, 2**63]
+
+    sample = bitmap.sample(50)
+    assert_equal sample.sort.uniq, sample
+    assert sample.all? { |x| bitmap.include?(x) }
+    assert_equal [2**40, 2**40 + 1, 2**63], bitmap.sample(bitmap.size).last(3)
+    assert_equal bitmap.to_a, bitmap.sample(200_000)
+
+    half = bitmap.sample_bitmap(0.5)
+    assert_operator half, :<=, bitmap
+    assert_in_delta 50_000, half.size, 1_500
+    assert_equal bitmap, bitmap.sample_bitmap(1)
+  end
+
+  def test_ranges_across_32_bits
+    bitmap = Roaring::Bitmap64.new((2**32 - 5)..(2**32 + 5)) | Roaring::Bitmap64[1, 2**40, 2**64 - 1]
+    assert_equal [1..1, (2**32 - 5)..(2**32 + 5), (2**40)..(2**40), (2**64 - 1)..(2**64 - 1)], bitmap.to_ranges
+    assert_equal bitmap, Roaring::Bitmap64.from_ranges(bitmap.to_ranges(packed: true))
+    assert_equal bitmap, Roaring::Bitmap64.from_ranges(bitmap.each_range.to_a)
+    assert_equal [(2**64 - 3)..(2**64 - 1)], Roaring::Bitmap64.from_ranges([(2**64 - 3)..]).to_ranges
+    assert_raises(RangeError) { Roaring::Bitmap64.from_ranges([0..2**64]) }
+    assert_raises(RangeError) { Roaring::Bitmap64.from_ranges([2**63, 2**63 + 1].pack("Q*")) }
+  end
 end
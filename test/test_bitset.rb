@@ -0,0 +1,111 @@
+# frozen_string_literal: true
+
+require "test_helper"
+require "objspace"
+
+class TestBitset < Minitest::Test
+  include Roaring
+
+  def test_simple_example
+    bitset = Bitset.new
+    bitset << 5 << 64 << 200_000
+    assert_equal 3, bitset.size
+    assert_includes bitset, 64
+    refute_includes bitset, 63
+    refute_includes bitset, 2**32 - 1
+    assert_equal [5, 64, 200_000], bitset.to_a
+    assert_equal 5, bitset.min
+    assert_equal 200_000, bitset.max
+    assert_equal 64, bitset[1]
+    assert_nil bitset[3]
+    assert_equal "#<Roaring::Bitset {5, 64, 200000}>", bitset.inspect
+  end
+
+  def test_add_and_remove
+    bitset = Bitset.new
+    assert_same bitset, bitset.add?(10)
+    assert_nil bitset.add?(10)
+    assert_same bitset, bitset.remove?(10)
+    assert_nil bitset.remove?(10)
+    assert_nil bitset.remove?(1_000_000)
+    bitset.remove(1_000_000)
+    assert_empty bitset
+    assert_nil bitset.min
+    assert_nil bitset.max
+
+    bitset.add_range(60, 130)
+    assert_equal (60...130).to_a, bitset.to_a
+    bitset.add_range_closed(3, 3)
+    assert_equal 71, bitset.size
+
+    assert_raises(RangeError) { bitset << -1 }
+    assert_raises(TypeError) { bitset << "1" }
+  end
+
+  def test_set_operations
+    a = Bitset[1, 2, 3, 100_000]
+    b = Bitset[2, 3, 4]
+
+    assert_equal [2, 3], (a & b).to_a
+    assert_equal [1, 2, 3, 4, 100_000], (a | b).to_a
+    assert_equal [1, 4, 100_000], (a ^ b).to_a
+    assert_equal [1, 100_000], (a - b).to_a
+    assert_equal [4], (b - a).to_a
+    assert_equal 2, a.and_cardinality(b)
+    assert a.intersect?(b)
+    refute a.intersect?(Bitset[5])
+    assert Bitset[2, 3] < b
+    assert b <= b
+    refute b < b
+    assert_equal Bitset[1, 2], Bitset[1, 2, 100_000].tap { |x| x.remove(100_000) }
+
+    a.and!(b)
+    assert_equal [2, 3], a.to_a
+    a.xor!(a)
+    assert_empty a
+    b.or!(b)
+    assert_equal [2, 3, 4], b.to_a
+  end
+
+  def test_conversions
+    bitmap = Bitmap32.new(0...100_000) | Bitmap32[1_000_000, 2**20 + 5, 2**24]
+    bitset = bitmap.to_bitset
+
+    assert_equal bitmap.to_a, bitset.to_a
+    assert_equal bitmap, bitset.to_bitmap32
+    assert_equal bitset, Bitset.new(bitmap)
+    assert_equal Bitmap32.new, Bitset.new.to_bitmap32
+    assert_equal Bitmap32[1, 2**16 + 3], Bitset[1, 2**16 + 3].to_bitmap32
+  end
+
+  def test_serialization
+    bitset = Bitset.new(0...70_000)
+    bitset << 1_000_000
+
+    assert_equal bitset, Bitset.deserialize(bitset.serialize)
+    assert_equal bitset.to_a, Bitmap32.deserialize(bitset.serialize).to_a
+    assert_equal bitset, Bitset.deserialize(bitset.to_bitmap32.serialize)
+    assert_equal bitset, Marshal.load(Marshal.dump(bitset))
+    assert_equal Bitset.new, Bitset.deserialize(Bitset.new.serialize)
+    assert_raises(ArgumentError) { Bitset.deserialize("garbage") }
+  end
+
+  def test_trim_and_frozen
+    bitset = Bitset[1, 1_000_000]
+    bitset.remove(1_000_000)
+    assert_operator ObjectSpace.memsize_of(bitset), :>, 100_000
+    bitset.trim
+    assert_operator ObjectSpace.memsize_of(bitset), :<, 1000
+    assert_equal [1], bitset.to_a
+    assert_empty bitset.clear.trim
+
+    generation = bitset.generation
+    bitset << 5
+    refute_equal generation, bitset.generation
+
+    bitset.freeze
+    assert_raises(FrozenError) { bitset << 1 }
+    assert_raises(FrozenError) { bitset.trim }
+    assert_equal [5], bitset.dup.to_a
+  end
+end
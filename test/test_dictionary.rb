@@ -0,0 +1,114 @@
+# frozen_string_literal: true
+
+require "test_helper"
+require "tmpdir"
+
+class TestDictionary < Minitest::Test
+  include Roaring
+
+  def test_intern
+    dictionary = Dictionary.new
+    assert_equal 0, dictionary.intern("apple")
+    assert_equal 1, dictionary.intern("banana")
+    assert_equal 0, dictionary.intern("apple")
+    assert_equal 1, dictionary.id("banana")
+    assert_nil dictionary.id("cherry")
+    assert_equal "banana", dictionary.string(1)
+    assert_equal Encoding::UTF_8, dictionary.string(1).encoding
+    assert_nil dictionary.string(2)
+    assert_nil dictionary.string(-1)
+    assert_equal 2, dictionary.size
+    assert_includes dictionary, "apple"
+    assert_equal ["apple", "banana"], dictionary.to_a
+  end
+
+  def test_encode_and_decode
+    dictionary = Dictionary.new
+    a = dictionary.encode(["x", "y", "z", "x"])
+    b = dictionary.encode(["z", "w", "", "y"])
+
+    assert_equal Bitmap32[0, 1, 2], a
+    assert_equal Bitmap32[1, 2, 3, 4], b
+    assert_equal ["y", "z"], dictionary.decode(a & b)
+    assert_equal ["x", "y", "z", "w", ""], dictionary.decode(a | b)
+    assert_empty dictionary.decode(Bitmap32[])
+    assert_raises(IndexError) { dictionary.decode(Bitmap32[5]) }
+    assert_raises(TypeError) { dictionary.decode([1]) }
+    assert_raises(TypeError) { dictionary.encode([1]) }
+  end
+
+  def test_many_strings
+    dictionary = Dictionary.new
+    strings = Array.new(100_000) { |i| "sku-#{i}" }
+    assert_equal Bitmap32.new(0...100_000), dictionary.encode(strings)
+    assert_equal strings, dictionary.decode(Bitmap32.new(0...100_000))
+    assert_equal 54_321, dictionary.id("sku-54321")
+  end
+
+  def test_frozen
+    dictionary = Dictionary.new
+    dictionary.encode(["a", "b"])
+    dictionary.freeze
+
+    assert_equal Bitmap32[1], dictionary.encode(["b"])
+    assert_raises(FrozenError) { dictionary.encode(["c"]) }
+    copy = dictionary.dup
+    assert_equal 2, copy.intern("c")
+    assert_nil dictionary.id("c")
+  end
+
+  def test_serialize
+    dictionary = Dictionary.new
+    dictionary.encode(Array.new(1000) { |i| "key#{i}" })
+
+    [Dictionary.deserialize(dictionary.serialize), Marshal.load(Marshal.dump(dictionary))].each do |copy|
+      assert_equal dictionary.to_a, copy.to_a
+      assert_equal 999, copy.id("key999")
+      assert_equal 1000, copy.intern("new")
+    end
+
+    assert_raises(ArgumentError) { Dictionary.deserialize("") }
+    assert_raises(ArgumentError) { Dictionary.deserialize(dictionary.serialize[0...-1]) }
+    assert_raises(ArgumentError) { Dictionary.deserialize(dictionary.serialize + "x") }
+  end
+
+  def test_corrupt_slots
+    home = "a".bytes.inject(2166136261) { |hash, byte| ((hash ^ byte) * 16777619) % 2**32 } % 4
+    table = ->(slot_count, slots) { ["RSTR", 1, 1, slot_count, 0, 1, *slots].pack("a4V3V*") + "a" }
+    slots = [0, 0, 0, 0].tap { |s| s[home] = 1 }
+    assert_equal 0, Dictionary.deserialize(table.(4, slots)).id("a")
+
+    # Duplicate ids which leave no empty slot, a missing id, and an id which
+    # lookups can't reach from the slot it hashes to
+    assert_raises(ArgumentError) { Dictionary.deserialize(table.(2, [1, 1])) }
+    assert_raises(ArgumentError) { Dictionary.deserialize(table.(4, [0, 0, 0, 0])) }
+    assert_raises(ArgumentError) { Dictionary.deserialize(table.(4, slots.rotate(-2))) }
+
+    Dir.mktmpdir do |dir|
+      path = File.join(dir, "dictionary")
+      File.binwrite(path, table.(2, [1, 1]))
+      assert_raises(ArgumentError) { Dictionary.load_file(path) }
+    end
+  end
+
+  def test_load_file
+    dictionary = Dictionary.new
+    dictionary.encode(["alpha", "beta", "gamma"])
+
+    Dir.mktmpdir do |dir|
+      path = File.join(dir, "dictionary")
+      dictionary.dump_file(path)
+
+      loaded = Dictionary.load_file(path)
+      assert_predicate loaded, :frozen?
+      assert_equal ["alpha", "beta", "gamma"], loaded.to_a
+      assert_equal 1, loaded.id("beta")
+      assert_equal ["gamma"], loaded.decode(Bitmap32[2])
+      assert_raises(FrozenError) { loaded.intern("delta") }
+      assert_equal 3, loaded.dup.intern("delta")
+
+      File.binwrite(path, "garbage")
+      assert_raises(ArgumentError) { Dictionary.load_file(path) }
+    end
+  end
+end
@@ -4,3 +4,23 @@ $LOAD_PATH.unshift File.expand_path("../lib", __dir__)
 require "roaring"
 
 require "minitest/autorun"
+
+module InterruptAssertions
+  # Raises in a thread running `operation` over and over, most likely as it
+  # returns from reading `bitmaps` without the GVL, then checks that none of
+  # them was left locked
+  def assert_unlocked_when_interrupted(bitmaps, &operation)
+    started = Queue.new
+    thread = Thread.new do
+      Thread.current.report_on_exception = false
+      started << true
+      loop(&operation)
+    end
+    started.pop
+    sleep 0.05
+    thread.raise(IOError, "interrupted")
+    assert_raises(IOError) { thread.join }
+
+    bitmaps.each { |bitmap| bitmap << 5 }
+  end
+end
@@ -0,0 +1,125 @@
+# frozen_string_literal: true
+
+require "test_helper"
+
+class TestInvertedIndex < Minitest::Test
+  include Roaring
+
+  def build_index
+    index = InvertedIndex.new
+    index.index(1, ["red", "shirt", "cotton"])
+    index.index(2, ["blue", "shirt"])
+    index.index(3, ["red", "dress"])
+    index.index(4, ["green", "dress", "cotton"])
+    index.index(5, "red")
+    index
+  end
+
+  def test_search
+    index = build_index
+
+    {
+      "red" => [1, 3, 5],
+      "purple" => [],
+      [:and, "red", "shirt"] => [1],
+      [:or, "shirt", "dress"] => [1, 2, 3, 4],
+      [:not, "red"] => [2, 4],
+      [:and, "cotton", [:not, "red"]] => [4],
+      [:and, [:or, "shirt", "dress"], [:not, "blue"], "red"] => [1, 3],
+      [:and, "red", "purple"] => [],
+      [:or, "purple", "blue"] => [2],
+    }.each do |query, expected|
+      assert_equal Bitmap32[*expected], index.search(query), query.inspect
+      assert_equal expected.size, index.count(query), query.inspect
+    end
+  end
+
+  def test_ractor_shareable
+    skip "Ractor unavailable" unless defined?(Ractor)
+
+    index = Ractor.make_shareable(build_index)
+    assert Ractor.shareable?(index)
+
+    experimental, Warning[:experimental] = Warning[:experimental], false
+    ractors = 2.times.map do
+      Ractor.new(index) { |i| 100.times.map { i.count([:or, "red", "shirt"]) }.uniq }
+    end
+    ractors.each do |ractor|
+      assert_equal [4], ractor.take
+    end
+    assert_equal Bitmap32[1, 2, 3, 5], index.search([:or, "red", "shirt"])
+  ensure
+    Warning[:experimental] = experimental if defined?(Ractor)
+  end
+
+  def test_postings_and_terms
+    index = build_index
+    assert_equal Bitmap32[1, 2], index.postings("shirt")
+    assert_empty index.postings("purple")
+    assert_equal ["red", "shirt", "cotton", "blue", "dress", "green"], index.terms
+    assert_equal 6, index.term_count
+    assert_equal 5, index.doc_count
+    assert_equal Bitmap32[1, 2, 3, 4, 5], index.docs
+    assert_includes index, 4
+  end
+
+  def test_delete_and_compact
+    index = build_index
+    index.delete(1).delete(42)
+
+    refute_includes index, 1
+    assert_equal 4, index.size
+    assert_equal Bitmap32[3, 5], index.search("red")
+    assert_equal 2, index.count([:not, "red"])
+    assert_equal Bitmap32[2], index.postings("shirt")
+
+    # Indexing a deleted document forgets its old terms
+    index.index(1, ["blue"])
+    assert_equal Bitmap32[1, 2], index.search("blue")
+    assert_equal Bitmap32[2], index.search("shirt")
+
+    index.delete(2).compact
+    assert_equal Bitmap32[1], index.search("blue")
+    assert_equal Bitmap32[1, 3, 4, 5], index.docs
+  end
+
+  def test_serialize
+    index = build_index
+    index.delete(3)
+
+    [InvertedIndex.deserialize(index.serialize), Marshal.load(Marshal.dump(index)), index.dup].each do |copy|
+      assert_equal index.terms, copy.terms
+      assert_equal index.docs, copy.docs
+      assert_equal Bitmap32[1, 5], copy.search("red")
+      copy.index(3, ["purple"])
+      assert_equal Bitmap32[3], copy.search("purple")
+      assert_empty copy.search("dress") & Bitmap32[3]
+    end
+    refute_includes index, 3
+
+    assert_raises(ArgumentError) { InvertedIndex.deserialize("") }
+    assert_raises(ArgumentError) { InvertedIndex.deserialize(index.serialize[0...-1]) }
+    assert_raises(ArgumentError) { InvertedIndex.deserialize(index.serialize + "x") }
+  end
+
+  def test_many_terms
+    index = InvertedIndex.new
+    1000.times { |i| index.index(i, ["term#{i}", "mod#{i % 7}"]) }
+    assert_equal 1007, index.term_count
+    assert_equal Bitmap32[42], index.search("term42")
+    assert_equal 143, index.count("mod0")
+    assert_equal InvertedIndex.deserialize(index.serialize).terms, index.terms
+  end
+
+  def test_invalid_arguments
+    index = build_index
+    assert_raises(ArgumentError) { index.search([:nand, "red"]) }
+    assert_raises(ArgumentError) { index.search([:not, "red", "blue"]) }
+    assert_raises(ArgumentError) { index.search([:and]) }
+    assert_raises(ArgumentError) { index.search(1) }
+    assert_raises(RangeError) { index.index(-1, ["red"]) }
+    assert_raises(TypeError) { index.index(6, [1]) }
+    assert_raises(FrozenError) { index.freeze.index(6, ["red"]) }
+    assert_equal Bitmap32[1, 3, 5], index.search("red")
+  end
+end
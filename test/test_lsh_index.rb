@@ -0,0 +1,58 @@
+# frozen_string_literal: true
+
+require "test_helper"
+
+class TestLSHIndex < Minitest::Test
+  include Roaring
+
+  def test_search
+    index = LSHIndex.new
+    index.add(:a, Bitmap32.new(0...1000))
+    index.add(:b, Bitmap32.new(10...1000))
+    index.add(:c, Bitmap32.new(5000...6000))
+
+    results = index.search(Bitmap32.new(0...990))
+    assert_equal [:a, :b], results.map(&:first)
+    assert_in_delta 0.99, results[0][1]
+    assert_in_delta 0.98, results[1][1]
+    assert_equal [[:a, 0.99]], index.search(Bitmap32.new(0...990), limit: 1)
+    assert_equal [:c], index.search(Bitmap32.new(5000...6010)).map(&:first)
+    assert_empty index.search(Bitmap32.new(100_000...101_000))
+    assert_includes index.candidates(Bitmap32.new(0...1000)), :a
+    refute_includes index.candidates(Bitmap32.new(0...1000)), :c
+  end
+
+  def test_finds_near_duplicates_among_many
+    random = Random.new(1)
+    index = LSHIndex.new(bands: 16, rows: 4)
+    segments = Array.new(300) do |i|
+      Bitmap32.new(Array.new(500) { random.rand(1_000_000) }).tap { |bitmap| index.add(i, bitmap) }
+    end
+    query = segments[42].dup
+    query.remove(query.min)
+    query << 2_000_000
+
+    assert_equal 42, index.search(query, threshold: 0.9).dig(0, 0)
+    assert_operator index.candidates(query).size, :<, 10
+  end
+
+  def test_add_and_delete
+    index = LSHIndex.new(bands: 4, rows: 2)
+    bitmap = Bitmap32[1, 2, 3]
+    index[:x] = bitmap
+    assert_equal 1, index.size
+    assert_same bitmap, index[:x]
+    assert_includes index, :x
+    assert_equal [[:x, bitmap]], index.to_a
+
+    index.add(:x, Bitmap32[7, 8, 9])
+    assert_equal 1, index.size
+    assert_empty index.candidates(bitmap)
+
+    assert_equal Bitmap32[7, 8, 9], index.delete(:x)
+    assert_nil index.delete(:x)
+    assert_empty index
+    assert_empty index.candidates(Bitmap32[7, 8, 9])
+    assert_raises(ArgumentError) { LSHIndex.new(bands: 0) }
+  end
+end
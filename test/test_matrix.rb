@@ -0,0 +1,79 @@
+# frozen_string_literal: true
+
+require "test_helper"
+
+class TestMatrix < Minitest::Test
+  include Roaring
+  include InterruptAssertions
+
+  def test_pairwise
+    bitmaps = [Bitmap32.new(0...100), Bitmap32.new(50...150), Bitmap32.new, Bitmap32[1_000_000]]
+
+    assert_equal [
+      [100, 50, 0, 0],
+      [50, 100, 0, 0],
+      [0, 0, 0, 0],
+      [0, 0, 0, 1],
+    ], Roaring.pairwise(bitmaps).unpack("Q*").each_slice(4).to_a
+    assert_equal [
+      [1.0, 1 / 3.0, 0.0, 0.0],
+      [1 / 3.0, 1.0, 0.0, 0.0],
+      [0.0, 0.0, 1.0, 0.0],
+      [0.0, 0.0, 0.0, 1.0],
+    ], Roaring.pairwise(bitmaps, metric: :jaccard).unpack("d*").each_slice(4).to_a
+    assert_equal "", Roaring.pairwise([])
+    assert_raises(ArgumentError) { Roaring.pairwise(bitmaps, metric: :cosine) }
+    assert_raises(TypeError) { Roaring.pairwise([Bitmap64[1]]) }
+  end
+
+  def test_pairwise_across_tiles
+    random = Random.new(7)
+    bitmaps = Array.new(100) { Bitmap32.new(Array.new(random.rand(0..200)) { random.rand(2_000) }) }
+    expected = bitmaps.map { |bitmap| bitmap.and_cardinality_many(bitmaps) }
+
+    assert_equal expected, Roaring.pairwise(bitmaps).unpack("Q*").each_slice(100).to_a
+    Roaring.parallelism = 4
+    assert_equal expected, Roaring.pairwise(bitmaps).unpack("Q*").each_slice(100).to_a
+  ensure
+    Roaring.parallelism = 1
+  end
+
+  def test_pairwise_interrupted
+    bitmaps = 40.times.map { |i| Bitmap32.new((i * 1000)...(i * 1000 + 70_000)) }
+    assert_unlocked_when_interrupted(bitmaps) { Roaring.pairwise(bitmaps) }
+  end
+
+  def test_retention
+    cohorts = [Bitmap32.new(0...10), Bitmap32.new(10...20), Bitmap32.new]
+    activity = [Bitmap32.new(0...20), Bitmap32.new(5...15), Bitmap32[1, 19]]
+
+    assert_equal [
+      [10, 5, 1],
+      [5, 1, 0],
+      [0, 0, 0],
+    ], Roaring.retention(cohorts, activity).unpack("Q*").each_slice(3).to_a
+    assert_equal [[10, 5, 1]], Roaring.retention(cohorts.first(1), activity).unpack("Q*").each_slice(3).to_a
+    assert_equal [[10], [0], [0]], Roaring.retention(cohorts, activity.first(1)).unpack("Q*").each_slice(1).to_a
+    assert_equal "", Roaring.retention([], activity)
+    assert_equal "", Roaring.retention(cohorts, [])
+    assert_raises(TypeError) { Roaring.retention(cohorts, [Bitmap64[1]]) }
+  end
+
+  def test_retention_interrupted
+    days = 40.times.map { |i| Bitmap32.new((i * 1000)...(i * 1000 + 70_000)) }
+    assert_unlocked_when_interrupted(days) { Roaring.retention(days, days) }
+  end
+
+  def test_retention_in_parallel
+    random = Random.new(11)
+    days = Array.new(40) { Bitmap32.new(Array.new(random.rand(0..300)) { random.rand(1_000) }) }
+    expected = days.each_with_index.map do |cohort, i|
+      days.drop(i).map { |activity| cohort.and_cardinality(activity) }.fill(0, days.size - i, i)
+    end
+
+    Roaring.parallelism = 4
+    assert_equal expected, Roaring.retention(days, days).unpack("Q*").each_slice(40).to_a
+  ensure
+    Roaring.parallelism = 1
+  end
+end
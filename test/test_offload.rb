@@ -0,0 +1,135 @@
+# frozen_string_literal: true
+
+require "test_helper"
+
+class TestOffload < Minitest::Test
+  include Roaring
+
+  # Just enough of a fiber scheduler to run fibers waiting on IO
+  class Scheduler
+    def initialize
+      @waiting = {}
+      @ready = []
+    end
+
+    def fiber(&block)
+      fiber = Fiber.new(blocking: false, &block)
+      fiber.resume
+      fiber
+    end
+
+    def io_wait(io, events, _timeout)
+      @waiting[io] = Fiber.current
+      Fiber.yield
+      events
+    end
+
+    def block(_blocker, _timeout = nil)
+      Fiber.yield
+    end
+
+    def unblock(_blocker, fiber)
+      @ready << fiber
+    end
+
+    def kernel_sleep(_duration = nil)
+      @ready << Fiber.current
+      Fiber.yield
+    end
+
+    def close
+      until @waiting.empty? && @ready.empty?
+        @ready.shift.resume until @ready.empty?
+        next if @waiting.empty?
+
+        readable, = IO.select(@waiting.keys)
+        readable.each { |io| @waiting.delete(io).resume }
+      end
+    end
+  end
+
+  def with_scheduler
+    Thread.new do
+      Fiber.set_scheduler(Scheduler.new)
+      yield
+    end.join
+  end
+
+  def test_offload_threshold
+    assert_nil Roaring.offload_threshold
+    Roaring.offload_threshold = 1024
+    assert_equal 1024, Roaring.offload_threshold
+  ensure
+    Roaring.offload_threshold = nil
+  end
+
+  def test_offloaded_operations
+    [Bitmap32, Bitmap64].each do |bitmap_class|
+      r1 = bitmap_class.new
+      r2 = bitmap_class.new
+      0.step(10_000_000, 997) { |i| r1 << i }
+      0.step(20_000_000, 1999) { |i| r2 << i }
+      expected = %i[& | ^ -].map { |op| r1.send(op, r2).serialize }
+      serialized = r1.serialize
+
+      Roaring.offload_threshold = 0
+      results = nil
+      with_scheduler do
+        Fiber.schedule do
+          results = %i[& | ^ -].map { |op| r1.send(op, r2).serialize }
+          assert_equal r1, bitmap_class.deserialize(serialized)
+          assert_raises(ArgumentError) { bitmap_class.deserialize("x" * 100) }
+        end
+      end
+      assert_equal expected, results
+    ensure
+      Roaring.offload_threshold = nil
+    end
+  end
+
+  def test_other_fibers_run_while_offloaded
+    r1 = Bitmap32.new
+    r2 = Bitmap32.new
+    r1.add_range(0, 1_000_000)
+    r2.add_range(500_000, 2_000_000)
+    r1.copy_on_write = true
+
+    Roaring.offload_threshold = 0
+    log = []
+    with_scheduler do
+      Fiber.schedule do
+        log << :start
+        log << (r1 | r2).cardinality
+      end
+      Fiber.schedule do
+        log << :other
+        assert_raises(RuntimeError) { r1.add(3_000_000) }
+        assert r1.copy_on_write?
+        assert_equal r1, r1.dup
+      end
+    end
+    assert_equal [:start, :other, 2_000_000], log
+    assert r1.copy_on_write?
+  ensure
+    Roaring.offload_threshold = nil
+  end
+
+  def test_offloaded_copies_of_shared_containers
+    base = Bitmap32.new((1..200).map { |i| i << 16 })
+    base.copy_on_write = true
+    copy = base.dup
+    small = Bitmap32[1, 2, 3]
+
+    Roaring.offload_threshold = 0
+    results = nil
+    with_scheduler do
+      Fiber.schedule do
+        results = [(base | small).cardinality, (small | copy).cardinality, (copy & base).cardinality]
+      end
+    end
+    assert_equal [203, 203, 200], results
+    assert copy.copy_on_write?
+  ensure
+    Roaring.offload_threshold = nil
+  end
+end
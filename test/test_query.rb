@@ -0,0 +1,136 @@
+# frozen_string_literal: true
+
+require "test_helper"
+
+class TestQuery < Minitest::Test
+  include Roaring
+
+  def bitmaps(bitmap_class)
+    a = bitmap_class.new
+    b = bitmap_class.new
+    c = bitmap_class.new
+    d = bitmap_class.new
+    0.step(300_000, 3) { |i| a << i }
+    0.step(300_000, 5) { |i| b << i }
+    c.add_range(100_000, 200_000)
+    d.add_range(150_000, 400_000)
+    [a, b, c, d]
+  end
+
+  def test_matches_bitmap_operations
+    [Bitmap32, Bitmap64].each do |bitmap_class|
+      a, b, c, d = bitmaps(bitmap_class)
+      empty = bitmap_class.new
+
+      {
+        Query[a] & b => a & b,
+        Query[a] | b | c => a | b | c,
+        Query[a] ^ b ^ c => a ^ b ^ c,
+        Query[d] - a - b => d - a - b,
+        Query[a] - (Query[b] - c) => a - (b - c),
+        (Query[a] | b | c) & (Query[d] - b) & c => (a | b | c) & (d - b) & c,
+        (Query[a] & b) | (Query[c] ^ d) => (a & b) | (c ^ d),
+        Query[a] & b & empty => empty,
+        Query[a] | (Query[b] | c) => a | b | c,
+        Query[a] => a,
+      }.each do |query, expected|
+        assert_equal expected, query.to_bitmap, query.inspect
+        assert_instance_of bitmap_class, query.to_bitmap
+        assert_equal expected.cardinality, query.count, query.inspect
+        assert_equal !expected.empty?, query.any?, query.inspect
+        assert_equal expected.to_a, query.to_a, query.inspect
+      end
+    end
+  end
+
+  def test_mixes_bitmap64_widths
+    a, b, c, = bitmaps(Bitmap64)
+    wide = Bitmap64[3, 6, 2**40]
+
+    assert_equal (a | b | wide) - c, ((Query[a] | b | wide) - c).to_bitmap
+    assert_equal [3, 6, 2**40], (Query[wide] & (Query[a] | Bitmap64[2**40])).to_a
+    assert_equal 1, (Query[wide] - a).count
+  end
+
+  def test_result_is_independent_of_operands
+    a, b, = bitmaps(Bitmap32)
+    result = Query[a].to_bitmap
+    result << 1_000_000
+    refute_includes a, 1_000_000
+
+    result = (Query[a] | b).to_bitmap
+    assert_equal a | b, result
+  end
+
+  def test_copies_of_shared_containers
+    a = Bitmap32.new((1..200).map { |i| i << 16 })
+    a.copy_on_write = true
+    b = a.dup
+    c = Bitmap32[1, 2, 3]
+
+    assert_equal 203, Query.new(a).or(c).to_bitmap.cardinality
+    assert_equal 203, Query.new(c).or(b).to_bitmap.cardinality
+    assert_equal 200, (Query[b] & a).count
+    assert_equal [1, 2, 3, 1 << 16], (Query[b] | c).first(4)
+  end
+
+  def test_enumerable_fallbacks
+    query = Query[Bitmap32[1, 2, 3]] | Bitmap32[3, 4]
+    assert_equal 2, query.count(&:even?)
+    assert_equal 1, query.count(4)
+    refute query.any? { |x| x > 4 }
+    assert_equal [1, 2], query.first(2)
+    refute query.empty?
+  end
+
+  def test_locks_operands_while_iterating
+    a = Bitmap32[1, 2, 3]
+    query = Query[a] & Bitmap32[1, 2]
+    assert_raises(RuntimeError) { query.each { a << 4 } }
+    a << 4
+    assert_equal [1, 2], query.to_a
+  end
+
+  def test_invalid_operands
+    assert_raises(TypeError) { (Query[Bitmap32[1]] & Bitmap64[1]).to_bitmap }
+    assert_raises(TypeError) { Query[Bitmap32[1]] & [1] }
+    assert_raises(TypeError) { Query[1] }
+    a = Bitmap32[1]
+    assert_raises(TypeError) { (Query[a] | Bitmap64[1]).to_a }
+    a << 2
+  end
+
+  def test_explain
+    large = Bitmap32.new(0...100_000)
+    medium = Bitmap32.new(0...5000)
+    excluded = Bitmap32[1, 2, 3]
+    small = Bitmap32.new(0...10)
+
+    query = Query[large] & (Query[medium] - excluded) & small
+    assert_equal <<~PLAN.chomp, query.explain
+      andnot (<= 10)
+        and (<= 10)
+          Bitmap32 (10)
+          Bitmap32 (5000)
+          Bitmap32 (100000)
+        Bitmap32 (3)
+    PLAN
+    assert_equal [0, 4, 5, 6, 7, 8, 9], query.to_a
+    assert_equal 7, query.count
+  end
+
+  def test_short_circuits_empty_intersections
+    a, b, c, = bitmaps(Bitmap64)
+    query = Query[a] & b & Bitmap64[] & (Query[c] - b)
+    assert_equal ["andnot (<= 0)", "  and (<= 0)", "    Bitmap64 (0)"], query.explain.lines.first(3).map(&:chomp)
+    assert_equal 0, query.count
+    refute query.any?
+    assert_empty query.to_a
+    assert_empty query.to_bitmap
+  end
+
+  def test_inspect
+    query = (Query[Bitmap32[1, 2]] | Bitmap32[3]) - Bitmap32[]
+    assert_equal "#<Roaring::Query ((Bitmap32(2) | Bitmap32(1)) - Bitmap32(0))>", query.inspect
+  end
+end
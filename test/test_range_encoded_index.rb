@@ -0,0 +1,62 @@
+# frozen_string_literal: true
+
+require "test_helper"
+
+class TestRangeEncodedIndex < Minitest::Test
+  include Roaring
+
+  def test_predicates
+    random = Random.new(5)
+    ages = Array.new(2000) { random.rand(18..90) }
+    index = RangeEncodedIndex.build(ages.pack("s*"), type: :int16)
+    rows = ->(&block) { Bitmap32.new(ages.each_index.select { |i| block.call(ages[i]) }) }
+
+    assert_equal ages.uniq.sort, index.values
+    assert_equal 2000, index.size
+    assert_equal Bitmap32.new(0...2000), index.rows
+    assert_equal rows.call { |age| age == 30 }, index.eq(30)
+    assert_equal rows.call { |age| age < 30 }, index.lt(30)
+    assert_equal rows.call { |age| age <= 30 }, index.le(30)
+    assert_equal rows.call { |age| age > 30 }, index.gt(30)
+    assert_equal rows.call { |age| age >= 30 }, index.ge(30)
+    assert_equal rows.call { |age| age.between?(25, 34) }, index.between(25, 34)
+    assert_equal rows.call { |age| age.between?(25, 34) }.size, index.count(25, 34)
+    assert_equal rows.call { |age| age.between?(25, 34) }, index.between(24.5, 34.5)
+    assert_empty index.between(34, 25)
+    assert_equal 0, index.count(34, 25)
+    assert_empty index.eq(100)
+    assert_empty index.lt(0)
+    assert_equal index.rows, index.ge(0)
+
+    result = index.le(90)
+    result << 5000
+    assert_equal 2000, index.le(90).size
+  end
+
+  def test_build_from_floats
+    index = RangeEncodedIndex.build([0.5, Float::NAN, -1.0, 0.5, -0.0].pack("e*"), type: :float)
+
+    assert_equal [-1.0, 0.0, 0.5], index.values
+    assert_equal Bitmap32[2, 4], index.le(0)
+    assert_equal Bitmap32[0, 3], index.gt(0)
+    assert_raises(ArgumentError) { RangeEncodedIndex.build("abc", type: :float) }
+    assert_raises(ArgumentError) { RangeEncodedIndex.build("", type: :decimal) }
+  end
+
+  def test_serialize
+    index = RangeEncodedIndex.build([3, 1, 2, 3, 0, -4].pack("q*"), type: :int64)
+    loaded = RangeEncodedIndex.deserialize(index.serialize)
+
+    assert_equal index.values, loaded.values
+    assert_equal index.between(-4, 2), loaded.between(-4, 2)
+    assert_equal index.ge(3), Marshal.load(Marshal.dump(index)).ge(3)
+    assert_equal [0.5, 2.0], RangeEncodedIndex.deserialize(RangeEncodedIndex.new(2.0 => Bitmap32[1], 0.5 => Bitmap32[0]).serialize).values
+    assert_equal 0, RangeEncodedIndex.deserialize(RangeEncodedIndex.new.serialize).size
+
+    data = index.serialize
+    assert_raises(ArgumentError) { RangeEncodedIndex.deserialize(data[0...-1]) }
+    assert_raises(ArgumentError) { RangeEncodedIndex.deserialize("#{data}x") }
+    assert_raises(ArgumentError) { RangeEncodedIndex.deserialize("nope") }
+    assert_raises(TypeError) { RangeEncodedIndex.new("a" => Bitmap32[1]).serialize }
+  end
+end
@@ -0,0 +1,101 @@
+# frozen_string_literal: true
+
+require "test_helper"
+
+class TestResultCache < Minitest::Test
+  include Roaring
+
+  def test_generation
+    [Bitmap32, Bitmap64].each do |bitmap_class|
+      a = bitmap_class[1, 2, 3]
+      generation = a.generation
+
+      a.include?(1)
+      a.cardinality
+      a & bitmap_class[1]
+      assert_equal generation, a.generation
+
+      a << 4
+      refute_equal generation, a.generation
+
+      generation = a.generation
+      a.remove(10)
+      refute_equal generation, a.generation
+
+      refute_equal a.generation, a.dup.generation
+      refute_equal a.generation, bitmap_class[1, 2, 3].generation
+    end
+  end
+
+  def test_binary_ops
+    cache = ResultCache.new
+    a = Bitmap32[1, 2, 3]
+    b = Bitmap32[2, 3, 4]
+
+    result = cache.and(a, b)
+    assert_equal Bitmap32[2, 3], result
+    assert_predicate result, :frozen?
+    assert_same result, cache.and(a, b)
+    assert_same result, cache.and(b, a)
+    assert_equal Bitmap32[1], cache.andnot(a, b)
+    assert_equal Bitmap32[4], cache.andnot(b, a)
+    assert_equal Bitmap32[1, 4], cache.xor(a, b)
+    assert_equal Bitmap32[1, 2, 3, 4], cache.or(a, b)
+    assert_equal 2, cache.hits
+    assert_equal 5, cache.misses
+
+    a << 4
+    refute_same result, cache.and(a, b)
+    assert_equal Bitmap32[2, 3, 4], cache.and(a, b)
+  end
+
+  def test_many_and_queries
+    cache = ResultCache.new
+    a = Bitmap64[1, 2, 3]
+    b = Bitmap64[2, 3, 4]
+    c = Bitmap64[3, 4, 5]
+
+    assert_equal Bitmap64[3], cache.and_many([a, b, c])
+    assert_same cache.or_many([a, b, c]), cache.or_many([c, a, b])
+
+    query = (Query[a] | b) - c
+    result = cache.query(query)
+    assert_equal Bitmap64[1, 2], result
+    assert_same result, cache.query((Query[a] | b) - c)
+    b << 10
+    assert_equal Bitmap64[1, 2, 10], cache.query(query)
+  end
+
+  def test_eviction
+    bitmaps = Array.new(4) { |i| Bitmap32.new((i * 100_000)...(i * 100_000 + 50_000)).tap(&:run_optimize) }
+    sizes = bitmaps.each_cons(2).map { |a, b| ObjectSpace.memsize_of(a | b) }
+    cache = ResultCache.new(max_bytes: sizes.first(2).sum)
+
+    first = cache.or(bitmaps[0], bitmaps[1])
+    cache.or(bitmaps[1], bitmaps[2])
+    assert_equal 2, cache.size
+    assert_equal sizes.first(2).sum, cache.bytes
+
+    # Using the first result makes the second one the least recently used
+    assert_same first, cache.or(bitmaps[0], bitmaps[1])
+    cache.or(bitmaps[2], bitmaps[3])
+    assert_equal 2, cache.size
+    assert_same first, cache.or(bitmaps[0], bitmaps[1])
+    assert cache.bytes <= cache.max_bytes
+
+    cache.clear
+    assert_equal 0, cache.size
+    assert_equal 0, cache.bytes
+  end
+
+  def test_eviction_of_bitmap64_results
+    bitmaps = Array.new(4) { |i| Bitmap64.new(0.step(1_000_000, 3)).shift(2**40 + i * 2_000_000) }
+    result = bitmaps[0] | bitmaps[1]
+    assert_operator ObjectSpace.memsize_of(result), :>, 200_000
+
+    cache = ResultCache.new(max_bytes: ObjectSpace.memsize_of(result) * 2)
+    bitmaps.each_cons(2) { |a, b| cache.or(a, b) }
+    assert_equal 2, cache.size
+    assert cache.bytes <= cache.max_bytes
+  end
+end
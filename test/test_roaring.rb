@@ -8,4 +8,13 @@ class TestRoaring < Minitest::Test
   def test_that_it_has_a_version_number
     refute_nil ::Roaring::VERSION
   end
+
+  def test_parallelism
+    assert_equal 1, Roaring.parallelism
+    Roaring.parallelism = 3
+    assert_equal 3, Roaring.parallelism
+    assert_raises(ArgumentError) { Roaring.parallelism = 0 }
+  ensure
+    Roaring.parallelism = 1
+  end
 end
@@ -0,0 +1,71 @@
+# frozen_string_literal: true
+
+require "test_helper"
+
+class TestWindowedBitmap < Minitest::Test
+  include Roaring
+
+  def test_simple_example
+    window = WindowedBitmap.new(3)
+    window << 1 << 2
+    window.rotate
+    window << 2 << 3
+    window.merge(Bitmap32[4])
+
+    assert_equal Bitmap32[2, 3, 4], window.union(last: 1)
+    assert_equal Bitmap32[1, 2, 3, 4], window.union
+    assert_equal Bitmap32[2], window.at_least(2)
+    assert_equal 4, window.cardinality
+    assert window.include?(1)
+    refute window.include?(1, last: 1)
+    refute window.include?(2, last: 0)
+    assert_empty window.union(last: 0)
+    assert_equal 0, window.cardinality(last: 0)
+    assert_equal Bitmap32[1, 2], window.bucket(1)
+    assert_nil window.bucket(3)
+    assert window.bucket(1).frozen?
+    assert_raises(FrozenError) { window.bucket(1) << 5 }
+    refute window.bucket(0).frozen?
+    assert_same window.current, window.bucket(0)
+
+    window.rotate
+    window.rotate
+    assert_equal Bitmap32[2, 3, 4], window.union
+    assert_empty window.at_least(2)
+    refute window.include?(1)
+    assert_equal 3, window.rotations
+
+    window.rotate(3)
+    assert_empty window.union
+    assert_equal 6, window.rotations
+    assert_raises(ArgumentError) { WindowedBitmap.new(0) }
+  end
+
+  def test_matches_unions_of_buckets
+    random = Random.new(5)
+    [1, 2, 7, 16].each do |size|
+      window = WindowedBitmap.new(size)
+      buckets = [[]]
+      120.times do
+        if random.rand < 0.3
+          window.rotate
+          buckets = (buckets << []).last(size)
+        else
+          values = Array.new(random.rand(20)) { random.rand(100) }
+          values.each { |value| window << value }
+          buckets.last.concat(values)
+        end
+
+        (0..size).each do |n|
+          assert_equal buckets.last(n).flatten.uniq.sort, window.union(last: n).to_a
+          value = random.rand(100)
+          assert_equal buckets.last(n).flatten.include?(value), window.include?(value, last: n)
+        end
+        (1..size + 1).each do |k|
+          expected = buckets.flat_map(&:uniq).tally.select { |_, count| count >= k }.keys.sort
+          assert_equal expected, window.at_least(k).to_a
+        end
+      end
+    end
+  end
+end